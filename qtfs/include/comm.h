@@ -4,6 +4,10 @@
 #define __QTFS_SERVER_COMM_H__
 
 #include <linux/version.h>
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#include <linux/time64.h>
+#endif
 
 #if (LINUX_VERSION_CODE == KERNEL_VERSION(4,19,90)) || (LINUX_VERSION_CODE == KERNEL_VERSION(4,19,36))
 #define KVER_4_19 1
@@ -39,6 +43,8 @@ enum {
 	_QTFS_IOCTL_QTSOCK_WL_ADD,
 	_QTFS_IOCTL_QTSOCK_WL_DEL,
 	_QTFS_IOCTL_QTSOCK_WL_GET,
+
+	_QTFS_IOCTL_PASS_ADD,
 };
 
 #define QTFS_IOCTL_THREAD_INIT			_IO(QTFS_IOCTL_MAGIC, _QTFS_IOCTL_EXEC)
@@ -55,8 +61,24 @@ enum {
 #define QTFS_IOCTL_QTSOCK_WL_ADD		_IO(QTFS_IOCTL_MAGIC, _QTFS_IOCTL_QTSOCK_WL_ADD)
 #define QTFS_IOCTL_QTSOCK_WL_DEL		_IO(QTFS_IOCTL_MAGIC, _QTFS_IOCTL_QTSOCK_WL_DEL)
 #define QTFS_IOCTL_QTSOCK_WL_GET		_IO(QTFS_IOCTL_MAGIC, _QTFS_IOCTL_QTSOCK_WL_GET)
+#define QTFS_IOCTL_PASS_ADD				_IO(QTFS_IOCTL_MAGIC, _QTFS_IOCTL_PASS_ADD)
+
+// An ioctl forwarded to the file at the server, described the way
+// _IOC_DIR and _IOC_SIZE describe encoded commands: what arg points to is
+// copied in for _IOC_WRITE and back for _IOC_READ, _IOC_NONE passes arg as
+// a value. Both sides must have a command, the server runs no other.
+#define QTFS_IOCTL_PASS_MAX 64
+#define QTFS_IOCTL_PASS_SIZE_MAX 1024
+struct qtfs_ioctl_pass {
+	unsigned int cmd;
+	unsigned int dir;
+	unsigned int size;
+};
 
-#define QTINFO_MAX_EVENT_TYPE 36 // look qtreq_type at req.h
+#define QTINFO_MAX_EVENT_TYPE 38 // look qtreq_type at req.h
+// latency histogram buckets: 0 is under 1us, n is [2^(n-1), 2^n)us, the
+// last one takes everything longer
+#define QTINFO_LAT_BUCKETS 24
 #define QTFS_FUNCTION_LEN 64
 
 #define QTFS_MAX_THREADS 16
@@ -91,6 +113,8 @@ struct wl_item {
 	char path[4096];
 };
 
+#define QTFS_WL_MAX_ITEMS 4096
+
 struct whitelist {
 	int len;
 	int type;
@@ -112,6 +136,7 @@ struct qtfs_server_epoll_s {
 	int event_nums;
 	struct epoll_event *events;
 	struct epoll_event *kevents;
+	int wakefd; // eventfd in epfd with data 0, kicked when invalidations are queued
 };
 
 enum qtfs_errcode {
@@ -135,6 +160,13 @@ enum qtinfo_cnts {
 	QTINF_SEQ_ERR,
 	QTINF_RESTART_SYS,
 	QTINF_TYPE_MISMATCH,
+	QTINF_ATTR_HIT,
+	QTINF_ATTR_MISS,
+	QTINF_INVALIDATE,
+	QTINF_POLL_HIT,
+	QTINF_POLL_MISS,
+	QTINF_RECONNECT,
+	QTINF_REPLAY,
 	QTINF_NUM,
 };
 #endif
@@ -144,6 +176,7 @@ enum qtinfo_cnts {
 	QTINF_ACTIV_CONN,
 	QTINF_EPOLL_ADDFDS,
 	QTINF_EPOLL_DELFDS,
+	QTINF_INVALIDATE,
 	QTINF_NUM,
 };
 #endif
@@ -162,14 +195,106 @@ struct qtinfo_client {
 	unsigned long send_err[QTINFO_MAX_EVENT_TYPE];
 	unsigned long i_events[QTINFO_MAX_EVENT_TYPE];
 	unsigned long o_events[QTINFO_MAX_EVENT_TYPE];
+	// round trip of qtfs_remote_run, send to response
+	unsigned long lat[QTINFO_MAX_EVENT_TYPE][QTINFO_LAT_BUCKETS];
 };
 
 struct qtinfo_server {
 	unsigned long cnts[QTINF_NUM];
 	unsigned long i_events[QTINFO_MAX_EVENT_TYPE];
 	unsigned long o_events[QTINFO_MAX_EVENT_TYPE];
+	// service time of the request handler
+	unsigned long lat[QTINFO_MAX_EVENT_TYPE][QTINFO_LAT_BUCKETS];
+};
+
+static inline int qtinfo_lat_bucket(unsigned long long ns)
+{
+#ifdef __KERNEL__
+	unsigned long long us = div_u64(ns, NSEC_PER_USEC);
+#else
+	unsigned long long us = ns / 1000;
+#endif
+	int b = 0;
+
+	while (us != 0 && b < QTINFO_LAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+#define QTINFO_MAX_HOLDERS 32
+
+// param pool usage, wait and hold times are log2 us buckets
+struct qtinfo_pool {
+	unsigned long takes;
+	unsigned long saturated; // takes that found all params busy and waited
+	int busy_max; // high-water mark of busy params
+	unsigned long wait_lat[QTINFO_LAT_BUCKETS];
+	unsigned long hold_lat[QTINFO_LAT_BUCKETS];
+	// the params held longest right now, longest first, with who_using;
+	// hold_idx is the param index, -1 ends, hold_more counts the busy
+	// ones that didn't fit
+	unsigned long hold_us[QTFS_MAX_THREADS];
+	int hold_idx[QTFS_MAX_THREADS];
+	int hold_more;
+	// per caller, by the function name recorded in who_using
+	struct {
+		char func[QTFS_FUNCTION_LEN];
+		unsigned long count;
+		unsigned long total_us;
+		unsigned long max_us;
+	} holders[QTINFO_MAX_HOLDERS];
 };
 
+static inline void qtinfo_pool_clear(struct qtinfo_pool *pool)
+{
+	int i;
+
+	pool->takes = 0;
+	pool->saturated = 0;
+	pool->busy_max = 0;
+	memset(pool->wait_lat, 0, sizeof(pool->wait_lat));
+	memset(pool->hold_lat, 0, sizeof(pool->hold_lat));
+	// names stay, their slots are still in use
+	for (i = 0; i < QTINFO_MAX_HOLDERS; i++) {
+		pool->holders[i].count = 0;
+		pool->holders[i].total_us = 0;
+		pool->holders[i].max_us = 0;
+	}
+}
+
+// transport options in effect and what they did
+struct qtinfo_tcp {
+	int nodelay;
+	int quickack;
+	int msg_more;
+	int sndbuf;
+	int rcvbuf;
+	int busy_poll;
+	unsigned long tuned; // sockets the options were applied to
+	unsigned long tune_err; // options the socket refused
+	unsigned long more_sends; // frame heads held with MSG_MORE for their payload
+	unsigned long quickacks; // quick ack armed again after a receive
+	unsigned long retrans; // segments retransmitted on our connections
+	unsigned long rx_calls; // recvmsg calls that staged data
+	unsigned long rx_msgs; // messages parsed from them
+	// smoothed rtt of the connection, sampled on every message received
+	unsigned long srtt[QTINFO_LAT_BUCKETS];
+};
+
+static inline void qtinfo_tcp_clear(struct qtinfo_tcp *tcp)
+{
+	tcp->tuned = 0;
+	tcp->tune_err = 0;
+	tcp->more_sends = 0;
+	tcp->quickacks = 0;
+	tcp->retrans = 0;
+	tcp->rx_calls = 0;
+	tcp->rx_msgs = 0;
+	memset(tcp->srtt, 0, sizeof(tcp->srtt));
+}
+
 struct qtinfo {
 	union {
 		struct qtinfo_client c;
@@ -184,6 +309,8 @@ struct qtinfo {
 	int epoll_state;
 	int pvar_vld; // valid param's number
 	int pvar_busy; // busy param's number
+	struct qtinfo_pool pool;
+	struct qtinfo_tcp tcp;
 };
 
 #define QTINFO_STATE(state) ((state == QTCONN_INIT) ? "INIT" : \
@@ -201,6 +328,9 @@ static inline void qtinfo_clear(void)
 	memset(qtfs_diag_info->c.send_err, 0, sizeof(qtfs_diag_info->c.send_err));
 	memset(qtfs_diag_info->c.i_events, 0, sizeof(qtfs_diag_info->c.i_events));
 	memset(qtfs_diag_info->c.o_events, 0, sizeof(qtfs_diag_info->c.o_events));
+	memset(qtfs_diag_info->c.lat, 0, sizeof(qtfs_diag_info->c.lat));
+	qtinfo_pool_clear(&qtfs_diag_info->pool);
+	qtinfo_tcp_clear(&qtfs_diag_info->tcp);
 	return;
 }
 static inline void qtinfo_cntinc(enum qtinfo_cnts idx)
@@ -245,6 +375,13 @@ static inline void qtinfo_senderrinc(int idx)
 	qtfs_diag_info->c.send_err[idx]++;
 	return;
 }
+static inline void qtinfo_latadd(int idx, unsigned long long ns)
+{
+	if (idx >= QTINFO_MAX_EVENT_TYPE)
+		return;
+	qtfs_diag_info->c.lat[idx][qtinfo_lat_bucket(ns)]++;
+	return;
+}
 #endif
 
 // ko compile
@@ -253,6 +390,9 @@ static inline void qtinfo_clear(void)
 {
 	memset(qtfs_diag_info->s.i_events, 0, sizeof(qtfs_diag_info->s.i_events));
 	memset(qtfs_diag_info->s.o_events, 0, sizeof(qtfs_diag_info->s.o_events));
+	memset(qtfs_diag_info->s.lat, 0, sizeof(qtfs_diag_info->s.lat));
+	qtinfo_pool_clear(&qtfs_diag_info->pool);
+	qtinfo_tcp_clear(&qtfs_diag_info->tcp);
 	return;
 }
 static inline void qtinfo_cntinc(enum qtinfo_cnts idx)
@@ -283,6 +423,13 @@ static inline void qtinfo_sendinc(int idx)
 	qtfs_diag_info->s.o_events[idx]++;
 	return;
 }
+static inline void qtinfo_latadd(int idx, unsigned long long ns)
+{
+	if (idx >= QTINFO_MAX_EVENT_TYPE)
+		return;
+	qtfs_diag_info->s.lat[idx][qtinfo_lat_bucket(ns)]++;
+	return;
+}
 #endif
 // QTINFO END
 
@@ -9,11 +9,19 @@
 #include <linux/inet.h>
 #include <linux/types.h>
 #include <linux/mount.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/idr.h>
+#include <linux/uio.h>
 #include <net/inet_sock.h>
 
 #include "comm.h"
 #include "log.h"
 
+// upper bound of pvars, in pipeline mode pvars are request slots and
+// don't own a socket, so there can be far more of them than connections
+#define QTFS_MAX_PARAMS 1024
+
 #ifdef QTFS_SERVER
 extern int qtfs_server_thread_run;
 extern struct qtfs_server_userp_s *qtfs_userps;
@@ -21,14 +29,29 @@ extern struct qtfs_server_userp_s *qtfs_userps;
 extern char qtfs_server_ip[20];
 extern int qtfs_server_port;
 extern int qtfs_sock_max_conn;
+extern unsigned int qtfs_data_msg_len;
 extern struct socket *qtfs_server_main_sock;
-extern struct qtfs_sock_var_s *qtfs_thread_var[QTFS_MAX_THREADS];
+extern struct qtfs_sock_var_s *qtfs_thread_var[QTFS_MAX_PARAMS];
 extern struct qtfs_sock_var_s *qtfs_epoll_var;
 extern char qtfs_log_level[QTFS_LOGLEVEL_STRLEN];
 extern int log_level;
 extern struct qtinfo *qtfs_diag_info;
 extern bool qtfs_epoll_mode;
+extern bool qtfs_tcp_nodelay;
+extern bool qtfs_tcp_quickack;
+extern bool qtfs_tcp_msg_more;
+extern int qtfs_sock_sndbuf;
+extern int qtfs_sock_rcvbuf;
+extern int qtfs_sock_busy_poll;
+extern int qtfs_conn_mode;
 extern struct qtsock_wl_stru qtsock_wl;
+#ifdef QTFS_CLIENT
+extern int qtfs_pipe_conns;
+extern int qtfs_pipe_max_req;
+extern int qtfs_reconnect_wait_ms;
+extern int qtfs_replay_max;
+extern unsigned int qtfs_data_len;
+#endif
 #define qtfs_conn_get_param(void) _qtfs_conn_get_param(__func__)
 
 static inline bool err_ptr(void *ptr)
@@ -60,33 +83,86 @@ typedef enum {
 	QTFS_CONN_SOCK_CLIENT,
 } qtfs_conn_cs_e;
 
+// endpoint of the shared memory transport, see qtfs_shm.h
 struct qtfs_pcie_var_s {
-	int srcid;
-	int dstid;
+	int srcid; // our side of the channel, QTFS_SHM_CLIENT or QTFS_SHM_SERVER
+	int dstid; // channel of the connection, -1 if none
+	wait_queue_head_t waitq; // woken by the channel's doorbell
+	bool watched; // server scheduler wants the doorbell too
 };
 
 struct qtfs_sock_var_s {
-	struct list_head lst;
-	struct llist_node lazy_put;
+	struct llist_node free_node;
+	bool busy;
 	int cs;
 	int cur_threadidx;
 	int miss_proc;
 	unsigned long seq_num;
 	qtfs_conn_type_e state;
 	char who_using[QTFS_FUNCTION_LEN];
+	// when who_using took it and its slot in the per-caller stats
+	u64 hold_start;
+	int hold_slot;
+	// total_retrans of the socket when last sampled
+	u32 tcp_retrans;
 	struct socket *sock;
 	struct socket *client_sock;
+	struct qtfs_pcie_var_s pcie;
 	char addr[20];
 	unsigned short port;
 
-	// use to memset buf
+	// bytes of the buffers written since they were last cleared, only that
+	// much is cleared when pvar is put back, 0 send_valid clears it all
 	unsigned long recv_valid;
 	unsigned long send_valid;
+	// received ahead of the message being parsed, rx_buf[rx_start, rx_end)
+	char *rx_buf;
+	size_t rx_start;
+	size_t rx_end;
 	struct kvec vec_recv;
 	struct kvec vec_send;
 	struct msghdr msg_recv;
 	struct msghdr msg_send;
+	// capacity of send buffer, vec_send.iov_len is the length to send,
+	// vec_recv.iov_len is the capacity of recv buffer
+	size_t send_max;
+	// bulk payload sent right after vec_send, set before qtfs_remote_run;
+	// it is in pvar's own memory, a user buffer could fault while a shared
+	// connection is locked for the send
+	struct kvec send_bulk;
+
+	// serialize senders and socket release, server workers send responses
+	// after the pvar is put back to the pool
+	struct mutex sendlock;
+	// increased every time client_sock is released
+	unsigned long conn_gen;
+	// pipeline mode: response dispatched by the pipe recv thread
+	struct completion done;
+	int pipe_ret;
+	// client: handed to the connection manager, queued until it's back
+	struct list_head reconn_node;
+	bool reconn_pending;
+	// server scheduler: attached to it, queued on the ready list or held
+	// by a worker receiving from it; the socket transport hooks sched_sk
+	bool sched_attached;
+	struct sock *sched_sk;
+	void (*sched_data_ready)(struct sock *sk);
+	void (*sched_state_change)(struct sock *sk);
+	struct list_head sched_node;
+	bool sched_queued;
+	bool sched_busy;
+};
+
+#ifdef QTFS_CLIENT
+// one multiplexed connection, many pvars may wait on it at the same time
+struct qtfs_pipe_s {
+	struct qtfs_sock_var_s conn;
+	spinlock_t lock;
+	struct idr reqs; // seq_num -> waiting pvar
+	struct task_struct *task;
+	int idx;
 };
+#endif
 
 struct qtfs_conn_var_s {
 	union {
@@ -105,18 +181,49 @@ struct qtsock_wl_stru {
 	rwlock_t rwlock;
 };
 
+/*
+ * A transport carries the byte stream of a connection, messages are framed
+ * and parsed above it. qtfs_conn_mode picks one at load time: the tcp
+ * socket, or rings in memory shared with the peer (QTFS_CONN_PCIE).
+ */
+struct qtfs_conn_ops {
+	const char *name;
+	// server: set up the listening side, client: a new endpoint
+	int (*init)(struct qtfs_sock_var_s *pvar);
+	// server: accept a waiting client, client: connect to the server
+	int (*connect)(struct qtfs_sock_var_s *pvar);
+	// drop the connection, -ENOTCONN if there was none
+	int (*release)(struct qtfs_sock_var_s *pvar);
+	// stop the stream both ways, the connection is released later
+	void (*shutdown)(struct qtfs_sock_var_s *pvar);
+	// undo init
+	void (*fini)(struct qtfs_sock_var_s *pvar);
+	bool (*connected)(struct qtfs_sock_var_s *pvar);
+	// bytes of msg's iter sent, they may be fewer on timeout
+	int (*sendmsg)(struct qtfs_sock_var_s *pvar, struct msghdr *msg);
+	// up to the length of msg's iter, 0 when the peer is gone, -EAGAIN
+	// with MSG_DONTWAIT or after the receive timeout; MSG_DONTWAIT only
+	// from callers woken by watch(), others block to not spin
+	int (*recvmsg)(struct qtfs_sock_var_s *pvar, struct msghdr *msg, int flags);
+#ifdef QTFS_SERVER
+	// server scheduler: call qtfs_sched_ready(pvar) on data or hangup
+	void (*watch)(struct qtfs_sock_var_s *pvar, bool on);
+	bool (*readable)(struct qtfs_sock_var_s *pvar);
+	// call qtfs_sched_kick() when a client comes, 0 if it will
+	int (*watch_listen)(bool on);
+	bool (*accept_ready)(void);
+	// sleep until a client may be waiting for pvar's side, at most timeo
+	void (*accept_wait)(struct qtfs_sock_var_s *pvar, long timeo);
+#endif
+};
+
+extern const struct qtfs_conn_ops qtfs_sock_ops;
+extern const struct qtfs_conn_ops qtfs_shm_ops;
+extern const struct qtfs_conn_ops *qtfs_conn_tp;
+
 static inline bool qtfs_sock_connected(struct qtfs_sock_var_s *pvar)
 {
-	struct socket *sock = pvar->client_sock;
-	__u8 tcpi_state;
-	if (sock == NULL)
-		return false;
-	tcpi_state = inet_sk_state_load(sock->sk);
-	if (tcpi_state == TCP_ESTABLISHED)
-		return true;
-	qtfs_warn("qtfs threadidx:%d tcpi state:%u(define:TCP_ESTABLISHED=1 is connected) disconnect!", pvar->cur_threadidx, tcpi_state);
-
-	return false;
+	return qtfs_conn_tp->connected(pvar);
 }
 
 int qtfs_conn_init(int msg_mode, struct qtfs_sock_var_s *pvar);
@@ -124,10 +231,17 @@ void qtfs_conn_fini(int msg_mode, struct qtfs_sock_var_s *pvar);
 int qtfs_conn_send(int msg_mode, struct qtfs_sock_var_s *pvar);
 int qtfs_conn_recv(int msg_mode, struct qtfs_sock_var_s *pvar);
 int qtfs_conn_recv_block(int msg_mode, struct qtfs_sock_var_s *pvar);
+int qtfs_conn_recv_block_split(int msg_mode, struct qtfs_sock_var_s *pvar, size_t (*inline_len)(void *),
+			void __user *ubuf, size_t usize, size_t *ulen);
+int qtfs_conn_sendv(int msg_mode, struct qtfs_sock_var_s *pvar, struct kvec *vec, size_t num, size_t len);
+int qtfs_conn_state(int idx);
 
 int qtfs_sock_var_init(struct qtfs_sock_var_s *pvar);
+int qtfs_sock_var_init_len(struct qtfs_sock_var_s *pvar, size_t recvlen, size_t sendlen);
+int qtfs_sock_var_grow(struct qtfs_sock_var_s *pvar, int dir, size_t len);
 void qtfs_sock_var_fini(struct qtfs_sock_var_s *pvar);
 void qtfs_sock_msg_clear(struct qtfs_sock_var_s *pvar);
+bool qtfs_rx_pending(struct qtfs_sock_var_s *pvar);
 void *qtfs_sock_msg_buf(struct qtfs_sock_var_s *pvar, int dir);
 
 void qtfs_conn_param_init(void);
@@ -138,11 +252,32 @@ void qtfs_conn_put_param(struct qtfs_sock_var_s *pvar);
 struct qtfs_sock_var_s *qtfs_epoll_establish_conn(void);
 void qtfs_epoll_cut_conn(struct qtfs_sock_var_s *pvar);
 
+#ifdef QTFS_CLIENT
+struct qtreq;
+int qtfs_pipe_init(void);
+void qtfs_pipe_fini(void);
+bool qtfs_pipe_enabled(void);
+int qtfs_pipe_run(struct qtfs_sock_var_s *pvar);
+int qtfs_missmsg_defer(struct qtreq *rsp);
+int qtfs_conn_wait_active(struct qtfs_sock_var_s *pvar);
+int qtfs_connmgr_init(void);
+void qtfs_connmgr_fini(void);
+#endif
+
+#ifdef QTFS_SERVER
+void qtfs_sched_detach(struct qtfs_sock_var_s *pvar);
+void qtfs_sched_ready(struct qtfs_sock_var_s *pvar);
+void qtfs_sched_kick(void);
+#endif
+
+void qtfs_shm_exit(void);
+
 int qtfs_sm_active(struct qtfs_sock_var_s *pvar);
 int qtfs_sm_reconnect(struct qtfs_sock_var_s *pvar);
 int qtfs_sm_exit(struct qtfs_sock_var_s *pvar);
 
 void qtfs_kallsyms_hack_init(void);
+void qtfs_conn_stat_fold(void);
 void qtfs_conn_list_cnt(void);
 
 int qtfs_uds_remote_init(void);
@@ -80,6 +80,16 @@ static inline int qtfs_log_init(char *level) {
 }								\
 )
 
+// info and debug logs of request paths, compiled out unless the module is
+// built with CONFIG_QTFS_DATAPATH_LOG=y, the qtfs_trace.h events cover them
+#ifdef CONFIG_QTFS_DATAPATH_LOG
+#define qtfs_dp_info(fmt, ...) qtfs_info(fmt, ##__VA_ARGS__)
+#define qtfs_dp_debug(fmt, ...) qtfs_debug(fmt, ##__VA_ARGS__)
+#else
+#define qtfs_dp_info(fmt, ...) no_printk(fmt, ##__VA_ARGS__)
+#define qtfs_dp_debug(fmt, ...) no_printk(fmt, ##__VA_ARGS__)
+#endif
+
 #define qtfs_err_ratelimited(fmt, ...) 	\
 (								\
 	{							\
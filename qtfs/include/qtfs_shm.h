@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef __QTFS_SHM_H__
+#define __QTFS_SHM_H__
+
+#include <linux/types.h>
+
+// Shared memory transport (QTFS_CONN_PCIE). The region is split into
+// channels, one per connection, each with a byte ring per direction. Only
+// fixed size fields and offsets live in the region, so it can be a PCIe BAR
+// or the memory of virtio queues as well as pages of the loopback backend.
+#define QTFS_SHM_MAGIC 0x5154534d // "QTSM"
+#define QTFS_SHM_CHANS 64
+#define QTFS_SHM_RING_LEN (64 * 1024) // power of 2
+
+// sides of a channel, ring[side] is written by side
+#define QTFS_SHM_CLIENT 0
+#define QTFS_SHM_SERVER 1
+#define QTFS_SHM_SIDES 2
+
+// link word of a channel, 0 is free
+#define QTFS_SHM_LINK_CLIENT 0x1
+#define QTFS_SHM_LINK_SERVER 0x2
+#define QTFS_SHM_LINK_CLOSED 0x4 // one side went away, or both while it's reset
+#define QTFS_SHM_LINK_EPOLL 0x8 // the client's epoll connection
+
+struct qtfs_shm_ring {
+	u32 head; // bytes written, by the producer only
+	u32 tx_wait; // producer waits for space, consumer kicks it
+	u32 pad0[14];
+	u32 tail; // bytes read, by the consumer only
+	u32 pad1[15];
+	char data[QTFS_SHM_RING_LEN];
+};
+
+struct qtfs_shm_chan {
+	u32 link;
+	u32 pad[15];
+	struct qtfs_shm_ring ring[QTFS_SHM_SIDES];
+};
+
+struct qtfs_shm_region {
+	u32 magic;
+	u32 nchans;
+	u32 pad[14];
+	struct qtfs_shm_chan chans[QTFS_SHM_CHANS];
+};
+
+// provides the region and the doorbells of both sides
+struct qtfs_shm_backend {
+	const char *name;
+	struct qtfs_shm_region *region;
+	// ring side's doorbell for channel chan
+	void (*kick)(struct qtfs_shm_backend *be, int side, int chan);
+	// set by each side when it attaches, called in rcu read side
+	void (*doorbell[QTFS_SHM_SIDES])(int chan);
+};
+
+// loopback backend, the server module shares its pages with a client on
+// the same host, for testing without a device
+extern struct qtfs_shm_backend qtfs_shm_loop;
+
+#endif
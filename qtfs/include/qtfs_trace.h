@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#undef TRACE_SYSTEM
+#ifdef QTFS_CLIENT
+#define TRACE_SYSTEM qtfs_client
+#else
+#define TRACE_SYSTEM qtfs_server
+#endif
+
+#if !defined(__QTFS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __QTFS_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include "comm.h"
+
+// Request path events, cheap enough to leave built in, see
+// /sys/kernel/tracing/events/qtfs_client and qtfs_server.
+// CREATE_TRACE_POINTS is defined by conn.c, part of both modules.
+
+DECLARE_EVENT_CLASS(qtfs_msg,
+	TP_PROTO(int conn, unsigned int type, unsigned long seq, unsigned long len, int ret),
+	TP_ARGS(conn, type, seq, len, ret),
+	TP_STRUCT__entry(
+		__field(int, conn)
+		__field(unsigned int, type)
+		__field(unsigned long, seq)
+		__field(unsigned long, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->conn = conn;
+		__entry->type = type;
+		__entry->seq = seq;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("conn=%d type=%u seq=%lu len=%lu ret=%d",
+		__entry->conn, __entry->type, __entry->seq, __entry->len, __entry->ret)
+);
+
+DEFINE_EVENT(qtfs_msg, qtfs_req_send,
+	TP_PROTO(int conn, unsigned int type, unsigned long seq, unsigned long len, int ret),
+	TP_ARGS(conn, type, seq, len, ret)
+);
+
+DEFINE_EVENT(qtfs_msg, qtfs_req_recv,
+	TP_PROTO(int conn, unsigned int type, unsigned long seq, unsigned long len, int ret),
+	TP_ARGS(conn, type, seq, len, ret)
+);
+
+TRACE_EVENT(qtfs_handle_enter,
+	TP_PROTO(int worker, unsigned int type, unsigned long seq),
+	TP_ARGS(worker, type, seq),
+	TP_STRUCT__entry(
+		__field(int, worker)
+		__field(unsigned int, type)
+		__field(unsigned long, seq)
+	),
+	TP_fast_assign(
+		__entry->worker = worker;
+		__entry->type = type;
+		__entry->seq = seq;
+	),
+	TP_printk("worker=%d type=%u seq=%lu", __entry->worker, __entry->type, __entry->seq)
+);
+
+TRACE_EVENT(qtfs_handle_exit,
+	TP_PROTO(int worker, unsigned int type, unsigned long seq, unsigned long len, u64 ns),
+	TP_ARGS(worker, type, seq, len, ns),
+	TP_STRUCT__entry(
+		__field(int, worker)
+		__field(unsigned int, type)
+		__field(unsigned long, seq)
+		__field(unsigned long, len)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->worker = worker;
+		__entry->type = type;
+		__entry->seq = seq;
+		__entry->len = len;
+		__entry->ns = ns;
+	),
+	TP_printk("worker=%d type=%u seq=%lu len=%lu ns=%llu",
+		__entry->worker, __entry->type, __entry->seq, __entry->len, __entry->ns)
+);
+
+TRACE_EVENT(qtfs_reconnect,
+	TP_PROTO(int conn, int state, int ret),
+	TP_ARGS(conn, state, ret),
+	TP_STRUCT__entry(
+		__field(int, conn)
+		__field(int, state)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->conn = conn;
+		__entry->state = state;
+		__entry->ret = ret;
+	),
+	TP_printk("conn=%d state=%d ret=%d", __entry->conn, __entry->state, __entry->ret)
+);
+
+TRACE_EVENT(qtfs_pool_wait,
+	TP_PROTO(const char *func, u64 ns, bool got),
+	TP_ARGS(func, ns, got),
+	TP_STRUCT__entry(
+		__array(char, func, QTFS_FUNCTION_LEN)
+		__field(u64, ns)
+		__field(bool, got)
+	),
+	TP_fast_assign(
+		strscpy(__entry->func, func, sizeof(__entry->func));
+		__entry->ns = ns;
+		__entry->got = got;
+	),
+	TP_printk("func=%s ns=%llu got=%d", __entry->func, __entry->ns, __entry->got)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE qtfs_trace
+#include <trace/define_trace.h>
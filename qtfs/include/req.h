@@ -54,6 +54,12 @@ enum qtreq_type {
 	QTFS_SC_SCHED_SETAFFINITY,
 
 	QTFS_REQ_EXIT, // exit server thread
+
+	// new types go here, the numbers above are what older peers know
+	QTFS_REQ_INVALIDATE, // server push, on epoll connection
+
+	QTFS_REQ_READDIRPLUS,
+
 	QTFS_REQ_INV,
 };
 #define QTFS_REQ_TYPEVALID(type) (type < QTFS_REQ_INV && type >= QTFS_REQ_NULL)
@@ -134,14 +140,20 @@ struct qtreq {
 #define QTFS_MSG_LEN sizeof(struct qtreq)
 #define QTFS_MSG_HEAD_LEN (QTFS_MSG_LEN - QTFS_REQ_MAX_LEN)
 
+// 大块数据消息：数据类请求（如READITER）的私有数据可以超过QTFS_REQ_MAX_LEN，
+// 上限在mount时协商，取值范围[QTFS_REQ_MAX_LEN, QTFS_DATA_MAX_LEN]
+#define QTFS_DATA_MAX_LEN (1024 * 1024)
+#define QTFS_DATA_DEF_LEN (256 * 1024)
+
 struct qtreq_ioctl {
 	struct qtreq_ioctl_len {
+		int fd; // the file opened at server
 		unsigned int cmd;
-		unsigned int size;
-		unsigned int offset;
+		unsigned int size; // of what arg points to in buf, 0 if not sent
+		unsigned long arg; // arg itself, for commands that pass a value
 	} d;
 
-	char path[QTFS_TAIL_LEN(struct qtreq_ioctl_len)];
+	char buf[QTFS_TAIL_LEN(struct qtreq_ioctl_len)];
 };
 
 struct qtrsp_ioctl {
@@ -162,11 +174,26 @@ struct qtrsp_statfs {
 	int errno;
 };
 
+#define QTFS_MNT_CAP_INVALIDATE 0x1	// client handles QTFS_REQ_INVALIDATE push
+#define QTFS_MNT_CAP_EPOLL_STREAM 0x2	// client honours QTFS_PUSH_NOACK
+#define QTFS_MNT_CAP_READDIR_FD 0x4	// client sends qtreq_readdir.fd
+
+// layouts of other requests changed along with it, a peer of another
+// version is refused at mount, client and server are upgraded together
+#define QTFS_PROTO_VERSION 1
+
+// the fields after path are new, an old client doesn't send them, an old
+// server reads path as before and only answers ret
 struct qtreq_mount {
 	char path[MAX_PATH_LEN];	// include file name
+	unsigned int data_len;		// data message payload size client wants
+	unsigned int caps;			// QTFS_MNT_CAP_xxx
+	unsigned int version;		// QTFS_PROTO_VERSION
 };
 struct qtrsp_mount {
 	int ret;
+	unsigned int data_len;		// negotiated
+	unsigned int version;		// QTFS_PROTO_VERSION of the server
 };
 
 struct qtreq_open {
@@ -230,7 +257,10 @@ struct qtrsp_mmap {
 	int ret;
 };
 
+// parent, handle and getattr's handle moved the fields behind them, only
+// a server of the same QTFS_PROTO_VERSION takes these
 struct qtreq_lookup {
+	__u64 parent; // handle of parent dir, fullname is only the name if set
 	char fullname[MAX_PATH_LEN];
 };
 
@@ -264,11 +294,15 @@ struct inode_info {
 struct qtrsp_lookup {
 	int ret;
 	int errno;
+	__u64 handle; // 0 if server keeps no handle for it
 	struct inode_info inode_info;
 };
 
 struct qtreq_readdir {
 	int count;
+	// dir opened by the client or -1, path is used then; it sits where old
+	// clients leave padding, so only trusted with QTFS_MNT_CAP_READDIR_FD
+	int fd;
 	loff_t pos;
 	char path[MAX_PATH_LEN];
 };
@@ -283,6 +317,24 @@ struct qtrsp_readdir {
 	char dirent[QTFS_TAIL_LEN(struct qtrsp_readdir_len)];
 };
 
+// readdirplus: dirent with its lstat, the request is qtreq_readdir and count
+// can go up to the data message size negotiated at mount
+struct qtfs_direntplus {
+	struct kstat	stat;
+	u64		d_ino;
+	s64		d_pos;		// dir position of this entry, to resume at it
+	int		stat_ret;	// 0 if stat is valid
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	unsigned char	resv;
+	char		d_name[];
+};
+
+struct qtrsp_readdirplus {
+	struct qtrsp_readdir_len d;
+	char dirent[QTFS_TAIL_LEN(struct qtrsp_readdir_len)];
+};
+
 struct qtreq_mkdir {
 	umode_t mode;
 	char path[MAX_PATH_LEN];
@@ -306,6 +358,7 @@ struct qtrsp_rmdir {
 struct qtreq_getattr {
 	u32 request_mask;
 	unsigned int query_flags;
+	__u64 handle; // path is not used if set
 	char path[MAX_PATH_LEN];
 };
 
@@ -499,11 +552,13 @@ struct qtrsp_sysumount {
 struct qtreq_poll {
 	int fd;
 	int qproc;
+	unsigned long data;	// client's file, readiness changes are pushed with it
 };
 
 struct qtrsp_poll {
 	int ret;
 	__poll_t mask;
+	int watched;		// server pushes readiness changes of this file
 };
 
 
@@ -520,8 +575,13 @@ struct qtrsp_epollctl {
 
 // server epoll 通知 client
 #define QTFS_EPOLL_MAX_EVENTS 128
+// in flags of a server push: the client must not ack this message
+#define QTFS_PUSH_NOACK 0x80000000
 struct qtreq_epollevt {
 	int event_nums;
+	// sits where events was padded to, they keep their offset; the server
+	// sets it only for a client that announced QTFS_MNT_CAP_EPOLL_STREAM
+	unsigned int flags;
 	struct qtreq_epoll_event events[QTFS_EPOLL_MAX_EVENTS];
 };
 
@@ -529,6 +589,20 @@ struct qtrsp_epollevt {
 	int ret;
 };
 
+// server 推送属性/目录项失效通知，走epoll连接，client回复qtrsp_epollevt
+#define QTFS_INVAL_ATTR		0x1	// attributes changed
+#define QTFS_INVAL_NAMES	0x2	// names under this dir (or the inode itself) removed or moved
+#define QTFS_INVAL_ALL		0x4	// queue overflowed, drop everything
+#define QTFS_INVAL_MAX_NUMS 256
+struct qtreq_invalidate {
+	int nums;
+	unsigned int flags;
+	struct qtreq_inval_entry {
+		unsigned long ino;
+		unsigned int flags;
+	} entries[QTFS_INVAL_MAX_NUMS];
+};
+
 struct qtreq_llseek {
 	loff_t off;
 	int whence;
@@ -7,6 +7,8 @@
 typedef unsigned long (*kallsyms_lookup_name_t)(const char *name);
 extern kallsyms_lookup_name_t qtfs_kallsyms_lookup_name;
 
+struct epoll_event;
+
 struct qtfs_kallsyms {
 	unsigned long **sys_call_table;
 
@@ -15,6 +17,10 @@ struct qtfs_kallsyms {
 	int (*__close_fd)(struct files_struct *, int);
 #endif
 	struct task_struct *(*find_get_task_by_vpid)(pid_t nr);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
+	// takes a kernel epoll_event, NULL falls back to the syscall
+	int (*do_epoll_ctl)(int, int, int, struct epoll_event *, bool);
+#endif
 };
 
 extern struct qtfs_kallsyms qtfs_kern_syms;
@@ -88,6 +94,7 @@ noinline long qtfs_syscall_mknodat(int dfd, const char __user *filename, umode_t
 			unsigned int dev);
 noinline off_t qtfs_syscall_lseek(unsigned int fd, off_t offset, unsigned int whence);
 long qtfs_syscall_kill(pid_t pid, int sig);
+long qtfs_syscall_ioctl(unsigned int fd, unsigned int cmd, unsigned long arg);
 long qtfs_syscall_sched_getaffinity(pid_t pid, unsigned int len, unsigned long __user *user_mask_ptr);
 long qtfs_syscall_sched_setaffinity(pid_t pid, unsigned int len, unsigned long __user *user_mask_ptr);
 long qtfs_syscall_connect(int fd, struct sockaddr __user *uservaddr, int addrlen);
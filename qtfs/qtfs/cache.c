@@ -0,0 +1,350 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/namei.h>
+#include <linux/poll.h>
+#include <linux/stat.h>
+
+#include "conn.h"
+#include "qtfs-mod.h"
+#include "req.h"
+#include "log.h"
+#include "ops.h"
+
+int qtfs_attr_timeout_ms = 1000;
+int qtfs_dentry_timeout_ms = 1000;
+
+// qtfs_iget makes a new inode every time, so several inodes can stand for one
+// host inode. Invalidation is keyed by host ino instead: bumping a bucket makes
+// every attr and dentry lease taken under the old generation stale.
+#define QTFS_GEN_BITS 12
+static atomic_t qtfs_attr_gens[1 << QTFS_GEN_BITS];
+static atomic_t qtfs_name_gens[1 << QTFS_GEN_BITS];
+// bumped when pushes may have been lost
+static atomic_t qtfs_gen_all = ATOMIC_INIT(0);
+// bumped by every invalidation, for callers that learn the ino only from the reply
+static atomic_t qtfs_inval_seq = ATOMIC_INIT(0);
+
+static inline u32 qtfs_gen(atomic_t *gens, unsigned long ino)
+{
+	return (u32)atomic_read(&gens[hash_long(ino, QTFS_GEN_BITS)]) + (u32)atomic_read(&qtfs_gen_all);
+}
+
+u32 qtfs_attr_gen(unsigned long ino)
+{
+	return qtfs_gen(qtfs_attr_gens, ino);
+}
+
+u32 qtfs_name_gen(unsigned long ino)
+{
+	return qtfs_gen(qtfs_name_gens, ino);
+}
+
+u32 qtfs_inval_seq_get(void)
+{
+	return (u32)atomic_read(&qtfs_inval_seq);
+}
+
+void qtfs_attr_cache_init(struct qtfs_inode_priv *priv)
+{
+	seqlock_init(&priv->attr_lock);
+	priv->attr_valid = false;
+}
+
+bool qtfs_attr_cache_get(struct inode *inode, struct kstat *stat, u32 req_mask, unsigned int flags)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+	struct qtfs_fs_info *fsinfo = inode->i_sb->s_fs_info;
+	unsigned int sync = flags & AT_STATX_SYNC_TYPE;
+	unsigned int seq;
+	bool hit;
+
+	if (priv == NULL || fsinfo->attr_timeout == 0 || sync == AT_STATX_FORCE_SYNC)
+		return false;
+	do {
+		seq = read_seqbegin(&priv->attr_lock);
+		hit = priv->attr_valid &&
+				(req_mask & ~(priv->attr_mask | STATX_BASIC_STATS)) == 0 &&
+				priv->attr_gen == qtfs_attr_gen(inode->i_ino) &&
+				(sync == AT_STATX_DONT_SYNC || time_before(jiffies, priv->attr_expire));
+		if (hit)
+			*stat = priv->attr;
+	} while (read_seqretry(&priv->attr_lock, seq));
+	qtinfo_cntinc(hit ? QTINF_ATTR_HIT : QTINF_ATTR_MISS);
+	return hit;
+}
+
+// gen must be sampled before the request went out, so an invalidation that
+// races with the reply leaves the entry stale instead of fresh
+void qtfs_attr_cache_set(struct inode *inode, struct kstat *stat, u32 req_mask, u32 gen)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+	struct qtfs_fs_info *fsinfo = inode->i_sb->s_fs_info;
+
+	if (priv == NULL || fsinfo->attr_timeout == 0)
+		return;
+	write_seqlock(&priv->attr_lock);
+	priv->attr = *stat;
+	priv->attr_mask = req_mask;
+	priv->attr_gen = gen;
+	priv->attr_expire = jiffies + fsinfo->attr_timeout;
+	priv->attr_valid = true;
+	write_sequnlock(&priv->attr_lock);
+}
+
+void qtfs_attr_invalidate_ino(unsigned long ino, unsigned int flags)
+{
+	atomic_inc(&qtfs_inval_seq);
+	if (flags & QTFS_INVAL_ALL) {
+		atomic_inc(&qtfs_gen_all);
+		return;
+	}
+	if (flags & (QTFS_INVAL_ATTR | QTFS_INVAL_NAMES))
+		atomic_inc(&qtfs_attr_gens[hash_long(ino, QTFS_GEN_BITS)]);
+	if (flags & QTFS_INVAL_NAMES)
+		atomic_inc(&qtfs_name_gens[hash_long(ino, QTFS_GEN_BITS)]);
+}
+
+// a dentry lease is bound to the name generation of its parent dir
+u32 qtfs_dentry_gen(struct dentry *dentry)
+{
+	struct dentry *parent = dget_parent(dentry);
+	u32 gen = qtfs_name_gen(d_inode(parent)->i_ino);
+
+	dput(parent);
+	return gen;
+}
+
+void qtfs_dentry_lease_set(struct dentry *dentry, u32 gen)
+{
+	struct qtfs_fs_info *fsinfo = dentry->d_sb->s_fs_info;
+
+	WRITE_ONCE(dentry->d_fsdata, (void *)(unsigned long)gen);
+	WRITE_ONCE(dentry->d_time, jiffies + fsinfo->dentry_timeout);
+}
+
+static bool qtfs_dentry_lease_valid(struct dentry *dentry, struct inode *dir)
+{
+	struct qtfs_fs_info *fsinfo = dentry->d_sb->s_fs_info;
+
+	if (fsinfo->dentry_timeout == 0)
+		return false;
+	return time_before(jiffies, READ_ONCE(dentry->d_time)) &&
+		(u32)(unsigned long)READ_ONCE(dentry->d_fsdata) == qtfs_name_gen(dir->i_ino);
+}
+
+static int qtfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+	struct dentry *parent;
+	struct inode *inode;
+	struct inode *dir;
+	struct kstat stat;
+	u32 agen, ngen;
+	int ret;
+
+	if (IS_ROOT(dentry))
+		return 1;
+	inode = d_inode_rcu(dentry);
+	// negative dentries are never leased, let lookup ask the server
+	if (inode == NULL)
+		return 0;
+
+	if (flags & LOOKUP_RCU) {
+		parent = READ_ONCE(dentry->d_parent);
+		dir = d_inode_rcu(parent);
+		if (dir && qtfs_dentry_lease_valid(dentry, dir))
+			return 1;
+		return -ECHILD;
+	}
+
+	parent = dget_parent(dentry);
+	dir = d_inode(parent);
+	if (qtfs_dentry_lease_valid(dentry, dir)) {
+		dput(parent);
+		return 1;
+	}
+	ngen = qtfs_name_gen(dir->i_ino);
+	dput(parent);
+
+	agen = qtfs_attr_gen(inode->i_ino);
+	ret = qtfs_remote_getattr(dentry, NULL, &stat, STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT);
+	if (ret == 0 && stat.ino == inode->i_ino && ((stat.mode ^ inode->i_mode) & S_IFMT) == 0) {
+		qtfs_attr_cache_set(inode, &stat, STATX_BASIC_STATS, agen);
+		qtfs_dentry_lease_set(dentry, ngen);
+		return 1;
+	}
+	// don't let a lost lease tear down whatever is mounted here
+	if (d_mountpoint(dentry))
+		return 1;
+	qtfs_debug("qtfs revalidate <%pd> invalid, ret:%d.", dentry, ret);
+	return (ret == 0 || ret == -ENOENT) ? 0 : ret;
+}
+
+const struct dentry_operations qtfs_dentry_ops = {
+	.d_revalidate = qtfs_d_revalidate,
+};
+
+void qtfs_invalidate_proc(struct qtreq_invalidate *req)
+{
+	int i;
+
+	if (req->flags & QTFS_INVAL_ALL)
+		qtfs_attr_invalidate_ino(0, QTFS_INVAL_ALL);
+	for (i = 0; i < req->nums && i < QTFS_INVAL_MAX_NUMS; i++)
+		qtfs_attr_invalidate_ino(req->entries[i].ino, req->entries[i].flags);
+	qtinfo_cntinc(QTINF_INVALIDATE);
+	qtfs_debug("qtfs invalidate %d inodes, flags:%x.", req->nums, req->flags);
+}
+
+// fifo readiness cache. Server epoll pushes report what became ready, reads
+// and writes that run dry report what is gone. A remote answer or a drain is
+// only taken if no push came in while it was in flight.
+#define QTFS_POLL_RD_BITS (EPOLLIN | EPOLLRDNORM | EPOLLRDBAND | EPOLLPRI | EPOLLRDHUP)
+#define QTFS_POLL_WR_BITS (EPOLLOUT | EPOLLWRNORM | EPOLLWRBAND)
+// bumped when pushes may have been lost
+static atomic_t qtfs_poll_gen = ATOMIC_INIT(0);
+
+static inline __poll_t qtfs_poll_file_bits(struct file *file)
+{
+	__poll_t bits = EPOLLHUP | EPOLLERR;
+
+	if (file->f_mode & FMODE_READ)
+		bits |= QTFS_POLL_RD_BITS;
+	if (file->f_mode & FMODE_WRITE)
+		bits |= QTFS_POLL_WR_BITS;
+	return bits;
+}
+
+// events whose changes reach us for this file
+static inline __poll_t qtfs_poll_cover(struct private_data *fpriv)
+{
+	__poll_t cover = READ_ONCE(fpriv->epoll_events);
+
+	if (READ_ONCE(fpriv->poll_watched))
+		cover |= QTFS_POLL_RD_BITS | QTFS_POLL_WR_BITS;
+	return cover;
+}
+
+// record what the server epoll pushes for this file, oneshot registrations
+// go quiet after their first event so they can't be trusted
+void qtfs_poll_cache_register(struct file *file, int op, __poll_t events)
+{
+	struct private_data *fpriv = file->private_data;
+	__poll_t cover = 0;
+
+	if (fpriv == NULL)
+		return;
+	if (op != EPOLL_CTL_DEL && !(events & EPOLLONESHOT)) {
+		if (events & (EPOLLIN | EPOLLRDNORM))
+			cover |= EPOLLIN | EPOLLRDNORM | EPOLLRDBAND | EPOLLPRI;
+		if (events & (EPOLLOUT | EPOLLWRNORM))
+			cover |= QTFS_POLL_WR_BITS;
+		cover |= events & EPOLLRDHUP;
+	}
+	WRITE_ONCE(fpriv->epoll_events, cover);
+}
+
+void qtfs_poll_cache_init(struct qtfs_inode_priv *priv)
+{
+	spin_lock_init(&priv->poll_lock);
+	priv->poll_valid = false;
+	priv->poll_mask = 0;
+	priv->poll_seq = 0;
+	priv->poll_gen = 0;
+}
+
+u32 qtfs_poll_seq(struct inode *inode)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+
+	return (priv == NULL) ? 0 : READ_ONCE(priv->poll_seq);
+}
+
+// answer from cache only for events this file gets pushes for
+bool qtfs_poll_cache_get(struct file *file, __poll_t want, __poll_t *mask)
+{
+	struct qtfs_inode_priv *priv = file->f_inode->i_private;
+	struct private_data *fpriv = file->private_data;
+	__poll_t bits = qtfs_poll_file_bits(file);
+	bool hit = false;
+
+	if (priv == NULL || fpriv == NULL || qtfs_poll_cover(fpriv) == 0)
+		return false;
+	want &= bits & ~(EPOLLHUP | EPOLLERR);
+	if (want & ~qtfs_poll_cover(fpriv))
+		goto out;
+	spin_lock(&priv->poll_lock);
+	if (priv->poll_valid && priv->poll_gen == (u32)atomic_read(&qtfs_poll_gen)) {
+		*mask = priv->poll_mask & bits;
+		hit = true;
+	}
+	spin_unlock(&priv->poll_lock);
+out:
+	qtinfo_cntinc(hit ? QTINF_POLL_HIT : QTINF_POLL_MISS);
+	return hit;
+}
+
+// seq must be sampled before the request went out
+void qtfs_poll_cache_fill(struct inode *inode, __poll_t mask, u32 seq)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+
+	if (priv == NULL)
+		return;
+	spin_lock(&priv->poll_lock);
+	if (priv->poll_seq == seq) {
+		priv->poll_mask = mask;
+		priv->poll_gen = (u32)atomic_read(&qtfs_poll_gen);
+		priv->poll_valid = true;
+	}
+	spin_unlock(&priv->poll_lock);
+}
+
+// a push or our own write: events replace the cached state of bits
+void qtfs_poll_cache_event(struct inode *inode, __poll_t bits, __poll_t events)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+
+	if (priv == NULL)
+		return;
+	spin_lock(&priv->poll_lock);
+	priv->poll_mask = (priv->poll_mask & ~bits) | (events & bits);
+	priv->poll_seq++;
+	spin_unlock(&priv->poll_lock);
+}
+
+// epoll reports everything that is ready among the events the file is
+// registered with, so these bits are known exactly
+void qtfs_poll_cache_push(struct file *file, __poll_t events)
+{
+	struct private_data *fpriv = file->private_data;
+	__poll_t bits = EPOLLHUP | EPOLLERR;
+
+	if (fpriv != NULL)
+		bits |= qtfs_poll_cover(fpriv) & qtfs_poll_file_bits(file);
+	if (events & EPOLLIN)
+		events |= EPOLLRDNORM;
+	if (events & EPOLLOUT)
+		events |= EPOLLWRNORM;
+	qtfs_poll_cache_event(file->f_inode, bits, events);
+}
+
+void qtfs_poll_cache_drained(struct inode *inode, __poll_t bits, u32 seq)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+
+	if (priv == NULL)
+		return;
+	spin_lock(&priv->poll_lock);
+	if (priv->poll_seq == seq)
+		priv->poll_mask &= ~bits;
+	spin_unlock(&priv->poll_lock);
+}
+
+void qtfs_poll_cache_invalidate_all(void)
+{
+	atomic_inc(&qtfs_poll_gen);
+}
@@ -6,6 +6,7 @@
 #include <linux/pagemap.h>
 #include <linux/mpage.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "conn.h"
 #include "qtfs-mod.h"
 #include "req.h"
@@ -66,3 +67,64 @@ int qtfs_missmsg_proc(struct qtfs_sock_var_s *pvar)
 	}
 	return ret;
 }
+
+// pipeline mode: a response nobody waits for is handled out of the pipe recv
+// thread, because the miss handlers need a round trip themselves
+struct qtfs_miss_work {
+	struct work_struct work;
+	struct qtreq *rsp;
+};
+
+static struct workqueue_struct *qtfs_miss_wq = NULL;
+
+static void qtfs_missmsg_work(struct work_struct *work)
+{
+	struct qtfs_miss_work *mw = container_of(work, struct qtfs_miss_work, work);
+
+	if (qtfs_miss_handles[mw->rsp->type].misshandle(mw->rsp) != QTFS_OK)
+		qtfs_err("qtfs miss message deferred proc failed, rsp type:%u.", mw->rsp->type);
+	kfree(mw->rsp);
+	kfree(mw);
+}
+
+int qtfs_missmsg_defer(struct qtreq *rsp)
+{
+	struct qtfs_miss_work *mw;
+
+	if (rsp->type > QTFS_REQ_OPEN || qtfs_miss_handles[rsp->type].misshandle == NULL)
+		return -ESRCH;
+	if (qtfs_miss_wq == NULL)
+		return -ESHUTDOWN;
+	mw = kmalloc(sizeof(struct qtfs_miss_work), GFP_KERNEL);
+	if (mw == NULL)
+		return -ENOMEM;
+	mw->rsp = kmalloc(QTFS_MSG_HEAD_LEN + rsp->len, GFP_KERNEL);
+	if (mw->rsp == NULL) {
+		kfree(mw);
+		return -ENOMEM;
+	}
+	memcpy(mw->rsp, rsp, QTFS_MSG_HEAD_LEN + rsp->len);
+	INIT_WORK(&mw->work, qtfs_missmsg_work);
+	queue_work(qtfs_miss_wq, &mw->work);
+	return 0;
+}
+
+int qtfs_missmsg_init(void)
+{
+	qtfs_miss_wq = alloc_workqueue("qtfs_miss", WQ_UNBOUND, 1);
+	if (qtfs_miss_wq == NULL) {
+		qtfs_err("qtfs miss workqueue alloc failed.");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void qtfs_missmsg_fini(void)
+{
+	struct workqueue_struct *wq = qtfs_miss_wq;
+
+	if (wq == NULL)
+		return;
+	qtfs_miss_wq = NULL;
+	destroy_workqueue(wq);
+}
@@ -12,7 +12,6 @@ extern struct inode_operations qtfs_proc_inode_ops;
 extern struct file_operations qtfs_proc_file_ops;
 extern struct inode_operations qtfs_proc_sym_ops;
 
-enum qtfs_type qtfs_get_type(char *str);
 bool is_sb_proc(struct super_block *sb);
 
 struct inode *qtfs_iget(struct super_block *sb, struct inode_info *ii);
@@ -24,5 +23,6 @@ int qtfs_getattr(struct user_namespace *mnt_userns, const struct path *, struct
 int qtfs_getattr(const struct path *, struct kstat *, u32, unsigned int);
 #endif
 struct dentry * qtfs_lookup(struct inode *, struct dentry *, unsigned int);
+int qtfs_remote_getattr(struct dentry *dentry, struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags);
 
 #endif
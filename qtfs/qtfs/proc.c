@@ -20,13 +20,6 @@ int qtfs_proc_getattr(struct user_namespace *mnt_userns, const struct path *path
 int qtfs_proc_getattr(const struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags);
 #endif
 
-enum qtfs_type qtfs_get_type(char *str)
-{
-	if (str && !strcmp(str, "proc"))
-		return QTFS_PROC;
-	return QTFS_NORMAL;
-}
-
 bool is_sb_proc(struct super_block *sb)
 {
 	struct qtfs_fs_info *qfi = sb->s_fs_info;
@@ -11,6 +11,7 @@
 #include "qtfs-mod.h"
 #include "syscall.h"
 #include "symbol_wrapper.h"
+#include "qtfs_trace.h"
 
 static struct file_system_type qtfs_fs_type = {
 	.owner		= THIS_MODULE,
@@ -22,6 +23,40 @@ MODULE_ALIAS_FS("qtfs");
 struct kmem_cache *qtfs_inode_priv_cache;
 struct task_struct *g_qtfs_epoll_thread = NULL;
 
+// requests that change nothing on the server, sending one again after its
+// connection was lost is harmless whether it was served or not
+static const bool qtfs_req_replayable[QTFS_REQ_INV] = {
+	[QTFS_REQ_READ] = true,
+	[QTFS_REQ_READITER] = true,
+	[QTFS_REQ_LOOKUP] = true,
+	[QTFS_REQ_READDIR] = true,
+	[QTFS_REQ_READDIRPLUS] = true,
+	[QTFS_REQ_GETATTR] = true,
+	[QTFS_REQ_GETLINK] = true,
+	[QTFS_REQ_READLINK] = true,
+	[QTFS_REQ_XATTRLIST] = true,
+	[QTFS_REQ_XATTRGET] = true,
+	[QTFS_REQ_STATFS] = true,
+};
+
+static inline bool qtfs_conn_lost(int err)
+{
+	return err == -EPIPE || err == -ECONNRESET || err == -ENOTCONN;
+}
+
+// send the request again once the connection is back, if it's replayable
+static bool qtfs_remote_replay(struct qtfs_sock_var_s *pvar, unsigned int type, int err, int *replays)
+{
+	if (!qtfs_conn_lost(err) || !qtfs_req_replayable[type] || *replays >= qtfs_replay_max)
+		return false;
+	(*replays)++;
+	if (qtfs_conn_wait_active(pvar) != 0)
+		return false;
+	qtinfo_cntinc(QTINF_REPLAY);
+	qtfs_warn("qtfs remote run replay type:%u after connection lost, err:%d times:%d.", type, err, *replays);
+	return true;
+}
+
 /*
  * 转发框架层：
  *				1. 调用者先在pvar里预留框架头后，填好自己的私有发送数据。
@@ -33,37 +68,62 @@ void *qtfs_remote_run(struct qtfs_sock_var_s *pvar, unsigned int type, unsigned
 {
 	int ret;
 	unsigned long retrytimes = 0;
+	int replays = 0;
+	u64 start;
 	struct qtreq *req = (struct qtreq *)pvar->vec_send.iov_base;
 	struct qtreq *rsp = (struct qtreq *)pvar->vec_recv.iov_base;
 	if (req == NULL || type >= QTFS_REQ_INV) {
 		qtfs_err("qtfs remote run failed, req is NULL type:%u.\n", type);
 		return NULL;
 	}
-	pvar->seq_num++;
 	req->type = type;
-	req->len = len;
-	req->seq_num = pvar->seq_num;
+	// bulk payload in send_bulk goes right after the inline part
+	req->len = len + pvar->send_bulk.iov_len;
 
 	// 调用qtfs_remote_run之前，调用者应该先把消息在iov_base里面封装好
 	// 如果不是socket通信，则是在其他通信模式定义的buf里，消息协议统一
 	// 都是struct qtreq *xx
 	// 给server发一个消息
 	pvar->vec_send.iov_len = QTFS_MSG_LEN - (QTFS_REQ_MAX_LEN - len);
-	pvar->send_valid = pvar->vec_send.iov_len + 1;
-	ret = qtfs_conn_send(QTFS_CONN_SOCKET, pvar);
-	if (ret == -EPIPE) {
-		qtfs_err("qtfs remote run thread:%d send get EPIPE, try reconnect.", pvar->cur_threadidx);
-		qtfs_sm_reconnect(pvar);
+	if (pvar->vec_send.iov_len > pvar->send_valid)
+		pvar->send_valid = pvar->vec_send.iov_len;
+	start = ktime_get_ns();
+again:
+	if (qtfs_pipe_enabled()) {
+		// seq_num is allocated by the pipe, response is dispatched to us by it
+		ret = qtfs_pipe_run(pvar);
+		pvar->send_bulk.iov_len = 0;
+		trace_qtfs_req_send(pvar->cur_threadidx, type, req->seq_num, req->len, ret);
+		qtinfo_sendinc(type);
+		if (ret < 0) {
+			if (qtfs_remote_replay(pvar, type, ret, &replays))
+				goto again;
+			qtfs_err("qtfs remote run pipe error, ret:%d type:%u.", ret, type);
+			qtinfo_recverrinc(type);
+			return NULL;
+		}
+		goto done;
 	}
+	pvar->seq_num++;
+	req->seq_num = pvar->seq_num;
+	ret = qtfs_conn_send(qtfs_conn_mode, pvar);
+	pvar->send_bulk.iov_len = 0;
+	trace_qtfs_req_send(pvar->cur_threadidx, type, req->seq_num, req->len, ret);
 	if (ret <= 0) {
 		qtfs_err("qtfs remote run send failed, ret:%d pvar sendlen:%lu.", ret, pvar->vec_send.iov_len);
 		qtinfo_senderrinc(req->type);
 	}
 	qtinfo_sendinc(type);
+	// no response comes on a lost connection, the manager brings it back
+	if (qtfs_conn_lost(ret)) {
+		if (qtfs_remote_replay(pvar, type, ret, &replays))
+			goto again;
+		return NULL;
+	}
 
 	// wait for response
 retry:
-	ret = qtfs_conn_recv_block(QTFS_CONN_SOCKET, pvar);
+	ret = qtfs_conn_recv_block(qtfs_conn_mode, pvar);
 	if (ret == -EAGAIN)
 		goto retry;
 	if (ret > 0 && req->seq_num != rsp->seq_num) {
@@ -88,14 +148,18 @@ retry:
 		goto retry;
 	}
 	if (ret < 0) {
+		if (qtfs_remote_replay(pvar, type, ret, &replays))
+			goto again;
 		qtfs_err("qtfs remote run error, ret:%d.", ret);
 		qtinfo_recverrinc(req->type);
 		return NULL;
 	}
 	if (retrytimes > 0)
 		qtfs_debug("qtfs remote run retry times:%lu.", retrytimes);
-	pvar->recv_valid = ret + 1;
+done:
+	trace_qtfs_req_recv(pvar->cur_threadidx, rsp->type, rsp->seq_num, rsp->len, ret);
 	qtinfo_recvinc(rsp->type);
+	qtinfo_latadd(type, ktime_get_ns() - start);
 
 	if (rsp->err == QTFS_ERR) {
 		qtfs_err("qtfs remote run error, req errcode:%d type:%u len:%lu\n", req->err, req->type, req->len);
@@ -113,6 +177,7 @@ static int qtfs_epoll_thread(void *data)
 	int ret;
 	struct inode *inode;
 	struct file *file;
+	struct private_data *fpriv;
 	int i;
 
 connecting:
@@ -126,6 +191,9 @@ connecting:
 		goto end;
 	}
 	qtfs_info("qtfs epoll thread establish a new connection.");
+	// invalidations pushed while we were away are lost
+	qtfs_attr_invalidate_ino(0, QTFS_INVAL_ALL);
+	qtfs_poll_cache_invalidate_all();
 	req = qtfs_sock_msg_buf(pvar, QTFS_RECV);
 	rsp = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 
@@ -139,10 +207,21 @@ connecting:
 	} while (0);
 
 	while (!kthread_should_stop()) {
-		ret = qtfs_conn_recv(QTFS_CONN_SOCKET, pvar);
+		// sleeps until a push comes, -EAGAIN on the receive timeout
+		ret = qtfs_conn_recv_block(qtfs_conn_mode, pvar);
 		if (ret == -EPIPE || qtfs_sock_connected(pvar) == false)
 			goto connecting;
-		if (ret < 0 || req->event_nums <= 0) {
+		if (ret < 0)
+			continue;
+		if (((struct qtreq *)pvar->vec_recv.iov_base)->type == QTFS_REQ_INVALIDATE) {
+			struct qtreq_invalidate *inval = (struct qtreq_invalidate *)req;
+
+			qtfs_invalidate_proc(inval);
+			if (inval->flags & QTFS_PUSH_NOACK)
+				continue;
+			goto ack;
+		}
+		if (req->event_nums <= 0) {
 			continue;
 		}
 		qtfs_debug("epoll thread recv %d events.", req->event_nums);
@@ -154,18 +233,25 @@ connecting:
 				continue;
 			}
 			inode = file->f_inode;
-			// 暂时只支持fifo文件的epoll
-			if (inode == NULL || !qtfs_support_epoll(inode->i_mode)) {
+			fpriv = file->private_data;
+			// 暂时只支持fifo文件的epoll, 以及服务端在watch的文件
+			if (inode == NULL || (!qtfs_support_epoll(inode->i_mode) &&
+					(fpriv == NULL || !fpriv->poll_watched))) {
 				qtfs_err("epoll thread event file:%lx not a fifo.", (unsigned long)file);
 				continue;
 			}
 			do {
 				struct qtfs_inode_priv *priv = inode->i_private;
-				__poll_t key;
-				if (req->events[i].events & EPOLLHUP)
-					key = EPOLLHUP;
-				else
-					key = EPOLLIN | EPOLLRDNORM;
+				__poll_t key = (__poll_t)req->events[i].events;
+				// wake writers too, a waiter only takes keys it polls for
+				if (key & EPOLLIN)
+					key |= EPOLLRDNORM;
+				if (key & EPOLLOUT)
+					key |= EPOLLWRNORM;
+				qtfs_poll_cache_push(file, (__poll_t)req->events[i].events);
+				// a watched file that went quiet only updates the cache
+				if (key == 0)
+					break;
 				if (priv == NULL) {
 					qtfs_err("epoll epoll wake up file:%lx error, inode priv is invalid.", (unsigned long)file);
 					WARN_ON(1);
@@ -174,7 +260,11 @@ connecting:
 				}
 			} while (0);
 		}
-		ret = qtfs_conn_send(QTFS_CONN_SOCKET, pvar);
+		// streamed pushes are not acked, the server doesn't wait for us
+		if (req->flags & QTFS_PUSH_NOACK)
+			continue;
+ack:
+		ret = qtfs_conn_send(qtfs_conn_mode, pvar);
 		if (ret < 0)
 			qtfs_err("conn send failed, ret:%d\n", ret);
 	}
@@ -213,20 +303,28 @@ static int __init qtfs_init(void)
 		qtfs_err("qtfs inode priv cache create failed.\n");
 		return -ENOMEM;
 	}
-	g_qtfs_epoll_thread = kthread_run(qtfs_epoll_thread, NULL, "qtfs_epoll");
-	if (IS_ERR(g_qtfs_epoll_thread)) {
-		qtfs_err("qtfs epoll thread run failed.\n");
-	}
+	// connections count into it from the first connect on
 	qtfs_diag_info = (struct qtinfo *)kmalloc(sizeof(struct qtinfo), GFP_KERNEL);
 	if (qtfs_diag_info == NULL) {
 		qtfs_err("kmalloc qtfs diag info failed.");
-	} else {
-		memset(qtfs_diag_info, 0, sizeof(struct qtinfo));
+		kmem_cache_destroy(qtfs_inode_priv_cache);
+		unregister_filesystem(&qtfs_fs_type);
+		return -ENOMEM;
+	}
+	memset(qtfs_diag_info, 0, sizeof(struct qtinfo));
+	// picks the transport, before the epoll thread's connection uses it
+	qtfs_conn_param_init();
+	g_qtfs_epoll_thread = kthread_run(qtfs_epoll_thread, NULL, "qtfs_epoll");
+	if (IS_ERR(g_qtfs_epoll_thread)) {
+		qtfs_err("qtfs epoll thread run failed.\n");
 	}
 
 	qtfs_misc_register();
 	qtfs_syscall_replace_start();
-	qtfs_conn_param_init();
+	if (qtfs_connmgr_init() != 0)
+		qtfs_err("qtfs conn manager init failed, callers reconnect by themselves.");
+	if (qtfs_missmsg_init() == 0 && qtfs_pipe_init() != 0)
+		qtfs_err("qtfs pipe init failed, fall back to one connection per request.");
 	qtfs_syscall_init();
 	qtfs_utils_register();
 	qtfs_uds_remote_init();
@@ -243,18 +341,19 @@ static void __exit qtfs_exit(void)
 		kthread_stop(g_qtfs_epoll_thread);
 	}
 
+	qtfs_pipe_fini();
+	qtfs_missmsg_fini();
+	qtfs_connmgr_fini();
 	qtfs_conn_param_fini();
 	qtfs_misc_destroy();
 	if (qtfs_epoll_var != NULL) {
 		qtfs_epoll_cut_conn(qtfs_epoll_var);
-		if (qtfs_epoll_var->sock != NULL) {
-			sock_release(qtfs_epoll_var->sock);
-			qtfs_epoll_var->sock = NULL;
-		}
+		qtfs_conn_fini(qtfs_conn_mode, qtfs_epoll_var);
 		qtfs_sock_var_fini(qtfs_epoll_var);
 		kfree(qtfs_epoll_var);
 		qtfs_epoll_var = NULL;
 	}
+	qtfs_shm_exit();
 
 	kfree(qtfs_diag_info);
 	qtfs_diag_info = NULL;
@@ -276,6 +375,34 @@ module_param_string(qtfs_server_ip, qtfs_server_ip, sizeof(qtfs_server_ip), 0600
 MODULE_PARM_DESC(qtfs_server_ip, "qtfs server ip");
 module_param(qtfs_server_port, int, 0644);
 module_param(qtfs_sock_max_conn, int, 0644);
+module_param(qtfs_conn_mode, int, 0444);
+MODULE_PARM_DESC(qtfs_conn_mode, "transport of connections, 0 tcp socket, 1 shared memory rings (the server module's loopback backend)");
+module_param(qtfs_pipe_conns, int, 0444);
+MODULE_PARM_DESC(qtfs_pipe_conns, "number of multiplexed connections, 0 means one connection per request");
+module_param(qtfs_pipe_max_req, int, 0644);
+MODULE_PARM_DESC(qtfs_pipe_max_req, "max requests in flight over multiplexed connections, up to 1024");
+module_param(qtfs_reconnect_wait_ms, int, 0644);
+MODULE_PARM_DESC(qtfs_reconnect_wait_ms, "how long a request waits in ms for its lost connection to be back");
+module_param(qtfs_replay_max, int, 0644);
+MODULE_PARM_DESC(qtfs_replay_max, "times a read-only request is sent again after its connection was lost, 0 disables it");
+module_param(qtfs_data_msg_len, uint, 0444);
+MODULE_PARM_DESC(qtfs_data_msg_len, "payload size of data messages to negotiate at mount, 8KB~1MB");
+module_param(qtfs_attr_timeout_ms, int, 0644);
+MODULE_PARM_DESC(qtfs_attr_timeout_ms, "default attribute cache lifetime in ms for new mounts, 0 disables it");
+module_param(qtfs_dentry_timeout_ms, int, 0644);
+MODULE_PARM_DESC(qtfs_dentry_timeout_ms, "default dentry lease in ms for new mounts, 0 revalidates on every lookup");
+module_param(qtfs_tcp_nodelay, bool, 0644);
+MODULE_PARM_DESC(qtfs_tcp_nodelay, "set TCP_NODELAY on new connections, small requests don't wait for Nagle");
+module_param(qtfs_tcp_quickack, bool, 0644);
+MODULE_PARM_DESC(qtfs_tcp_quickack, "ack every received message right away instead of delaying acks");
+module_param(qtfs_tcp_msg_more, bool, 0644);
+MODULE_PARM_DESC(qtfs_tcp_msg_more, "send a frame head with MSG_MORE when its payload follows");
+module_param(qtfs_sock_sndbuf, int, 0644);
+MODULE_PARM_DESC(qtfs_sock_sndbuf, "SO_SNDBUF of new connections in bytes, 0 keeps autotuning");
+module_param(qtfs_sock_rcvbuf, int, 0644);
+MODULE_PARM_DESC(qtfs_sock_rcvbuf, "SO_RCVBUF of new connections in bytes, 0 keeps autotuning");
+module_param(qtfs_sock_busy_poll, int, 0644);
+MODULE_PARM_DESC(qtfs_sock_busy_poll, "busy poll time in us of new request connections, 0 disables it");
 module_param_string(qtfs_log_level, qtfs_log_level, sizeof(qtfs_log_level), 0600);
 
 module_init(qtfs_init);
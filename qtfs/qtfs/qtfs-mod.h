@@ -37,12 +37,37 @@ extern struct kmem_cache *qtfs_inode_priv_cache;
 
 struct private_data {
 	int fd;
+	// readahead sequential detection: where the last window ended
+	loff_t ra_next;
+	unsigned int ra_hits;
+	// events this file is registered with on the server epoll, 0 if none
+	__poll_t epoll_events;
+	// server pushes every readiness change of this file
+	bool poll_watched;
 };
 
 struct qtfs_inode_priv {
 	unsigned int files;
 	wait_queue_head_t readq;
 	wait_queue_head_t writeq;
+
+	// attribute cache, valid until attr_expire and while attr_gen matches
+	seqlock_t attr_lock;
+	bool attr_valid;
+	u32 attr_mask;
+	u32 attr_gen;
+	unsigned long attr_expire;
+	struct kstat attr;
+
+	// readiness of fifo, kept up to date by epoll pushes while some file
+	// of this inode is registered on the server epoll
+	spinlock_t poll_lock;
+	bool poll_valid;
+	__poll_t poll_mask;
+	u32 poll_seq; // bumped by every update that isn't a remote answer
+	u32 poll_gen;
+
+	u64 handle; // server handle from lookup, 0 to use the full path
 };
 
 enum {
@@ -73,6 +98,9 @@ struct qtfs_fs_info {
 	char *mnt_path;
 
 	enum qtfs_type type;
+	// cache lifetimes in jiffies, 0 means always ask the server
+	unsigned long attr_timeout;
+	unsigned long dentry_timeout;
 };
 
 struct qtfs_dir_entry {
@@ -166,10 +194,51 @@ struct dentry *qtfs_fs_mount(struct file_system_type *fs_type,
 void *qtfs_remote_run(struct qtfs_sock_var_s *pvar, unsigned int type, unsigned int len);
 int qtfs_misc_register(void);
 void qtfs_misc_destroy(void);
+bool qtfs_ioctl_pass_find(unsigned int cmd, struct qtfs_ioctl_pass *pass);
 long qtfs_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 int qtfs_missmsg_proc(struct qtfs_sock_var_s *pvar);
+int qtfs_missmsg_init(void);
+void qtfs_missmsg_fini(void);
 int qtfs_utils_register(void);
 void qtfs_utils_destroy(void);
 
+extern int qtfs_attr_timeout_ms;
+extern int qtfs_dentry_timeout_ms;
+extern const struct dentry_operations qtfs_dentry_ops;
+u32 qtfs_attr_gen(unsigned long ino);
+u32 qtfs_name_gen(unsigned long ino);
+u32 qtfs_inval_seq_get(void);
+static inline u64 qtfs_inode_handle(struct inode *inode)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+
+	return (priv == NULL) ? 0 : READ_ONCE(priv->handle);
+}
+
+static inline void qtfs_inode_handle_set(struct inode *inode, u64 handle)
+{
+	struct qtfs_inode_priv *priv = inode->i_private;
+
+	if (priv != NULL)
+		WRITE_ONCE(priv->handle, handle);
+}
+
+void qtfs_attr_cache_init(struct qtfs_inode_priv *priv);
+bool qtfs_attr_cache_get(struct inode *inode, struct kstat *stat, u32 req_mask, unsigned int flags);
+void qtfs_attr_cache_set(struct inode *inode, struct kstat *stat, u32 req_mask, u32 gen);
+void qtfs_attr_invalidate_ino(unsigned long ino, unsigned int flags);
+u32 qtfs_dentry_gen(struct dentry *dentry);
+void qtfs_dentry_lease_set(struct dentry *dentry, u32 gen);
+void qtfs_invalidate_proc(struct qtreq_invalidate *req);
+void qtfs_poll_cache_register(struct file *file, int op, __poll_t events);
+void qtfs_poll_cache_init(struct qtfs_inode_priv *priv);
+u32 qtfs_poll_seq(struct inode *inode);
+bool qtfs_poll_cache_get(struct file *file, __poll_t want, __poll_t *mask);
+void qtfs_poll_cache_fill(struct inode *inode, __poll_t mask, u32 seq);
+void qtfs_poll_cache_event(struct inode *inode, __poll_t bits, __poll_t events);
+void qtfs_poll_cache_push(struct file *file, __poll_t events);
+void qtfs_poll_cache_drained(struct inode *inode, __poll_t bits, u32 seq);
+void qtfs_poll_cache_invalidate_all(void);
+
 #endif
 
@@ -54,8 +54,19 @@ int qtfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	return 0;
 }
 
+static void qtfs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+	if (inode->i_private) {
+		kmem_cache_free(qtfs_inode_priv_cache, inode->i_private);
+		inode->i_private = NULL;
+	}
+}
+
 static const struct super_operations qtfs_ops = {
 	.statfs = qtfs_statfs,
+	.evict_inode = qtfs_evict_inode,
 };
 
 static inline struct qtfs_fs_info *qtfs_priv_byinode(struct inode *inode)
@@ -64,6 +75,13 @@ static inline struct qtfs_fs_info *qtfs_priv_byinode(struct inode *inode)
 	return sb->s_fs_info;
 }
 
+static inline bool qtfs_mountpoint_known(struct dentry *dentry)
+{
+	struct qtfs_fs_info *fsinfo = qtfs_priv_byinode(d_inode(dentry));
+
+	return fsinfo == NULL || fsinfo->mnt_path != NULL;
+}
+
 static inline char *qtfs_mountpoint_path_init(struct dentry *dentry, struct path *path, char *mnt_file)
 {
 	char *name = NULL;
@@ -102,10 +120,151 @@ static inline char *qtfs_mountpoint_path_init(struct dentry *dentry, struct path
 	return fsinfo->mnt_path;
 }
 
-int qtfs_readdir(struct file *filp, struct dir_context *ctx)
+// put an entry of readdirplus into dcache, so the lookup and getattr that
+// usually follow a listing are served locally
+static void qtfs_readdir_prime(struct dentry *parent, struct qtfs_direntplus *dirent, int namelen, u32 ngen, u32 seq)
+{
+	DECLARE_WAIT_QUEUE_HEAD_ONSTACK(wq);
+	struct qstr name = QSTR_INIT(dirent->d_name, namelen);
+	struct kstat *stat = &dirent->stat;
+	struct dentry *dentry, *alias;
+	struct inode *inode;
+	struct inode_info ii;
+
+	name.hash = full_name_hash(parent, name.name, name.len);
+	dentry = d_lookup(parent, &name);
+	if (dentry == NULL) {
+		dentry = d_alloc_parallel(parent, &name, &wq);
+		if (IS_ERR(dentry))
+			return;
+	}
+	if (!d_in_lookup(dentry)) {
+		inode = d_inode(dentry);
+		// same object still behind the name, just refresh it
+		if (inode && inode->i_ino == stat->ino && ((inode->i_mode ^ stat->mode) & S_IFMT) == 0)
+			goto refresh;
+		dput(dentry);
+		return;
+	}
+
+	memset(&ii, 0, sizeof(ii));
+	ii.mode = stat->mode;
+	ii.i_ino = stat->ino;
+	ii.i_uid = stat->uid;
+	ii.i_gid = stat->gid;
+	ii.i_rdev = stat->rdev;
+	ii.i_size = stat->size;
+	ii.i_blocks = stat->blocks;
+	ii.atime = stat->atime;
+	ii.mtime = stat->mtime;
+	ii.ctime = stat->ctime;
+	inode = qtfs_iget(parent->d_sb, &ii);
+	if (inode == NULL) {
+		d_lookup_done(dentry);
+		dput(dentry);
+		return;
+	}
+	alias = d_splice_alias(inode, dentry);
+	d_lookup_done(dentry);
+	if (alias) {
+		dput(dentry);
+		if (IS_ERR(alias))
+			return;
+		dentry = alias;
+	}
+	inode = d_inode(dentry);
+
+refresh:
+	// stat of an entry raced with an invalidation we can't match by ino
+	if (qtfs_inval_seq_get() == seq)
+		qtfs_attr_cache_set(inode, stat, STATX_BASIC_STATS, qtfs_attr_gen(inode->i_ino));
+	qtfs_dentry_lease_set(dentry, ngen);
+	dput(dentry);
+}
+
+// remote fd of the dir for qtreq_readdir, -1 if it has none
+static inline int qtfs_dir_fd(struct file *filp)
+{
+	struct private_data *private = filp->private_data;
+
+	return (private == NULL) ? -1 : private->fd;
+}
+
+static int qtfs_readdirplus(struct file *filp, struct dir_context *ctx)
 {
 	struct qtfs_sock_var_s *pvar = qtfs_conn_get_param();
 	struct qtreq_readdir *req;
+	struct qtrsp_readdirplus *rsp;
+	struct qtfs_direntplus *dirent = NULL;
+	struct dentry *parent = filp->f_path.dentry;
+	size_t datalen = qtfs_data_len;
+	u32 ngen, seq;
+	int idx;
+	int namelen;
+	int dircnt;
+
+	if (!pvar) {
+		qtfs_err("Failed to get qtfs sock var");
+		return -EINVAL;
+	}
+
+	if (ctx->pos == -1) {
+		qtfs_conn_put_param(pvar);
+		return -ENOENT;
+	}
+	// a batch as big as the data message negotiated at mount
+	if (datalen > QTFS_REQ_MAX_LEN &&
+			qtfs_sock_var_grow(pvar, QTFS_RECV, QTFS_MSG_HEAD_LEN + datalen) != QTFS_OK)
+		datalen = QTFS_REQ_MAX_LEN;
+
+	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
+	QTFS_FULLNAME(req->path, parent);
+	req->fd = qtfs_dir_fd(filp);
+	req->count = datalen - sizeof(rsp->d);
+	req->pos = ctx->pos;
+
+	ngen = qtfs_name_gen(d_inode(parent)->i_ino);
+	seq = qtfs_inval_seq_get();
+	rsp = qtfs_remote_run(pvar, QTFS_REQ_READDIRPLUS, QTFS_SEND_SIZE(struct qtreq_readdir, req->path));
+	if (IS_ERR(rsp) || rsp == NULL) {
+		qtfs_conn_put_param(pvar);
+		return PTR_ERR(rsp);
+	}
+	if (rsp->d.ret == QTFS_ERR) {
+		qtfs_err("qtfs readdirplus failed.");
+		qtfs_conn_put_param(pvar);
+		return -EFAULT;
+	}
+
+	idx = 0;
+	dircnt = rsp->d.vldcnt;
+	while (dircnt > 0) {
+		dirent = (struct qtfs_direntplus *)&rsp->dirent[idx];
+		namelen = strlen(dirent->d_name);
+		// caller's buffer is full, the rest is fetched again from here
+		if (!dir_emit(ctx, dirent->d_name, namelen, dirent->d_ino, dirent->d_type))
+			break;
+		if (dirent->stat_ret == 0)
+			qtfs_readdir_prime(parent, dirent, namelen, ngen, seq);
+		idx += dirent->d_reclen;
+		dircnt--;
+	}
+
+	if (dircnt > 0)
+		ctx->pos = dirent->d_pos;
+	else
+		ctx->pos = (rsp->d.over) ? -1 : rsp->d.pos;
+	qtfs_dp_info("qtfs readdirplus<%s> success vldcnt:%d left:%d over:%d pos:%lld.",
+			req->path, rsp->d.vldcnt, dircnt, rsp->d.over, ctx->pos);
+	qtfs_conn_put_param(pvar);
+	return 0;
+}
+
+int qtfs_readdir(struct file *filp, struct dir_context *ctx)
+{
+	struct qtfs_fs_info *fsinfo = qtfs_priv_byinode(file_inode(filp));
+	struct qtfs_sock_var_s *pvar = NULL;
+	struct qtreq_readdir *req;
 	struct qtrsp_readdir *rsp;
 	struct qtfs_dirent64 *dirent = NULL;
 	int idx;
@@ -113,6 +272,11 @@ int qtfs_readdir(struct file *filp, struct dir_context *ctx)
 	int namelen;
 	int dircnt;
 
+	// entries are worth priming only when the cache may keep them
+	if (fsinfo->type != QTFS_PROC && (fsinfo->attr_timeout || fsinfo->dentry_timeout))
+		return qtfs_readdirplus(filp, ctx);
+
+	pvar = qtfs_conn_get_param();
 	if (!pvar) {
 		qtfs_err("Failed to get qtfs sock var");
 		return -EINVAL;
@@ -126,6 +290,7 @@ int qtfs_readdir(struct file *filp, struct dir_context *ctx)
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 	rsp = qtfs_sock_msg_buf(pvar, QTFS_RECV);
 	QTFS_FULLNAME(req->path, filp->f_path.dentry);
+	req->fd = qtfs_dir_fd(filp);
 	req->count = sizeof(rsp->dirent);
 	req->pos = ctx->pos;
 
@@ -148,12 +313,12 @@ int qtfs_readdir(struct file *filp, struct dir_context *ctx)
 		ret = dir_emit(ctx, dirent->d_name, namelen,
 					dirent->d_ino, dirent->d_type);
 		idx += dirent->d_reclen;
-		qtfs_debug("qtfs readdir direntoff:0x%lx name:<%s>, ret:%d, reclen:%u namelen:%d, ino:%llu type:%d",
+		qtfs_dp_debug("qtfs readdir direntoff:0x%lx name:<%s>, ret:%d, reclen:%u namelen:%d, ino:%llu type:%d",
 				(void *)dirent - (void *)rsp->dirent, dirent->d_name, ret, dirent->d_reclen, namelen, dirent->d_ino, dirent->d_type);
 	}
 
 	ctx->pos = (rsp->d.over) ? -1 : rsp->d.pos;
-	qtfs_info("qtfs readdir<%s> success ret:%d vldcnt:%d over:%d pos:%lld.",
+	qtfs_dp_info("qtfs readdir<%s> success ret:%d vldcnt:%d over:%d pos:%lld.",
 			req->path, rsp->d.ret, rsp->d.vldcnt, rsp->d.over, ctx->pos);
 	qtfs_conn_put_param(pvar);
 	return 0;
@@ -170,7 +335,7 @@ int qtfs_open(struct inode *inode, struct file *file)
 		qtfs_err("Failed to get qtfs sock var");
 		return -EINVAL;
 	}
-	data = (struct private_data *)kmalloc(sizeof(struct private_data), GFP_KERNEL);
+	data = (struct private_data *)kzalloc(sizeof(struct private_data), GFP_KERNEL);
 	if (err_ptr(data)) {
 		qtfs_err("qtfs_open alloc private_data failed: %ld", PTR_ERR(data));
 		qtfs_conn_put_param(pvar);
@@ -194,12 +359,12 @@ int qtfs_open(struct inode *inode, struct file *file)
 		if (rsp->fd != -ENOENT) {
 			qtfs_err("qtfs_open failed with %d ret:%d", rsp->fd, rsp->ret);
 		} else {
-			qtfs_info("qtfs_open file %s failed, not exist.", req->path);
+			qtfs_dp_info("qtfs_open file %s failed, not exist.", req->path);
 		}
 		qtfs_conn_put_param(pvar);
 		return err;
 	}
-	qtfs_info("qtfs open:%s success, f_mode:%o flag:%x, fd:%d", req->path, file->f_mode, file->f_flags, rsp->fd);
+	qtfs_dp_info("qtfs open:%s success, f_mode:%o flag:%x, fd:%d", req->path, file->f_mode, file->f_flags, rsp->fd);
 	data->fd = rsp->fd;
 	WARN_ON(file->private_data);
 	file->private_data = data;
@@ -208,18 +373,6 @@ int qtfs_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
-int qtfs_dir_open(struct inode *inode, struct file *file)
-{
-	qtfs_info("qtfs dir open enter: %s.", file->f_path.dentry->d_iname);
-	return 0;
-}
-
-int qtfs_dir_release(struct inode *inode, struct file *file)
-{
-	qtfs_info("qtfs dir release enter: %s.", file->f_path.dentry->d_iname);
-	return 0;
-}
-
 int qtfs_release(struct inode *inode, struct file *file)
 {
 	struct qtfs_sock_var_s *pvar = qtfs_conn_get_param();
@@ -255,7 +408,7 @@ int qtfs_release(struct inode *inode, struct file *file)
 		ret = PTR_ERR(rsp);
 		goto end;
 	}
-	qtfs_info("qtfs release success fd:%d ret:%d %s", req->fd, rsp->ret, (rsp->ret == QTFS_ERR) ? "failed" : "success");
+	qtfs_dp_info("qtfs release success fd:%d ret:%d %s", req->fd, rsp->ret, (rsp->ret == QTFS_ERR) ? "failed" : "success");
 	ret = rsp->ret;
 end:
 	qtfs_conn_put_param(pvar);
@@ -264,6 +417,56 @@ end:
 	return ret;
 }
 
+// hold the dir open on server for readdir, a failed open only makes
+// readdir fall back to opening by path
+int qtfs_dir_open(struct inode *inode, struct file *file)
+{
+	struct qtfs_sock_var_s *pvar;
+	struct qtreq_open *req;
+	struct qtrsp_open *rsp;
+	struct private_data *data;
+
+	qtfs_dp_info("qtfs dir open enter: %s.", file->f_path.dentry->d_iname);
+	data = (struct private_data *)kzalloc(sizeof(struct private_data), GFP_KERNEL);
+	if (data == NULL) {
+		qtfs_err("qtfs dir open alloc private_data failed.");
+		return -ENOMEM;
+	}
+	data->fd = -1;
+	WARN_ON(file->private_data);
+	file->private_data = data;
+
+	pvar = qtfs_conn_get_param();
+	if (pvar == NULL) {
+		qtfs_err("Failed to get qtfs sock var");
+		return 0;
+	}
+	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
+	QTFS_FULLNAME(req->path, file->f_path.dentry);
+	req->flags = O_RDONLY | O_NONBLOCK | O_DIRECTORY;
+	req->mode = 0;
+	rsp = qtfs_remote_run(pvar, QTFS_REQ_OPEN, QTFS_SEND_SIZE(struct qtreq_open, req->path));
+	if (IS_ERR(rsp) || rsp == NULL || rsp->ret == QTFS_ERR) {
+		qtfs_dp_info("qtfs dir open:%s remote failed, readdir by path.", req->path);
+	} else {
+		data->fd = rsp->fd;
+	}
+	qtfs_conn_put_param(pvar);
+	return 0;
+}
+
+int qtfs_dir_release(struct inode *inode, struct file *file)
+{
+	struct private_data *private = file->private_data;
+
+	qtfs_dp_info("qtfs dir release enter: %s.", file->f_path.dentry->d_iname);
+	if (private != NULL && private->fd >= 0)
+		return qtfs_release(inode, file);
+	kfree(private);
+	file->private_data = NULL;
+	return 0;
+}
+
 ssize_t qtfs_readiter(struct kiocb *kio, struct iov_iter *iov)
 {
 	struct qtfs_sock_var_s *pvar = qtfs_conn_get_param();
@@ -275,11 +478,18 @@ ssize_t qtfs_readiter(struct kiocb *kio, struct iov_iter *iov)
 	size_t tocnt = 0;
 	ssize_t ret;
 	struct private_data *private = NULL;
+	size_t datalen = qtfs_data_len;
+	struct inode *inode = file_inode(kio->ki_filp);
+	u32 pseq = qtfs_poll_seq(inode);
 
 	if (!pvar) {
 		qtfs_err("Failed to get qtfs sock var");
 		return -EINVAL;
 	}
+	// large reads use the data message size negotiated at mount
+	if (datalen > QTFS_REQ_MAX_LEN && leftlen > QTFS_REQ_MAX_LEN &&
+			qtfs_sock_var_grow(pvar, QTFS_RECV, QTFS_MSG_HEAD_LEN + datalen) != QTFS_OK)
+		datalen = QTFS_REQ_MAX_LEN;
 
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 
@@ -299,7 +509,8 @@ ssize_t qtfs_readiter(struct kiocb *kio, struct iov_iter *iov)
 	reqlen = sizeof(struct qtreq_readiter);
 
 	do {
-		req->len = leftlen;
+		// never ask for more than our recv buffer can hold
+		req->len = min(leftlen, datalen - sizeof(rsp->d));
 		req->pos = kio->ki_pos;
 		rsp = qtfs_remote_run(pvar, QTFS_REQ_READITER, reqlen);
 		if (IS_ERR(rsp) || rsp == NULL) {
@@ -308,9 +519,11 @@ ssize_t qtfs_readiter(struct kiocb *kio, struct iov_iter *iov)
 		}
 		if (rsp->d.ret == QTFS_ERR || rsp->d.len <= 0) {
 			if (rsp->d.len != 0)
-				qtfs_info("qtfs readiter error: %ld.", rsp->d.len);
+				qtfs_dp_info("qtfs readiter error: %ld.", rsp->d.len);
 			ret = (ssize_t)rsp->d.len;
 			qtfs_conn_put_param(pvar);
+			if (!S_ISREG(inode->i_mode) && (ret == 0 || ret == -EAGAIN))
+				qtfs_poll_cache_drained(inode, EPOLLIN | EPOLLRDNORM, pseq);
 			return ret;
 		}
 		tocnt = copy_to_iter(rsp->readbuf, rsp->d.len, iov);
@@ -323,10 +536,13 @@ ssize_t qtfs_readiter(struct kiocb *kio, struct iov_iter *iov)
 		leftlen -= rsp->d.len;
 		kio->ki_pos += rsp->d.len;
 	} while (leftlen > 0 && rsp->d.end == 0);
-	qtfs_info("qtfs readiter over, leftlen:%lu, reqlen:%lu, fullname:<%s>, ino:%lu, pos:%lld, iovcnt:%lu\n", leftlen,
+	qtfs_dp_info("qtfs readiter over, leftlen:%lu, reqlen:%lu, fullname:<%s>, ino:%lu, pos:%lld, iovcnt:%lu\n", leftlen,
 				req->len, kio->ki_filp->f_path.dentry->d_iname, kio->ki_filp->f_inode->i_ino, kio->ki_pos, iov_iter_count(iov));
 
 	qtfs_conn_put_param(pvar);
+	// fifos and devices return what they have, a short read emptied it
+	if (!S_ISREG(inode->i_mode) && leftlen > 0)
+		qtfs_poll_cache_drained(inode, EPOLLIN | EPOLLRDNORM, pseq);
 	return allcnt - leftlen;
 }
 
@@ -335,7 +551,6 @@ ssize_t qtfs_writeiter(struct kiocb *kio, struct iov_iter *iov)
 	struct qtfs_sock_var_s *pvar = qtfs_conn_get_param();
 	struct qtreq_write *req;
 	struct qtrsp_write *rsp;
-	char *wrbuf = NULL;
 	int wrbuflen;
 	int maxbuflen;
 	size_t len = iov_iter_count(iov);
@@ -343,6 +558,7 @@ ssize_t qtfs_writeiter(struct kiocb *kio, struct iov_iter *iov)
 	struct private_data *private = NULL;
 	ssize_t ret;
 	struct file *filp;
+	u32 pseq = qtfs_poll_seq(file_inode(kio->ki_filp));
 
 	if (!pvar) {
 		qtfs_err("Failed to get qtfs sock var.");
@@ -371,19 +587,35 @@ ssize_t qtfs_writeiter(struct kiocb *kio, struct iov_iter *iov)
 	req->d.mode = filp->f_mode;
 	req->d.flags = filp->f_flags;
 
-	wrbuf = req->path_buf;
-	maxbuflen = sizeof(req->path_buf);
+	// payload is sent behind the request head, so it's only limited by the
+	// data message size negotiated at mount; it's copied to the pvar before
+	// the send, a fault in the user buffer may need a request of its own
+	maxbuflen = qtfs_data_len - sizeof(req->d);
+	if (qtfs_sock_var_grow(pvar, QTFS_SEND, QTFS_MSG_LEN + maxbuflen) != QTFS_OK) {
+		qtfs_conn_put_param(pvar);
+		return -ENOMEM;
+	}
+	// grown buffer, head and req->d were kept
+	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 	do {
+		struct iov_iter iter = *iov;
+
 		req->d.total_len = len;
-		wrbuflen = (leftlen >= maxbuflen) ? (maxbuflen - 1) : leftlen;
+		wrbuflen = (leftlen >= maxbuflen) ? maxbuflen : leftlen;
+		pvar->send_bulk.iov_base = (char *)pvar->vec_send.iov_base + QTFS_MSG_LEN;
+		wrbuflen = copy_from_iter(pvar->send_bulk.iov_base, wrbuflen, &iter);
+		if (wrbuflen == 0) {
+			// bad user buffer, only this call fails
+			if (leftlen == len) {
+				qtfs_conn_put_param(pvar);
+				return -EFAULT;
+			}
+			break;
+		}
+		pvar->send_bulk.iov_len = wrbuflen;
 		req->d.buflen = wrbuflen;
 		req->d.pos = kio->ki_pos;
-		if (copy_from_iter(wrbuf, wrbuflen, iov) == 0) {
-			qtfs_err("qtfs write copy from iter failed, len:%d.", wrbuflen);
-			qtfs_conn_put_param(pvar);
-			return -EFAULT;
-		}
-		rsp = qtfs_remote_run(pvar, QTFS_REQ_WRITE, sizeof(struct qtreq_write) - sizeof(req->path_buf) + wrbuflen);
+		rsp = qtfs_remote_run(pvar, QTFS_REQ_WRITE, sizeof(req->d));
 		if (IS_ERR(rsp) || rsp == NULL) {
 			qtfs_conn_put_param(pvar);
 			return PTR_ERR(rsp);
@@ -392,27 +624,31 @@ ssize_t qtfs_writeiter(struct kiocb *kio, struct iov_iter *iov)
 			qtfs_err("qtfs write remote error, errno:%ld, leftlen:%lu.", rsp->len, leftlen);
 			ret = rsp->len;
 			qtfs_conn_put_param(pvar);
+			if (leftlen != len)
+				qtfs_attr_invalidate_ino(filp->f_inode->i_ino, QTFS_INVAL_ATTR);
+			if (!S_ISREG(filp->f_inode->i_mode) && ret == -EAGAIN)
+				qtfs_poll_cache_drained(filp->f_inode, EPOLLOUT | EPOLLWRNORM, pseq);
 			return ret;
 		}
-		if (rsp->len != wrbuflen) {
-			iov->count -= (rsp->len - wrbuflen);
-			iov->iov_offset += (rsp->len - wrbuflen);
-		}
+		iov_iter_advance(iov, rsp->len);
 		kio->ki_pos += rsp->len;
 		leftlen -= rsp->len;
 	} while (leftlen);
+	qtfs_attr_invalidate_ino(filp->f_inode->i_ino, QTFS_INVAL_ATTR);
 
 	do {
 		struct inode *inode = kio->ki_filp->f_inode;
 		struct qtfs_inode_priv *priv = inode->i_private;
-		if (S_ISFIFO(inode->i_mode))
+		if (S_ISFIFO(inode->i_mode)) {
+			qtfs_poll_cache_event(inode, EPOLLIN | EPOLLRDNORM, EPOLLIN | EPOLLRDNORM);
 			wake_up_interruptible_sync_poll(&priv->readq, EPOLLIN | EPOLLRDNORM);
+		}
 		if (S_ISCHR(inode->i_mode)) {
 			wake_up_interruptible_poll(&priv->readq, EPOLLIN);
-			qtfs_err("writeiter file:%s char:<%s> wakup poll.", filp->f_path.dentry->d_iname, req->path_buf);
+			qtfs_dp_debug("writeiter file:%s char wakup poll.", filp->f_path.dentry->d_iname);
 		}
 	} while (0);
-	qtfs_info("qtfs write %s over, leftlen:%lu.", filp->f_path.dentry->d_iname, leftlen);
+	qtfs_dp_info("qtfs write %s over, leftlen:%lu.", filp->f_path.dentry->d_iname, leftlen);
 	qtfs_conn_put_param(pvar);
 	return len - leftlen;
 }
@@ -425,7 +661,7 @@ loff_t qtfs_llseek(struct file *file, loff_t off, int whence)
 	loff_t ret;
 	struct private_data *priv = NULL;
 	
-	qtfs_info("qtfs llseek off:%lld, whence:%d cur pos:%lld.", off, whence, file->f_pos);
+	qtfs_dp_info("qtfs llseek off:%lld, whence:%d cur pos:%lld.", off, whence, file->f_pos);
 
 	if (off == 0 && whence == SEEK_CUR) {
 		return file->f_pos;
@@ -454,13 +690,13 @@ loff_t qtfs_llseek(struct file *file, loff_t off, int whence)
 	file->f_pos = rsp->off;
 	ret = rsp->off;
 	qtfs_conn_put_param(pvar);
-	qtfs_info("qtfs llseek successed, cur seek pos:%lld.", ret);
+	qtfs_dp_info("qtfs llseek successed, cur seek pos:%lld.", ret);
 	return ret;
 }
 
 static void qtfs_vma_close(struct vm_area_struct *vma)
 {
-	qtfs_info("qtfs vma close enter.");
+	qtfs_dp_info("qtfs vma close enter.");
 	filemap_write_and_wait(vma->vm_file->f_mapping);
 }
 
@@ -468,7 +704,7 @@ static vm_fault_t qtfs_vm_fault(struct vm_fault *vmf)
 {
 	vm_fault_t ret = filemap_fault(vmf);
 
-	qtfs_info("qtfs vm ops fault enter, filemap fault:0x%x, pgoff:%lu.", ret, vmf->pgoff);
+	qtfs_dp_info("qtfs vm ops fault enter, filemap fault:0x%x, pgoff:%lu.", ret, vmf->pgoff);
 	return ret;
 }
 
@@ -476,14 +712,14 @@ static vm_fault_t qtfs_vm_fault(struct vm_fault *vmf)
 static vm_fault_t qtfs_map_pages(struct vm_fault *vmf,
  		pgoff_t start_pgoff, pgoff_t end_pgoff)
  {
- 	qtfs_info("qtfs map pages enter, pgoff:%lu start:%lu end:%lu.", vmf->pgoff, start_pgoff, end_pgoff);
+ 	qtfs_dp_info("qtfs map pages enter, pgoff:%lu start:%lu end:%lu.", vmf->pgoff, start_pgoff, end_pgoff);
 	return filemap_map_pages(vmf, start_pgoff, end_pgoff);
  }
 #else
 static void qtfs_map_pages(struct vm_fault *vmf,
 		pgoff_t start_pgoff, pgoff_t end_pgoff)
 {
-	qtfs_info("qtfs map pages enter, pgoff:%lu start:%lu end:%lu.", vmf->pgoff, start_pgoff, end_pgoff);
+	qtfs_dp_info("qtfs map pages enter, pgoff:%lu start:%lu end:%lu.", vmf->pgoff, start_pgoff, end_pgoff);
 
 	filemap_map_pages(vmf, start_pgoff, end_pgoff);
 	return;
@@ -492,7 +728,7 @@ static void qtfs_map_pages(struct vm_fault *vmf,
 
 static vm_fault_t qtfs_page_mkwrite(struct vm_fault *vmf)
 {
-	qtfs_info("qtfs page mkwrite enter.");
+	qtfs_dp_info("qtfs page mkwrite enter.");
 	return filemap_page_mkwrite(vmf);
 }
 
@@ -521,90 +757,69 @@ int qtfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	return 0;
 }
 
-long qtfs_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg, unsigned int size)
+// run the ioctl on the file opened at server, as described by pass
+static long qtfs_do_ioctl(struct file *filp, const struct qtfs_ioctl_pass *pass, unsigned long arg)
 {
-	struct qtfs_sock_var_s *pvar = qtfs_conn_get_param();
+	struct qtfs_sock_var_s *pvar;
+	struct private_data *private = filp->private_data;
 	struct qtreq_ioctl *req;
 	struct qtrsp_ioctl *rsp;
-	unsigned int len = 0;
-	int ret = -EINVAL;
+	long ret;
 
+	if (private == NULL || err_ptr(private) || private->fd < 0)
+		return -EBADF;
+	pvar = qtfs_conn_get_param();
 	if (!pvar) {
 		qtfs_err("Failed to get qtfs sock var");
 		return -EINVAL;
 	}
-
-	WARN_ON(size >= MAX_PATH_LEN);
-	if (size >= MAX_PATH_LEN) {
-		qtfs_conn_put_param(pvar);
-		return -ENOMEM;
-	}
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
-	rsp = qtfs_sock_msg_buf(pvar, QTFS_RECV);
-
-	QTFS_FULLNAME(req->path, filp->f_path.dentry);
-
-	req->d.cmd = cmd;
-	if (size > 0) {
-		req->d.offset = ALIGN(strlen(req->path) + 1, 64);
-		ret = copy_from_user(req->path + req->d.offset, (char __user *)arg, size);
-		if (ret) {
-			qtfs_err("%s: copy_from_user %p, 0x%lx, %u failed.", __func__, req->path + req->d.offset, arg, size);
+	req->d.fd = private->fd;
+	req->d.cmd = pass->cmd;
+	req->d.size = 0;
+	req->d.arg = arg;
+	if ((pass->dir & _IOC_WRITE) && pass->size > 0) {
+		if (copy_from_user(req->buf, (void __user *)arg, pass->size)) {
+			ret = -EFAULT;
 			goto out;
 		}
-		len = sizeof(struct qtreq_ioctl) - sizeof(req->path) + req->d.offset + size;
-		req->d.size = size;
-	} else {
-		len = sizeof(struct qtreq_ioctl) - sizeof(req->path) + strlen(req->path) + 1;
+		req->d.size = pass->size;
 	}
 
-	rsp = qtfs_remote_run(pvar, QTFS_REQ_IOCTL, len);
-	if (IS_ERR(rsp) || rsp == NULL) {
-		qtfs_conn_put_param(pvar);
-		return PTR_ERR(rsp);
+	rsp = qtfs_remote_run(pvar, QTFS_REQ_IOCTL, sizeof(req->d) + req->d.size);
+	if (IS_ERR_OR_NULL(rsp)) {
+		ret = (rsp == NULL) ? -EIO : PTR_ERR(rsp);
+		goto out;
 	}
-	if (rsp->ret == QTFS_ERR) {
-		qtfs_err("qtfs ioctl cmd:0x%x failed. %d", cmd, rsp->errno);
-		ret = rsp->errno;
-		qtfs_conn_put_param(pvar);
-		return ret;
-	}
-
-	qtfs_info("qtfs do ioctl cmd:0x%x success, path: %s size:%u, rsp size:%u", cmd, req->path, size, rsp->size);
 	ret = rsp->errno;
-	if (rsp->size > 0)
-		ret = copy_to_user((char __user *)arg, rsp->buf, size);
+	if (rsp->ret == QTFS_ERR) {
+		qtfs_dp_info("qtfs ioctl cmd:0x%x failed, errno:%d.", pass->cmd, rsp->errno);
+		goto out;
+	}
+	if ((pass->dir & _IOC_READ) && rsp->size > 0 &&
+			copy_to_user((void __user *)arg, rsp->buf, min(rsp->size, pass->size)))
+		ret = -EFAULT;
+	qtfs_dp_info("qtfs do ioctl cmd:0x%x fd:%d size:%u, rsp size:%u ret:%ld", pass->cmd, req->d.fd,
+			pass->size, rsp->size, ret);
 out:
 	qtfs_conn_put_param(pvar);
-	return (long)ret;
+	return ret;
 }
 
 long qtfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	switch(cmd) {
-		case FS_IOC_FSGETXATTR:
-		case TCGETS:
-			return qtfs_do_ioctl(filp, cmd, arg, 0);
-		case FS_IOC_FSSETXATTR:
-			return qtfs_do_ioctl(filp, cmd, arg, sizeof(struct fsxattr));
-		case TCSETS:
-			return qtfs_do_ioctl(filp, cmd, arg, sizeof(struct ktermios));
-		default: {
-			char *fullname = kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-			if (!fullname)
-				return -ENOMEM;
-			memset(fullname, 0, MAX_PATH_LEN);
-			qtfs_fullname(fullname, filp->f_path.dentry);
-			qtfs_err("qtfs ioctl get not support cmd:%d file:%s TCGETS:%d", cmd, fullname, TCGETS);
-			kfree(fullname);
-			return -EOPNOTSUPP;
-		}
+	struct qtfs_ioctl_pass pass;
+
+	if (!qtfs_ioctl_pass_find(cmd, &pass)) {
+		qtfs_dp_info("qtfs ioctl cmd:0x%x not forwarded, file:%s.", cmd, filp->f_path.dentry->d_iname);
+		return -ENOTTY;
 	}
+	return qtfs_do_ioctl(filp, &pass, arg);
 }
 
 loff_t qtfs_dir_file_llseek(struct file *file, loff_t offset, int whence)
 {
-	qtfs_info("qtfs generic file llseek: %s.", file->f_path.dentry->d_iname);
+	qtfs_dp_info("qtfs generic file llseek: %s.", file->f_path.dentry->d_iname);
 	return generic_file_llseek(file, offset, whence);
 }
 
@@ -627,22 +842,25 @@ static struct file_operations qtfs_dir_ops = {
 static __poll_t
 qtfsfifo_poll(struct file *filp, poll_table *wait)
 {
-	struct qtfs_inode_priv *priv = filp->f_inode->i_private;
+	struct inode *inode = filp->f_inode;
+	struct qtfs_inode_priv *priv = inode->i_private;
 	__poll_t mask = 0;
-	struct list_head *p;
 	struct qtfs_sock_var_s *pvar;
 	struct qtreq_poll *req;
 	struct qtrsp_poll *rsp;
 	struct private_data *fpriv = (struct private_data *)filp->private_data;
+	u32 seq;
 
 	poll_wait(filp, &priv->readq, wait);
 
-	p = &priv->readq.head;
-
 	if (fpriv->fd < 0) {
 		qtfs_err("fifo poll priv file invalid.");
 		return 0;
 	}
+	// registered on the server epoll, pushes keep the cached mask current
+	if (qtfs_poll_cache_get(filp, poll_requested_events(wait), &mask))
+		return mask;
+	seq = qtfs_poll_seq(inode);
 	pvar = qtfs_conn_get_param();
 	if (pvar == NULL) {
 		qtfs_err("qtfs fifo poll get param failed.");
@@ -650,6 +868,7 @@ qtfsfifo_poll(struct file *filp, poll_table *wait)
 	}
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 	req->fd = fpriv->fd;
+	req->data = (unsigned long)filp;
 	rsp = qtfs_remote_run(pvar, QTFS_REQ_FIFOPOLL, sizeof(struct qtreq_poll));
 	if (IS_ERR(rsp) || rsp == NULL) {
 		qtfs_conn_put_param(pvar);
@@ -661,10 +880,11 @@ qtfsfifo_poll(struct file *filp, poll_table *wait)
 		return 0;
 	}
 	mask = rsp->mask;
+	if (rsp->watched)
+		WRITE_ONCE(fpriv->poll_watched, true);
+	qtfs_poll_cache_fill(inode, mask, seq);
 
-	qtfs_info("fifo poll success mask:%x, qproc:%lx key:%x head:%lx next:%lx pre:%lx",
-			mask, (unsigned long)wait->_qproc, (unsigned)wait->_key, (unsigned long)p,
-			(unsigned long)p->next, (unsigned long)p->prev);
+	qtfs_dp_info("fifo poll success mask:%x.", mask);
 	qtfs_conn_put_param(pvar);
 	return mask;
 }
@@ -695,7 +915,7 @@ static int qtfs_readpage(struct file *file, struct page *page)
 {
 	void *kaddr = NULL;
 	loff_t offset = page->index << PAGE_SHIFT;
-	qtfs_info("qtfs readpage enter, page pos:%lld.", offset);
+	qtfs_dp_info("qtfs readpage enter, page pos:%lld.", offset);
 
 	kaddr = kmap_atomic(page);
 	kernel_read(file, kaddr, PAGE_SIZE, &offset);
@@ -717,40 +937,91 @@ static int qtfs_read_folio(struct file *file, struct folio *folio)
 }
 #endif
 
-#ifndef KVER_4_19
-static struct page **qtfs_alloc_pages(unsigned int nr)
+#if (!defined KVER_4_19) && (!defined KVER_5_4)
+// max readahead window in units of data messages
+#define QTFS_RA_MAX_MSGS 8
+
+/*
+ * The kernel grows readahead windows for sequential access up to
+ * f_ra.ra_pages, let sequential streams on qtfs grow it further so that one
+ * window is several full data messages, and fall back on random access.
+ */
+static void qtfs_readahead_adapt(struct file *file, struct private_data *private,
+				struct readahead_control *rac, unsigned int msg_pages)
 {
-	struct page **pages = kzalloc(nr * (sizeof(struct page *)), GFP_KERNEL);
-	if (pages == NULL) {
-		qtfs_err("qtfs alloc pages failed.");
-		return NULL;
-	}
-	return pages;
-}
+	unsigned int max_pages = msg_pages * QTFS_RA_MAX_MSGS;
+	unsigned int def_pages = inode_to_bdi(file_inode(file))->ra_pages;
 
-static void qtfs_free_pages(struct page **pages)
-{
-	kfree(pages);
+	if (readahead_pos(rac) == private->ra_next) {
+		private->ra_hits++;
+		if (file->f_ra.ra_pages < max_pages)
+			file->f_ra.ra_pages = min(max(file->f_ra.ra_pages, msg_pages) * 2, max_pages);
+	} else {
+		private->ra_hits = 0;
+		file->f_ra.ra_pages = def_pages;
+	}
+	private->ra_next = readahead_pos(rac) + readahead_length(rac);
 }
 
-#ifndef KVER_5_4
+// read the whole window with as few data messages as possible, and scatter
+// the data into the pages in order
 static void qtfs_readahead(struct readahead_control *rac)
 {
-	int i;
-	unsigned int nr_pages = readahead_count(rac);
-	struct page **pages = qtfs_alloc_pages(nr_pages);
-	qtfs_info("qtfs readahead.");
+	struct file *file = rac->file;
+	struct private_data *private = (file == NULL) ? NULL : file->private_data;
+	struct qtfs_sock_var_s *pvar;
+	struct qtreq_readiter *req;
+	struct qtrsp_readiter *rsp = NULL;
+	size_t datalen = qtfs_data_len;
+	loff_t pos = readahead_pos(rac);
+	struct page *page;
 
-	nr_pages = __readahead_batch(rac, pages, nr_pages);
+	if (err_ptr(private) || private->fd <= 0)
+		return; // pages not read are unlocked and dropped by caller
+	pvar = qtfs_conn_get_param();
+	if (pvar == NULL)
+		return;
+	if (datalen > QTFS_REQ_MAX_LEN &&
+			qtfs_sock_var_grow(pvar, QTFS_RECV, QTFS_MSG_HEAD_LEN + datalen) != QTFS_OK)
+		datalen = QTFS_REQ_MAX_LEN;
+	qtfs_readahead_adapt(file, private, rac, (datalen - sizeof(rsp->d)) >> PAGE_SHIFT);
+	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 
-	for (i = 0; i < nr_pages; i++) {
-		qtfs_readpage(rac->file, pages[i]);
+	while (readahead_count(rac) > 0) {
+		size_t len = min_t(size_t, readahead_length(rac), (datalen - sizeof(rsp->d)) & PAGE_MASK);
+		size_t off = 0;
+		ssize_t got;
+
+		req->fd = private->fd;
+		req->len = len;
+		req->pos = pos;
+		rsp = qtfs_remote_run(pvar, QTFS_REQ_READITER, sizeof(struct qtreq_readiter));
+		if (IS_ERR_OR_NULL(rsp) || rsp->d.ret == QTFS_ERR || rsp->d.len <= 0)
+			break;
+		got = rsp->d.len;
+		while (off < got && (page = readahead_page(rac)) != NULL) {
+			size_t cnt = min_t(size_t, PAGE_SIZE, got - off);
+			void *kaddr = kmap_atomic(page);
+
+			memcpy(kaddr, rsp->readbuf + off, cnt);
+			if (cnt < PAGE_SIZE)
+				memset(kaddr + cnt, 0, PAGE_SIZE - cnt);
+			flush_dcache_page(page);
+			kunmap_atomic(kaddr);
+			SetPageUptodate(page);
+			unlock_page(page);
+			put_page(page);
+			off += PAGE_SIZE;
+		}
+		pos += got;
+		// short read means eof, pages left are beyond it
+		if (got < len || rsp->d.end)
+			break;
 	}
-	qtfs_free_pages(pages);
+	qtfs_conn_put_param(pvar);
 	return;
 }
 #endif
-#endif
 
 static int qtfs_writepage(struct page *page, struct writeback_control *wbc)
 {
@@ -809,6 +1080,8 @@ int qtfs_new_entry(struct inode *inode, struct dentry *dentry)
 {
 	struct dentry *d = NULL;
 
+	// parent dir is locked by vfs, its mtime and nlink have changed
+	qtfs_attr_invalidate_ino(d_inode(dentry->d_parent)->i_ino, QTFS_INVAL_ATTR);
 	if (!inode)
 		return -ENOMEM;
 
@@ -817,6 +1090,7 @@ int qtfs_new_entry(struct inode *inode, struct dentry *dentry)
 	if (IS_ERR(d)) {
 		return PTR_ERR(d);
 	}
+	qtfs_dentry_lease_set(d ? d : dentry, qtfs_dentry_gen(dentry));
 	if (d)
 		dput(d);
 	return 0;
@@ -958,6 +1232,9 @@ static void qtfs_inode_priv_alloc(struct inode *inode)
 	priv->files = 0;
 	init_waitqueue_head(&priv->readq);
 	init_waitqueue_head(&priv->writeq);
+	qtfs_attr_cache_init(priv);
+	qtfs_poll_cache_init(priv);
+	priv->handle = 0;
 	return;
 }
 
@@ -1018,6 +1295,7 @@ struct dentry *qtfs_lookup(struct inode *parent_inode, struct dentry *child_dent
 	struct qtrsp_lookup *rsp;
 	struct inode *inode;
 	struct dentry *d = NULL;
+	u32 gen;
 	int ret;
 
 	if (!pvar) {
@@ -1026,18 +1304,32 @@ struct dentry *qtfs_lookup(struct inode *parent_inode, struct dentry *child_dent
 	}
 
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
-	ret = qtfs_fullname(req->fullname, child_dentry);
-	if (ret < 0) {
-		qtfs_err("qtfs lookup get fullname failed, too many path layers, <%s>!", req->fullname);
-		goto err_end;
+	gen = qtfs_dentry_gen(child_dentry);
+	req->parent = qtfs_inode_handle(parent_inode);
+retry:
+	if (req->parent != 0) {
+		// the server walks only the name from the parent's handle
+		memcpy(req->fullname, child_dentry->d_name.name, child_dentry->d_name.len);
+		req->fullname[child_dentry->d_name.len] = '\0';
+	} else {
+		ret = qtfs_fullname(req->fullname, child_dentry);
+		if (ret < 0) {
+			qtfs_err("qtfs lookup get fullname failed, too many path layers, <%s>!", req->fullname);
+			goto err_end;
+		}
 	}
-	rsp = qtfs_remote_run(pvar, QTFS_REQ_LOOKUP, strlen(req->fullname));
+	rsp = qtfs_remote_run(pvar, QTFS_REQ_LOOKUP, QTFS_SEND_SIZE(struct qtreq_lookup, req->fullname));
 	if (IS_ERR(rsp) || rsp == NULL) {
 		qtfs_conn_put_param(pvar);
 		return (void *)rsp;
 	}
+	if (rsp->ret != QTFS_OK && rsp->errno == -ESTALE && req->parent != 0) {
+		qtfs_inode_handle_set(parent_inode, 0);
+		req->parent = 0;
+		goto retry;
+	}
 	if (rsp->ret != QTFS_OK) {
-		qtfs_info("qtfs fs lookup failed, path:<%s> not exist at peer.\n", req->fullname);
+		qtfs_dp_info("qtfs fs lookup failed, path:<%s> not exist at peer.\n", req->fullname);
 		d = ERR_PTR(rsp->errno);
 		qtfs_conn_put_param(pvar);
 		return d;
@@ -1045,8 +1337,11 @@ struct dentry *qtfs_lookup(struct inode *parent_inode, struct dentry *child_dent
 	inode = qtfs_iget(parent_inode->i_sb, &(rsp->inode_info));
 	if (inode == NULL)
 		goto err_end;
+	qtfs_inode_handle_set(inode, rsp->handle);
 	d = d_splice_alias(inode, child_dentry);
-	qtfs_debug("qtfs lookup fullname:%s mode:%o(rsp:%o), ino:%lu(rsp:%lu).",
+	if (!IS_ERR(d))
+		qtfs_dentry_lease_set(d ? d : child_dentry, gen);
+	qtfs_dp_debug("qtfs lookup fullname:%s mode:%o(rsp:%o), ino:%lu(rsp:%lu).",
 			req->fullname, inode->i_mode, rsp->inode_info.mode, inode->i_ino, rsp->inode_info.i_ino);
 
 	qtfs_conn_put_param(pvar);
@@ -1086,6 +1381,8 @@ int qtfs_rmdir(struct inode *dir, struct dentry *dentry)
 	}
 	qtfs_info("qtfs rmdir success:<%s>.\n", req->path);
 	qtfs_conn_put_param(pvar);
+	qtfs_attr_invalidate_ino(dir->i_ino, QTFS_INVAL_ATTR);
+	qtfs_attr_invalidate_ino(inode->i_ino, QTFS_INVAL_ATTR);
 	if (inode->i_nlink > 0)
                 drop_nlink(inode);
         d_invalidate(dentry);
@@ -1120,6 +1417,8 @@ int qtfs_unlink(struct inode *dir, struct dentry *dentry)
 		qtfs_info("qtfs unlink %s success\n", req->path);
 		inode->i_ctime = dir->i_ctime;
 		inode_dec_link_count(inode);
+		qtfs_attr_invalidate_ino(dir->i_ino, QTFS_INVAL_ATTR);
+		qtfs_attr_invalidate_ino(inode->i_ino, QTFS_INVAL_ATTR);
 	}
 	ret = rsp->errno;
 	qtfs_conn_put_param(pvar);
@@ -1160,6 +1459,9 @@ int qtfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_d
 	inode_inc_link_count(inode);
 	ihold(inode);
 	d_instantiate(new_dentry, inode);
+	qtfs_attr_invalidate_ino(dir->i_ino, QTFS_INVAL_ATTR);
+	qtfs_attr_invalidate_ino(inode->i_ino, QTFS_INVAL_ATTR);
+	qtfs_dentry_lease_set(new_dentry, qtfs_dentry_gen(new_dentry));
 	qtfs_info("qtfs link success, old:%s new:%s", req->path, req->path + req->d.oldlen);
 	qtfs_conn_put_param(pvar);
 	return 0;
@@ -1218,16 +1520,12 @@ err_end:
 	return error;
 }
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
-int qtfs_getattr(struct user_namespace *mnt_userns, const struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags)
-#else
-int qtfs_getattr(const struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags)
-#endif
+// path is only needed to learn the mount point the first time, may be NULL
+int qtfs_remote_getattr(struct dentry *dentry, struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags)
 {
 	struct qtfs_sock_var_s *pvar = qtfs_conn_get_param();
 	struct qtreq_getattr *req;
 	struct qtrsp_getattr *rsp;
-	struct inode *inode = path->dentry->d_inode;
 	int ret;
 
 	if (!pvar) {
@@ -1236,16 +1534,27 @@ int qtfs_getattr(const struct path *path, struct kstat *stat, u32 req_mask, unsi
 	}
 
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
-	QTFS_FULLNAME(req->path, path->dentry);
 	req->request_mask = req_mask;
 	req->query_flags = flags;
-
-	(void)qtfs_mountpoint_path_init(path->dentry, (struct path*)path, req->path);
+	req->handle = qtfs_inode_handle(d_inode(dentry));
+retry:
+	req->path[0] = '\0';
+	// the mount point is learned from the full path once
+	if (req->handle == 0 || (path && !qtfs_mountpoint_known(dentry))) {
+		QTFS_FULLNAME(req->path, dentry);
+		if (path)
+			(void)qtfs_mountpoint_path_init(dentry, path, req->path);
+	}
 	rsp = qtfs_remote_run(pvar, QTFS_REQ_GETATTR, QTFS_SEND_SIZE(struct qtreq_getattr, req->path));
 	if (IS_ERR(rsp) || rsp == NULL) {
 		qtfs_conn_put_param(pvar);
 		return PTR_ERR(rsp);
 	}
+	if (rsp->ret && rsp->errno == -ESTALE && req->handle != 0) {
+		qtfs_inode_handle_set(d_inode(dentry), 0);
+		req->handle = 0;
+		goto retry;
+	}
 	if (rsp->ret) {
 		qtfs_err("qtfs getattr <%s> failed.errno: %d %s\n", req->path, rsp->errno,
 				(rsp->errno != -ENOENT) ? "." : "file not exist");
@@ -1254,15 +1563,42 @@ int qtfs_getattr(const struct path *path, struct kstat *stat, u32 req_mask, unsi
 		return ret;
 	}
 	*stat = rsp->stat;
-	qtfs_debug("qtfs getattr success:<%s> blksiz:%u size:%lld mode:%o ino:%llu pathino:%lu. %s\n", req->path, rsp->stat.blksize,
-			rsp->stat.size, rsp->stat.mode, rsp->stat.ino, inode->i_ino, rsp->stat.ino != inode->i_ino ? "delete current inode" : "");
-	if (inode->i_ino != rsp->stat.ino || inode->i_mode != rsp->stat.mode) {
+	qtfs_dp_debug("qtfs getattr success:<%s> blksiz:%u size:%lld mode:%o ino:%llu.\n", req->path, rsp->stat.blksize,
+			rsp->stat.size, rsp->stat.mode, rsp->stat.ino);
+	qtfs_conn_put_param(pvar);
+	return 0;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
+int qtfs_getattr(struct user_namespace *mnt_userns, const struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags)
+#else
+int qtfs_getattr(const struct path *path, struct kstat *stat, u32 req_mask, unsigned int flags)
+#endif
+{
+	struct inode *inode = path->dentry->d_inode;
+	u32 agen, ngen;
+	int ret;
+
+	if (qtfs_attr_cache_get(inode, stat, req_mask, flags))
+		return 0;
+
+	agen = qtfs_attr_gen(inode->i_ino);
+	ngen = qtfs_dentry_gen(path->dentry);
+	ret = qtfs_remote_getattr(path->dentry, (struct path *)path, stat, req_mask, flags);
+	if (ret)
+		return ret;
+	if (inode->i_ino != stat->ino || inode->i_mode != stat->mode) {
+		qtfs_dp_debug("qtfs getattr ino:%llu mode:%o changed at peer, delete current inode:%lu.",
+				stat->ino, stat->mode, inode->i_ino);
 		if (inode->i_nlink > 0){
 			drop_nlink(inode);
 		}
 		d_invalidate(path->dentry);
+		return 0;
 	}
-	qtfs_conn_put_param(pvar);
+	qtfs_attr_cache_set(inode, stat, req_mask, agen);
+	// server just resolved the same name to the same inode
+	qtfs_dentry_lease_set(path->dentry, ngen);
 	return 0;
 }
 
@@ -1286,7 +1622,7 @@ int qtfs_setattr(struct dentry *dentry, struct iattr *attr)
 	QTFS_FULLNAME(req->path, dentry);
 	req->attr = *attr;
 	req->attr.ia_file = NULL;
-	qtfs_info("iattr iavalid:%u mode:0x%o size:%lld file:0x%lx\n",
+	qtfs_dp_info("iattr iavalid:%u mode:0x%o size:%lld file:0x%lx\n",
 			req->attr.ia_valid, req->attr.ia_mode, req->attr.ia_size, (unsigned long)req->attr.ia_file);
 	rsp = qtfs_remote_run(pvar, QTFS_REQ_SETATTR, QTFS_SEND_SIZE(struct qtreq_setattr, req->path));
 	if (IS_ERR(rsp) || rsp == NULL) {
@@ -1299,8 +1635,9 @@ int qtfs_setattr(struct dentry *dentry, struct iattr *attr)
 		qtfs_conn_put_param(pvar);
 		return ret;
 	}
-	qtfs_info("qtfs setattr <%s> success.\n", req->path);
+	qtfs_dp_info("qtfs setattr <%s> success.\n", req->path);
 	qtfs_conn_put_param(pvar);
+	qtfs_attr_invalidate_ino(d_inode(dentry)->i_ino, QTFS_INVAL_ATTR);
 	return 0;
 }
 const char *qtfs_getlink(struct dentry *dentry,
@@ -1412,6 +1749,11 @@ int qtfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		qtfs_err("qtfs rename failed,errno:%d\n", rsp->errno);
 	} else {
 		qtfs_info("qtfs rename success, oldname:%s newname:%s flags:%x\n", req->path, &req->path[req->d.oldlen], flags);
+		qtfs_attr_invalidate_ino(old_dir->i_ino, QTFS_INVAL_ATTR);
+		qtfs_attr_invalidate_ino(new_dir->i_ino, QTFS_INVAL_ATTR);
+		qtfs_attr_invalidate_ino(d_inode(old_dentry)->i_ino, QTFS_INVAL_ATTR);
+		if (d_really_is_positive(new_dentry))
+			qtfs_attr_invalidate_ino(d_inode(new_dentry)->i_ino, QTFS_INVAL_ATTR);
 	}
 	ret = rsp->errno;
 	qtfs_conn_put_param(pvar);
@@ -1483,11 +1825,71 @@ static int qtfs_fill_super(struct super_block *sb, void *priv_data, int silent)
 	sb->s_fs_info = priv;
 	sb->s_op = &qtfs_ops;
 	sb->s_time_gran = 1;
+	// proc keeps local entries and changes under our feet, never lease it
+	if (priv->type != QTFS_PROC)
+		sb->s_d_op = &qtfs_dentry_ops;
 
 	sb->s_root = d_make_root(root_inode);
 	return 0;
 }
 
+enum {
+	QTFS_OPT_PROC,
+	QTFS_OPT_ATTR_TIMEOUT,
+	QTFS_OPT_DENTRY_TIMEOUT,
+	QTFS_OPT_ERR,
+};
+
+static const match_table_t qtfs_tokens = {
+	{QTFS_OPT_PROC, "proc"},
+	{QTFS_OPT_ATTR_TIMEOUT, "attr_timeout=%d"},
+	{QTFS_OPT_DENTRY_TIMEOUT, "dentry_timeout=%d"},
+	{QTFS_OPT_ERR, NULL},
+};
+
+// mount data is comma separated: "proc", "attr_timeout=ms", "dentry_timeout=ms"
+static int qtfs_parse_opts(struct qtfs_fs_info *priv, char *data)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *opts, *orig, *p;
+	int val;
+
+	priv->type = QTFS_NORMAL;
+	priv->attr_timeout = msecs_to_jiffies(qtfs_attr_timeout_ms);
+	priv->dentry_timeout = msecs_to_jiffies(qtfs_dentry_timeout_ms);
+	if (data == NULL)
+		return 0;
+	orig = opts = kstrdup(data, GFP_KERNEL);
+	if (opts == NULL)
+		return -ENOMEM;
+	while ((p = strsep(&opts, ",")) != NULL) {
+		if (*p == '\0')
+			continue;
+		switch (match_token(p, qtfs_tokens, args)) {
+			case QTFS_OPT_PROC:
+				priv->type = QTFS_PROC;
+				break;
+			case QTFS_OPT_ATTR_TIMEOUT:
+				if (match_int(&args[0], &val) == 0 && val >= 0)
+					priv->attr_timeout = msecs_to_jiffies(val);
+				break;
+			case QTFS_OPT_DENTRY_TIMEOUT:
+				if (match_int(&args[0], &val) == 0 && val >= 0)
+					priv->dentry_timeout = msecs_to_jiffies(val);
+				break;
+			default:
+				qtfs_warn("qtfs ignore unknown mount option:%s.", p);
+				break;
+		}
+	}
+	kfree(orig);
+	if (priv->type == QTFS_PROC) {
+		priv->attr_timeout = 0;
+		priv->dentry_timeout = 0;
+	}
+	return 0;
+}
+
 struct dentry *qtfs_fs_mount(struct file_system_type *fs_type,
 								int flags, const char *dev_name, void *data)
 {
@@ -1503,12 +1905,33 @@ struct dentry *qtfs_fs_mount(struct file_system_type *fs_type,
 
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
 	strlcpy(req->path, dev_name, PATH_MAX);
-	rsp = qtfs_remote_run(pvar, QTFS_REQ_MOUNT, strlen(dev_name));
-	if (IS_ERR(rsp) || rsp == NULL || rsp->ret != QTFS_OK) {
+	req->data_len = qtfs_data_msg_len;
+	req->caps = QTFS_MNT_CAP_INVALIDATE | QTFS_MNT_CAP_EPOLL_STREAM | QTFS_MNT_CAP_READDIR_FD;
+	req->version = QTFS_PROTO_VERSION;
+	// the new fields follow path, so the whole struct is sent
+	rsp = qtfs_remote_run(pvar, QTFS_REQ_MOUNT, sizeof(struct qtreq_mount));
+	if (IS_ERR(rsp) || rsp == NULL) {
+		qtfs_err("qtfs fs mount failed, path:<%s> no response from peer.\n", dev_name);
+		qtfs_conn_put_param(pvar);
+		return ERR_PTR(-ENOENT);
+	}
+	// an old server answers ret only, the rest of rsp is stale
+	if (((struct qtreq *)pvar->vec_recv.iov_base)->len < sizeof(struct qtrsp_mount) ||
+			rsp->version != QTFS_PROTO_VERSION) {
+		qtfs_err("qtfs fs mount failed, peer protocol version differs from ours:%u, upgrade both sides.\n",
+				QTFS_PROTO_VERSION);
+		qtfs_conn_put_param(pvar);
+		return ERR_PTR(-EPROTO);
+	}
+	if (rsp->ret != QTFS_OK) {
 		qtfs_err("qtfs fs mount failed, path:<%s> not exist at peer.\n", dev_name);
 		qtfs_conn_put_param(pvar);
 		return ERR_PTR(-ENOENT);
 	}
+	if (rsp->data_len >= QTFS_REQ_MAX_LEN && rsp->data_len <= QTFS_DATA_MAX_LEN) {
+		qtfs_data_len = rsp->data_len;
+		qtfs_info("qtfs data message len negotiated:%u.", qtfs_data_len);
+	}
 
 	priv = (struct qtfs_fs_info *)kmalloc(sizeof(struct qtfs_fs_info), GFP_KERNEL);
 	if (err_ptr(priv)) {
@@ -1518,7 +1941,11 @@ struct dentry *qtfs_fs_mount(struct file_system_type *fs_type,
 	}
 
 	memset(priv, 0, sizeof(struct qtfs_fs_info));
-	priv->type = qtfs_get_type((char *)data);
+	if (qtfs_parse_opts(priv, (char *)data) != 0) {
+		kfree(priv);
+		qtfs_conn_put_param(pvar);
+		return ERR_PTR(-ENOMEM);
+	}
 	strlcpy(priv->peer_path, dev_name, NAME_MAX);
 	priv->mnt_path = NULL;
 
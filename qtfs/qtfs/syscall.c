@@ -92,6 +92,7 @@ static void do_epoll_ctl_remote(int op, struct epoll_event __user *event, struct
 		qtinfo_cntinc(QTINF_EPOLL_FDERR);
 		return;
 	}
+	qtfs_poll_cache_register(file, op, tmp.events);
 	if (op == EPOLL_CTL_ADD) {
 		qtinfo_cntinc(QTINF_EPOLL_ADDFDS);
 	} else {
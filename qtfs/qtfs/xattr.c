@@ -158,6 +158,7 @@ static int qtfs_xattr_set(const struct xattr_handler *handler,
 		qtfs_err("xattr set failed file:%s name:%s", req->buf, name);
 	} else {
 		qtfs_info("xattr set successed file:%s name:%s", req->buf, name);
+		qtfs_attr_invalidate_ino(inode->i_ino, QTFS_INVAL_ATTR);
 	}
 	ret = rsp->errno;
 	qtfs_conn_put_param(pvar);
@@ -4,6 +4,9 @@
 #include <linux/tcp.h>
 #include <net/tcp.h>
 #include <linux/un.h>
+#include <linux/kthread.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
 
 #include "comm.h"
 #include "conn.h"
@@ -11,29 +14,63 @@
 #include "req.h"
 #include "symbol_wrapper.h"
 #include "uds_module.h"
+#include "qtfs_shm.h"
+
+#define CREATE_TRACE_POINTS
+#include "qtfs_trace.h"
 
 char qtfs_log_level[QTFS_LOGLEVEL_STRLEN] = {0};
 char qtfs_server_ip[20] = "127.0.0.1";
 int log_level = LOG_ERROR;
 int qtfs_server_port = 12345;
 int qtfs_sock_max_conn = QTFS_MAX_THREADS;
+// payload size of data messages, client: wanted; server: max supported
+unsigned int qtfs_data_msg_len = QTFS_DATA_DEF_LEN;
 struct qtinfo *qtfs_diag_info = NULL;
 bool qtfs_epoll_mode = false; // true: support any mode; false: only support fifo
+// transport options, applied to each connection when it's set up
+bool qtfs_tcp_nodelay = true;
+bool qtfs_tcp_quickack = false;
+bool qtfs_tcp_msg_more = true;
+int qtfs_sock_sndbuf = 0; // bytes, 0 keeps the kernel's autotuning
+int qtfs_sock_rcvbuf = 0;
+int qtfs_sock_busy_poll = 0; // us, request connections only
+int qtfs_conn_mode = QTFS_CONN_SOCKET;
+const struct qtfs_conn_ops *qtfs_conn_tp = &qtfs_sock_ops;
 
 static atomic_t g_qtfs_conn_num;
-static struct list_head g_vld_lst;
-static struct list_head g_busy_lst;
-static struct llist_head g_lazy_put_llst;
+// serializes growing the pool only, get and put don't take it
 static struct mutex g_param_mutex;
 int qtfs_mod_exiting = false;
-struct qtfs_sock_var_s *qtfs_thread_var[QTFS_MAX_THREADS] = {NULL};
+struct qtfs_sock_var_s *qtfs_thread_var[QTFS_MAX_PARAMS] = {NULL};
 struct qtfs_sock_var_s *qtfs_epoll_var = NULL;
 #ifdef QTFS_SERVER
 struct socket *qtfs_server_main_sock = NULL;
 struct qtfs_server_userp_s *qtfs_userps = NULL;
 #endif
+#ifdef QTFS_CLIENT
+// number of multiplexed connections, 0 means one connection per pvar
+int qtfs_pipe_conns = 4;
+// max requests in flight over all pipes
+int qtfs_pipe_max_req = 128;
+// how long a caller waits for its connection to come back
+int qtfs_reconnect_wait_ms = 3000;
+// times a request that changes nothing is sent again after its connection was lost
+int qtfs_replay_max = 2;
+// payload size of data messages negotiated with server at mount
+unsigned int qtfs_data_len = QTFS_REQ_MAX_LEN;
+static struct qtfs_pipe_s *qtfs_pipes = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(qtfs_pipe_waitq);
+#endif
 struct qtsock_wl_stru qtsock_wl;
-#define QTFS_EPOLL_THREADIDX (QTFS_MAX_THREADS + 4)
+#define QTFS_EPOLL_THREADIDX (QTFS_MAX_PARAMS + 4)
+#define QTFS_PIPE_THREADIDX(i) (QTFS_MAX_PARAMS + 8 + (i))
+// staging buffer of a connection, a full inline message and the next ones
+#define QTFS_RX_BUF_LEN (2 * QTFS_MSG_LEN)
+// server: longest sleep waiting for a client to accept
+#define QTFS_ACCEPT_WAIT_MS 500
+// client: longest wait for a handshake in flight before backing off
+#define QTFS_CONNECT_WAIT_MS 100
 
 #if (defined KVER_4_19) || (defined KVER_5_4)
 static inline void sock_valbool_flag(struct sock *sk, enum sock_flags bit,
@@ -122,9 +159,112 @@ void sock_set_reuseaddr(struct sock *sk)
 
 #define QTFS_SERVER_MAXCONN 2
 
+// transport counters, every connection bumps them, see qtfs_conn_stat_fold
+static struct {
+	atomic64_t tuned;
+	atomic64_t tune_err;
+	atomic64_t more_sends;
+	atomic64_t quickacks;
+	atomic64_t retrans;
+	atomic64_t rx_calls;
+	atomic64_t rx_msgs;
+	atomic64_t srtt[QTINFO_LAT_BUCKETS];
+} g_tcp_stat;
+
+#if (defined KVER_4_19) || (defined KVER_5_4)
+static int qtfs_sock_setopt(struct socket *sock, int level, int opt, int val)
+{
+	return kernel_setsockopt(sock, level, opt, (char *)&val, sizeof(val));
+}
+#else
+static int qtfs_sock_setopt(struct socket *sock, int level, int opt, int val)
+{
+	sockptr_t optval = KERNEL_SOCKPTR(&val);
+
+	if (level == SOL_SOCKET)
+		return sock_setsockopt(sock, level, opt, optval, sizeof(val));
+	return sock->ops->setsockopt(sock, level, opt, optval, sizeof(val));
+}
+#endif
+
+static void qtfs_sock_tune_opt(struct socket *sock, int level, int opt, int val)
+{
+	int ret = qtfs_sock_setopt(sock, level, opt, val);
+
+	if (ret != 0) {
+		atomic64_inc(&g_tcp_stat.tune_err);
+		qtfs_warn("qtfs sock set option level:%d opt:%d val:%d failed, ret:%d.", level, opt, val, ret);
+	}
+}
+
+// small requests must not wait for Nagle or a delayed ack, the payload of
+// a frame is held back with MSG_MORE instead so it still fills segments
+static void qtfs_sock_tune(struct socket *sock, bool request)
+{
+	if (qtfs_tcp_nodelay)
+		qtfs_sock_tune_opt(sock, SOL_TCP, TCP_NODELAY, 1);
+	if (qtfs_tcp_quickack)
+		qtfs_sock_tune_opt(sock, SOL_TCP, TCP_QUICKACK, 1);
+	if (qtfs_sock_sndbuf > 0)
+		qtfs_sock_tune_opt(sock, SOL_SOCKET, SO_SNDBUF, qtfs_sock_sndbuf);
+	if (qtfs_sock_rcvbuf > 0)
+		qtfs_sock_tune_opt(sock, SOL_SOCKET, SO_RCVBUF, qtfs_sock_rcvbuf);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	// set directly, the option wants CAP_NET_ADMIN of whoever connects
+	if (request && qtfs_sock_busy_poll > 0)
+		WRITE_ONCE(sock->sk->sk_ll_usec, qtfs_sock_busy_poll);
+#endif
+	qtfs_diag_info->tcp.nodelay = qtfs_tcp_nodelay;
+	qtfs_diag_info->tcp.quickack = qtfs_tcp_quickack;
+	qtfs_diag_info->tcp.msg_more = qtfs_tcp_msg_more;
+	qtfs_diag_info->tcp.sndbuf = qtfs_sock_sndbuf;
+	qtfs_diag_info->tcp.rcvbuf = qtfs_sock_rcvbuf;
+	qtfs_diag_info->tcp.busy_poll = qtfs_sock_busy_poll;
+	atomic64_inc(&g_tcp_stat.tuned);
+}
+
+// a message came in on pvar's connection: sample its rtt and retransmits,
+// and ack the next one right away again, quick ack mode doesn't last
+static void qtfs_sock_after_recv(struct qtfs_sock_var_s *pvar)
+{
+	struct socket *sock = pvar->client_sock;
+	struct tcp_sock *tp;
+	u32 retrans;
+
+	atomic64_inc(&g_tcp_stat.rx_msgs);
+	if (sock == NULL || sock->sk == NULL || sock->sk->sk_protocol != IPPROTO_TCP)
+		return;
+	tp = tcp_sk(sock->sk);
+	atomic64_inc(&g_tcp_stat.srtt[qtinfo_lat_bucket((unsigned long long)(READ_ONCE(tp->srtt_us) >> 3) * NSEC_PER_USEC)]);
+	retrans = READ_ONCE(tp->total_retrans);
+	if (retrans < pvar->tcp_retrans)
+		pvar->tcp_retrans = 0;
+	atomic64_add(retrans - pvar->tcp_retrans, &g_tcp_stat.retrans);
+	pvar->tcp_retrans = retrans;
+	if (qtfs_tcp_quickack) {
+		qtfs_sock_setopt(sock, SOL_TCP, TCP_QUICKACK, 1);
+		atomic64_inc(&g_tcp_stat.quickacks);
+	}
+}
+
 static int qtfs_conn_sock_recv(struct qtfs_sock_var_s *pvar, bool block);
 static int qtfs_conn_sock_send(struct qtfs_sock_var_s *pvar);
-static void qtfs_conn_sock_fini(struct qtfs_sock_var_s *pvar);
+static int qtfs_conn_release_client(struct qtfs_sock_var_s *pvar);
+#ifdef QTFS_CLIENT
+static int qtfs_connmgr_wait(struct qtfs_sock_var_s *pvar);
+#endif
+void qtfs_sock_recvtimeo_set(struct socket *sock, __s64 sec, __s64 usec);
+
+// point msg at kernel buffers, dir is READ or WRITE
+static void qtfs_msg_kvec(struct msghdr *msg, int dir, struct kvec *vec, size_t num, size_t len)
+{
+	memset(msg, 0, sizeof(*msg));
+#ifdef KVER_4_19
+	iov_iter_kvec(&msg->msg_iter, dir | ITER_KVEC, vec, num, len);
+#else
+	iov_iter_kvec(&msg->msg_iter, dir, vec, num, len);
+#endif
+}
 
 // try to connect remote uds server, only for unix domain socket
 #define QTFS_UDS_PROXY_SUFFIX ".proxy"
@@ -308,7 +448,8 @@ static int qtfs_conn_server_accept(struct qtfs_sock_var_s *pvar)
 	if (ret < 0) {
 		return ret;
 	}
-	QTSOCK_SET_KEEPX(sock, 5);
+	QTSOCK_SET_KEEPX(pvar->client_sock, 5);
+	qtfs_sock_tune(pvar->client_sock, !QTCONN_IS_EPOLL_CONN(pvar));
 
 	qtfs_info("qtfs accept a client connection.\n");
 	return 0;
@@ -381,6 +522,14 @@ static int qtfs_conn_client_conn(struct qtfs_sock_var_s *pvar)
 	saddr.sin_addr.s_addr = in_aton(pvar->addr);
 
 	ret = sock->ops->connect(sock, (struct sockaddr *)&saddr, sizeof(saddr), SOCK_NONBLOCK);
+	// the handshake is in flight, a reachable server answers within a
+	// round trip, only a silent one leaves it to the caller's backoff
+	if (ret == -EINPROGRESS || ret == -EALREADY) {
+		wait_event_interruptible_timeout(*sk_sleep(sock->sk),
+				READ_ONCE(sock->sk->sk_state) != TCP_SYN_SENT || qtfs_mod_exiting,
+				msecs_to_jiffies(QTFS_CONNECT_WAIT_MS));
+		ret = sock->ops->connect(sock, (struct sockaddr *)&saddr, sizeof(saddr), SOCK_NONBLOCK);
+	}
 	if (ret < 0) {
 		qtfs_err("%s: sock(%llx) addr(%s): connect get ret: %d\n", __func__, (__u64)sock, pvar->addr, ret);
 		return ret;
@@ -400,7 +549,10 @@ static int qtfs_conn_sockclient_init(struct qtfs_sock_var_s *pvar)
 		goto err_end;
 	}
 	QTSOCK_SET_KEEPX(sock, 5);
+	// before connecting, buffer sizes decide the window scale
+	qtfs_sock_tune(sock, !QTCONN_IS_EPOLL_CONN(pvar));
 	pvar->client_sock = sock;
+	pvar->tcp_retrans = 0;
 
 	return 0;
 err_end:
@@ -409,69 +561,265 @@ err_end:
 }
 #endif
 
-int qtfs_conn_init(int msg_mode, struct qtfs_sock_var_s *pvar)
+static int qtfs_sock_init(struct qtfs_sock_var_s *pvar)
 {
-	int ret = -EINVAL;
-
-	switch (msg_mode) {
-		case QTFS_CONN_SOCKET:
 #ifdef QTFS_SERVER
-			ret = qtfs_conn_sockserver_init(pvar);
+	return qtfs_conn_sockserver_init(pvar);
 #endif
 #ifdef QTFS_CLIENT
-			ret = qtfs_conn_sockclient_init(pvar);
+	return qtfs_conn_sockclient_init(pvar);
 #endif
-			break;
+}
 
-		default:
-			qtfs_err("qtfs connection init failed, unknown mode:%d.\n", msg_mode);
-			break;
-	}
+static int qtfs_sock_connect(struct qtfs_sock_var_s *pvar)
+{
+	int ret;
 
+#ifdef QTFS_SERVER
+	ret = qtfs_conn_server_accept(pvar);
+#endif
+#ifdef QTFS_CLIENT
+	ret = qtfs_conn_client_conn(pvar);
+#endif
+	if (ret == 0)
+		qtfs_sock_recvtimeo_set(pvar->client_sock, QTFS_SOCK_RCVTIMEO, 0);
 	return ret;
 }
 
-void qtfs_conn_fini(int msg_mode, struct qtfs_sock_var_s *pvar)
+static int qtfs_sock_release(struct qtfs_sock_var_s *pvar)
 {
-	switch (msg_mode) {
-		case QTFS_CONN_SOCKET:
-			qtfs_conn_sock_fini(pvar);
-			break;
+	if (pvar->client_sock == NULL)
+		return -ENOTCONN;
+	sock_release(pvar->client_sock);
+	pvar->client_sock = NULL;
+	return 0;
+}
 
-		default:
-			qtfs_err("qtfs connection fini failed, unknown mode:%d.\n", msg_mode);
-			break;
+static void qtfs_sock_shutdown(struct qtfs_sock_var_s *pvar)
+{
+	if (pvar->client_sock != NULL)
+		kernel_sock_shutdown(pvar->client_sock, SHUT_RDWR);
+}
+
+// the epoll connection listens on its own socket
+static void qtfs_sock_fini(struct qtfs_sock_var_s *pvar)
+{
+	if (pvar->sock != NULL) {
+		sock_release(pvar->sock);
+		pvar->sock = NULL;
 	}
-	return;
 }
 
-int qtfs_conn_send(int msg_mode, struct qtfs_sock_var_s *pvar)
+static bool qtfs_sock_established(struct qtfs_sock_var_s *pvar)
 {
-	int ret = -EINVAL;
-	switch (msg_mode) {
-		case QTFS_CONN_SOCKET:
-			ret = qtfs_conn_sock_send(pvar);
-			break;
-		default:
-			qtfs_err("qtfs connection send failed, unknown mode:%d.\n", msg_mode);
-			break;
+	struct socket *sock = pvar->client_sock;
+	__u8 tcpi_state;
+	if (sock == NULL)
+		return false;
+	tcpi_state = inet_sk_state_load(sock->sk);
+	if (tcpi_state == TCP_ESTABLISHED)
+		return true;
+	qtfs_warn("qtfs threadidx:%d tcpi state:%u(define:TCP_ESTABLISHED=1 is connected) disconnect!", pvar->cur_threadidx, tcpi_state);
+
+	return false;
+}
+
+static int qtfs_sock_sendmsg(struct qtfs_sock_var_s *pvar, struct msghdr *msg)
+{
+	if (pvar->client_sock == NULL)
+		return -ENOTCONN;
+	return sock_sendmsg(pvar->client_sock, msg);
+}
+
+static int qtfs_sock_recvmsg(struct qtfs_sock_var_s *pvar, struct msghdr *msg, int flags)
+{
+	if (pvar->client_sock == NULL)
+		return -ENOTCONN;
+	return sock_recvmsg(pvar->client_sock, msg, flags);
+}
+
+#ifdef QTFS_SERVER
+static void qtfs_sock_data_ready(struct sock *sk)
+{
+	struct qtfs_sock_var_s *pvar;
+	void (*data_ready)(struct sock *sk);
+
+	read_lock_bh(&sk->sk_callback_lock);
+	pvar = sk->sk_user_data;
+	data_ready = (pvar != NULL) ? pvar->sched_data_ready : sk->sk_data_ready;
+	if (data_ready != qtfs_sock_data_ready)
+		data_ready(sk);
+	if (pvar != NULL)
+		qtfs_sched_ready(pvar);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+// a closed or reset connection must reach a worker too, its recv fails
+// and the slot goes back to be accepted again
+static void qtfs_sock_state_change(struct sock *sk)
+{
+	struct qtfs_sock_var_s *pvar;
+	void (*state_change)(struct sock *sk);
+
+	read_lock_bh(&sk->sk_callback_lock);
+	pvar = sk->sk_user_data;
+	state_change = (pvar != NULL) ? pvar->sched_state_change : sk->sk_state_change;
+	if (state_change != qtfs_sock_state_change)
+		state_change(sk);
+	if (pvar != NULL)
+		qtfs_sched_ready(pvar);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void qtfs_sock_watch(struct qtfs_sock_var_s *pvar, bool on)
+{
+	struct sock *sk = on ? pvar->client_sock->sk : pvar->sched_sk;
+
+	if (sk == NULL)
+		return;
+	write_lock_bh(&sk->sk_callback_lock);
+	if (on) {
+		pvar->sched_data_ready = sk->sk_data_ready;
+		pvar->sched_state_change = sk->sk_state_change;
+		sk->sk_user_data = pvar;
+		sk->sk_data_ready = qtfs_sock_data_ready;
+		sk->sk_state_change = qtfs_sock_state_change;
+	} else if (sk->sk_user_data == pvar) {
+		sk->sk_data_ready = pvar->sched_data_ready;
+		sk->sk_state_change = pvar->sched_state_change;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+	pvar->sched_sk = on ? sk : NULL;
+}
+
+static bool qtfs_sock_readable(struct qtfs_sock_var_s *pvar)
+{
+	struct sock *sk = pvar->sched_sk;
+
+	return sk != NULL && !skb_queue_empty(&sk->sk_receive_queue);
+}
+
+static struct sock *qtfs_sock_listen_sk = NULL;
+static void (*qtfs_sock_listen_data_ready)(struct sock *sk) = NULL;
+
+static void qtfs_sock_listen_ready(struct sock *sk)
+{
+	void (*data_ready)(struct sock *sk) = READ_ONCE(qtfs_sock_listen_data_ready);
+
+	if (data_ready != NULL)
+		data_ready(sk);
+	qtfs_sched_kick();
+}
+
+// the listening socket exists once the first connection is accepted
+static int qtfs_sock_watch_listen(bool on)
+{
+	struct sock *sk;
+
+	if (!on) {
+		sk = qtfs_sock_listen_sk;
+		if (sk == NULL)
+			return 0;
+		write_lock_bh(&sk->sk_callback_lock);
+		sk->sk_data_ready = qtfs_sock_listen_data_ready;
+		write_unlock_bh(&sk->sk_callback_lock);
+		qtfs_sock_listen_sk = NULL;
+		return 0;
 	}
-	return ret;
+	if (qtfs_sock_listen_sk != NULL)
+		return 0;
+	if (qtfs_server_main_sock == NULL)
+		return -ENOTCONN;
+	sk = qtfs_server_main_sock->sk;
+	write_lock_bh(&sk->sk_callback_lock);
+	WRITE_ONCE(qtfs_sock_listen_data_ready, sk->sk_data_ready);
+	sk->sk_data_ready = qtfs_sock_listen_ready;
+	write_unlock_bh(&sk->sk_callback_lock);
+	qtfs_sock_listen_sk = sk;
+	return 0;
 }
 
-int do_qtfs_conn_recv(int msg_mode, struct qtfs_sock_var_s *pvar, bool block)
+static bool qtfs_sock_accept_ready(void)
 {
-	int ret = -EINVAL;
-	switch (msg_mode) {
-		case QTFS_CONN_SOCKET:
-			ret = qtfs_conn_sock_recv(pvar, block);
-			break;
+	return !reqsk_queue_empty(&inet_csk(qtfs_sock_listen_sk)->icsk_accept_queue);
+}
 
-		default:
-			qtfs_err("qtfs connection recv failed, unknown mode:%d.\n", msg_mode);
-			break;
+static void qtfs_sock_accept_wait(struct qtfs_sock_var_s *pvar, long timeo)
+{
+	struct socket *sock = QTCONN_IS_EPOLL_CONN(pvar) ? pvar->sock : qtfs_server_main_sock;
+
+	if (sock == NULL) {
+		schedule_timeout_interruptible(timeo);
+		return;
 	}
-	return ret;
+	// the listening socket's sk_data_ready wakes its wait queue
+	wait_event_interruptible_timeout(*sk_sleep(sock->sk),
+			!reqsk_queue_empty(&inet_csk(sock->sk)->icsk_accept_queue) || qtfs_mod_exiting, timeo);
+}
+#endif
+
+const struct qtfs_conn_ops qtfs_sock_ops = {
+	.name = "socket",
+	.init = qtfs_sock_init,
+	.connect = qtfs_sock_connect,
+	.release = qtfs_sock_release,
+	.shutdown = qtfs_sock_shutdown,
+	.fini = qtfs_sock_fini,
+	.connected = qtfs_sock_established,
+	.sendmsg = qtfs_sock_sendmsg,
+	.recvmsg = qtfs_sock_recvmsg,
+#ifdef QTFS_SERVER
+	.watch = qtfs_sock_watch,
+	.readable = qtfs_sock_readable,
+	.watch_listen = qtfs_sock_watch_listen,
+	.accept_ready = qtfs_sock_accept_ready,
+	.accept_wait = qtfs_sock_accept_wait,
+#endif
+};
+
+// only the transport chosen at load is set up
+static const struct qtfs_conn_ops *qtfs_conn_ops_of(int msg_mode)
+{
+	if (msg_mode != qtfs_conn_mode) {
+		qtfs_err("qtfs connection mode:%d not in use, mode is %d.\n", msg_mode, qtfs_conn_mode);
+		return NULL;
+	}
+	return qtfs_conn_tp;
+}
+
+int qtfs_conn_init(int msg_mode, struct qtfs_sock_var_s *pvar)
+{
+	const struct qtfs_conn_ops *ops = qtfs_conn_ops_of(msg_mode);
+
+	if (ops == NULL)
+		return -EINVAL;
+	return ops->init(pvar);
+}
+
+void qtfs_conn_fini(int msg_mode, struct qtfs_sock_var_s *pvar)
+{
+	const struct qtfs_conn_ops *ops = qtfs_conn_ops_of(msg_mode);
+
+	if (ops == NULL)
+		return;
+	if (qtfs_conn_release_client(pvar) == 0)
+		qtfs_info("qtfs conn finish threadidx:%d.", pvar->cur_threadidx);
+	ops->fini(pvar);
+}
+
+int qtfs_conn_send(int msg_mode, struct qtfs_sock_var_s *pvar)
+{
+	if (qtfs_conn_ops_of(msg_mode) == NULL)
+		return -EINVAL;
+	return qtfs_conn_sock_send(pvar);
+}
+
+int do_qtfs_conn_recv(int msg_mode, struct qtfs_sock_var_s *pvar, bool block)
+{
+	if (qtfs_conn_ops_of(msg_mode) == NULL)
+		return -EINVAL;
+	return qtfs_conn_sock_recv(pvar, block);
 }
 
 int qtfs_conn_recv_block(int msg_mode, struct qtfs_sock_var_s *pvar)
@@ -517,178 +865,489 @@ void qtfs_sock_recvtimeo_set(struct socket *sock, __s64 sec, __s64 usec)
 	}
 }
 
-static int qtfs_conn_sock_recv(struct qtfs_sock_var_s *pvar, bool block)
+// send pvar's message on conn, the bulk payload in send_bulk follows the
+// inline part and is sent from where it is, without a copy into vec_send
+static int qtfs_sock_send_frame(struct qtfs_sock_var_s *conn, struct qtfs_sock_var_s *pvar)
 {
+	struct msghdr msg;
 	int ret;
-	int headlen = 0;
-	int total = 0;
-	struct qtreq *rsp = NULL;
-	struct kvec load;
+	int bulk;
 
-	memset(&pvar->msg_recv, 0, sizeof(pvar->msg_recv));
-
-	headlen = kernel_recvmsg(pvar->client_sock, &pvar->msg_recv, &pvar->vec_recv, 1,
-							QTFS_MSG_HEAD_LEN, (block == true) ? 0 : MSG_DONTWAIT);
-	if (headlen <= 0) {
-		return headlen;
-	}
+	qtfs_msg_kvec(&msg, WRITE, &pvar->vec_send, 1, pvar->vec_send.iov_len);
+	if (pvar->send_bulk.iov_len == 0)
+		return qtfs_conn_tp->sendmsg(conn, &msg);
 
-	load.iov_base = pvar->vec_recv.iov_base + QTFS_MSG_HEAD_LEN;
-	load.iov_len = pvar->vec_recv.iov_len - QTFS_MSG_HEAD_LEN;
-	total = 0;
-	rsp = pvar->vec_recv.iov_base;
-	if (rsp->len > load.iov_len) {
-		qtfs_err("qtfs recv head invalid len is:%lu", rsp->len);
-		return -EINVAL;
-	}
-	while (total < rsp->len) {
-		ret = kernel_recvmsg(pvar->client_sock, &pvar->msg_recv, &load, 1,
-						rsp->len - total, (block == true) ? 0 : MSG_DONTWAIT);
-		if (ret <= 0) break;
-		total += ret;
-		load.iov_base += ret;
-		load.iov_len -= ret;
-		if (load.iov_base > (pvar->vec_recv.iov_base + pvar->vec_recv.iov_len)) {
-			qtfs_err("qtfs recv error, total:%d iov_base:%lx iovlen:%lu ret:%d rsplen:%lu", total,
-							(unsigned long)pvar->vec_recv.iov_base, pvar->vec_recv.iov_len, ret, rsp->len);
-			WARN_ON(1);
-			dump_stack();
-			break;
-		}
-	}
-	if (total > rsp->len) {
-		qtfs_err("recv total:%d msg len:%lu\n", total, rsp->len);
-		BUG();
+	if (qtfs_tcp_msg_more) {
+		msg.msg_flags = MSG_MORE;
+		atomic64_inc(&g_tcp_stat.more_sends);
 	}
-	
-	return total + headlen;
+	ret = qtfs_conn_tp->sendmsg(conn, &msg);
+	if (ret != pvar->vec_send.iov_len)
+		return ret;
+	qtfs_msg_kvec(&msg, WRITE, &pvar->send_bulk, 1, pvar->send_bulk.iov_len);
+	bulk = qtfs_conn_tp->sendmsg(conn, &msg);
+	if (bulk < 0)
+		return bulk;
+	return ret + bulk;
 }
 
 static int qtfs_conn_sock_send(struct qtfs_sock_var_s *pvar)
 {
-	int ret = kernel_sendmsg(pvar->client_sock, &pvar->msg_send, &pvar->vec_send, 1,
-							pvar->vec_send.iov_len);
+	size_t total = pvar->vec_send.iov_len + pvar->send_bulk.iov_len;
+	int ret = qtfs_sock_send_frame(pvar, pvar);
 	if (ret < 0) {
 		qtfs_err("qtfs sock send error, ret:%d.\n", ret);
+	} else if (ret != total) {
+		// message is cut, peer can't find the next one, restart the connection
+		qtfs_err("qtfs sock send part of msg:%d total:%lu.\n", ret, total);
+		qtfs_conn_tp->shutdown(pvar);
+		ret = -EPIPE;
 	}
 	return ret;
 }
 
-static void qtfs_conn_sock_fini(struct qtfs_sock_var_s *pvar)
+// receive exactly len bytes to buf, or to user buffer ubuf if buf is NULL;
+// wait: the message has begun, keep waiting on receive timeout, otherwise
+// don't block for the first byte, connections are handed out when readable
+static int qtfs_sock_recv_exact(struct qtfs_sock_var_s *pvar, void *buf, void __user *ubuf, size_t len, bool wait)
 {
-	if (pvar->client_sock != NULL) {
-		qtfs_err("qtfs conn sock finish threadidx:%d, client:%lx.", pvar->cur_threadidx, (unsigned long)pvar->client_sock);
-		sock_release(pvar->client_sock);
-		pvar->client_sock = NULL;
-	}
+	struct msghdr msg;
+	struct kvec vec;
+	size_t total = 0;
+	int ret;
 
-	return;
+	while (total < len) {
+		if (buf != NULL) {
+			vec.iov_base = buf + total;
+			vec.iov_len = len - total;
+			qtfs_msg_kvec(&msg, READ, &vec, 1, vec.iov_len);
+			ret = qtfs_conn_tp->recvmsg(pvar, &msg, (wait || total > 0) ? 0 : MSG_DONTWAIT);
+		} else {
+			memset(&msg, 0, sizeof(msg));
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+			iov_iter_ubuf(&msg.msg_iter, READ, ubuf + total, len - total);
+#else
+			struct iovec iov = { .iov_base = ubuf + total, .iov_len = len - total };
+			iov_iter_init(&msg.msg_iter, READ, &iov, 1, len - total);
+#endif
+			ret = qtfs_conn_tp->recvmsg(pvar, &msg, 0);
+		}
+		if (ret == 0)
+			return -EPIPE;
+		if (ret < 0) {
+			if (ret == -EAGAIN && (wait || total > 0) && qtfs_mod_exiting == false)
+				continue;
+			return ret;
+		}
+		total += ret;
+	}
+	return total;
 }
 
-int qtfs_sock_var_init(struct qtfs_sock_var_s *pvar)
+/*
+ * Messages are parsed out of a staging buffer per connection: one recvmsg
+ * takes whatever the socket has, up to the free space, so a burst of small
+ * responses or pushes costs one call instead of two per message. A payload
+ * larger than the staging buffer is received straight to its destination.
+ */
+static inline size_t qtfs_rx_avail(struct qtfs_sock_var_s *pvar)
 {
-	memset(pvar, 0, sizeof(struct qtfs_sock_var_s));
-	pvar->vec_recv.iov_base = kmalloc(QTFS_MSG_LEN, GFP_KERNEL);
-	if (pvar->vec_recv.iov_base == NULL) {
-		qtfs_err("qtfs recv kmalloc failed, len:%lu.\n", QTFS_MSG_LEN);
-		return QTFS_ERR;
-	}
-	pvar->vec_send.iov_base = kmalloc(QTFS_MSG_LEN, GFP_KERNEL);
-	if (pvar->vec_send.iov_base == NULL) {
-		qtfs_err("qtfs send kmalloc failed, len:%lu.\n", QTFS_MSG_LEN);
-		kfree(pvar->vec_recv.iov_base);
-		pvar->vec_recv.iov_base = NULL;
-		return QTFS_ERR;
-	}
-	pvar->vec_recv.iov_len = QTFS_MSG_LEN;
-	pvar->vec_send.iov_len = 0;
-	memset(pvar->vec_recv.iov_base, 0, QTFS_MSG_LEN);
-	memset(pvar->vec_send.iov_base, 0, QTFS_MSG_LEN);
-	INIT_LIST_HEAD(&pvar->lst);
-	return QTFS_OK;
+	return pvar->rx_end - pvar->rx_start;
 }
 
-void qtfs_sock_var_fini(struct qtfs_sock_var_s *pvar)
+// a message head is staged, no data_ready comes for what is staged
+bool qtfs_rx_pending(struct qtfs_sock_var_s *pvar)
 {
-	if (pvar->vec_recv.iov_base != NULL) {
-		kfree(pvar->vec_recv.iov_base);
-		pvar->vec_recv.iov_base = NULL;
-	}
-	if (pvar->vec_send.iov_base != NULL) {
-		kfree(pvar->vec_send.iov_base);
-		pvar->vec_send.iov_base = NULL;
-	}
-
-	return ;
+	return qtfs_rx_avail(pvar) >= QTFS_MSG_HEAD_LEN;
 }
 
-void qtfs_sock_msg_clear(struct qtfs_sock_var_s *pvar)
+static void qtfs_rx_reset(struct qtfs_sock_var_s *pvar)
 {
-	memset(pvar->vec_recv.iov_base, 0, QTFS_MSG_LEN);
-	memset(pvar->vec_send.iov_base, 0, QTFS_MSG_LEN);
-	pvar->recv_valid = QTFS_MSG_LEN;
-	pvar->send_valid = QTFS_MSG_LEN;
-#ifdef QTFS_CLIENT
-	memset(pvar->who_using, 0, QTFS_FUNCTION_LEN);
-#endif
-	return;
+	pvar->rx_start = 0;
+	pvar->rx_end = 0;
 }
 
-void *qtfs_sock_msg_buf(struct qtfs_sock_var_s *pvar, int dir)
+// have at least need (<= QTFS_RX_BUF_LEN) bytes staged; block: wait for the
+// first byte, wait: the message has begun, keep waiting on receive timeout,
+// the same as in qtfs_sock_recv_exact
+static int qtfs_rx_fill(struct qtfs_sock_var_s *pvar, size_t need, bool block, bool wait)
 {
-	struct qtreq *req = (dir == QTFS_SEND) ? pvar->vec_send.iov_base : pvar->vec_recv.iov_base;
-	if (!req) {
-		WARN_ON(1);
-		return NULL;
+	struct msghdr msg;
+	struct kvec vec;
+	bool begun;
+	int ret;
+
+	if (pvar->rx_buf == NULL)
+		return -ENOTCONN;
+	if (qtfs_rx_avail(pvar) >= need)
+		return 0;
+	// the buffer is linear, move the partial message to its front
+	if (pvar->rx_start > 0) {
+		memmove(pvar->rx_buf, pvar->rx_buf + pvar->rx_start, qtfs_rx_avail(pvar));
+		pvar->rx_end -= pvar->rx_start;
+		pvar->rx_start = 0;
+	}
+	while (pvar->rx_end < need) {
+		begun = wait || pvar->rx_end > 0;
+		vec.iov_base = pvar->rx_buf + pvar->rx_end;
+		vec.iov_len = QTFS_RX_BUF_LEN - pvar->rx_end;
+		qtfs_msg_kvec(&msg, READ, &vec, 1, vec.iov_len);
+		ret = qtfs_conn_tp->recvmsg(pvar, &msg, (block || begun) ? 0 : MSG_DONTWAIT);
+		if (ret == 0)
+			return -EPIPE;
+		if (ret < 0) {
+			if (ret == -EAGAIN && begun && qtfs_mod_exiting == false)
+				continue;
+			return ret;
+		}
+		pvar->rx_end += ret;
+		atomic64_inc(&g_tcp_stat.rx_calls);
 	}
-	return req->data;
+	return 0;
 }
 
-// state machine
-#define QTCONN_CUR_STATE(pvar) ((pvar->state == QTCONN_INIT) ? "INIT" : \
-														((pvar->state == QTCONN_CONNECTING) ? "CONNECTING" : \
-														((pvar->state == QTCONN_ACTIVE) ? "ACTIVE" : "UNKNOWN")))
-
-static int qtfs_sm_connecting(struct qtfs_sock_var_s *pvar)
+// move len bytes of the message to buf, or to user buffer ubuf if buf is
+// NULL; a short rest is staged along with what follows it, a long one is
+// received in place
+static int qtfs_rx_take(struct qtfs_sock_var_s *pvar, void *buf, void __user *ubuf, size_t len)
 {
-	int ret = QTERROR;
+	size_t total = 0;
+	size_t n;
+	int ret;
 
-#ifdef QTFS_SERVER
-	ret = qtfs_conn_server_accept(pvar);
-	if (ret == 0) {
-		qtfs_info("qtfs sm connecting accept a new connection, addr:%s port:%u.",
-								pvar->addr, pvar->port);
-		qtfs_sock_recvtimeo_set(pvar->client_sock, QTFS_SOCK_RCVTIMEO, 0);
-	} else {
-		msleep(500);
-	}
-#endif
-#ifdef QTFS_CLIENT
-	int retry;
-	qtfs_info("qtfs sm connecting wait for server thread:%d, addr:%s port:%u",
-									pvar->cur_threadidx, pvar->addr, pvar->port);
-	retry = 3;
-	while (qtfs_mod_exiting == false && retry-- > 0) {
-		ret = qtfs_conn_client_conn(pvar);
-		if (ret == 0) {
-			qtfs_info("qtfs sm connecting connect to a new connection, addr:%s port:%u.",
-									pvar->addr, pvar->port);
-			qtfs_sock_recvtimeo_set(pvar->client_sock, QTFS_SOCK_RCVTIMEO, 0);
+	while (total < len) {
+		n = min(len - total, qtfs_rx_avail(pvar));
+		if (buf != NULL)
+			memcpy(buf + total, pvar->rx_buf + pvar->rx_start, n);
+		else if (copy_to_user(ubuf + total, pvar->rx_buf + pvar->rx_start, n))
+			return -EFAULT;
+		pvar->rx_start += n;
+		total += n;
+		if (pvar->rx_start == pvar->rx_end)
+			qtfs_rx_reset(pvar);
+		if (total == len)
+			break;
+		if (len - total > QTFS_RX_BUF_LEN) {
+			ret = qtfs_sock_recv_exact(pvar, (buf == NULL) ? NULL : buf + total,
+						(buf == NULL) ? ubuf + total : NULL, len - total, true);
+			if (ret < 0)
+				return ret;
 			break;
 		}
-		msleep(1);
+		ret = qtfs_rx_fill(pvar, len - total, true, true);
+		if (ret < 0)
+			return ret;
 	}
-#endif
-
-	return ret;
+	return len;
 }
 
-int qtfs_sm_active(struct qtfs_sock_var_s *pvar)
+// read and drop len bytes of payload through pvar's own recv buffer, so the
+// next message head is found where it should be
+static int qtfs_rx_drain(struct qtfs_sock_var_s *pvar, size_t len)
 {
-	int ret = 0;
+	void *buf = pvar->vec_recv.iov_base + QTFS_MSG_HEAD_LEN;
+	size_t bufsize = pvar->vec_recv.iov_len - QTFS_MSG_HEAD_LEN;
+	int ret;
 
-	switch (pvar->state) {
-		case QTCONN_ACTIVE:
+	while (len > 0) {
+		ret = qtfs_rx_take(pvar, buf, NULL, (len > bufsize) ? bufsize : len);
+		if (ret < 0)
+			return ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static inline void qtfs_rx_dirty(struct qtfs_sock_var_s *pvar, size_t len)
+{
+	if (len > pvar->recv_valid)
+		pvar->recv_valid = len;
+}
+
+static int qtfs_conn_sock_recv(struct qtfs_sock_var_s *pvar, bool block)
+{
+	struct qtreq *rsp = pvar->vec_recv.iov_base;
+	int ret;
+
+	ret = qtfs_rx_fill(pvar, QTFS_MSG_HEAD_LEN, block, false);
+	if (ret < 0)
+		return ret;
+	qtfs_rx_take(pvar, rsp, NULL, QTFS_MSG_HEAD_LEN);
+	if (rsp->len > pvar->vec_recv.iov_len - QTFS_MSG_HEAD_LEN) {
+		qtfs_err("qtfs recv head invalid len is:%lu", rsp->len);
+		// a corrupt length can't be skipped, drop the connection
+		if (rsp->len > QTFS_DATA_MAX_LEN) {
+			qtfs_conn_tp->shutdown(pvar);
+			return -EPIPE;
+		}
+		ret = qtfs_rx_drain(pvar, rsp->len);
+		qtfs_rx_dirty(pvar, pvar->vec_recv.iov_len);
+		return (ret < 0) ? ret : -EINVAL;
+	}
+	ret = qtfs_rx_take(pvar, rsp->data, NULL, rsp->len);
+	if (ret < 0)
+		return ret;
+	qtfs_rx_dirty(pvar, QTFS_MSG_HEAD_LEN + rsp->len);
+	qtfs_sock_after_recv(pvar);
+	return QTFS_MSG_HEAD_LEN + rsp->len;
+}
+
+/*
+ * Receive a message, the payload after the first inline_len(head) bytes goes
+ * straight to user buffer ubuf when it fits, so handler can use it in place.
+ * *ulen is set to the bytes put to ubuf. Returns total bytes received.
+ */
+int qtfs_conn_recv_block_split(int msg_mode, struct qtfs_sock_var_s *pvar, size_t (*inline_len)(void *),
+			void __user *ubuf, size_t usize, size_t *ulen)
+{
+	struct qtreq *head = pvar->vec_recv.iov_base;
+	size_t inl;
+	int ret;
+
+	*ulen = 0;
+	if (qtfs_conn_ops_of(msg_mode) == NULL) {
+		qtfs_err("qtfs connection recv split failed, unknown mode:%d.\n", msg_mode);
+		return -EINVAL;
+	}
+	ret = qtfs_rx_fill(pvar, QTFS_MSG_HEAD_LEN, false, false);
+	if (ret < 0)
+		return ret;
+	qtfs_rx_take(pvar, head, NULL, QTFS_MSG_HEAD_LEN);
+	if (head->len > QTFS_DATA_MAX_LEN) {
+		qtfs_err("qtfs recv head invalid len is:%lu", head->len);
+		return -EPIPE;
+	}
+	inl = (inline_len == NULL) ? head->len : inline_len(head);
+	if (inl > head->len || ubuf == NULL || head->len - inl > usize)
+		inl = head->len;
+	if (QTFS_MSG_HEAD_LEN + inl > pvar->vec_recv.iov_len) {
+		if (qtfs_sock_var_grow(pvar, QTFS_RECV, QTFS_MSG_HEAD_LEN + inl) != QTFS_OK)
+			return -EPIPE;
+		head = pvar->vec_recv.iov_base;
+	}
+	ret = qtfs_rx_take(pvar, head->data, NULL, inl);
+	if (ret < 0)
+		return ret;
+	qtfs_rx_dirty(pvar, QTFS_MSG_HEAD_LEN + inl);
+	if (head->len > inl) {
+		ret = qtfs_rx_take(pvar, NULL, ubuf, head->len - inl);
+		if (ret < 0)
+			return (ret == -EFAULT) ? -EPIPE : ret;
+		*ulen = head->len - inl;
+	}
+	qtfs_sock_after_recv(pvar);
+	return QTFS_MSG_HEAD_LEN + head->len;
+}
+
+int qtfs_conn_sendv(int msg_mode, struct qtfs_sock_var_s *pvar, struct kvec *vec, size_t num, size_t len)
+{
+	struct msghdr msg;
+	int ret = -EINVAL;
+
+	switch (msg_mode) {
+		case QTFS_CONN_SOCKET:
+		case QTFS_CONN_PCIE:
+			if (qtfs_conn_ops_of(msg_mode) == NULL)
+				break;
+			qtfs_msg_kvec(&msg, WRITE, vec, num, len);
+			ret = qtfs_conn_tp->sendmsg(pvar, &msg);
+			if (ret < 0)
+				qtfs_err("qtfs sock sendv error, ret:%d.\n", ret);
+			break;
+		default:
+			qtfs_err("qtfs connection sendv failed, unknown mode:%d.\n", msg_mode);
+			break;
+	}
+	return ret;
+}
+
+// -ENOTCONN if pvar had no connection
+static int qtfs_conn_release_client(struct qtfs_sock_var_s *pvar)
+{
+	int ret;
+
+#ifdef QTFS_SERVER
+	// unhook the scheduler before the socket goes
+	qtfs_sched_detach(pvar);
+#endif
+	ret = qtfs_conn_tp->release(pvar);
+	if (ret < 0)
+		return ret;
+	pvar->conn_gen++;
+	// what was staged belongs to the old stream
+	qtfs_rx_reset(pvar);
+	return 0;
+}
+
+int qtfs_sock_var_init(struct qtfs_sock_var_s *pvar)
+{
+	return qtfs_sock_var_init_len(pvar, QTFS_MSG_LEN, QTFS_MSG_LEN);
+}
+
+int qtfs_sock_var_init_len(struct qtfs_sock_var_s *pvar, size_t recvlen, size_t sendlen)
+{
+	memset(pvar, 0, sizeof(struct qtfs_sock_var_s));
+	if (recvlen < QTFS_MSG_LEN || sendlen < QTFS_MSG_LEN) {
+		qtfs_err("qtfs sock var init invalid len recv:%lu send:%lu.\n", recvlen, sendlen);
+		return QTFS_ERR;
+	}
+	pvar->vec_recv.iov_base = kvmalloc(recvlen, GFP_KERNEL);
+	if (pvar->vec_recv.iov_base == NULL) {
+		qtfs_err("qtfs recv kmalloc failed, len:%lu.\n", recvlen);
+		return QTFS_ERR;
+	}
+	pvar->vec_send.iov_base = kvmalloc(sendlen, GFP_KERNEL);
+	if (pvar->vec_send.iov_base == NULL) {
+		qtfs_err("qtfs send kmalloc failed, len:%lu.\n", sendlen);
+		kvfree(pvar->vec_recv.iov_base);
+		pvar->vec_recv.iov_base = NULL;
+		return QTFS_ERR;
+	}
+	pvar->rx_buf = kvmalloc(QTFS_RX_BUF_LEN, GFP_KERNEL);
+	if (pvar->rx_buf == NULL) {
+		qtfs_err("qtfs rx buf kmalloc failed, len:%lu.\n", QTFS_RX_BUF_LEN);
+		kvfree(pvar->vec_recv.iov_base);
+		kvfree(pvar->vec_send.iov_base);
+		pvar->vec_recv.iov_base = NULL;
+		pvar->vec_send.iov_base = NULL;
+		return QTFS_ERR;
+	}
+	pvar->vec_recv.iov_len = recvlen;
+	pvar->vec_send.iov_len = 0;
+	pvar->send_max = sendlen;
+	memset(pvar->vec_recv.iov_base, 0, QTFS_MSG_LEN);
+	memset(pvar->vec_send.iov_base, 0, QTFS_MSG_LEN);
+	pvar->busy = false;
+#ifdef QTFS_SERVER
+	pvar->pcie.srcid = QTFS_SHM_SERVER;
+#else
+	pvar->pcie.srcid = QTFS_SHM_CLIENT;
+#endif
+	pvar->pcie.dstid = -1;
+	init_waitqueue_head(&pvar->pcie.waitq);
+	INIT_LIST_HEAD(&pvar->sched_node);
+	INIT_LIST_HEAD(&pvar->reconn_node);
+	mutex_init(&pvar->sendlock);
+	init_completion(&pvar->done);
+	return QTFS_OK;
+}
+
+void qtfs_sock_var_fini(struct qtfs_sock_var_s *pvar)
+{
+	if (pvar->vec_recv.iov_base != NULL) {
+		kvfree(pvar->vec_recv.iov_base);
+		pvar->vec_recv.iov_base = NULL;
+	}
+	if (pvar->vec_send.iov_base != NULL) {
+		kvfree(pvar->vec_send.iov_base);
+		pvar->vec_send.iov_base = NULL;
+	}
+	if (pvar->rx_buf != NULL) {
+		kvfree(pvar->rx_buf);
+		pvar->rx_buf = NULL;
+	}
+
+	return ;
+}
+
+// make pvar's buffer in dir hold at least len bytes for data messages,
+// the larger buffer is kept by pvar for later users
+int qtfs_sock_var_grow(struct qtfs_sock_var_s *pvar, int dir, size_t len)
+{
+	size_t cur = (dir == QTFS_SEND) ? pvar->send_max : pvar->vec_recv.iov_len;
+	void **pbuf = (dir == QTFS_SEND) ? &pvar->vec_send.iov_base : &pvar->vec_recv.iov_base;
+	void *buf;
+
+	if (len <= cur)
+		return QTFS_OK;
+	if (len > QTFS_MSG_HEAD_LEN + QTFS_DATA_MAX_LEN) {
+		qtfs_err("qtfs sock var grow len:%lu too large.", len);
+		return QTFS_ERR;
+	}
+	buf = kvmalloc(len, GFP_KERNEL);
+	if (buf == NULL) {
+		qtfs_err("qtfs sock var grow kvmalloc failed, len:%lu.", len);
+		return QTFS_ERR;
+	}
+	// keep request head and private data already filled by caller
+	memcpy(buf, *pbuf, QTFS_MSG_LEN);
+	kvfree(*pbuf);
+	*pbuf = buf;
+	if (dir == QTFS_SEND)
+		pvar->send_max = len;
+	else
+		pvar->vec_recv.iov_len = len;
+	return QTFS_OK;
+}
+
+// clear what the last user wrote, not the whole buffers
+void qtfs_sock_msg_clear(struct qtfs_sock_var_s *pvar)
+{
+	size_t send = (pvar->send_valid == 0) ? QTFS_MSG_LEN : pvar->send_valid;
+
+	memset(pvar->vec_recv.iov_base, 0, min_t(size_t, pvar->recv_valid, QTFS_MSG_LEN));
+	memset(pvar->vec_send.iov_base, 0, min_t(size_t, send, QTFS_MSG_LEN));
+	pvar->recv_valid = 0;
+	pvar->send_valid = 0;
+#ifdef QTFS_CLIENT
+	memset(pvar->who_using, 0, QTFS_FUNCTION_LEN);
+#endif
+	return;
+}
+
+void *qtfs_sock_msg_buf(struct qtfs_sock_var_s *pvar, int dir)
+{
+	struct qtreq *req = (dir == QTFS_SEND) ? pvar->vec_send.iov_base : pvar->vec_recv.iov_base;
+	if (!req) {
+		WARN_ON(1);
+		return NULL;
+	}
+	return req->data;
+}
+
+// state machine
+#define QTCONN_CUR_STATE(pvar) ((pvar->state == QTCONN_INIT) ? "INIT" : \
+														((pvar->state == QTCONN_CONNECTING) ? "CONNECTING" : \
+														((pvar->state == QTCONN_ACTIVE) ? "ACTIVE" : "UNKNOWN")))
+
+static int qtfs_sm_connecting(struct qtfs_sock_var_s *pvar)
+{
+	int ret = QTERROR;
+
+#ifdef QTFS_SERVER
+	ret = qtfs_conn_tp->connect(pvar);
+	if (ret != 0) {
+		// a client coming back is accepted as soon as it arrives
+		qtfs_conn_tp->accept_wait(pvar, msecs_to_jiffies(QTFS_ACCEPT_WAIT_MS));
+		ret = qtfs_conn_tp->connect(pvar);
+	}
+	if (ret == 0) {
+		qtfs_info("qtfs sm connecting accept a new connection, addr:%s port:%u.",
+								pvar->addr, pvar->port);
+	}
+#endif
+#ifdef QTFS_CLIENT
+	// one attempt that waits out the handshake, the connection manager and
+	// pipe threads retry with backoff when it fails
+	qtfs_info("qtfs sm connecting wait for server thread:%d, addr:%s port:%u",
+									pvar->cur_threadidx, pvar->addr, pvar->port);
+	if (qtfs_mod_exiting == false) {
+		ret = qtfs_conn_tp->connect(pvar);
+		if (ret == 0)
+			qtfs_info("qtfs sm connecting connect to a new connection, addr:%s port:%u.",
+									pvar->addr, pvar->port);
+	}
+#endif
+
+	return ret;
+}
+
+int qtfs_sm_active(struct qtfs_sock_var_s *pvar)
+{
+	int ret = 0;
+
+	switch (pvar->state) {
+		case QTCONN_ACTIVE:
 			// do nothing
 			break;
 		case QTCONN_INIT:
@@ -697,7 +1356,7 @@ int qtfs_sm_active(struct qtfs_sock_var_s *pvar)
 				WARN_ON(1);
 				qtfs_err("qtfs sm active client sock not NULL!");
 			}
-			ret = qtfs_conn_init(QTFS_CONN_SOCKET, pvar);
+			ret = qtfs_conn_init(qtfs_conn_mode, pvar);
 			if (ret < 0) {
 				qtfs_err("qtfs sm active init failed, ret:%d.", ret);
 				break;
@@ -733,14 +1392,12 @@ int qtfs_sm_reconnect(struct qtfs_sock_var_s *pvar)
 			break;
 		case QTCONN_ACTIVE:
 			// release current socket and reconnect
-			if (pvar->client_sock == NULL) {
+			if (qtfs_conn_release_client(pvar) < 0) {
 				qtfs_err("qtfs sm reconnect client sock invalid?");
 				WARN_ON(1);
 			}
-			sock_release(pvar->client_sock);
-			pvar->client_sock = NULL;
 
-			ret = qtfs_conn_init(QTFS_CONN_SOCKET, pvar);
+			ret = qtfs_conn_init(qtfs_conn_mode, pvar);
 			if (ret < 0) {
 				qtfs_err("qtfs sm active init failed, ret:%d.", ret);
 				break;
@@ -759,6 +1416,7 @@ int qtfs_sm_reconnect(struct qtfs_sock_var_s *pvar)
 			ret = QTERROR;
 			break;
 	}
+	trace_qtfs_reconnect(pvar->cur_threadidx, pvar->state, ret);
 	return ret;
 }
 
@@ -771,12 +1429,10 @@ int qtfs_sm_exit(struct qtfs_sock_var_s *pvar)
 			break;
 		case QTCONN_ACTIVE:
 		case QTCONN_CONNECTING:
-			if (pvar->client_sock == NULL) {
+			if (qtfs_conn_release_client(pvar) < 0) {
 				qtfs_err("qtfs sm exit client sock invalid.");
 				break;
 			}
-			sock_release(pvar->client_sock);
-			pvar->client_sock = NULL;
 #ifdef QTFS_SERVER
 			pvar->state = QTCONN_CONNECTING;
 #endif
@@ -794,32 +1450,154 @@ int qtfs_sm_exit(struct qtfs_sock_var_s *pvar)
 	return ret;
 }
 
-int qtfs_mutex_lock_interruptible(struct mutex *lock)
+/*
+ * pvar pool: every cpu caches one free pvar in a slot taken and refilled by
+ * xchg/cmpxchg, the others sit on a global llist that only needs g_pool_lock
+ * to pop, as llist_del_first allows a single consumer. Callers sleep on
+ * g_pool_waitq while all pvars up to the limit are busy.
+ */
+static DEFINE_PER_CPU(struct qtfs_sock_var_s *, g_pool_cache);
+static LLIST_HEAD(g_free_llst);
+static DEFINE_SPINLOCK(g_pool_lock);
+static DECLARE_WAIT_QUEUE_HEAD(g_pool_waitq);
+static atomic_t g_pool_busy;
+
+// pool counters, bumped from every cpu and folded into diag info by
+// qtfs_conn_stat_fold when it is read
+static struct {
+	atomic64_t takes;
+	atomic64_t saturated;
+	atomic64_t busy_max;
+	atomic64_t wait_lat[QTINFO_LAT_BUCKETS];
+	atomic64_t hold_lat[QTINFO_LAT_BUCKETS];
+	struct {
+		atomic64_t count;
+		atomic64_t total_us;
+		atomic64_t max_us;
+	} holders[QTINFO_MAX_HOLDERS];
+} g_pool_stat;
+
+static void qtfs_stat_max(atomic64_t *max, s64 val)
 {
-	int ret;
-	ret = mutex_lock_interruptible(lock);
-	if (ret == 0) {
-		// mutex lock successed, proc lazy put
-		while (1) {
-			struct llist_node *toput = llist_del_first(&g_lazy_put_llst);
-			struct qtfs_sock_var_s *pvar;
-			if (toput == NULL)
-				break;
-			pvar = llist_entry(toput, struct qtfs_sock_var_s, lazy_put);
-			qtfs_sock_msg_clear(pvar);
-			list_move_tail(&pvar->lst, &g_vld_lst);
-			qtfs_warn("qtfs pvar lazy put idx:%d.", pvar->cur_threadidx);
+	s64 old = atomic64_read(max);
+	s64 cur;
+
+	while (val > old) {
+		cur = atomic64_cmpxchg(max, old, val);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+static struct qtfs_sock_var_s *qtfs_pool_take(void)
+{
+	struct qtfs_sock_var_s *pvar;
+	struct qtfs_sock_var_s **slot;
+	struct llist_node *node;
+	int cpu;
+
+	pvar = this_cpu_xchg(g_pool_cache, NULL);
+	if (pvar != NULL)
+		return pvar;
+	if (!llist_empty(&g_free_llst)) {
+		spin_lock(&g_pool_lock);
+		node = llist_del_first(&g_free_llst);
+		spin_unlock(&g_pool_lock);
+		if (node != NULL)
+			return llist_entry(node, struct qtfs_sock_var_s, free_node);
+	}
+	// the free ones may all be parked on other cpus
+	for_each_possible_cpu(cpu) {
+		slot = per_cpu_ptr(&g_pool_cache, cpu);
+		if (READ_ONCE(*slot) == NULL)
+			continue;
+		pvar = xchg(slot, NULL);
+		if (pvar != NULL)
+			return pvar;
+	}
+	return NULL;
+}
+
+static void qtfs_pool_give(struct qtfs_sock_var_s *pvar)
+{
+	if (this_cpu_cmpxchg(g_pool_cache, NULL, pvar) != NULL)
+		llist_add(&pvar->free_node, &g_free_llst);
+	// pairs with the waiter queueing itself before qtfs_pool_take
+	if (wq_has_sleeper(&g_pool_waitq))
+		wake_up(&g_pool_waitq);
+}
+
+// callers are keyed by their __func__ pointer, the name goes to diag info
+static const char *g_pool_holder[QTINFO_MAX_HOLDERS];
+
+static int qtfs_pool_holder_slot(const char *func)
+{
+	int i;
+
+	for (i = 0; i < QTINFO_MAX_HOLDERS; i++) {
+		if (READ_ONCE(g_pool_holder[i]) == func)
+			return i;
+	}
+	spin_lock(&g_pool_lock);
+	for (i = 0; i < QTINFO_MAX_HOLDERS; i++) {
+		if (g_pool_holder[i] == func)
+			break;
+		if (g_pool_holder[i] == NULL) {
+			strscpy(qtfs_diag_info->pool.holders[i].func, func, QTFS_FUNCTION_LEN);
+			WRITE_ONCE(g_pool_holder[i], func);
+			break;
 		}
 	}
-	return ret;
+	spin_unlock(&g_pool_lock);
+	return (i < QTINFO_MAX_HOLDERS) ? i : -1;
+}
+
+static void qtfs_conn_param_hold(struct qtfs_sock_var_s *pvar, const char *func)
+{
+	int busy;
+
+	WRITE_ONCE(pvar->busy, true);
+	busy = atomic_inc_return(&g_pool_busy);
+	qtfs_stat_max(&g_pool_stat.busy_max, busy);
+	strscpy(pvar->who_using, func, QTFS_FUNCTION_LEN);
+	pvar->hold_slot = qtfs_pool_holder_slot(func);
+	pvar->hold_start = ktime_get_ns();
+}
+
+static void qtfs_conn_param_release(struct qtfs_sock_var_s *pvar)
+{
+	u64 ns;
+	unsigned long us;
+
+	if (pvar->hold_start == 0)
+		return;
+	ns = ktime_get_ns() - pvar->hold_start;
+	us = div_u64(ns, NSEC_PER_USEC);
+	pvar->hold_start = 0;
+	atomic64_inc(&g_pool_stat.hold_lat[qtinfo_lat_bucket(ns)]);
+	if (pvar->hold_slot >= 0) {
+		atomic64_inc(&g_pool_stat.holders[pvar->hold_slot].count);
+		atomic64_add(us, &g_pool_stat.holders[pvar->hold_slot].total_us);
+		qtfs_stat_max(&g_pool_stat.holders[pvar->hold_slot].max_us, us);
+	}
 }
 
 void qtfs_conn_param_init(void)
 {
-	INIT_LIST_HEAD(&g_vld_lst);
-	INIT_LIST_HEAD(&g_busy_lst);
-	init_llist_head(&g_lazy_put_llst);
+	if (qtfs_conn_mode == QTFS_CONN_PCIE) {
+		qtfs_conn_tp = &qtfs_shm_ops;
+	} else if (qtfs_conn_mode != QTFS_CONN_SOCKET) {
+		qtfs_err("qtfs conn mode:%d invalid, use socket.", qtfs_conn_mode);
+		qtfs_conn_mode = QTFS_CONN_SOCKET;
+	}
+	qtfs_info("qtfs connections over %s.", qtfs_conn_tp->name);
 	atomic_set(&g_qtfs_conn_num, 0);
+	atomic_set(&g_pool_busy, 0);
+	if (qtfs_data_msg_len < QTFS_REQ_MAX_LEN)
+		qtfs_data_msg_len = QTFS_REQ_MAX_LEN;
+	if (qtfs_data_msg_len > QTFS_DATA_MAX_LEN)
+		qtfs_data_msg_len = QTFS_DATA_MAX_LEN;
 
 	mutex_init(&g_param_mutex);
 	return;
@@ -827,39 +1605,32 @@ void qtfs_conn_param_init(void)
 
 void qtfs_conn_param_fini(void)
 {
-	struct list_head *plst;
-	struct list_head *n;
-	int ret;
+	struct qtfs_sock_var_s *pvar;
 	int conn_num;
+	int cpu;
 	int i;
 
-	ret = qtfs_mutex_lock_interruptible(&g_param_mutex);
-	if (ret < 0) {
-		qtfs_err("qtfs conn param finish mutex lock interrup failed, ret:%d.", ret);
-		WARN_ON(1);
-		return;
-	}
-
-	list_for_each_safe(plst, n, &g_vld_lst) {
-		struct qtfs_sock_var_s *pvar = (struct qtfs_sock_var_s *)plst;
-		qtfs_sock_var_fini((struct qtfs_sock_var_s *)plst);
-		qtfs_sm_exit((struct qtfs_sock_var_s *)plst);
-		kfree(plst);
-		if (pvar->cur_threadidx < 0 || pvar->cur_threadidx >= QTFS_MAX_THREADS) {
-			qtfs_err("qtfs free unknown threadidx %d", pvar->cur_threadidx);
-		} else {
-			qtfs_thread_var[pvar->cur_threadidx] = NULL;
-			qtfs_info("qtfs free pvar idx:%d successed.", pvar->cur_threadidx);
-		}
-	}
+	wake_up_all(&g_pool_waitq);
+	mutex_lock(&g_param_mutex);
 	conn_num = atomic_read(&g_qtfs_conn_num);
 	for (i = 0; i < conn_num; i++) {
-		if (qtfs_thread_var[i] != NULL) {
-			qtfs_err("qtfs param not free idx:%d holder:%s",
-							qtfs_thread_var[i]->cur_threadidx,
-							qtfs_thread_var[i]->who_using);
+		pvar = qtfs_thread_var[i];
+		if (pvar == NULL)
+			continue;
+		if (READ_ONCE(pvar->busy)) {
+			qtfs_err("qtfs param not free idx:%d holder:%s", pvar->cur_threadidx, pvar->who_using);
+			continue;
 		}
+		qtfs_sock_var_fini(pvar);
+		qtfs_sm_exit(pvar);
+		kfree(pvar);
+		qtfs_thread_var[i] = NULL;
+		qtfs_info("qtfs free pvar idx:%d successed.", i);
 	}
+	// cpu slots and free list only point to freed pvars now
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(&g_pool_cache, cpu) = NULL;
+	init_llist_head(&g_free_llst);
 	mutex_unlock(&g_param_mutex);
 #ifdef QTFS_SERVER
 	if (qtfs_server_main_sock != NULL) {
@@ -869,81 +1640,85 @@ void qtfs_conn_param_fini(void)
 #endif
 }
 
-struct qtfs_sock_var_s *_qtfs_conn_get_param(const char *func)
+static int qtfs_conn_max_param(void)
 {
-	struct qtfs_sock_var_s *pvar = NULL;
-	int ret;
-	int cnt = 0;
+	int max = qtfs_sock_max_conn;
 
-	if (qtfs_mod_exiting == true) {
-		qtfs_warn("qtfs module is exiting, good bye!");
-		return NULL;
-	}
+#ifdef QTFS_CLIENT
+	if (qtfs_pipe_enabled())
+		max = qtfs_pipe_max_req;
+#endif
+	return (max > QTFS_MAX_PARAMS) ? QTFS_MAX_PARAMS : max;
+}
 
-retry:
-	ret = qtfs_mutex_lock_interruptible(&g_param_mutex);
-	if (ret < 0) {
-		qtfs_err("qtfs conn get param mutex lock interrup failed, ret:%d.", ret);
-		return NULL;
-	}
-	if (!list_empty(&g_vld_lst))
-		pvar = list_last_entry(&g_vld_lst, struct qtfs_sock_var_s, lst);
-	if (pvar != NULL) {
-		list_move_tail(&pvar->lst, &g_busy_lst);
-	}
-	mutex_unlock(&g_param_mutex);
+// make sure pvar can carry a request, reconnect under sendlock because
+// server workers may still be sending responses on this connection
+static int qtfs_conn_param_active(struct qtfs_sock_var_s *pvar)
+{
+#ifdef QTFS_CLIENT
+	bool up;
 
-	if (pvar != NULL) {
-		int ret;
-		if (pvar->state == QTCONN_ACTIVE && qtfs_sock_connected(pvar) == false) {
-			qtfs_warn("qtfs get param thread:%d disconnected, try to reconnect.", pvar->cur_threadidx);
-			ret = qtfs_sm_reconnect(pvar);
-		} else {
-			ret = qtfs_sm_active(pvar);
-		}
-		if (ret != 0) {
-			qtfs_conn_put_param(pvar);
-			return NULL;
-		}
-		memcpy(pvar->who_using, func, (strlen(func) >= QTFS_FUNCTION_LEN - 1) ? (QTFS_FUNCTION_LEN - 1) : strlen(func));
-		return pvar;
+	// request slot only, the connections are owned by the pipes
+	if (qtfs_pipe_enabled())
+		return 0;
+	mutex_lock(&pvar->sendlock);
+	up = !READ_ONCE(pvar->reconn_pending) && pvar->state == QTCONN_ACTIVE && qtfs_sock_connected(pvar);
+	mutex_unlock(&pvar->sendlock);
+	if (up)
+		return 0;
+	if (pvar->state == QTCONN_ACTIVE)
+		qtfs_warn("qtfs get param thread:%d disconnected, wait for reconnect.", pvar->cur_threadidx);
+	// the manager connects it, we wait for it
+	return qtfs_connmgr_wait(pvar);
+#else
+	int ret;
+
+	mutex_lock(&pvar->sendlock);
+	if (pvar->state == QTCONN_ACTIVE && qtfs_sock_connected(pvar) == false) {
+		qtfs_warn("qtfs get param thread:%d disconnected, try to reconnect.", pvar->cur_threadidx);
+		ret = qtfs_sm_reconnect(pvar);
+	} else {
+		ret = qtfs_sm_active(pvar);
 	}
+	mutex_unlock(&pvar->sendlock);
+	return ret;
+#endif
+}
 
-	ret = qtfs_mutex_lock_interruptible(&g_param_mutex);
+// slow path while the pool grows, NULL if it's at the limit already
+static struct qtfs_sock_var_s *qtfs_conn_new_param(const char *func)
+{
+	struct qtfs_sock_var_s *pvar = NULL;
+	int ret;
+
+	ret = mutex_lock_interruptible(&g_param_mutex);
 	if (ret < 0) {
-		qtfs_err("qtfs conn get param mutex lock interrup failed, ret:%d.", ret);
-		return NULL;
+		qtfs_err("qtfs conn new param mutex lock interrup failed, ret:%d.", ret);
+		return ERR_PTR(ret);
 	}
-	if (atomic_read(&g_qtfs_conn_num) >= qtfs_sock_max_conn) {
+	if (atomic_read(&g_qtfs_conn_num) >= qtfs_conn_max_param()) {
 		mutex_unlock(&g_param_mutex);
-		cnt++;
-		msleep(1);
-		if (cnt < 100000)
-			goto retry;
-		qtfs_err("qtfs get param failed, the concurrency specification has reached the upper limit");
 		return NULL;
 	}
 	pvar = kmalloc(sizeof(struct qtfs_sock_var_s), GFP_KERNEL);
 	if (pvar == NULL) {
 		qtfs_err("qtfs get param kmalloc failed.\n");
 		mutex_unlock(&g_param_mutex);
-		return NULL;
+		return ERR_PTR(-ENOMEM);
 	}
 	if (QTFS_OK != qtfs_sock_var_init(pvar)) {
 		qtfs_err("qtfs sock var init failed.\n");
 		kfree(pvar);
 		mutex_unlock(&g_param_mutex);
-		return NULL;
+		return ERR_PTR(-ENOMEM);
 	}
 
-	memcpy(pvar->who_using, func, (strlen(func) >= QTFS_FUNCTION_LEN - 1) ? (QTFS_FUNCTION_LEN - 1) : strlen(func));
+	qtfs_conn_param_hold(pvar, func);
 	pvar->cur_threadidx = atomic_read(&g_qtfs_conn_num);
 	qtfs_info("qtfs create new param, cur conn num:%d\n", atomic_read(&g_qtfs_conn_num));
 
 	qtfs_thread_var[pvar->cur_threadidx] = pvar;
-	// add to busy list
 	atomic_inc(&g_qtfs_conn_num);
-	list_add(&pvar->lst, &g_busy_lst);
 
 	strcpy(pvar->addr, qtfs_server_ip);
 	pvar->port = qtfs_server_port;
@@ -953,34 +1728,28 @@ retry:
 #ifdef QTFS_CLIENT
 	mutex_unlock(&g_param_mutex);
 	pvar->cs = QTFS_CONN_SOCK_CLIENT;
-	ret = qtfs_sm_active(pvar);
+	ret = qtfs_conn_param_active(pvar);
 	if (ret < 0) {
 		qtfs_err("qtfs get param active connection failed, ret:%d, curstate:%s", ret, QTCONN_CUR_STATE(pvar));
-		// put to vld list
+		// back to the pool, next user tries to connect again
 		qtfs_conn_put_param(pvar);
-		return NULL;
+		return ERR_PTR(ret);
 	}
-	qtfs_thread_var[pvar->cur_threadidx] = pvar;
 #else
 	pvar->cs = QTFS_CONN_SOCK_SERVER;
 	if (qtfs_server_main_sock == NULL) {
-		if (qtfs_sm_active(pvar)) {
-			qtfs_err("qtfs get param active connection failed, ret:%d, curstate:%s", ret, QTCONN_CUR_STATE(pvar));
-			// put to vld list
-			mutex_unlock(&g_param_mutex);
-			qtfs_conn_put_param(pvar);
-			return NULL;
-		}
+		// the first one creates the listening socket, under the mutex
+		ret = qtfs_sm_active(pvar);
 		mutex_unlock(&g_param_mutex);
 	} else {
 		mutex_unlock(&g_param_mutex);
 		pvar->state = QTCONN_CONNECTING;
 		ret = qtfs_sm_active(pvar);
-		if (ret < 0) {
-			qtfs_err("qtfs get param active connection failed, ret:%d curstate:%s", ret, QTCONN_CUR_STATE(pvar));
-			qtfs_conn_put_param(pvar);
-			return NULL;
-		}
+	}
+	if (ret < 0) {
+		qtfs_err("qtfs get param active connection failed, ret:%d curstate:%s", ret, QTCONN_CUR_STATE(pvar));
+		qtfs_conn_put_param(pvar);
+		return ERR_PTR(ret);
 	}
 #endif
 	qtinfo_cntinc(QTINF_ACTIV_CONN);
@@ -988,6 +1757,49 @@ retry:
 	return pvar;
 }
 
+struct qtfs_sock_var_s *_qtfs_conn_get_param(const char *func)
+{
+	struct qtfs_sock_var_s *pvar = NULL;
+	int ret;
+
+	if (qtfs_mod_exiting == true) {
+		qtfs_warn("qtfs module is exiting, good bye!");
+		return NULL;
+	}
+
+	atomic64_inc(&g_pool_stat.takes);
+	pvar = qtfs_pool_take();
+	if (pvar == NULL) {
+		u64 start;
+
+		pvar = qtfs_conn_new_param(func);
+		if (IS_ERR(pvar))
+			return NULL;
+		if (pvar != NULL)
+			return pvar;
+		// all qtfs_sock_max_conn params are busy
+		atomic64_inc(&g_pool_stat.saturated);
+		start = ktime_get_ns();
+		ret = wait_event_interruptible_exclusive(g_pool_waitq,
+				(pvar = qtfs_pool_take()) != NULL || READ_ONCE(qtfs_mod_exiting));
+		start = ktime_get_ns() - start;
+		atomic64_inc(&g_pool_stat.wait_lat[qtinfo_lat_bucket(start)]);
+		trace_qtfs_pool_wait(func, start, pvar != NULL);
+		if (pvar == NULL) {
+			qtfs_err("qtfs get param failed while all %d params busy, ret:%d.", atomic_read(&g_qtfs_conn_num), ret);
+			return NULL;
+		}
+	}
+
+	qtfs_conn_param_hold(pvar, func);
+	ret = qtfs_conn_param_active(pvar);
+	if (ret != 0) {
+		qtfs_conn_put_param(pvar);
+		return NULL;
+	}
+	return pvar;
+}
+
 struct qtfs_sock_var_s *qtfs_epoll_establish_conn(void)
 {
 	struct qtfs_sock_var_s *pvar = NULL;
@@ -1040,16 +1852,11 @@ struct qtfs_sock_var_s *qtfs_epoll_establish_conn(void)
 
 void qtfs_conn_put_param(struct qtfs_sock_var_s *pvar)
 {
-	int ret;
-	ret = qtfs_mutex_lock_interruptible(&g_param_mutex);
-	if (ret < 0) {
-		llist_add(&pvar->lazy_put, &g_lazy_put_llst);
-		qtfs_warn("qtfs conn put param add to lazy list idx:%d, ret:%d.", pvar->cur_threadidx, ret);
-		return;
-	}
 	qtfs_sock_msg_clear(pvar);
-	list_move_tail(&pvar->lst, &g_vld_lst);
-	mutex_unlock(&g_param_mutex);
+	qtfs_conn_param_release(pvar);
+	WRITE_ONCE(pvar->busy, false);
+	atomic_dec(&g_pool_busy);
+	qtfs_pool_give(pvar);
 	return;
 }
 
@@ -1062,34 +1869,580 @@ void qtfs_epoll_cut_conn(struct qtfs_sock_var_s *pvar)
 	return;
 }
 
+static DEFINE_SPINLOCK(g_stat_lock);
+
+static void qtfs_stat_fold(unsigned long *dst, atomic64_t *src)
+{
+	*dst += atomic64_xchg(src, 0);
+}
+
+static void qtfs_stat_fold_max(unsigned long *dst, atomic64_t *src)
+{
+	unsigned long val = atomic64_xchg(src, 0);
+
+	if (val > *dst)
+		*dst = val;
+}
+
+// move what the counters gathered since the last read into diag info,
+// readers and qtinfo_clear call this first
+void qtfs_conn_stat_fold(void)
+{
+	struct qtinfo_pool *pool = &qtfs_diag_info->pool;
+	struct qtinfo_tcp *tcp = &qtfs_diag_info->tcp;
+	int busy_max;
+	int i;
+
+	spin_lock(&g_stat_lock);
+	qtfs_stat_fold(&pool->takes, &g_pool_stat.takes);
+	qtfs_stat_fold(&pool->saturated, &g_pool_stat.saturated);
+	busy_max = atomic64_xchg(&g_pool_stat.busy_max, 0);
+	if (busy_max > pool->busy_max)
+		pool->busy_max = busy_max;
+	for (i = 0; i < QTINFO_LAT_BUCKETS; i++) {
+		qtfs_stat_fold(&pool->wait_lat[i], &g_pool_stat.wait_lat[i]);
+		qtfs_stat_fold(&pool->hold_lat[i], &g_pool_stat.hold_lat[i]);
+	}
+	for (i = 0; i < QTINFO_MAX_HOLDERS; i++) {
+		qtfs_stat_fold(&pool->holders[i].count, &g_pool_stat.holders[i].count);
+		qtfs_stat_fold(&pool->holders[i].total_us, &g_pool_stat.holders[i].total_us);
+		qtfs_stat_fold_max(&pool->holders[i].max_us, &g_pool_stat.holders[i].max_us);
+	}
+	qtfs_stat_fold(&tcp->tuned, &g_tcp_stat.tuned);
+	qtfs_stat_fold(&tcp->tune_err, &g_tcp_stat.tune_err);
+	qtfs_stat_fold(&tcp->more_sends, &g_tcp_stat.more_sends);
+	qtfs_stat_fold(&tcp->quickacks, &g_tcp_stat.quickacks);
+	qtfs_stat_fold(&tcp->retrans, &g_tcp_stat.retrans);
+	qtfs_stat_fold(&tcp->rx_calls, &g_tcp_stat.rx_calls);
+	qtfs_stat_fold(&tcp->rx_msgs, &g_tcp_stat.rx_msgs);
+	for (i = 0; i < QTINFO_LAT_BUCKETS; i++)
+		qtfs_stat_fold(&tcp->srtt[i], &g_tcp_stat.srtt[i]);
+	spin_unlock(&g_stat_lock);
+}
+
 void qtfs_conn_list_cnt(void)
 {
-	struct list_head *entry;
 	struct qtfs_sock_var_s *pvar;
-#ifdef QTFS_CLIENT
-	int ret = 0;
-	ret = qtfs_mutex_lock_interruptible(&g_param_mutex);
-	if (ret < 0) {
-		qtfs_err("qtfs conn put param mutex lock interrup failed, ret:%d.", ret);
-		return;
-	}
-#endif
-	qtfs_diag_info->pvar_busy = 0;
-	qtfs_diag_info->pvar_vld = 0;
+	int conn_num = atomic_read(&g_qtfs_conn_num);
+	int busy = atomic_read(&g_pool_busy);
+	struct qtinfo_pool *pool = &qtfs_diag_info->pool;
+	int shown = 0;
+	int i, j;
+
+	qtfs_conn_stat_fold();
+	qtfs_diag_info->pvar_busy = busy;
+	qtfs_diag_info->pvar_vld = conn_num - busy;
 	memset(qtfs_diag_info->who_using, 0, sizeof(qtfs_diag_info->who_using));
-	list_for_each(entry, &g_busy_lst) {
-		qtfs_diag_info->pvar_busy++;
-		pvar = (struct qtfs_sock_var_s *)entry;
-		if (pvar->cur_threadidx < 0 || pvar->cur_threadidx >= QTFS_MAX_THREADS)
+	memset(pool->hold_us, 0, sizeof(pool->hold_us));
+	memset(pool->hold_idx, -1, sizeof(pool->hold_idx));
+	pool->hold_more = 0;
+	if (busy > pool->busy_max)
+		pool->busy_max = busy;
+	// the pool grows past the slots we report, keep the longest holders
+	for (i = 0; i < conn_num && i < QTFS_MAX_PARAMS; i++) {
+		unsigned long us = 0;
+		u64 start;
+
+		pvar = READ_ONCE(qtfs_thread_var[i]);
+		if (pvar == NULL || !READ_ONCE(pvar->busy))
 			continue;
-		strncpy(qtfs_diag_info->who_using[pvar->cur_threadidx],
-								qtfs_thread_var[pvar->cur_threadidx]->who_using, QTFS_FUNCTION_LEN);
+		start = READ_ONCE(pvar->hold_start);
+		if (start != 0)
+			us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+		if (shown == QTFS_MAX_THREADS) {
+			pool->hold_more++;
+			if (us <= pool->hold_us[shown - 1])
+				continue;
+			shown--;
+		}
+		for (j = shown; j > 0 && pool->hold_us[j - 1] < us; j--) {
+			memcpy(qtfs_diag_info->who_using[j], qtfs_diag_info->who_using[j - 1], QTFS_FUNCTION_LEN);
+			pool->hold_us[j] = pool->hold_us[j - 1];
+			pool->hold_idx[j] = pool->hold_idx[j - 1];
+		}
+		strscpy(qtfs_diag_info->who_using[j], pvar->who_using, QTFS_FUNCTION_LEN);
+		pool->hold_us[j] = us;
+		pool->hold_idx[j] = i;
+		shown++;
 	}
-	list_for_each(entry, &g_vld_lst)
-		qtfs_diag_info->pvar_vld++;
+	return;
+}
+
+// state of the idx'th connection, for diag info
+int qtfs_conn_state(int idx)
+{
 #ifdef QTFS_CLIENT
-	mutex_unlock(&g_param_mutex);
+	if (qtfs_pipe_enabled()) {
+		if (idx < 0 || idx >= qtfs_pipe_conns)
+			return -1;
+		return qtfs_pipes[idx].conn.state;
+	}
 #endif
-	return;
+	if (idx < 0 || idx >= QTFS_MAX_PARAMS || qtfs_thread_var[idx] == NULL)
+		return -1;
+	return qtfs_thread_var[idx]->state;
 }
 
+#ifdef QTFS_CLIENT
+/*
+ * Connection manager: callers don't reconnect in their own context. A
+ * holder whose connection is down queues its pvar to the manager thread and
+ * parks on qtfs_connmgr_doneq, the thread reconnects with backoff and wakes
+ * it. Once a lost connection is back, the server was likely restarted, so
+ * the thread also reconnects the idle pvars of the pool for the next callers.
+ */
+#define QTFS_RECONN_MIN_MS 10
+#define QTFS_RECONN_MAX_MS 1000
+
+static struct task_struct *qtfs_connmgr_task = NULL;
+static LIST_HEAD(qtfs_connmgr_list);
+static DEFINE_SPINLOCK(qtfs_connmgr_lock);
+static DECLARE_WAIT_QUEUE_HEAD(qtfs_connmgr_waitq);
+static DECLARE_WAIT_QUEUE_HEAD(qtfs_connmgr_doneq);
+static bool qtfs_connmgr_warm = false;
+
+static inline unsigned int qtfs_reconn_backoff(unsigned int ms)
+{
+	return (ms == 0) ? QTFS_RECONN_MIN_MS : min(ms * 2, (unsigned int)QTFS_RECONN_MAX_MS);
+}
+
+// one attempt to bring pvar's connection up
+static int qtfs_connmgr_fix(struct qtfs_sock_var_s *pvar)
+{
+	bool lost;
+	int ret;
+
+	mutex_lock(&pvar->sendlock);
+	lost = (pvar->state == QTCONN_ACTIVE);
+	if (lost && qtfs_sock_connected(pvar))
+		ret = 0;
+	else if (lost)
+		ret = qtfs_sm_reconnect(pvar);
+	else
+		ret = qtfs_sm_active(pvar);
+	mutex_unlock(&pvar->sendlock);
+	if (ret == 0 && lost)
+		qtinfo_cntinc(QTINF_RECONNECT);
+	return ret;
+}
+
+static int qtfs_connmgr_wait(struct qtfs_sock_var_s *pvar)
+{
+	long ret;
+
+	// no thread to hand it to, connect here
+	if (qtfs_connmgr_task == NULL)
+		return qtfs_connmgr_fix(pvar);
+	spin_lock(&qtfs_connmgr_lock);
+	if (!pvar->reconn_pending) {
+		pvar->reconn_pending = true;
+		list_add_tail(&pvar->reconn_node, &qtfs_connmgr_list);
+	}
+	spin_unlock(&qtfs_connmgr_lock);
+	wake_up(&qtfs_connmgr_waitq);
+	ret = wait_event_interruptible_timeout(qtfs_connmgr_doneq,
+			!READ_ONCE(pvar->reconn_pending) || READ_ONCE(qtfs_mod_exiting),
+			msecs_to_jiffies(qtfs_reconnect_wait_ms));
+	if (!READ_ONCE(pvar->reconn_pending))
+		return 0;
+	// it stays queued, whoever takes pvar next waits for it again
+	qtfs_err("qtfs conn thread:%d not back in %dms, ret:%ld.", pvar->cur_threadidx, qtfs_reconnect_wait_ms, ret);
+	return (ret < 0) ? ret : -ENOTCONN;
+}
+
+// reconnect the idle pvars that lost their connection along with a fixed one
+static void qtfs_connmgr_warm_pool(void)
+{
+	struct qtfs_sock_var_s *pvar, *next;
+	struct llist_node *all;
+	LLIST_HEAD(held);
+	bool down = false;
+	int fixed = 0;
+
+	// take them all first, a pvar given back isn't checked twice
+	while ((pvar = qtfs_pool_take()) != NULL)
+		llist_add(&pvar->free_node, &held);
+	all = llist_del_all(&held);
+	llist_for_each_entry_safe(pvar, next, all, free_node) {
+		if (!down && !kthread_should_stop() && !READ_ONCE(pvar->reconn_pending) &&
+				pvar->state == QTCONN_ACTIVE && !qtfs_sock_connected(pvar)) {
+			if (qtfs_connmgr_fix(pvar) == 0)
+				fixed++;
+			else
+				down = true;
+		}
+		qtfs_pool_give(pvar);
+	}
+	if (fixed > 0)
+		qtfs_info("qtfs conn manager reconnected %d idle connections.", fixed);
+}
+
+static int qtfs_connmgr_thread(void *data)
+{
+	struct qtfs_sock_var_s *pvar;
+	unsigned int backoff = 0;
+	bool lost;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		if (backoff > 0)
+			schedule_timeout_interruptible(msecs_to_jiffies(backoff));
+		else
+			wait_event_interruptible(qtfs_connmgr_waitq, !list_empty_careful(&qtfs_connmgr_list) ||
+					READ_ONCE(qtfs_connmgr_warm) || kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+		spin_lock(&qtfs_connmgr_lock);
+		pvar = list_first_entry_or_null(&qtfs_connmgr_list, struct qtfs_sock_var_s, reconn_node);
+		if (pvar != NULL)
+			list_del_init(&pvar->reconn_node);
+		spin_unlock(&qtfs_connmgr_lock);
+		if (pvar == NULL) {
+			// parked callers first, then the idle ones
+			if (xchg(&qtfs_connmgr_warm, false))
+				qtfs_connmgr_warm_pool();
+			backoff = 0;
+			continue;
+		}
+		lost = (pvar->state == QTCONN_ACTIVE);
+		ret = qtfs_connmgr_fix(pvar);
+		spin_lock(&qtfs_connmgr_lock);
+		if (ret == 0)
+			WRITE_ONCE(pvar->reconn_pending, false);
+		else
+			list_add_tail(&pvar->reconn_node, &qtfs_connmgr_list);
+		spin_unlock(&qtfs_connmgr_lock);
+		if (ret != 0) {
+			backoff = qtfs_reconn_backoff(backoff);
+			continue;
+		}
+		backoff = 0;
+		if (lost)
+			WRITE_ONCE(qtfs_connmgr_warm, true);
+		wake_up_all(&qtfs_connmgr_doneq);
+	}
+	return 0;
+}
+
+int qtfs_connmgr_init(void)
+{
+	struct task_struct *task;
+
+	task = kthread_run(qtfs_connmgr_thread, NULL, "qtfs_connmgr");
+	if (IS_ERR_OR_NULL(task)) {
+		qtfs_err("qtfs conn manager thread run failed.");
+		return -ENOMEM;
+	}
+	qtfs_connmgr_task = task;
+	return 0;
+}
+
+// before the pvars are freed
+void qtfs_connmgr_fini(void)
+{
+	struct qtfs_sock_var_s *pvar, *tmp;
+
+	if (qtfs_connmgr_task == NULL)
+		return;
+	kthread_stop(qtfs_connmgr_task);
+	qtfs_connmgr_task = NULL;
+	wake_up_all(&qtfs_connmgr_doneq);
+	spin_lock(&qtfs_connmgr_lock);
+	list_for_each_entry_safe(pvar, tmp, &qtfs_connmgr_list, reconn_node) {
+		list_del_init(&pvar->reconn_node);
+		pvar->reconn_pending = false;
+	}
+	spin_unlock(&qtfs_connmgr_lock);
+}
+
+// wait until pvar can carry a request again, after its connection was lost
+// with one in flight
+int qtfs_conn_wait_active(struct qtfs_sock_var_s *pvar)
+{
+	if (qtfs_mod_exiting)
+		return -ESHUTDOWN;
+	// the request goes to whichever pipe is up, qtfs_pipe_select waits
+	if (qtfs_pipe_enabled())
+		return 0;
+	return qtfs_conn_param_active(pvar);
+}
+
+/*
+ * Pipeline mode: pvars are only request slots, requests of many pvars are
+ * multiplexed over a few connections. Each request gets a seq_num from the
+ * pipe's idr, one recv thread per pipe reads responses and dispatches them
+ * to the waiting pvar by seq_num, so responses may come back in any order.
+ */
+bool qtfs_pipe_enabled(void)
+{
+	return qtfs_pipes != NULL;
+}
+
+static bool qtfs_pipe_any_active(void)
+{
+	int i;
+
+	for (i = 0; i < qtfs_pipe_conns; i++) {
+		if (qtfs_pipes[i].conn.state == QTCONN_ACTIVE)
+			return true;
+	}
+	return false;
+}
+
+static struct qtfs_pipe_s *qtfs_pipe_select(void)
+{
+	int start;
+	int i;
+
+	if (!qtfs_pipe_any_active())
+		wait_event_interruptible_timeout(qtfs_pipe_waitq,
+				qtfs_pipe_any_active() || qtfs_mod_exiting, msecs_to_jiffies(qtfs_reconnect_wait_ms));
+	start = raw_smp_processor_id() % qtfs_pipe_conns;
+	for (i = 0; i < qtfs_pipe_conns; i++) {
+		struct qtfs_pipe_s *pipe = &qtfs_pipes[(start + i) % qtfs_pipe_conns];
+		if (pipe->conn.state == QTCONN_ACTIVE)
+			return pipe;
+	}
+	return NULL;
+}
+
+// fail all requests in flight, their responses are lost with the connection
+static void qtfs_pipe_fail_all(struct qtfs_pipe_s *pipe, int err)
+{
+	struct qtfs_sock_var_s *pvar;
+	int id;
+
+	spin_lock(&pipe->lock);
+	idr_for_each_entry(&pipe->reqs, pvar, id) {
+		idr_remove(&pipe->reqs, id);
+		pvar->pipe_ret = err;
+		complete(&pvar->done);
+	}
+	spin_unlock(&pipe->lock);
+}
+
+int qtfs_pipe_run(struct qtfs_sock_var_s *pvar)
+{
+	struct qtfs_pipe_s *pipe;
+	struct qtreq *req = pvar->vec_send.iov_base;
+	int id;
+	int ret;
+
+	pipe = qtfs_pipe_select();
+	if (pipe == NULL) {
+		qtfs_err("qtfs pipe run failed, no active connection.");
+		return -ENOTCONN;
+	}
+
+	reinit_completion(&pvar->done);
+	pvar->pipe_ret = 0;
+	idr_preload(GFP_KERNEL);
+	spin_lock(&pipe->lock);
+	id = idr_alloc_cyclic(&pipe->reqs, pvar, 1, INT_MAX, GFP_NOWAIT);
+	spin_unlock(&pipe->lock);
+	idr_preload_end();
+	if (id < 0) {
+		qtfs_err("qtfs pipe:%d alloc request id failed:%d.", pipe->idx, id);
+		return id;
+	}
+	req->seq_num = id;
+	pvar->seq_num = id;
+
+	mutex_lock(&pipe->conn.sendlock);
+	if (pipe->conn.state == QTCONN_ACTIVE) {
+		size_t total = pvar->vec_send.iov_len + pvar->send_bulk.iov_len;
+		ret = qtfs_sock_send_frame(&pipe->conn, pvar);
+		if (ret >= 0 && ret != total) {
+			// stream is out of sync now, let recv thread rebuild it
+			qtfs_conn_tp->shutdown(&pipe->conn);
+			ret = -EPIPE;
+		}
+	} else {
+		ret = -ENOTCONN;
+	}
+	mutex_unlock(&pipe->conn.sendlock);
+	if (ret < 0)
+		goto remove;
+
+	ret = wait_for_completion_killable(&pvar->done);
+	if (ret == 0)
+		return pvar->pipe_ret;
+
+remove:
+	spin_lock(&pipe->lock);
+	if (idr_remove(&pipe->reqs, id) == NULL) {
+		spin_unlock(&pipe->lock);
+		// recv thread is already filling our buffer, wait for it
+		wait_for_completion(&pvar->done);
+		return pvar->pipe_ret;
+	}
+	spin_unlock(&pipe->lock);
+	return ret;
+}
+
+static int qtfs_pipe_recv_one(struct qtfs_pipe_s *pipe)
+{
+	struct qtreq *head = pipe->conn.vec_recv.iov_base;
+	struct qtfs_sock_var_s *pvar = NULL;
+	void *buf;
+	int ret;
+
+	// block for the first byte, the receive timeout brings us back to
+	// check kthread_should_stop() with -EAGAIN
+	ret = qtfs_rx_fill(&pipe->conn, QTFS_MSG_HEAD_LEN, true, false);
+	if (ret < 0)
+		return ret;
+	qtfs_rx_take(&pipe->conn, head, NULL, QTFS_MSG_HEAD_LEN);
+	qtfs_sock_after_recv(&pipe->conn);
+	if (head->len > QTFS_DATA_MAX_LEN) {
+		qtfs_err("qtfs pipe:%d recv head invalid len:%lu", pipe->idx, head->len);
+		return -EINVAL;
+	}
+	if (head->seq_num <= INT_MAX) {
+		spin_lock(&pipe->lock);
+		pvar = idr_remove(&pipe->reqs, (int)head->seq_num);
+		spin_unlock(&pipe->lock);
+	}
+	if (pvar == NULL) {
+		// nobody is waiting for it, drain to the pipe's own buffer
+		ret = qtfs_rx_drain(&pipe->conn, head->len);
+		if (ret < 0)
+			return ret;
+		qtinfo_cntinc(QTINF_SEQ_ERR);
+		if (head->len <= QTFS_REQ_MAX_LEN)
+			qtfs_missmsg_defer(head);
+		return 0;
+	}
+	if (head->len > pvar->vec_recv.iov_len - QTFS_MSG_HEAD_LEN) {
+		qtfs_err("qtfs pipe:%d rsp len:%lu exceed recv buf:%lu.", pipe->idx, head->len, pvar->vec_recv.iov_len);
+		ret = qtfs_rx_drain(&pipe->conn, head->len);
+		pvar->pipe_ret = -EMSGSIZE;
+		complete(&pvar->done);
+		return ret;
+	}
+
+	buf = pvar->vec_recv.iov_base;
+	memcpy(buf, head, QTFS_MSG_HEAD_LEN);
+	ret = qtfs_rx_take(&pipe->conn, buf + QTFS_MSG_HEAD_LEN, NULL, head->len);
+	qtfs_rx_dirty(pvar, QTFS_MSG_HEAD_LEN + head->len);
+	pvar->pipe_ret = (ret < 0) ? ret : (QTFS_MSG_HEAD_LEN + head->len);
+	complete(&pvar->done);
+	return (ret < 0) ? ret : 0;
+}
+
+static int qtfs_pipe_thread(void *data)
+{
+	struct qtfs_pipe_s *pipe = (struct qtfs_pipe_s *)data;
+	struct qtfs_sock_var_s *conn = &pipe->conn;
+	unsigned int backoff = 0;
+	bool broken = false;
+	bool lost;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		if (broken || conn->state != QTCONN_ACTIVE || !qtfs_sock_connected(conn)) {
+			qtfs_pipe_fail_all(pipe, -EPIPE);
+			mutex_lock(&conn->sendlock);
+			lost = (conn->state == QTCONN_ACTIVE);
+			if (lost)
+				ret = qtfs_sm_reconnect(conn);
+			else
+				ret = qtfs_sm_active(conn);
+			mutex_unlock(&conn->sendlock);
+			if (ret != 0) {
+				backoff = qtfs_reconn_backoff(backoff);
+				schedule_timeout_interruptible(msecs_to_jiffies(backoff));
+				continue;
+			}
+			if (lost)
+				qtinfo_cntinc(QTINF_RECONNECT);
+			backoff = 0;
+			broken = false;
+			qtfs_info("qtfs pipe:%d connection active.", pipe->idx);
+			wake_up_interruptible_all(&qtfs_pipe_waitq);
+		}
+		// idle pipes sleep in the recv, -EAGAIN is its timeout
+		ret = qtfs_pipe_recv_one(pipe);
+		if (ret == 0 || ret == -EAGAIN || ret == -EINTR || ret == -ERESTARTSYS)
+			continue;
+		qtfs_err("qtfs pipe:%d recv failed:%d, reconnect.", pipe->idx, ret);
+		broken = true;
+	}
+	return 0;
+}
+
+int qtfs_pipe_init(void)
+{
+	struct qtfs_pipe_s *pipes;
+	int i;
+
+	if (qtfs_pipe_conns <= 0) {
+		qtfs_info("qtfs pipeline mode disabled.");
+		return 0;
+	}
+	if (qtfs_pipe_conns > QTFS_MAX_THREADS)
+		qtfs_pipe_conns = QTFS_MAX_THREADS;
+	pipes = kcalloc(qtfs_pipe_conns, sizeof(struct qtfs_pipe_s), GFP_KERNEL);
+	if (pipes == NULL) {
+		qtfs_err("qtfs pipe init kmalloc failed, conns:%d.", qtfs_pipe_conns);
+		return -ENOMEM;
+	}
+	for (i = 0; i < qtfs_pipe_conns; i++) {
+		struct qtfs_pipe_s *pipe = &pipes[i];
+		if (qtfs_sock_var_init(&pipe->conn) != QTFS_OK)
+			goto err_end;
+		spin_lock_init(&pipe->lock);
+		idr_init(&pipe->reqs);
+		pipe->idx = i;
+		pipe->conn.cur_threadidx = QTFS_PIPE_THREADIDX(i);
+		pipe->conn.cs = QTFS_CONN_SOCK_CLIENT;
+		pipe->conn.state = QTCONN_INIT;
+		strcpy(pipe->conn.addr, qtfs_server_ip);
+		pipe->conn.port = qtfs_server_port;
+	}
+	for (i = 0; i < qtfs_pipe_conns; i++) {
+		pipes[i].task = kthread_run(qtfs_pipe_thread, &pipes[i], "qtfs_pipe%d", i);
+		if (IS_ERR_OR_NULL(pipes[i].task)) {
+			qtfs_err("qtfs pipe:%d recv thread run failed.", i);
+			pipes[i].task = NULL;
+			goto err_end;
+		}
+	}
+	qtfs_pipes = pipes;
+	qtfs_info("qtfs pipeline mode enabled, conns:%d max requests:%d.", qtfs_pipe_conns, qtfs_pipe_max_req);
+	return 0;
+
+err_end:
+	for (i = 0; i < qtfs_pipe_conns; i++) {
+		if (pipes[i].task != NULL)
+			kthread_stop(pipes[i].task);
+		qtfs_sm_exit(&pipes[i].conn);
+		qtfs_sock_var_fini(&pipes[i].conn);
+		idr_destroy(&pipes[i].reqs);
+	}
+	kfree(pipes);
+	return -ENOMEM;
+}
+
+void qtfs_pipe_fini(void)
+{
+	int i;
+
+	if (qtfs_pipes == NULL)
+		return;
+	wake_up_interruptible_all(&qtfs_pipe_waitq);
+	for (i = 0; i < qtfs_pipe_conns; i++) {
+		struct qtfs_pipe_s *pipe = &qtfs_pipes[i];
+		kthread_stop(pipe->task);
+		qtfs_pipe_fail_all(pipe, -ESHUTDOWN);
+		mutex_lock(&pipe->conn.sendlock);
+		qtfs_sm_exit(&pipe->conn);
+		mutex_unlock(&pipe->conn.sendlock);
+		qtfs_sock_var_fini(&pipe->conn);
+		idr_destroy(&pipe->reqs);
+	}
+	// pvars were put back before module exit, nobody reference pipes now
+	kfree(qtfs_pipes);
+	qtfs_pipes = NULL;
+}
+#endif
@@ -0,0 +1,423 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/signal.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "conn.h"
+#include "log.h"
+#include "qtfs_shm.h"
+
+// Shared memory transport: a connection is a channel of the backend's
+// region, the client claims a free one and kicks the server, which accepts
+// it by setting its own bit in the link word. Each side writes its ring and
+// kicks the other after writing, the consumer kicks back only when the
+// producer waits for space. Whoever leaves last resets the rings and frees
+// the channel.
+
+#ifdef QTFS_SERVER
+#define QTFS_SHM_SIDE QTFS_SHM_SERVER
+#else
+#define QTFS_SHM_SIDE QTFS_SHM_CLIENT
+#endif
+#define QTFS_SHM_PEER (QTFS_SHM_SIDES - 1 - QTFS_SHM_SIDE)
+#define QTFS_SHM_LINK_SIDE(side) (((side) == QTFS_SHM_SERVER) ? QTFS_SHM_LINK_SERVER : QTFS_SHM_LINK_CLIENT)
+#define QTFS_SHM_LINK_BOTH (QTFS_SHM_LINK_CLIENT | QTFS_SHM_LINK_SERVER)
+
+static struct qtfs_shm_backend *qtfs_shm_be = NULL;
+static DEFINE_MUTEX(qtfs_shm_mutex);
+// our pvar on each channel, for the doorbell
+static struct qtfs_sock_var_s *qtfs_shm_ep[QTFS_SHM_CHANS];
+#ifdef QTFS_SERVER
+// connecting server pvars wait here for a client
+static DECLARE_WAIT_QUEUE_HEAD(qtfs_shm_acceptq);
+#endif
+
+#ifdef QTFS_SERVER
+static void qtfs_shm_loop_kick(struct qtfs_shm_backend *be, int side, int chan)
+{
+	void (*doorbell)(int chan);
+
+	rcu_read_lock();
+	doorbell = READ_ONCE(be->doorbell[side]);
+	if (doorbell != NULL)
+		doorbell(chan);
+	rcu_read_unlock();
+}
+
+struct qtfs_shm_backend qtfs_shm_loop = {
+	.name = "loopback",
+	.kick = qtfs_shm_loop_kick,
+};
+EXPORT_SYMBOL_GPL(qtfs_shm_loop);
+#endif
+
+static inline void qtfs_shm_kick(int side, int chan)
+{
+	qtfs_shm_be->kick(qtfs_shm_be, side, chan);
+}
+
+static inline struct qtfs_shm_chan *qtfs_shm_chan(struct qtfs_sock_var_s *pvar)
+{
+	if (pvar->pcie.dstid < 0 || qtfs_shm_be == NULL)
+		return NULL;
+	return &qtfs_shm_be->region->chans[pvar->pcie.dstid];
+}
+
+static inline u32 qtfs_shm_avail(struct qtfs_shm_ring *ring)
+{
+	return smp_load_acquire(&ring->head) - READ_ONCE(ring->tail);
+}
+
+static inline u32 qtfs_shm_space(struct qtfs_shm_ring *ring)
+{
+	return QTFS_SHM_RING_LEN - (READ_ONCE(ring->head) - smp_load_acquire(&ring->tail));
+}
+
+static void qtfs_shm_doorbell(int chan)
+{
+	struct qtfs_sock_var_s *pvar;
+
+	if (chan < 0 || chan >= QTFS_SHM_CHANS)
+		return;
+	pvar = READ_ONCE(qtfs_shm_ep[chan]);
+	if (pvar == NULL) {
+#ifdef QTFS_SERVER
+		// a client wants to be accepted
+		wake_up_interruptible_all(&qtfs_shm_acceptq);
+		qtfs_sched_kick();
+#endif
+		return;
+	}
+	wake_up_interruptible_all(&pvar->pcie.waitq);
+#ifdef QTFS_SERVER
+	if (READ_ONCE(pvar->pcie.watched))
+		qtfs_sched_ready(pvar);
+#endif
+}
+
+static int qtfs_shm_attach(void)
+{
+	struct qtfs_shm_backend *be;
+	int ret = 0;
+
+	if (smp_load_acquire(&qtfs_shm_be) != NULL)
+		return 0;
+	mutex_lock(&qtfs_shm_mutex);
+	if (qtfs_shm_be != NULL)
+		goto out;
+#ifdef QTFS_SERVER
+	be = &qtfs_shm_loop;
+	be->region = vzalloc(sizeof(struct qtfs_shm_region));
+	if (be->region == NULL) {
+		qtfs_err("qtfs shm region alloc failed, len:%lu.", sizeof(struct qtfs_shm_region));
+		ret = -ENOMEM;
+		goto out;
+	}
+	be->region->nchans = QTFS_SHM_CHANS;
+	smp_store_release(&be->region->magic, QTFS_SHM_MAGIC);
+#else
+	be = symbol_get(qtfs_shm_loop);
+	if (be == NULL) {
+		qtfs_err("qtfs shm no backend, load qtfs_server with the same qtfs_conn_mode first.");
+		ret = -ENODEV;
+		goto out;
+	}
+	// the server sets the region up when its first worker starts
+	if (READ_ONCE(be->region) == NULL || smp_load_acquire(&be->region->magic) != QTFS_SHM_MAGIC) {
+		symbol_put(qtfs_shm_loop);
+		ret = -EAGAIN;
+		goto out;
+	}
+#endif
+	WRITE_ONCE(be->doorbell[QTFS_SHM_SIDE], qtfs_shm_doorbell);
+	smp_store_release(&qtfs_shm_be, be);
+	qtfs_info("qtfs shm attached to %s backend, channels:%u.", be->name, be->region->nchans);
+out:
+	mutex_unlock(&qtfs_shm_mutex);
+	return ret;
+}
+
+// after every connection is released
+void qtfs_shm_exit(void)
+{
+	struct qtfs_shm_backend *be = qtfs_shm_be;
+
+	if (be == NULL)
+		return;
+	WRITE_ONCE(be->doorbell[QTFS_SHM_SIDE], NULL);
+	synchronize_rcu();
+	qtfs_shm_be = NULL;
+#ifdef QTFS_SERVER
+	vfree(be->region);
+	be->region = NULL;
+#else
+	symbol_put(qtfs_shm_loop);
+#endif
+}
+
+static int qtfs_shm_init(struct qtfs_sock_var_s *pvar)
+{
+	return qtfs_shm_attach();
+}
+
+static void qtfs_shm_fini(struct qtfs_sock_var_s *pvar)
+{
+	return;
+}
+
+static void qtfs_shm_bind(struct qtfs_sock_var_s *pvar, int chan)
+{
+	pvar->pcie.dstid = chan;
+	WRITE_ONCE(qtfs_shm_ep[chan], pvar);
+}
+
+static bool qtfs_shm_connected(struct qtfs_sock_var_s *pvar)
+{
+	struct qtfs_shm_chan *chan = qtfs_shm_chan(pvar);
+
+	if (chan == NULL)
+		return false;
+	return (READ_ONCE(chan->link) & (QTFS_SHM_LINK_BOTH | QTFS_SHM_LINK_CLOSED)) == QTFS_SHM_LINK_BOTH;
+}
+
+static int qtfs_shm_release(struct qtfs_sock_var_s *pvar)
+{
+	struct qtfs_shm_chan *chan = qtfs_shm_chan(pvar);
+	int idx = pvar->pcie.dstid;
+	u32 old, new;
+	int i;
+
+	if (chan == NULL)
+		return -ENOTCONN;
+	WRITE_ONCE(qtfs_shm_ep[idx], NULL);
+	// a doorbell running on another cpu may still see pvar
+	synchronize_rcu();
+	pvar->pcie.dstid = -1;
+	do {
+		old = READ_ONCE(chan->link);
+		new = (old & ~QTFS_SHM_LINK_SIDE(QTFS_SHM_SIDE)) | QTFS_SHM_LINK_CLOSED;
+	} while (cmpxchg(&chan->link, old, new) != old);
+	if (new & QTFS_SHM_LINK_BOTH) {
+		// the peer sees the hangup and releases its end
+		qtfs_shm_kick(QTFS_SHM_PEER, idx);
+		return 0;
+	}
+	for (i = 0; i < QTFS_SHM_SIDES; i++) {
+		chan->ring[i].head = 0;
+		chan->ring[i].tail = 0;
+		chan->ring[i].tx_wait = 0;
+	}
+	smp_store_release(&chan->link, 0);
+	return 0;
+}
+
+static void qtfs_shm_shutdown(struct qtfs_sock_var_s *pvar)
+{
+	struct qtfs_shm_chan *chan = qtfs_shm_chan(pvar);
+	u32 old;
+
+	if (chan == NULL)
+		return;
+	do {
+		old = READ_ONCE(chan->link);
+	} while (cmpxchg(&chan->link, old, old | QTFS_SHM_LINK_CLOSED) != old);
+	qtfs_shm_kick(QTFS_SHM_PEER, pvar->pcie.dstid);
+	wake_up_interruptible_all(&pvar->pcie.waitq);
+}
+
+#ifdef QTFS_SERVER
+// a channel claimed by a client and not accepted yet, -1 if none
+static int qtfs_shm_claimed(struct qtfs_shm_region *region, u32 want)
+{
+	int i;
+
+	for (i = 0; i < QTFS_SHM_CHANS; i++) {
+		if (READ_ONCE(region->chans[i].link) == want)
+			return i;
+	}
+	return -1;
+}
+#endif
+
+static int qtfs_shm_connect(struct qtfs_sock_var_s *pvar)
+{
+	struct qtfs_shm_region *region = qtfs_shm_be->region;
+	u32 want = QTFS_SHM_LINK_CLIENT | ((pvar == qtfs_epoll_var) ? QTFS_SHM_LINK_EPOLL : 0);
+	int i;
+
+#ifdef QTFS_SERVER
+	while ((i = qtfs_shm_claimed(region, want)) >= 0) {
+		if (cmpxchg(&region->chans[i].link, want, want | QTFS_SHM_LINK_SERVER) == want) {
+			qtfs_shm_bind(pvar, i);
+			qtfs_shm_kick(QTFS_SHM_CLIENT, i);
+			return 0;
+		}
+	}
+	return -EAGAIN;
+#else
+	for (i = 0; i < QTFS_SHM_CHANS; i++) {
+		if (cmpxchg(&region->chans[i].link, 0, want) == 0)
+			break;
+	}
+	if (i == QTFS_SHM_CHANS) {
+		qtfs_err("qtfs shm no free channel, all %d are in use.", QTFS_SHM_CHANS);
+		return -EBUSY;
+	}
+	qtfs_shm_bind(pvar, i);
+	qtfs_shm_kick(QTFS_SHM_SERVER, i);
+	wait_event_interruptible_timeout(pvar->pcie.waitq,
+			READ_ONCE(region->chans[i].link) != want, QTFS_SOCK_RCVTIMEO * HZ);
+	if (qtfs_shm_connected(pvar))
+		return 0;
+	// not accepted in time, give the channel back
+	qtfs_shm_release(pvar);
+	return -ETIMEDOUT;
+#endif
+}
+
+static int qtfs_shm_sendmsg(struct qtfs_sock_var_s *pvar, struct msghdr *msg)
+{
+	struct qtfs_shm_chan *chan = qtfs_shm_chan(pvar);
+	struct qtfs_shm_ring *ring;
+	size_t total = 0;
+	u32 head, space, off, n;
+	long ret;
+
+	if (chan == NULL)
+		return -ENOTCONN;
+	ring = &chan->ring[QTFS_SHM_SIDE];
+	while (msg_data_left(msg) > 0) {
+		if (!qtfs_shm_connected(pvar))
+			return (total > 0) ? total : -EPIPE;
+		space = qtfs_shm_space(ring);
+		if (space == 0) {
+			qtfs_shm_kick(QTFS_SHM_PEER, pvar->pcie.dstid);
+			WRITE_ONCE(ring->tx_wait, 1);
+			smp_mb();
+			ret = wait_event_interruptible_timeout(pvar->pcie.waitq,
+					qtfs_shm_space(ring) > 0 || !qtfs_shm_connected(pvar), QTFS_SOCK_SNDTIMEO * HZ);
+			if (ret <= 0)
+				return (total > 0) ? total : ((ret == 0) ? -EAGAIN : ret);
+			continue;
+		}
+		head = ring->head;
+		off = head & (QTFS_SHM_RING_LEN - 1);
+		n = min_t(size_t, msg_data_left(msg), min(space, QTFS_SHM_RING_LEN - off));
+		if (copy_from_iter(ring->data + off, n, &msg->msg_iter) != n)
+			return (total > 0) ? total : -EFAULT;
+		smp_store_release(&ring->head, head + n);
+		total += n;
+	}
+	// the rest of the frame follows right away
+	if (!(msg->msg_flags & MSG_MORE))
+		qtfs_shm_kick(QTFS_SHM_PEER, pvar->pcie.dstid);
+	return total;
+}
+
+static int qtfs_shm_recvmsg(struct qtfs_sock_var_s *pvar, struct msghdr *msg, int flags)
+{
+	struct qtfs_shm_chan *chan = qtfs_shm_chan(pvar);
+	struct qtfs_shm_ring *ring;
+	u32 tail, avail, off, n;
+	u32 total = 0;
+	long ret;
+
+	if (chan == NULL)
+		return -ENOTCONN;
+	ring = &chan->ring[QTFS_SHM_PEER];
+	while ((avail = qtfs_shm_avail(ring)) == 0) {
+		if (!qtfs_shm_connected(pvar))
+			return 0;
+		// only the server scheduler asks so, the doorbell queues the
+		// connection again when data comes; everyone else sleeps here
+		if (flags & MSG_DONTWAIT)
+			return -EAGAIN;
+		ret = wait_event_interruptible_timeout(pvar->pcie.waitq,
+				qtfs_shm_avail(ring) > 0 || !qtfs_shm_connected(pvar), QTFS_SOCK_RCVTIMEO * HZ);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -EAGAIN;
+	}
+	tail = ring->tail;
+	avail = min_t(size_t, avail, msg_data_left(msg));
+	while (total < avail) {
+		off = (tail + total) & (QTFS_SHM_RING_LEN - 1);
+		n = min(avail - total, QTFS_SHM_RING_LEN - off);
+		if (copy_to_iter(ring->data + off, n, &msg->msg_iter) != n) {
+			if (total == 0)
+				return -EFAULT;
+			break;
+		}
+		total += n;
+	}
+	smp_store_release(&ring->tail, tail + total);
+	smp_mb();
+	if (READ_ONCE(ring->tx_wait)) {
+		WRITE_ONCE(ring->tx_wait, 0);
+		qtfs_shm_kick(QTFS_SHM_PEER, pvar->pcie.dstid);
+	}
+	return total;
+}
+
+#ifdef QTFS_SERVER
+static void qtfs_shm_watch(struct qtfs_sock_var_s *pvar, bool on)
+{
+	WRITE_ONCE(pvar->pcie.watched, on);
+}
+
+static bool qtfs_shm_readable(struct qtfs_sock_var_s *pvar)
+{
+	struct qtfs_shm_chan *chan = qtfs_shm_chan(pvar);
+
+	return chan != NULL && qtfs_shm_avail(&chan->ring[QTFS_SHM_PEER]) > 0;
+}
+
+// doorbells of channels nobody is on kick the scheduler already
+static int qtfs_shm_watch_listen(bool on)
+{
+	return 0;
+}
+
+static bool qtfs_shm_accept_ready(void)
+{
+	if (qtfs_shm_be == NULL)
+		return false;
+	return qtfs_shm_claimed(qtfs_shm_be->region, QTFS_SHM_LINK_CLIENT) >= 0;
+}
+
+static void qtfs_shm_accept_wait(struct qtfs_sock_var_s *pvar, long timeo)
+{
+	u32 want = QTFS_SHM_LINK_CLIENT | ((pvar == qtfs_epoll_var) ? QTFS_SHM_LINK_EPOLL : 0);
+
+	if (qtfs_shm_be == NULL) {
+		schedule_timeout_interruptible(timeo);
+		return;
+	}
+	wait_event_interruptible_timeout(qtfs_shm_acceptq,
+			qtfs_shm_claimed(qtfs_shm_be->region, want) >= 0, timeo);
+}
+#endif
+
+const struct qtfs_conn_ops qtfs_shm_ops = {
+	.name = "shm",
+	.init = qtfs_shm_init,
+	.connect = qtfs_shm_connect,
+	.release = qtfs_shm_release,
+	.shutdown = qtfs_shm_shutdown,
+	.fini = qtfs_shm_fini,
+	.connected = qtfs_shm_connected,
+	.sendmsg = qtfs_shm_sendmsg,
+	.recvmsg = qtfs_shm_recvmsg,
+#ifdef QTFS_SERVER
+	.watch = qtfs_shm_watch,
+	.readable = qtfs_shm_readable,
+	.watch_listen = qtfs_shm_watch_listen,
+	.accept_ready = qtfs_shm_accept_ready,
+	.accept_wait = qtfs_shm_accept_wait,
+#endif
+};
@@ -8,6 +8,10 @@
 #include <linux/time.h>
 #include <linux/delay.h>
 #include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/termios.h>
+#include <asm/ioctls.h>
 
 #include "comm.h"
 #include "log.h"
@@ -26,6 +30,116 @@ static struct miscdevice qtfs_misc_dev = {
 	.fops	= &qtfs_misc_fops,
 };
 
+static const struct qtfs_ioctl_pass qtfs_ioctl_pass_default[] = {
+	{ FS_IOC_FSGETXATTR, _IOC_READ, sizeof(struct fsxattr) },
+	{ FS_IOC_FSSETXATTR, _IOC_WRITE, sizeof(struct fsxattr) },
+	{ TCGETS, _IOC_READ, sizeof(struct termios) },
+	{ TCSETS, _IOC_WRITE, sizeof(struct termios) },
+	{ TCSETSW, _IOC_WRITE, sizeof(struct termios) },
+	{ TCSETSF, _IOC_WRITE, sizeof(struct termios) },
+	{ TCFLSH, _IOC_NONE, 0 },
+	{ TIOCGWINSZ, _IOC_READ, sizeof(struct winsize) },
+	{ TIOCSWINSZ, _IOC_WRITE, sizeof(struct winsize) },
+	{ FIONREAD, _IOC_READ, sizeof(int) },
+};
+
+// entries are only appended, readers go lockless up to the published count
+static struct qtfs_ioctl_pass qtfs_ioctl_pass_table[QTFS_IOCTL_PASS_MAX];
+static int qtfs_ioctl_pass_nr = 0;
+static DEFINE_MUTEX(qtfs_ioctl_pass_mutex);
+
+static void qtfs_ioctl_pass_init(void)
+{
+	memcpy(qtfs_ioctl_pass_table, qtfs_ioctl_pass_default, sizeof(qtfs_ioctl_pass_default));
+	smp_store_release(&qtfs_ioctl_pass_nr, ARRAY_SIZE(qtfs_ioctl_pass_default));
+}
+
+bool qtfs_ioctl_pass_find(unsigned int cmd, struct qtfs_ioctl_pass *pass)
+{
+	int nr = smp_load_acquire(&qtfs_ioctl_pass_nr);
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (qtfs_ioctl_pass_table[i].cmd == cmd) {
+			*pass = qtfs_ioctl_pass_table[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+static int qtfs_ioctl_pass_add(struct qtfs_ioctl_pass *pass)
+{
+	struct qtfs_ioctl_pass old;
+	int ret = 0;
+
+	if (pass->size > QTFS_IOCTL_PASS_SIZE_MAX || (pass->dir & ~(_IOC_READ | _IOC_WRITE)) != 0 ||
+			(pass->dir != _IOC_NONE && pass->size == 0)) {
+		qtfs_err("qtfs ioctl pass cmd:0x%x invalid dir:%u size:%u.", pass->cmd, pass->dir, pass->size);
+		return -EINVAL;
+	}
+	mutex_lock(&qtfs_ioctl_pass_mutex);
+	if (qtfs_ioctl_pass_find(pass->cmd, &old)) {
+		ret = (old.dir == pass->dir && old.size == pass->size) ? 0 : -EEXIST;
+	} else if (qtfs_ioctl_pass_nr >= QTFS_IOCTL_PASS_MAX) {
+		ret = -ENOSPC;
+	} else {
+		qtfs_ioctl_pass_table[qtfs_ioctl_pass_nr] = *pass;
+		smp_store_release(&qtfs_ioctl_pass_nr, qtfs_ioctl_pass_nr + 1);
+	}
+	mutex_unlock(&qtfs_ioctl_pass_mutex);
+	if (ret == 0)
+		qtfs_info("qtfs ioctl pass cmd:0x%x dir:%u size:%u added.", pass->cmd, pass->dir, pass->size);
+	else
+		qtfs_err("qtfs ioctl pass cmd:0x%x add failed, ret:%d.", pass->cmd, ret);
+	return ret;
+}
+
+static struct dentry *qtfs_debugfs_dir = NULL;
+
+static void qtfs_debugfs_lat(struct seq_file *m, const char *name, unsigned long *lat)
+{
+	int b;
+
+	seq_printf(m, "%s(us, log2):", name);
+	for (b = 0; b < QTINFO_LAT_BUCKETS; b++) {
+		if (lat[b] != 0)
+			seq_printf(m, " <%lu:%lu", 1UL << b, lat[b]);
+	}
+	seq_puts(m, "\n");
+}
+
+// same as the pool part of qtinfo -a, readable without the tool
+static int qtfs_debugfs_pool_show(struct seq_file *m, void *v)
+{
+	struct qtinfo_pool *pool;
+	int i;
+
+	if (qtfs_diag_info == NULL)
+		return -ENODEV;
+	qtfs_conn_list_cnt();
+	pool = &qtfs_diag_info->pool;
+	seq_printf(m, "max: %d valid: %d busy: %d busy_max: %d takes: %lu saturated: %lu\n",
+			qtfs_sock_max_conn, qtfs_diag_info->pvar_vld, qtfs_diag_info->pvar_busy,
+			pool->busy_max, pool->takes, pool->saturated);
+	qtfs_debugfs_lat(m, "wait", pool->wait_lat);
+	qtfs_debugfs_lat(m, "hold", pool->hold_lat);
+	for (i = 0; i < QTINFO_MAX_HOLDERS; i++) {
+		if (pool->holders[i].func[0] == '\0' || pool->holders[i].count == 0)
+			continue;
+		seq_printf(m, "caller %s count: %lu avg_us: %lu max_us: %lu\n", pool->holders[i].func,
+				pool->holders[i].count, pool->holders[i].total_us / pool->holders[i].count,
+				pool->holders[i].max_us);
+	}
+	for (i = 0; i < QTFS_MAX_THREADS && pool->hold_idx[i] >= 0; i++)
+		seq_printf(m, "conn%d held by %s for %luus\n", pool->hold_idx[i] + 1,
+				qtfs_diag_info->who_using[i], pool->hold_us[i]);
+	if (pool->hold_more > 0)
+		seq_printf(m, "%d more held for less, not shown\n", pool->hold_more);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(qtfs_debugfs_pool);
+
 int qtfs_misc_register(void)
 {
 	int ret = misc_register(&qtfs_misc_dev);
@@ -33,11 +147,18 @@ int qtfs_misc_register(void)
 		qtfs_err("qtfs misc register failed, ret:%d.", ret);
 		return -EFAULT;
 	}
+	qtfs_ioctl_pass_init();
+	// debugfs is optional, qtinfo works without it
+	qtfs_debugfs_dir = debugfs_create_dir(qtfs_misc_dev.name, NULL);
+	if (!IS_ERR_OR_NULL(qtfs_debugfs_dir))
+		debugfs_create_file("pool", 0400, qtfs_debugfs_dir, NULL, &qtfs_debugfs_pool_fops);
 	return 0;
 }
 
 void qtfs_misc_destroy(void)
 {
+	debugfs_remove_recursive(qtfs_debugfs_dir);
+	qtfs_debugfs_dir = NULL;
 	misc_deregister(&qtfs_misc_dev);
 	return;
 }
@@ -45,13 +166,8 @@ void qtfs_misc_destroy(void)
 void qtfs_misc_flush_threadstate(void)
 {
 	int i;
-	for (i = 0; i < QTFS_MAX_THREADS; i++) {
-		if (qtfs_thread_var[i] == NULL) {
-			qtfs_diag_info->thread_state[i] = -1;
-			continue;
-		}
-		qtfs_diag_info->thread_state[i] = qtfs_thread_var[i]->state;
-	}
+	for (i = 0; i < QTFS_MAX_THREADS; i++)
+		qtfs_diag_info->thread_state[i] = qtfs_conn_state(i);
 	qtfs_diag_info->epoll_state = (qtfs_epoll_var == NULL) ? -1 : qtfs_epoll_var->state;
 }
 
@@ -137,6 +253,8 @@ long qtfs_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			}
 			break;
 		case QTFS_IOCTL_CLEARALL:
+			// pending counts go with the rest
+			qtfs_conn_stat_fold();
 			qtinfo_clear();
 			break;
 		case QTFS_IOCTL_LOGLEVEL:
@@ -260,6 +378,17 @@ long qtfs_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			__putname(name);
 			break;
 		}
+		case QTFS_IOCTL_PASS_ADD:
+		{
+			struct qtfs_ioctl_pass pass;
+			if (copy_from_user(&pass, (void *)arg, sizeof(pass))) {
+				qtfs_err("ioctl pass add copy from user failed.");
+				goto err_end;
+			}
+			if (qtfs_ioctl_pass_add(&pass) != 0)
+				goto err_end;
+			break;
+		}
 	}
 	return ret;
 err_end:
@@ -103,6 +103,9 @@ int qtfs_kallsyms_hack_init(void)
 	KSYMS(__close_fd, int (*)(struct files_struct *, int));
 	KSYMS_NULL_RETURN(qtfs_kern_syms.__close_fd);
 #endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
+	KSYMS(do_epoll_ctl, int (*)(int, int, int, struct epoll_event *, bool));
+#endif
 
 #ifdef __aarch64__
 	update_mapping_prot = (void *)kallsyms_lookup_name("update_mapping_prot");
@@ -226,6 +229,8 @@ WRAPPER_DEFINE(4, long, qtfs_syscall_mknodat(int x1, const char __user *x2, umod
 WRAPPER_DEFINE(3, off_t, qtfs_syscall_lseek(unsigned int x1, off_t x2, 
 			unsigned int x3), __NR_lseek);
 WRAPPER_DEFINE(2, long, qtfs_syscall_kill(pid_t x1, int x2), __NR_kill);
+WRAPPER_DEFINE(3, long, qtfs_syscall_ioctl(unsigned int x1, unsigned int x2,
+			unsigned long x3), __NR_ioctl);
 WRAPPER_DEFINE(3, long, qtfs_syscall_sched_getaffinity(pid_t x1, unsigned int x2, 
 			unsigned long __user *x3), __NR_sched_getaffinity);
 WRAPPER_DEFINE(3, long, qtfs_syscall_sched_setaffinity(pid_t x1, unsigned int x2, 
@@ -15,6 +15,8 @@
 #include <malloc.h>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 
 #include "comm.h"
 #include "ipc/uds_main.h"
@@ -46,8 +48,9 @@ struct engine_arg {
 	int thread_idx;
 };
 
-#define QTFS_USERP_MAXSIZE 65536
-#define QTFS_USERP_SIZE 4096
+#define QTFS_USERP_MAXSIZE (1024 * 1024)
+// big enough to take a whole write payload received by kernel in place
+#define QTFS_USERP_SIZE QTFS_USERP_MAXSIZE
 #define QTFS_SERVER_FILE "/dev/qtfs_server"
 
 int qtfs_fd;
@@ -102,7 +105,8 @@ static void *qtfs_engine_kthread(void *arg)
 	long ret;
 
 	while (engine_run) {
-		ret = ioctl(parg->fd, QTFS_IOCTL_THREAD_RUN, 0);
+		// thread idx selects this thread's userp and request buffers in kernel
+		ret = ioctl(parg->fd, QTFS_IOCTL_THREAD_RUN, parg->thread_idx);
 		if (ret == QTEXIT) {
 			engine_out("qtfs server thread:%d exit.", parg->thread_idx);
 			break;
@@ -173,8 +177,20 @@ int qtfs_epoll_init(int fd)
 		close(epfd);
 		return -1;
 	}
-	engine_out("qtfs engine set epoll arg, fd:%d event nums:%d events:%lx.", epfd, MAX_EVENTS, evts);
+	// edge triggered and never read: every kick from the kernel is a new edge
+	// that breaks epoll_wait, data 0 tells it apart from client files
+	int wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakefd >= 0) {
+		struct epoll_event wev = {.events = EPOLLIN | EPOLLET, .data.u64 = 0};
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &wev) < 0) {
+			engine_err("add wake eventfd to epoll failed, errno:%d.", errno);
+			close(wakefd);
+			wakefd = -1;
+		}
+	}
+	engine_out("qtfs engine set epoll arg, fd:%d event nums:%d events:%lx wakefd:%d.", epfd, MAX_EVENTS, evts, wakefd);
 	ep.epfd = epfd;
+	ep.wakefd = wakefd;
 	ep.event_nums = MAX_EVENTS;
 	ep.events = evts;
 	int ret = ioctl(fd, QTFS_IOCTL_EPFDSET, &ep);
@@ -18,6 +18,7 @@
 #include <linux/uio.h>
 #include <linux/blkdev.h>
 #include <linux/version.h>
+#include <linux/ktime.h>
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
 #include <linux/fdtable.h>
 #endif
@@ -29,27 +30,12 @@
 #include "fsops.h"
 #include "comm.h"
 #include "symbol_wrapper.h"
+#include "qtfs_trace.h"
 
 #define REQ(arg) (arg->data)
 #define RSP(arg) (arg->out)
 #define USERP(arg) (arg->userp)
 
-bool in_white_list(char *path, int type)
-{
-	int i, in_wl = -1;
-
-	if (!whitelist[type]) {
-		return true;
-	}
-	for (i = 0; i < whitelist[type]->len; i++) {
-		if (!strncmp(path, whitelist[type]->wl[i].path, whitelist[type]->wl[i].len)){
-			in_wl = i;
-			break;
-		}
-	}
-	return in_wl != -1;
-}
-
 static inline void qtfs_inode_info_fill(struct inode_info *ii, struct inode *inode)
 {
 	ii->mode = inode->i_mode;
@@ -74,115 +60,56 @@ static inline void qtfs_inode_info_fill(struct inode_info *ii, struct inode *ino
 	return;
 }
 
+// only commands in the passthrough table run, on the fd the client opened
 static int handle_ioctl(struct qtserver_arg *arg)
 {
-	int ret;
-	int iret;
-	struct file *file;
 	struct qtreq_ioctl *req = (struct qtreq_ioctl *)REQ(arg);
 	struct qtrsp_ioctl *rsp = (struct qtrsp_ioctl *)RSP(arg);
 	struct qtfs_server_userp_s *userp = (struct qtfs_server_userp_s *)USERP(arg);
-	file = filp_open(req->path, O_RDONLY, 0);
-	if (err_ptr(file)) {
-		qtfs_err("handle ioctl error, path:<%s> failed.\n", req->path);
-		rsp->ret = QTFS_ERR;
-		rsp->size = 0;
-		rsp->errno = -ENOENT;
-		return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf);
-	}
+	struct qtfs_ioctl_pass pass;
+	unsigned long uarg;
+	long iret;
 
-	switch (req->d.cmd) {
-	case FS_IOC_FSGETXATTR:
-		iret = file->f_op->unlocked_ioctl(file, req->d.cmd, (unsigned long)userp->userp);
-		if (iret) {
-			qtfs_err("fsgetxattr ioctl failed with %d\n", iret);
-			rsp->errno = iret;
-			goto err;
-		}
-		ret = copy_from_user(rsp->buf, userp->userp, sizeof(struct fsxattr));
-		if (ret) {
-			qtfs_err("fsgetxattr copy_from_user failed with %d\n", ret);
-			rsp->errno = ret;
-			goto err;
-		}
-		rsp->ret = QTFS_OK;
-		rsp->errno = iret;
-		rsp->size = sizeof(struct fsxattr);
-		filp_close(file, NULL);
-		return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf) + sizeof(struct fsxattr);
-	case FS_IOC_FSSETXATTR:
-		if (req->d.size <= 0) {
-			rsp->errno = -EINVAL;
-			goto err;
-		}
-		ret = copy_to_user(userp->userp, req->path+req->d.offset, req->d.size);
-		if (ret) {
-			qtfs_err("fssetxattr copy_to_user failed with %d\n", ret);
-			rsp->errno = ret;
-			goto err;
-		}
-		iret = file->f_op->unlocked_ioctl(file, req->d.cmd, (unsigned long)userp->userp);
-		if (iret) {
-			qtfs_err("fssetxattr ioctl failed with %d\n", iret);
-			rsp->errno = iret;
-			goto err;
-		}
-		rsp->ret = QTFS_OK;
-		rsp->errno = iret;
-		rsp->size = 0;
-		filp_close(file, NULL);
-		return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf);
-	case TCGETS:
-		iret = file->f_op->unlocked_ioctl(file, req->d.cmd, (unsigned long)userp->userp);
-		if (iret) {
-			qtfs_err("ioctl TCGETS failed with %d\n", iret);
-			rsp->errno = iret;
-			goto err;
-		}
-		qtfs_info("ioctl TCGETS ret:%d", iret);
-		
-		ret = copy_from_user(rsp->buf, userp->userp, sizeof(struct ktermios));
-		if (ret) {
-			qtfs_err("fsgetxattr copy_from_user failed with %d\n", ret);
-			rsp->errno = ret;
-			goto err;
-		}
-		rsp->ret = QTFS_OK;
-		rsp->errno = iret;
-		rsp->size = sizeof(struct ktermios);
-		filp_close(file, NULL);
-		return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf) + sizeof(struct ktermios);
-	case TCSETS:
-		if (req->d.size <= 0) {
-			rsp->errno = -EINVAL;
-			goto err;
-		}
-		ret = copy_to_user(userp->userp, req->path+req->d.offset, req->d.size);
-		if (ret) {
-			qtfs_err("tcsets copy_to_user failed with %d\n", ret);
-			rsp->errno = ret;
+	rsp->size = 0;
+	if (!qtfs_ioctl_pass_find(req->d.cmd, &pass)) {
+		qtfs_err("handle ioctl cmd:0x%x fd:%d not in passthrough table.", req->d.cmd, req->d.fd);
+		iret = -ENOTTY;
+		goto err;
+	}
+	if (pass.size > userp->size || pass.size > sizeof(rsp->buf) ||
+			((pass.dir & _IOC_WRITE) && req->d.size != pass.size)) {
+		qtfs_err("handle ioctl cmd:0x%x size:%u invalid, req size:%u.", pass.cmd, pass.size, req->d.size);
+		iret = -EINVAL;
+		goto err;
+	}
+	if (pass.dir == _IOC_NONE) {
+		uarg = req->d.arg;
+	} else {
+		uarg = (unsigned long)userp->userp;
+		if ((pass.dir & _IOC_WRITE) && copy_to_user(userp->userp, req->buf, pass.size)) {
+			iret = -EFAULT;
 			goto err;
 		}
-		qtfs_err("tcsets size:%u sizeof ktermios:%lu", req->d.size, sizeof(struct ktermios));
-		iret = file->f_op->unlocked_ioctl(file, req->d.cmd, (unsigned long)userp->userp);
-		if (iret) {
-			qtfs_err("tcsets ioctl failed with %d\n", iret);
-			rsp->errno = iret;
+	}
+	iret = qtfs_syscall_ioctl(req->d.fd, req->d.cmd, uarg);
+	if (iret < 0)
+		goto err;
+	if ((pass.dir & _IOC_READ) && pass.size > 0) {
+		if (copy_from_user(rsp->buf, userp->userp, pass.size)) {
+			iret = -EFAULT;
 			goto err;
 		}
-		rsp->ret = QTFS_OK;
-		rsp->errno = iret;
-		rsp->size = 0;
-		filp_close(file, NULL);
-		return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf);
-	default:
-		rsp->errno = -EOPNOTSUPP;
-		goto err;
+		rsp->size = pass.size;
 	}
+	rsp->ret = QTFS_OK;
+	rsp->errno = iret;
+	qtfs_dp_info("handle ioctl cmd:0x%x fd:%d ret:%ld rsp size:%u.", req->d.cmd, req->d.fd, iret, rsp->size);
+	return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf) + rsp->size;
+
 err:
 	rsp->ret = QTFS_ERR;
+	rsp->errno = iret;
 	rsp->size = 0;
-	filp_close(file, NULL);
 	return sizeof(struct qtrsp_ioctl) - sizeof(rsp->buf);
 }
 
@@ -215,16 +142,37 @@ static int handle_statfs(struct qtserver_arg *arg)
 	return sizeof(struct qtrsp_statfs);
 }
 
+// set by a mount from a client that fills qtreq_readdir.fd
+static bool qtfs_readdir_byfd = false;
+
 static int handle_mount(struct qtserver_arg *arg)
 {
 	struct path path;
 	int ret;
 	struct qtreq_mount *req = (struct qtreq_mount *)REQ(arg);
 	struct qtrsp_mount *rsp = (struct qtrsp_mount *)RSP(arg);
-	if (!in_white_list(req->path, QTFS_WHITELIST_MOUNT)) {
+
+	// an old client sends path only and knows ret only
+	if (arg->inlen < sizeof(struct qtreq_mount)) {
+		qtfs_err("handle mount refused, client of an old protocol, ours:%u.\n", QTFS_PROTO_VERSION);
 		rsp->ret = QTFS_ERR;
 		return sizeof(rsp->ret);
 	}
+	rsp->version = QTFS_PROTO_VERSION;
+	rsp->data_len = 0;
+	if (req->version != QTFS_PROTO_VERSION) {
+		qtfs_err("handle mount refused, client protocol version:%u ours:%u.\n", req->version, QTFS_PROTO_VERSION);
+		rsp->ret = QTFS_ERR;
+		return sizeof(struct qtrsp_mount);
+	}
+	if (!in_white_list(req->path, QTFS_WHITELIST_MOUNT)) {
+		rsp->ret = QTFS_ERR;
+		return sizeof(struct qtrsp_mount);
+	}
+	// data message size: the smaller one of client wanted and we support
+	rsp->data_len = (req->data_len < qtfs_data_msg_len) ? req->data_len : qtfs_data_msg_len;
+	if (rsp->data_len < QTFS_REQ_MAX_LEN)
+		rsp->data_len = QTFS_REQ_MAX_LEN;
 
 	ret = kern_path(req->path, LOOKUP_DIRECTORY, &path);
 	if (ret) {
@@ -233,9 +181,16 @@ static int handle_mount(struct qtserver_arg *arg)
 	} else {
 		rsp->ret = QTFS_OK;
 		qtfs_info("handle mount path:%s success.\n", req->path);
+		if (req->caps & QTFS_MNT_CAP_INVALIDATE)
+			qtfs_inval_enabled = true;
+		if (req->caps & QTFS_MNT_CAP_EPOLL_STREAM)
+			qtfs_epoll_stream = true;
+		if (req->caps & QTFS_MNT_CAP_READDIR_FD)
+			WRITE_ONCE(qtfs_readdir_byfd, true);
+		qtfs_inval_watch(path.dentry->d_inode);
 		path_put(&path);
 	}
-	return sizeof(rsp->ret);
+	return sizeof(struct qtrsp_mount);
 }
 
 int handle_open(struct qtserver_arg *arg)
@@ -269,7 +224,7 @@ int handle_open(struct qtserver_arg *arg)
 		if (fd != -ENOENT) {
 			qtfs_err("handle open file <<%s>>flags:%llx mode:%o, opened:failed %d\n", req->path, req->flags, req->mode, fd);
 		} else {
-			qtfs_info("handle open file <<%s>>flags:%llx mode:%o, opened:failed - file not exist\n", req->path, req->flags, req->mode);
+			qtfs_dp_info("handle open file <<%s>>flags:%llx mode:%o, opened:failed - file not exist\n", req->path, req->flags, req->mode);
 		}
 		rsp->ret = QTFS_ERR;
 		rsp->fd = fd;
@@ -293,26 +248,59 @@ int handle_close(struct qtserver_arg *arg)
 		rsp->ret = QTFS_ERR;
 		return sizeof(struct qtrsp_close);
 	}
+	do {
+		struct file *file = fget(req->fd);
+
+		if (file != NULL) {
+			qtfs_poll_unwatch(file);
+			fput(file);
+		}
+		qtfs_wl_fd_drop(req->fd);
+	} while (0);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0))
 	rsp->ret = qtfs_kern_syms.__close_fd(current->files, req->fd);
 #else
 	rsp->ret = close_fd(req->fd);
 #endif
-	qtfs_info("handle close file, fd:%d ret:%d", req->fd, rsp->ret);
+	qtfs_dp_info("handle close file, fd:%d ret:%d", req->fd, rsp->ret);
 	return sizeof(struct qtrsp_close);
 }
 
+// read into the response buffer or write from the request buffer with a
+// kvec iter, so the data doesn't bounce through the engine's userp buffer
+static ssize_t qtfs_server_rw_kvec(struct file *file, int rw, char *buf, size_t len, loff_t *pos)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct kiocb kiocb;
+	struct iov_iter iter;
+	ssize_t ret;
+
+#ifdef KVER_4_19
+	iov_iter_kvec(&iter, rw | ITER_KVEC, &kv, 1, len);
+#else
+	iov_iter_kvec(&iter, rw, &kv, 1, len);
+#endif
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_pos = *pos;
+	ret = (rw == READ) ? call_read_iter(file, &kiocb, &iter) : call_write_iter(file, &kiocb, &iter);
+	if (ret > 0)
+		*pos = kiocb.ki_pos;
+	return ret;
+}
+
 static int handle_readiter(struct qtserver_arg *arg)
 {
 	struct file *file = NULL;
-    char *pathbuf, *fullname;
 	int idx = 0;
 	int ret = 0;
 	int block_size;
 	size_t maxlen;
+	bool to_rsp;
 	struct qtreq_readiter *req = (struct qtreq_readiter *)REQ(arg);
 	struct qtrsp_readiter *rsp = (struct qtrsp_readiter *)RSP(arg);
 	struct qtfs_server_userp_s *userp = (struct qtfs_server_userp_s *)USERP(arg);
+	// readbuf extends to the end of the data message buffer
+	size_t bufsize = arg->outlen - sizeof(rsp->d);
 	file = fget(req->fd);
 	if (file->f_flags & O_DIRECT) {
 		if (file->f_inode->i_sb->s_bdev != NULL && file->f_inode->i_sb->s_bdev->bd_disk != NULL 
@@ -328,22 +316,17 @@ static int handle_readiter(struct qtserver_arg *arg)
 			rsp->d.len = -EINVAL;
 			return sizeof(struct qtrsp_readiter) - sizeof(rsp->readbuf);
 		}
-		maxlen = (req->len >= sizeof(rsp->readbuf)) ? (block_size * (sizeof(rsp->readbuf) /block_size)) : req->len;
+		maxlen = (req->len >= bufsize) ? (block_size * (bufsize / block_size)) : req->len;
 	} else {
-		maxlen = (req->len >= sizeof(rsp->readbuf)) ? (sizeof(rsp->readbuf) - 1) : req->len;
+		maxlen = (req->len >= bufsize) ? (bufsize - 1) : req->len;
 	}
 
-	pathbuf = __getname();
-    fullname = file_path(file, pathbuf, PATH_MAX);
-	if (!in_white_list(fullname, QTFS_WHITELIST_READ)) {
-		qtfs_err("%s not in whitelist.\n", fullname);
-		__putname(pathbuf);
+	if (!qtfs_wl_file_allowed(req->fd, file, QTFS_WHITELIST_READ)) {
 		rsp->d.ret = QTFS_ERR;
 		rsp->d.len = 0;
 		rsp->d.errno = -ENOENT;
 		goto end;
 	}
-	__putname(pathbuf);
 	if (err_ptr(file)) {
 		qtfs_err("handle readiter error, open failed, file:%p.\n", file);
 		rsp->d.ret = QTFS_ERR;
@@ -351,12 +334,20 @@ static int handle_readiter(struct qtserver_arg *arg)
 		rsp->d.errno = -ENOENT;
 		goto end;
 	}
+	// O_DIRECT wants user pages and some files only have ->read, those
+	// still go through userp
+	to_rsp = (file->f_flags & O_DIRECT) == 0 && file->f_op->read_iter != NULL;
 	do {
+		int readsize;
 
-		int readsize = (userp->size < (maxlen - idx)) ? userp->size : (maxlen - idx);
-		if (file->f_op->read) {
-			ret = file->f_op->read(file, userp->userp, readsize, &req->pos);
+		if (to_rsp) {
+			readsize = maxlen - idx;
+			ret = qtfs_server_rw_kvec(file, READ, &rsp->readbuf[idx], readsize, &req->pos);
 		} else {
+			readsize = (userp->size < (maxlen - idx)) ? userp->size : (maxlen - idx);
+			if (file->f_op->read) {
+				ret = file->f_op->read(file, userp->userp, readsize, &req->pos);
+			} else {
 				struct kiocb kiocb;
 				struct iov_iter iter;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
@@ -369,13 +360,14 @@ static int handle_readiter(struct qtserver_arg *arg)
 				kiocb.ki_pos = req->pos;
 				ret = call_read_iter(file, &kiocb, &iter);
 				req->pos = kiocb.ki_pos;
+			}
+			if (ret > 0 && copy_from_user(&rsp->readbuf[idx], userp->userp, ret)) {
+				qtfs_err("readiter copy from user failed.");
+				break;
+			}
 		}
 		if (ret <= 0)
 			break;
-		if (copy_from_user(&rsp->readbuf[idx], userp->userp, ret)) {
-			qtfs_err("readiter copy from user failed.");
-			break;
-		}
 		rsp->d.len += ret;
 		idx += ret;
 		if (ret < readsize) {
@@ -395,7 +387,7 @@ static int handle_readiter(struct qtserver_arg *arg)
 		rsp->d.ret = QTFS_OK;
 	}
 
-	qtfs_info("handle readiter file:<%s>, len:%lu, rsplen:%ld, pos:%lld, ret:%d errno:%d.\n",
+	qtfs_dp_info("handle readiter file:<%s>, len:%lu, rsplen:%ld, pos:%lld, ret:%d errno:%d.\n",
 			file->f_path.dentry->d_iname, req->len, rsp->d.len, req->pos, rsp->d.ret, rsp->d.errno);
 end:
 	fput(file);
@@ -405,7 +397,6 @@ end:
 static int handle_write(struct qtserver_arg *arg)
 {
 	struct file *file = NULL;
-    char *pathbuf, *fullname;
 	int block_size;
 	struct qtreq_write *req = (struct qtreq_write *)REQ(arg);
 	struct qtrsp_write *rsp = (struct qtrsp_write *)RSP(arg);
@@ -431,15 +422,11 @@ static int handle_write(struct qtserver_arg *arg)
 	} else {
 		leftlen = req->d.buflen;
 	}
-	pathbuf = __getname();
-	fullname = file_path(file, pathbuf, PATH_MAX);
-	if (!in_white_list(fullname, QTFS_WHITELIST_WRITE)) {
-		__putname(pathbuf);
+	if (!qtfs_wl_file_allowed(req->d.fd, file, QTFS_WHITELIST_WRITE)) {
 		rsp->ret = QTFS_ERR;
 		rsp->len = 0;
 		goto end;
 	}
-	__putname(pathbuf);
 	if (err_ptr(file)) {
 		qtfs_err("qtfs handle write error, filp:<%p> open failed.\n", file);
 		rsp->ret = QTFS_ERR;
@@ -450,23 +437,49 @@ static int handle_write(struct qtserver_arg *arg)
 	file->f_mode = req->d.mode;
 	file->f_flags = req->d.flags;
 	rsp->len = 0;
+	if (arg->bulk_len != 0 && leftlen > arg->bulk_len)
+		leftlen = arg->bulk_len;
 	file_start_write(file);
+	// inline payload is written from the request buffer as it is, a short
+	// write goes on with the rest like the user buffer loop below
+	if (arg->bulk_len == 0 && (file->f_flags & O_DIRECT) == 0 && file->f_op->write_iter != NULL) {
+		while (leftlen > 0) {
+			ret = qtfs_server_rw_kvec(file, WRITE, &req->path_buf[idx], leftlen, &req->d.pos);
+			if (ret < 0) {
+				rsp->len = ret;
+				break;
+			}
+			if (ret == 0)
+				break;
+			leftlen -= ret;
+			idx += ret;
+			rsp->len += ret;
+		}
+		leftlen = 0;
+	}
 	while (leftlen > 0) {
-		len = leftlen > userp->size ? userp->size : leftlen;
-		if (copy_to_user(userp->userp, &req->path_buf[idx], len)) {
-			qtfs_err("write copy to userp failed.\n");
-			rsp->len = -EFAULT;
-			break;
+		char __user *ubuf = userp->userp;
+		if (arg->bulk_len != 0) {
+			// payload was received right into userp, write it in place
+			ubuf += idx;
+			len = leftlen;
+		} else {
+			len = leftlen > userp->size ? userp->size : leftlen;
+			if (copy_to_user(userp->userp, &req->path_buf[idx], len)) {
+				qtfs_err("write copy to userp failed.\n");
+				rsp->len = -EFAULT;
+				break;
+			}
 		}
 		if (file->f_op->write) {
-			ret = file->f_op->write(file, userp->userp, len, &req->d.pos);
+			ret = file->f_op->write(file, ubuf, len, &req->d.pos);
 		} else {
 			struct kiocb kiocb;
 			struct iov_iter iter;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
-			iov_iter_ubuf(&iter, WRITE, userp->userp, len);
+			iov_iter_ubuf(&iter, WRITE, ubuf, len);
 #else
-			struct iovec iov = { .iov_base = (void __user *)userp->userp, .iov_len = len };
+			struct iovec iov = { .iov_base = ubuf, .iov_len = len };
 			iov_iter_init(&iter, WRITE, &iov, 1, len);
 #endif
 			init_sync_kiocb(&kiocb, file);
@@ -488,7 +501,7 @@ static int handle_write(struct qtserver_arg *arg)
 	}
 	file_end_write(file);
 	rsp->ret = (rsp->len <= 0) ? QTFS_ERR : QTFS_OK;
-	qtfs_info("handle write file<%s> %s, write len:%ld pos:%lld mode:%o flags:%x.", file->f_path.dentry->d_iname,
+	qtfs_dp_info("handle write file<%s> %s, write len:%ld pos:%lld mode:%o flags:%x.", file->f_path.dentry->d_iname,
 			(rsp->ret == QTFS_ERR) ? "failed" : "succeded", rsp->len, req->d.pos, file->f_mode, file->f_flags);
 end:
 	fput(file);
@@ -497,21 +510,36 @@ end:
 
 static int handle_lookup(struct qtserver_arg *arg)
 {
-	struct path path;
+	struct path path, parent;
 	struct inode *inode;
 	struct qtreq_lookup *req = (struct qtreq_lookup *)REQ(arg);
 	struct qtrsp_lookup *rsp = (struct qtrsp_lookup *)RSP(arg);
 	int ret;
-	ret = kern_path(req->fullname, 0, &path);
+
+	rsp->handle = 0;
+	if (req->parent != 0) {
+		// only the last component is walked
+		ret = qtfs_handle_path(req->parent, &parent);
+		if (ret == 0) {
+			ret = vfs_path_lookup(parent.dentry, parent.mnt, req->fullname, 0, &path);
+			path_put(&parent);
+		}
+	} else {
+		ret = kern_path(req->fullname, 0, &path);
+	}
 	if (ret) {
-		qtfs_info("qtfs handle lookup(%s) not exist, ret%d.\n", req->fullname, ret);
+		qtfs_dp_info("qtfs handle lookup(%s) parent:%llx not exist, ret%d.\n", req->fullname, req->parent, ret);
 		rsp->errno = (ret == -ENOENT ? 0 : ret);
 		rsp->ret = QTFS_ERR;
 	} else {
 		inode = path.dentry->d_inode;
 		rsp->ret = QTFS_OK;
 		qtfs_inode_info_fill(&rsp->inode_info, inode);
-		qtfs_debug("handle lookup name:%s, mode:%o ino:%lu", req->fullname, rsp->inode_info.mode, rsp->inode_info.i_ino);
+		rsp->handle = qtfs_handle_get(&path);
+		// client leases the name against its parent dir
+		qtfs_inval_watch(inode);
+		qtfs_inval_watch(path.dentry->d_parent->d_inode);
+		qtfs_dp_debug("handle lookup name:%s, mode:%o ino:%lu", req->fullname, rsp->inode_info.mode, rsp->inode_info.i_ino);
 		path_put(&path);
 	}
 	return sizeof(struct qtrsp_lookup);
@@ -556,6 +584,40 @@ static int qtfs_filldir(struct dir_context *ctx, const char *name, int namelen,
 #endif
 }
 
+// a dir opened by the client keeps its fd, so chunks continue on one file and
+// its readdir cursor (e.g. ext4 htree) instead of walking and opening per chunk
+static struct file *qtfs_readdir_file(struct qtreq_readdir *req, bool *byfd)
+{
+	struct file *file;
+
+	*byfd = false;
+	if (READ_ONCE(qtfs_readdir_byfd) && req->fd >= 0) {
+		file = fget(req->fd);
+		if (file && S_ISDIR(file_inode(file)->i_mode)) {
+			// seek only when it moved, so the fs keeps its cursor
+			if (file->f_pos == req->pos || vfs_llseek(file, req->pos, SEEK_SET) == req->pos) {
+				*byfd = true;
+				return file;
+			}
+		}
+		if (file)
+			fput(file);
+		qtfs_err("handle readdir fd:%d invalid, fallback to path:%s.", req->fd, req->path);
+	}
+	file = filp_open(req->path, O_RDONLY|O_NONBLOCK|O_DIRECTORY, 0);
+	if (!err_ptr(file))
+		file->f_pos = req->pos;
+	return file;
+}
+
+static void qtfs_readdir_file_put(struct file *file, bool byfd)
+{
+	if (byfd)
+		fput(file);
+	else
+		filp_close(file, NULL);
+}
+
 static int handle_readdir(struct qtserver_arg *arg)
 {
 	struct file *file = NULL;
@@ -570,32 +632,140 @@ static int handle_readdir(struct qtserver_arg *arg)
 		.dir = (struct qtfs_dirent64 *)rsp->dirent,
 		.vldcnt = 0,
 	};
+	bool byfd;
 	
 	if (!in_white_list(req->path, QTFS_WHITELIST_READDIR)) {
 		rsp->d.ret = QTFS_ERR;
 		rsp->d.vldcnt = 0;
 		return sizeof(struct qtrsp_readdir) - sizeof(rsp->dirent);
 	}
-	file = filp_open(req->path, O_RDONLY|O_NONBLOCK|O_DIRECTORY, 0);
+	file = qtfs_readdir_file(req, &byfd);
 	if (err_ptr(file)) {
 		qtfs_err("handle readdir error, filp:<%s> open failed.\n", req->path);
 		rsp->d.ret = QTFS_ERR;
 		rsp->d.vldcnt = 0;
 		return sizeof(struct qtrsp_readdir) - sizeof(rsp->dirent);
 	}
-	file->f_pos = req->pos;
 	ret = iterate_dir(file, &buf.ctx);
 	rsp->d.pos = file->f_pos;
 	rsp->d.ret = QTFS_OK;
 	rsp->d.vldcnt = buf.vldcnt;
 	rsp->d.over = (req->pos == rsp->d.pos) ? 1 : 0;
-	qtfs_info("handle readdir ret:%d, pos:%lld path:%s, valid count:%d, leftcount:%d validbyte:%lu\n",
-			ret, req->pos, req->path, buf.vldcnt, buf.count, sizeof(rsp->dirent) - buf.count);
-	filp_close(file, NULL);
+	qtfs_dp_info("handle readdir ret:%d, fd:%d pos:%lld path:%s, valid count:%d, leftcount:%d validbyte:%lu\n",
+			ret, req->fd, req->pos, req->path, buf.vldcnt, buf.count, sizeof(rsp->dirent) - buf.count);
+	qtfs_readdir_file_put(file, byfd);
 
 	return sizeof(struct qtrsp_readdir) - buf.count;
 }
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+static bool qtfs_filldirplus(struct dir_context *ctx, const char *name, int namelen,
+		loff_t offset, u64 ino, unsigned int d_type)
+#else
+static int qtfs_filldirplus(struct dir_context *ctx, const char *name, int namelen,
+		loff_t offset, u64 ino, unsigned int d_type)
+#endif
+{
+	struct qtfs_direntplus *dirent;
+	struct qtfs_getdents_plus *buf = container_of(ctx, struct qtfs_getdents_plus, ctx);
+	int reclen = ALIGN(offsetof(struct qtfs_direntplus, d_name) + namelen + 1, sizeof(u64));
+
+	if (reclen > buf->count)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+		return false;
+#else
+		return -EINVAL;
+#endif
+
+	dirent = buf->dir;
+	dirent->d_ino = ino;
+	dirent->d_pos = offset;
+	dirent->d_reclen = reclen;
+	dirent->d_type = d_type;
+	dirent->stat_ret = -ENOENT;
+	memcpy(dirent->d_name, name, namelen);
+	dirent->d_name[namelen] = '\0';
+
+	buf->dir = (void *)dirent + reclen;
+	buf->count -= reclen;
+	buf->vldcnt++;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+	return true;
+#else
+	return 0;
+#endif
+}
+
+static int handle_readdirplus(struct qtserver_arg *arg)
+{
+	struct file *file = NULL;
+	struct qtreq_readdir *req = (struct qtreq_readdir *)REQ(arg);
+	struct qtrsp_readdirplus *rsp = (struct qtrsp_readdirplus *)RSP(arg);
+	size_t bufsize = arg->outlen - sizeof(rsp->d);
+	struct qtfs_direntplus *dirent;
+	struct dentry *dentry;
+	struct path path;
+	int namelen;
+	int ret;
+	int i;
+	struct qtfs_getdents_plus buf = {
+		.ctx.actor = qtfs_filldirplus,
+		.ctx.pos = req->pos,
+		.count = (req->count > 0 && req->count < bufsize) ? req->count : bufsize,
+		.dir = (struct qtfs_direntplus *)rsp->dirent,
+		.vldcnt = 0,
+	};
+	int bufcount = buf.count;
+	bool byfd;
+
+	rsp->d.vldcnt = 0;
+	if (!in_white_list(req->path, QTFS_WHITELIST_READDIR)) {
+		rsp->d.ret = QTFS_ERR;
+		return sizeof(rsp->d);
+	}
+	file = qtfs_readdir_file(req, &byfd);
+	if (err_ptr(file)) {
+		qtfs_err("handle readdirplus error, filp:<%s> open failed.\n", req->path);
+		rsp->d.ret = QTFS_ERR;
+		return sizeof(rsp->d);
+	}
+	ret = iterate_dir(file, &buf.ctx);
+	rsp->d.pos = file->f_pos;
+	rsp->d.ret = QTFS_OK;
+	rsp->d.vldcnt = buf.vldcnt;
+	rsp->d.over = (req->pos == rsp->d.pos) ? 1 : 0;
+
+	// dir lock is dropped by now, stat the entries like handle_lookup would
+	dirent = (struct qtfs_direntplus *)rsp->dirent;
+	for (i = 0; i < buf.vldcnt; i++, dirent = (void *)dirent + dirent->d_reclen) {
+		namelen = strlen(dirent->d_name);
+		if (namelen <= 2 && dirent->d_name[0] == '.' && (namelen == 1 || dirent->d_name[1] == '.'))
+			continue;
+		dentry = lookup_one_len_unlocked(dirent->d_name, file->f_path.dentry, namelen);
+		if (IS_ERR(dentry)) {
+			dirent->stat_ret = PTR_ERR(dentry);
+			continue;
+		}
+		// kern_path on the client's next lookup would cross into the mount
+		if (d_really_is_negative(dentry) || d_mountpoint(dentry)) {
+			dput(dentry);
+			continue;
+		}
+		path.mnt = file->f_path.mnt;
+		path.dentry = dentry;
+		dirent->stat_ret = vfs_getattr(&path, &dirent->stat, STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT);
+		if (dirent->stat_ret == 0)
+			qtfs_inval_watch(d_inode(dentry));
+		dput(dentry);
+	}
+	qtfs_inval_watch(file_inode(file));
+	qtfs_dp_info("handle readdirplus ret:%d, fd:%d pos:%lld path:%s, valid count:%d, validbyte:%d\n",
+			ret, req->fd, req->pos, req->path, buf.vldcnt, bufcount - buf.count);
+	qtfs_readdir_file_put(file, byfd);
+
+	return sizeof(rsp->d) + bufcount - buf.count;
+}
+
 static int handle_mkdir(struct qtserver_arg *arg)
 {
 	struct qtreq_mkdir *req = (struct qtreq_mkdir *)REQ(arg);
@@ -672,8 +842,11 @@ static int handle_getattr(struct qtserver_arg *arg)
 	struct path path;
 	int ret;
 
-	qtfs_debug("handle getattr path:%s\n", req->path);
-	ret = kern_path(req->path, 0, &path);
+	qtfs_dp_debug("handle getattr path:%s handle:%llx\n", req->path, req->handle);
+	if (req->handle != 0)
+		ret = qtfs_handle_path(req->handle, &path);
+	else
+		ret = kern_path(req->path, 0, &path);
 	if (ret) {
 		rsp->errno = ret;
 		qtfs_err("handle getattr path:%s failed, ret:%d %s\n", req->path, ret, (ret != -ENOENT) ? "." : "file not exist");
@@ -688,8 +861,9 @@ static int handle_getattr(struct qtserver_arg *arg)
 		goto failed;
 	}
 	rsp->ret = QTFS_OK;
+	qtfs_inval_watch(path.dentry->d_inode);
 	path_put(&path);
-	qtfs_debug("handle getattr:<%s> blksize:%u size:%lld mode:%o ino:%llu req_mask:%x req_flags:%u.\n", req->path, rsp->stat.blksize,
+	qtfs_dp_debug("handle getattr:<%s> blksize:%u size:%lld mode:%o ino:%llu req_mask:%x req_flags:%u.\n", req->path, rsp->stat.blksize,
 			rsp->stat.size, rsp->stat.mode, rsp->stat.ino, req->request_mask, req->query_flags);
 	return sizeof(struct qtrsp_getattr);
 
@@ -1239,17 +1413,16 @@ int handle_fifopoll(struct qtserver_arg *arg)
 	struct pipe_inode_info *pipe;
 	struct inode *inode;
 	__poll_t mask;
-	struct poll_wqueues table;
-	poll_table *pt;
 
 	filp = fget(req->fd);
 	inode = filp->f_inode;
+	rsp->watched = 0;
 	if (!S_ISFIFO(inode->i_mode)) {
-		msleep(1);
-		poll_initwait(&table);
-		pt = &table.pt;
-		mask = vfs_poll(filp, pt);
-		poll_freewait(&table);
+		// no sleep before polling, later changes are pushed to the client
+		if (req->data == 0)
+			mask = vfs_poll(filp, NULL);
+		else if (qtfs_poll_watch(filp, req->data, &mask))
+			rsp->watched = 1;
 		goto end;
 	}
 	pipe = filp->private_data;
@@ -1277,7 +1450,7 @@ end:
 	rsp->mask = mask;
 	rsp->ret = QTFS_OK;
 
-	qtfs_info("handle fifo poll f_mode:%o: %s get poll mask 0x%x poll:%lx\n",
+	qtfs_dp_info("handle fifo poll f_mode:%o: %s get poll mask 0x%x poll:%lx\n",
 			filp->f_mode, filp->f_path.dentry->d_iname, rsp->mask, (unsigned long)filp->f_op->poll);
 	fput(filp);
 	return sizeof(struct qtrsp_poll);
@@ -1293,12 +1466,22 @@ int handle_epollctl(struct qtserver_arg *arg)
 
 	evt.data = (__u64)req->event.data;
 	evt.events = req->event.events;
-	if (copy_to_user(userp->userp, &evt, sizeof(struct epoll_event)) <= 0) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
+	// the event stays in kernel, no staging through userp
+	if (qtfs_kern_syms.do_epoll_ctl != NULL) {
+		ret = qtfs_kern_syms.do_epoll_ctl(qtfs_epoll.epfd, req->op, req->fd, &evt, false);
+		goto done;
+	}
+#endif
+	if (copy_to_user(userp->userp, &evt, sizeof(struct epoll_event))) {
 		qtfs_err("copy to user failed.");
 		rsp->ret = QTFS_ERR;
 		return sizeof(struct qtrsp_epollctl);
 	}
 	ret = qtfs_syscall_epoll_ctl(qtfs_epoll.epfd, req->op, req->fd, userp->userp);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
+done:
+#endif
 	if (ret < 0) {
 		qtfs_err("handle do epoll ctl failed, ret:%d.", ret);
 		rsp->ret = QTFS_ERR;
@@ -1306,7 +1489,7 @@ int handle_epollctl(struct qtserver_arg *arg)
 	}
 	qtinfo_cntinc((req->op == EPOLL_CTL_ADD) ? QTINF_EPOLL_ADDFDS : QTINF_EPOLL_DELFDS);
 	rsp->ret = QTFS_OK;
-	qtfs_info("handle do epoll ctl success, fd:%d op:%x data:%lx poll_t:%x.",
+	qtfs_dp_info("handle do epoll ctl success, fd:%d op:%x data:%lx poll_t:%x.",
 			req->fd, req->op, req->event.data, (unsigned)req->event.events);
 
 	return sizeof(struct qtrsp_epollctl);
@@ -1317,7 +1500,7 @@ int handle_llseek(struct qtserver_arg *arg)
 	struct qtreq_llseek *req = (struct qtreq_llseek *)REQ(arg);
 	struct qtrsp_llseek *rsp = (struct qtrsp_llseek *)RSP(arg);
 
-	qtfs_info("llseek get req fd:%d, off:%lld whence:%d.", req->fd, req->off, req->whence);
+	qtfs_dp_info("llseek get req fd:%d, off:%lld whence:%d.", req->fd, req->off, req->whence);
 	rsp->off = qtfs_syscall_lseek(req->fd, req->off, req->whence);
 	if (rsp->off < 0) {
 		qtfs_err("llseek ksys lseek return :%lld failed, req fd:%d off:%lld whence:%d.",
@@ -1454,72 +1637,119 @@ static struct qtserver_ops qtfs_server_handles[] = {
 	{QTFS_SC_SCHED_GETAFFINITY,	remotesc_sched_getaffinity,	"sched_getaffinity"},
 	{QTFS_SC_SCHED_SETAFFINITY, remotesc_sched_setaffinity, "sched_setaffinity"},
 
-	{QTFS_REQ_EXIT,			handle_exit,	"exit"}, // keep this handle at the end
+	{QTFS_REQ_EXIT,			handle_exit,	"exit"},
+
+	// types added later, after exit so the numbers above stay
+	{QTFS_REQ_INVALIDATE,	NULL,			"invalidate"},
+
+	{QTFS_REQ_READDIRPLUS,	handle_readdirplus,	"readdirplus"},
 };
 
-int qtfs_sock_server_run(struct qtfs_sock_var_s *pvar)
+// bytes of request kept in kernel buffer, the rest is bulk payload that can
+// be received straight to userp
+static size_t qtfs_server_inline_len(void *msg)
+{
+	struct qtreq *head = (struct qtreq *)msg;
+
+	if (head->type == QTFS_REQ_WRITE)
+		return sizeof(struct qtreq_write_len);
+	return head->len;
+}
+
+int qtfs_sock_server_recv(struct qtfs_sock_var_s *pvar, struct qtfs_server_worker_s *worker)
 {
 	int ret;
-	struct qtreq *req;
-	struct qtreq *rsp;
-	unsigned long totalproc = 0;
+	struct qtfs_server_userp_s *userp = &qtfs_userps[worker->idx];
+	struct qtreq *head;
+	void *tmp;
+
+	ret = qtfs_conn_recv_block_split(qtfs_conn_mode, pvar, qtfs_server_inline_len,
+				userp->userp, userp->size, &worker->bulk_len);
+	if (ret == -EPIPE) {
+		qtfs_err("qtfs server thread recv EPIPE, restart the connection.");
+		mutex_lock(&pvar->sendlock);
+		qtfs_sm_reconnect(pvar);
+		mutex_unlock(&pvar->sendlock);
+		return QTERROR;
+	}
+	if (ret <= 0)
+		return QTERROR;
+	// take the request away, pvar gets the worker's spare buffer back
+	tmp = pvar->vec_recv.iov_base;
+	pvar->vec_recv.iov_base = worker->req;
+	worker->req = tmp;
+	swap(pvar->vec_recv.iov_len, worker->req_size);
+	worker->conn_gen = pvar->conn_gen;
+	head = worker->req;
+	trace_qtfs_req_recv(pvar->cur_threadidx, head->type, head->seq_num, head->len, ret);
+	return QTOK;
+}
 
-	req = pvar->vec_recv.iov_base;
-	rsp = pvar->vec_send.iov_base;
-	do {
-		ret = qtfs_conn_recv_block(QTFS_CONN_SOCKET, pvar);
-		if (ret == -EPIPE) {
-			qtfs_err("qtfs server thread recv EPIPE, restart the connection.");
-			qtfs_sm_reconnect(pvar);
-			break;
-		}
-		if (ret < 0)
-			break;
-		pvar->recv_valid = ret + 1;
-		if (req->type >= QTFS_REQ_INV) {
-			qtfs_err("qtfs server recv unknown operate type:%d\n", req->type);
-			rsp->type = req->type;
-			rsp->len = 0;
-			rsp->err = QTFS_ERR;
-		} else {
-			struct qtserver_arg arg;
-			arg.data = req->data;
-			arg.out = rsp->data;
-			arg.userp = &qtfs_userps[pvar->cur_threadidx];
-			if (arg.userp->userp == NULL || arg.userp->userp2 == NULL)
-				qtfs_err("server run userp:%lx userp2:%lx", (unsigned long)arg.userp->userp, (unsigned long)arg.userp->userp2);
-			rsp->len = qtfs_server_handles[req->type].handle(&arg);
-			rsp->type = req->type;
-			rsp->err = QTFS_OK;
-			totalproc++;
-			qtinfo_recvinc(req->type);
-		}
-		if (rsp->len > QTFS_REQ_MAX_LEN) {
-			qtfs_crit("handle rsp len error type:%d len:%lu", rsp->type, rsp->len);
-			WARN_ON(1);
-			rsp->len = QTFS_REQ_MAX_LEN - 1;
-			rsp->err = QTFS_ERR;
-		}
-		rsp->seq_num = req->seq_num;
-		pvar->vec_send.iov_len = QTFS_MSG_LEN - QTFS_REQ_MAX_LEN + rsp->len;
-		pvar->send_valid = pvar->vec_send.iov_len + 1;
-		qtfs_debug("Server thread:%d count:%lu recv len:%d type:%d(%s) seq_num:%lu, reqlen:%lu, resp len:%lu, rsp threadidx:%d.\n",
-				pvar->cur_threadidx, totalproc, ret, req->type, qtfs_server_handles[req->type].str, req->seq_num,
-				req->len, pvar->vec_send.iov_len, pvar->cur_threadidx);
-		ret = qtfs_conn_send(QTFS_CONN_SOCKET, pvar);
-		if (ret == -EPIPE) {
-			qtfs_err("qtfs server send get EPIPE, just restart the connection\n");
-			qtfs_sm_reconnect(pvar);
-			break;
-		}
-		if (ret < 0) {
-			qtfs_err("conn send failed, ret:%d\n", ret);
-			WARN_ON(1);
-		}
+int qtfs_sock_server_handle(struct qtfs_sock_var_s *pvar, struct qtfs_server_worker_s *worker)
+{
+	int ret;
+	struct qtreq *req = worker->req;
+	struct qtreq *rsp = worker->rsp;
+	struct kvec vec;
+
+	// server push types have no handle
+	if (req->type >= QTFS_REQ_INV || qtfs_server_handles[req->type].handle == NULL) {
+		qtfs_err("qtfs server recv unknown operate type:%d\n", req->type);
+		rsp->type = req->type;
+		rsp->len = 0;
+		rsp->err = QTFS_ERR;
+	} else {
+		struct qtserver_arg arg;
+		u64 start;
+		arg.data = req->data;
+		arg.out = rsp->data;
+		arg.outlen = worker->rsp_max;
+		arg.userp = &qtfs_userps[worker->idx];
+		arg.bulk_len = worker->bulk_len;
+		arg.inlen = req->len;
+		if (arg.userp->userp == NULL || arg.userp->userp2 == NULL)
+			qtfs_err("server run userp:%lx userp2:%lx", (unsigned long)arg.userp->userp, (unsigned long)arg.userp->userp2);
+		trace_qtfs_handle_enter(worker->idx, req->type, req->seq_num);
+		start = ktime_get_ns();
+		rsp->len = qtfs_server_handles[req->type].handle(&arg);
+		start = ktime_get_ns() - start;
+		trace_qtfs_handle_exit(worker->idx, req->type, req->seq_num, rsp->len, start);
+		qtinfo_latadd(req->type, start);
+		rsp->type = req->type;
+		rsp->err = QTFS_OK;
+		qtinfo_recvinc(req->type);
+	}
+	if (rsp->len > worker->rsp_max) {
+		qtfs_crit("handle rsp len error type:%d len:%lu", rsp->type, rsp->len);
+		WARN_ON(1);
+		rsp->len = QTFS_REQ_MAX_LEN - 1;
+		rsp->err = QTFS_ERR;
+	}
+	rsp->seq_num = req->seq_num;
+	vec.iov_base = rsp;
+	vec.iov_len = QTFS_MSG_LEN - QTFS_REQ_MAX_LEN + rsp->len;
+	qtfs_dp_debug("Server worker:%d conn:%d type:%d(%s) seq_num:%lu, reqlen:%lu, resp len:%lu.\n",
+			worker->idx, pvar->cur_threadidx, req->type, qtfs_server_handles[req->type].str, req->seq_num,
+			req->len, vec.iov_len);
+
+	// responses of several workers share the connection, and it may have
+	// been rebuilt while we were handling, the client has given up then
+	mutex_lock(&pvar->sendlock);
+	if (pvar->conn_gen != worker->conn_gen)
+		ret = -ENOTCONN;
+	else
+		ret = qtfs_conn_sendv(qtfs_conn_mode, pvar, &vec, 1, vec.iov_len);
+	mutex_unlock(&pvar->sendlock);
+	trace_qtfs_req_send(pvar->cur_threadidx, rsp->type, rsp->seq_num, vec.iov_len, ret);
+	if (ret < 0) {
+		// the thread receiving on this connection will restart it
+		qtfs_err("conn send failed, ret:%d type:%u seq_num:%lu\n", ret, rsp->type, rsp->seq_num);
+	} else {
 		qtinfo_sendinc(rsp->type);
-	} while(0);
+	}
 
-	qtfs_sock_msg_clear(pvar);
+	// only what was sent has been written
+	memset(rsp, 0, min_t(size_t, vec.iov_len, QTFS_MSG_LEN));
 	return (ret < 0) ? QTERROR : QTOK;
 }
 
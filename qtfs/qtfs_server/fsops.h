@@ -11,4 +11,11 @@ struct qtfs_getdents {
 	int count;
 };
 
+struct qtfs_getdents_plus {
+	struct dir_context ctx;
+	int vldcnt;
+	struct qtfs_direntplus *dir;
+	int count;
+};
+
 #endif
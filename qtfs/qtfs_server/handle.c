@@ -0,0 +1,256 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/dcache.h>
+#include <linux/exportfs.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/list.h>
+#include <linux/mount.h>
+#include <linux/mutex.h>
+#include <linux/namei.h>
+#include <linux/path.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+
+#include "conn.h"
+#include "qtfs-server.h"
+#include "req.h"
+#include "log.h"
+#include "comm.h"
+
+// Opaque handles given to the client for looked up files, so it can ask
+// for a child by parent handle and name, or stat a file by its handle,
+// instead of sending a full path that is walked again from the root.
+// A handle is the file's exportfs file handle and the path of the mount
+// it was found on, nothing is pinned, so the host can still unmount it.
+// The table keeps the qtfs_handle_max most recently used ones, and the
+// client falls back to the full path when a handle was dropped or doesn't
+// resolve anymore (-ESTALE).
+#define QTFS_HANDLE_HASH_BITS 10
+#define QTFS_HANDLE_FH_WORDS 32 // MAX_HANDLE_SZ
+
+int qtfs_handle_max = 4096;
+
+struct qtfs_handle {
+	struct hlist_node hnode; // by id
+	struct hlist_node fnode; // by file handle
+	struct list_head lru;
+	u64 id;
+	u32 key;
+	// only compared, an unmounted sb makes the mount check fail
+	struct super_block *sb;
+	char *mnt_path; // root of the mount, walked to get a vfsmount again
+	int fh_type;
+	int fh_len; // in words
+	u32 fh[QTFS_HANDLE_FH_WORDS];
+};
+
+static DEFINE_MUTEX(qtfs_handle_mutex);
+static DEFINE_HASHTABLE(qtfs_handle_byid, QTFS_HANDLE_HASH_BITS);
+static DEFINE_HASHTABLE(qtfs_handle_byfh, QTFS_HANDLE_HASH_BITS);
+static LIST_HEAD(qtfs_handle_lru);
+static int qtfs_handle_nr = 0;
+// ids of an earlier module instance must not match, start from load time
+static u64 qtfs_handle_seq = 0;
+
+static struct qtfs_handle *qtfs_handle_find_fh(const struct qtfs_handle *key)
+{
+	struct qtfs_handle *h;
+
+	hash_for_each_possible(qtfs_handle_byfh, h, fnode, key->key) {
+		if (h->sb == key->sb && h->fh_type == key->fh_type && h->fh_len == key->fh_len &&
+				memcmp(h->fh, key->fh, key->fh_len * sizeof(u32)) == 0)
+			return h;
+	}
+	return NULL;
+}
+
+static struct qtfs_handle *qtfs_handle_find_id(u64 id)
+{
+	struct qtfs_handle *h;
+
+	hash_for_each_possible(qtfs_handle_byid, h, hnode, id) {
+		if (h->id == id)
+			return h;
+	}
+	return NULL;
+}
+
+static void qtfs_handle_unlink(struct qtfs_handle *h)
+{
+	hash_del(&h->hnode);
+	hash_del(&h->fnode);
+	list_del(&h->lru);
+	qtfs_handle_nr--;
+}
+
+static void qtfs_handle_free(struct qtfs_handle *h)
+{
+	kfree(h->mnt_path);
+	kfree(h);
+}
+
+// file handle and mount path of path to h, false if its fs can't export
+static bool qtfs_handle_encode(const struct path *path, struct qtfs_handle *h)
+{
+	const struct export_operations *eops = path->dentry->d_sb->s_export_op;
+	struct path root = { .mnt = path->mnt, .dentry = path->mnt->mnt_root };
+	char *buf;
+	char *p;
+
+	// without fh_to_dentry it encodes, but never decodes again
+	if (eops == NULL || eops->fh_to_dentry == NULL)
+		return false;
+	h->fh_len = QTFS_HANDLE_FH_WORDS;
+	h->fh_type = exportfs_encode_fh(path->dentry, (struct fid *)h->fh, &h->fh_len, 0);
+	if (h->fh_type <= 0 || h->fh_type == FILEID_INVALID || h->fh_len > QTFS_HANDLE_FH_WORDS)
+		return false;
+	h->sb = path->dentry->d_sb;
+	h->key = jhash(h->fh, h->fh_len * sizeof(u32), (u32)(unsigned long)h->sb);
+
+	buf = __getname();
+	if (buf == NULL)
+		return false;
+	p = d_path(&root, buf, PATH_MAX);
+	// a mount we can't walk to again, e.g. detached or of another root
+	if (IS_ERR(p) || p[0] != '/') {
+		__putname(buf);
+		return false;
+	}
+	h->mnt_path = kstrdup(p, GFP_KERNEL);
+	__putname(buf);
+	return h->mnt_path != NULL;
+}
+
+// handle of path, 0 if handles are disabled or it can't be kept
+u64 qtfs_handle_get(const struct path *path)
+{
+	struct qtfs_handle *h, *found, *old = NULL;
+	u64 id;
+
+	if (qtfs_handle_max <= 0)
+		return 0;
+	h = kzalloc(sizeof(struct qtfs_handle), GFP_KERNEL);
+	if (h == NULL)
+		return 0;
+	if (!qtfs_handle_encode(path, h)) {
+		qtfs_handle_free(h);
+		return 0;
+	}
+	mutex_lock(&qtfs_handle_mutex);
+	found = qtfs_handle_find_fh(h);
+	if (found != NULL) {
+		list_move_tail(&found->lru, &qtfs_handle_lru);
+		id = found->id;
+		mutex_unlock(&qtfs_handle_mutex);
+		qtfs_handle_free(h);
+		return id;
+	}
+	if (qtfs_handle_seq == 0)
+		qtfs_handle_seq = (u64)ktime_get_real_seconds() << 32;
+	h->id = ++qtfs_handle_seq;
+	hash_add(qtfs_handle_byid, &h->hnode, h->id);
+	hash_add(qtfs_handle_byfh, &h->fnode, h->key);
+	list_add_tail(&h->lru, &qtfs_handle_lru);
+	qtfs_handle_nr++;
+	if (qtfs_handle_nr > qtfs_handle_max) {
+		old = list_first_entry(&qtfs_handle_lru, struct qtfs_handle, lru);
+		qtfs_handle_unlink(old);
+	}
+	id = h->id;
+	mutex_unlock(&qtfs_handle_mutex);
+	if (old != NULL)
+		qtfs_handle_free(old);
+	return id;
+}
+
+static int qtfs_handle_acceptable(void *context, struct dentry *dentry)
+{
+	return 1;
+}
+
+// drop a handle that doesn't resolve anymore, the client goes by path then
+static void qtfs_handle_drop(u64 id)
+{
+	struct qtfs_handle *h;
+
+	mutex_lock(&qtfs_handle_mutex);
+	h = qtfs_handle_find_id(id);
+	if (h != NULL)
+		qtfs_handle_unlink(h);
+	mutex_unlock(&qtfs_handle_mutex);
+	if (h != NULL)
+		qtfs_handle_free(h);
+}
+
+// take a reference of the path of handle id, the file must still be linked
+int qtfs_handle_path(u64 id, struct path *path)
+{
+	struct qtfs_handle *h;
+	struct super_block *sb;
+	struct dentry *dentry;
+	struct path mnt;
+	u32 fh[QTFS_HANDLE_FH_WORDS];
+	int fh_type, fh_len;
+	char *mnt_path;
+	int ret;
+
+	mutex_lock(&qtfs_handle_mutex);
+	h = qtfs_handle_find_id(id);
+	if (h == NULL) {
+		mutex_unlock(&qtfs_handle_mutex);
+		return -ESTALE;
+	}
+	list_move_tail(&h->lru, &qtfs_handle_lru);
+	mnt_path = kstrdup(h->mnt_path, GFP_KERNEL);
+	sb = h->sb;
+	fh_type = h->fh_type;
+	fh_len = h->fh_len;
+	memcpy(fh, h->fh, fh_len * sizeof(u32));
+	mutex_unlock(&qtfs_handle_mutex);
+	if (mnt_path == NULL)
+		return -ENOMEM;
+
+	ret = kern_path(mnt_path, 0, &mnt);
+	kfree(mnt_path);
+	if (ret)
+		goto stale;
+	// something else is mounted there now, or the fs went away
+	if (mnt.mnt->mnt_sb != sb || mnt.dentry != mnt.mnt->mnt_root) {
+		path_put(&mnt);
+		goto stale;
+	}
+	dentry = exportfs_decode_fh(mnt.mnt, (struct fid *)fh, fh_len, fh_type,
+			qtfs_handle_acceptable, NULL);
+	if (IS_ERR_OR_NULL(dentry) || d_unhashed(dentry)) {
+		if (!IS_ERR_OR_NULL(dentry))
+			dput(dentry);
+		path_put(&mnt);
+		goto stale;
+	}
+	dput(mnt.dentry);
+	path->mnt = mnt.mnt;
+	path->dentry = dentry;
+	return 0;
+
+stale:
+	qtfs_handle_drop(id);
+	return -ESTALE;
+}
+
+void qtfs_handle_fini(void)
+{
+	struct qtfs_handle *h, *tmp;
+	LIST_HEAD(drop);
+
+	mutex_lock(&qtfs_handle_mutex);
+	list_for_each_entry_safe(h, tmp, &qtfs_handle_lru, lru) {
+		qtfs_handle_unlink(h);
+		list_add_tail(&h->lru, &drop);
+	}
+	mutex_unlock(&qtfs_handle_mutex);
+	list_for_each_entry_safe(h, tmp, &drop, lru)
+		qtfs_handle_free(h);
+}
@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/fs.h>
+#include <linux/fsnotify_backend.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+
+#include "conn.h"
+#include "qtfs-server.h"
+#include "req.h"
+#include "log.h"
+#include "comm.h"
+
+// Watch host inodes the client has looked up, and queue their ino for the
+// epoll thread to push as QTFS_REQ_INVALIDATE. Marks pin inodes, so only the
+// newest qtfs_inval_max_marks are kept; older ones fall back to the client's
+// cache timeouts.
+#define QTFS_INVAL_MASK (FS_MODIFY | FS_ATTRIB | FS_CREATE | FS_DELETE | FS_MOVED_FROM | \
+						FS_MOVED_TO | FS_DELETE_SELF | FS_MOVE_SELF)
+#define QTFS_INVAL_QUEUE_LEN 1024
+
+int qtfs_inval_max_marks = 8192;
+bool qtfs_inval_enabled = false;
+
+struct qtfs_inval_mark {
+	struct fsnotify_mark fsn;
+	struct list_head node;
+	unsigned long ino;
+};
+
+static struct fsnotify_group *qtfs_inval_group = NULL;
+static DEFINE_SPINLOCK(qtfs_inval_lock);
+static LIST_HEAD(qtfs_inval_marks);
+static int qtfs_inval_nmarks = 0;
+
+static struct qtreq_inval_entry qtfs_inval_queue[QTFS_INVAL_QUEUE_LEN];
+static int qtfs_inval_qlen = 0;
+static bool qtfs_inval_overflow = false;
+
+static void qtfs_inval_queue_add(struct fsnotify_mark *fsn, u32 mask)
+{
+	struct qtfs_inval_mark *mark = container_of(fsn, struct qtfs_inval_mark, fsn);
+	unsigned int flags = QTFS_INVAL_ATTR;
+	unsigned long irqflags;
+	bool kick;
+
+	if (mask & (FS_DELETE | FS_MOVED_FROM | FS_DELETE_SELF | FS_MOVE_SELF))
+		flags |= QTFS_INVAL_NAMES;
+	spin_lock_irqsave(&qtfs_inval_lock, irqflags);
+	// the epoll thread drains everything once woken, so only kick it on the first entry
+	kick = (qtfs_inval_qlen == 0 && !qtfs_inval_overflow);
+	// bursts on one inode collapse into the last queued entry
+	if (qtfs_inval_qlen > 0 && qtfs_inval_queue[qtfs_inval_qlen - 1].ino == mark->ino) {
+		qtfs_inval_queue[qtfs_inval_qlen - 1].flags |= flags;
+	} else if (qtfs_inval_qlen < QTFS_INVAL_QUEUE_LEN) {
+		qtfs_inval_queue[qtfs_inval_qlen].ino = mark->ino;
+		qtfs_inval_queue[qtfs_inval_qlen].flags = flags;
+		qtfs_inval_qlen++;
+	} else {
+		qtfs_inval_overflow = true;
+	}
+	spin_unlock_irqrestore(&qtfs_inval_lock, irqflags);
+	if (kick)
+		qtfs_server_epoll_wake();
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
+static int qtfs_inval_handle_event(struct fsnotify_mark *mark, u32 mask, struct inode *inode,
+		struct inode *dir, const struct qstr *name, u32 cookie)
+{
+	qtfs_inval_queue_add(mark, mask);
+	return 0;
+}
+#else
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+static int qtfs_inval_handle_event(struct fsnotify_group *group, u32 mask, const void *data,
+		int data_type, struct inode *dir, const struct qstr *name, u32 cookie,
+		struct fsnotify_iter_info *iter_info)
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+static int qtfs_inval_handle_event(struct fsnotify_group *group, struct inode *inode, u32 mask,
+		const void *data, int data_type, const struct qstr *name, u32 cookie,
+		struct fsnotify_iter_info *iter_info)
+#else
+static int qtfs_inval_handle_event(struct fsnotify_group *group, struct inode *inode, u32 mask,
+		const void *data, int data_type, const unsigned char *name, u32 cookie,
+		struct fsnotify_iter_info *iter_info)
+#endif
+{
+	struct fsnotify_mark *mark = fsnotify_iter_inode_mark(iter_info);
+
+	if (mark)
+		qtfs_inval_queue_add(mark, mask);
+	return 0;
+}
+#endif
+
+static void qtfs_inval_free_mark(struct fsnotify_mark *fsn)
+{
+	struct qtfs_inval_mark *mark = container_of(fsn, struct qtfs_inval_mark, fsn);
+
+	spin_lock_irq(&qtfs_inval_lock);
+	if (!list_empty(&mark->node)) {
+		list_del_init(&mark->node);
+		qtfs_inval_nmarks--;
+	}
+	spin_unlock_irq(&qtfs_inval_lock);
+	kfree(mark);
+}
+
+static const struct fsnotify_ops qtfs_inval_ops = {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
+	.handle_inode_event = qtfs_inval_handle_event,
+#else
+	.handle_event = qtfs_inval_handle_event,
+#endif
+	.free_mark = qtfs_inval_free_mark,
+};
+
+static void qtfs_inval_evict_oldest(void)
+{
+	struct qtfs_inval_mark *mark = NULL;
+
+	spin_lock_irq(&qtfs_inval_lock);
+	if (!list_empty(&qtfs_inval_marks)) {
+		mark = list_first_entry(&qtfs_inval_marks, struct qtfs_inval_mark, node);
+		list_del_init(&mark->node);
+		qtfs_inval_nmarks--;
+		// it may be going away because its inode was deleted
+		if (!refcount_inc_not_zero(&mark->fsn.refcnt))
+			mark = NULL;
+	}
+	spin_unlock_irq(&qtfs_inval_lock);
+	if (mark == NULL)
+		return;
+	fsnotify_destroy_mark(&mark->fsn, qtfs_inval_group);
+	fsnotify_put_mark(&mark->fsn);
+}
+
+void qtfs_inval_watch(struct inode *inode)
+{
+	struct fsnotify_mark *fsn;
+	struct qtfs_inval_mark *mark;
+
+	if (!qtfs_inval_enabled || qtfs_inval_group == NULL || qtfs_inval_max_marks <= 0 || inode == NULL)
+		return;
+	fsn = fsnotify_find_mark(&inode->i_fsnotify_marks, qtfs_inval_group);
+	if (fsn) {
+		fsnotify_put_mark(fsn);
+		return;
+	}
+	mark = kzalloc(sizeof(struct qtfs_inval_mark), GFP_KERNEL);
+	if (mark == NULL)
+		return;
+	fsnotify_init_mark(&mark->fsn, qtfs_inval_group);
+	INIT_LIST_HEAD(&mark->node);
+	mark->fsn.mask = QTFS_INVAL_MASK;
+	mark->ino = inode->i_ino;
+	if (fsnotify_add_inode_mark(&mark->fsn, inode, 0) != 0) {
+		// raced with another thread watching the same inode
+		fsnotify_put_mark(&mark->fsn);
+		return;
+	}
+	spin_lock_irq(&qtfs_inval_lock);
+	list_add_tail(&mark->node, &qtfs_inval_marks);
+	qtfs_inval_nmarks++;
+	spin_unlock_irq(&qtfs_inval_lock);
+	// the connector holds its own reference from now on
+	fsnotify_put_mark(&mark->fsn);
+
+	while (READ_ONCE(qtfs_inval_nmarks) > qtfs_inval_max_marks)
+		qtfs_inval_evict_oldest();
+}
+
+bool qtfs_inval_pending(void)
+{
+	return READ_ONCE(qtfs_inval_qlen) > 0 || READ_ONCE(qtfs_inval_overflow);
+}
+
+// move queued entries into req, return the message length
+int qtfs_inval_fill(struct qtreq_invalidate *req)
+{
+	int nums;
+
+	spin_lock_irq(&qtfs_inval_lock);
+	req->flags = qtfs_inval_overflow ? QTFS_INVAL_ALL : 0;
+	qtfs_inval_overflow = false;
+	nums = (qtfs_inval_qlen < QTFS_INVAL_MAX_NUMS) ? qtfs_inval_qlen : QTFS_INVAL_MAX_NUMS;
+	memcpy(req->entries, qtfs_inval_queue, nums * sizeof(struct qtreq_inval_entry));
+	qtfs_inval_qlen -= nums;
+	memmove(qtfs_inval_queue, &qtfs_inval_queue[nums], qtfs_inval_qlen * sizeof(struct qtreq_inval_entry));
+	spin_unlock_irq(&qtfs_inval_lock);
+	req->nums = nums;
+	return sizeof(struct qtreq_invalidate) - sizeof(req->entries) + nums * sizeof(struct qtreq_inval_entry);
+}
+
+int qtfs_inval_init(void)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0))
+	qtfs_inval_group = fsnotify_alloc_group(&qtfs_inval_ops, 0);
+#else
+	qtfs_inval_group = fsnotify_alloc_group(&qtfs_inval_ops);
+#endif
+	if (IS_ERR(qtfs_inval_group)) {
+		qtfs_err("qtfs invalidate fsnotify group alloc failed:%ld.", PTR_ERR(qtfs_inval_group));
+		qtfs_inval_group = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void qtfs_inval_fini(void)
+{
+	if (qtfs_inval_group == NULL)
+		return;
+	qtfs_inval_enabled = false;
+	while (READ_ONCE(qtfs_inval_nmarks) > 0)
+		qtfs_inval_evict_oldest();
+	// free_mark must have run for all of them before the module goes
+	fsnotify_wait_marks_destroyed();
+	fsnotify_put_group(qtfs_inval_group);
+	qtfs_inval_group = NULL;
+}
@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "conn.h"
+#include "qtfs-server.h"
+#include "req.h"
+#include "log.h"
+#include "comm.h"
+
+// Keep a wait queue entry on files the client polls, so a poll is answered
+// with the current mask right away and later wakeups are pushed to the
+// client on the epoll connection, as if the file was in the epoll set.
+#define QTFS_POLL_WAIT_MAX 4
+#define QTFS_POLL_HASH_BITS 8
+
+int qtfs_poll_max_watches = 4096;
+
+struct qtfs_poll_watch;
+struct qtfs_poll_wait {
+	struct qtfs_poll_watch *watch;
+	wait_queue_head_t *whead;
+	wait_queue_entry_t wait;
+};
+
+struct qtfs_poll_watch {
+	struct hlist_node hnode;
+	struct list_head pending;
+	struct file *file;
+	unsigned long data; // client's file
+	poll_table pt;
+	int nwait;
+	bool overflow;
+	struct qtfs_poll_wait waits[QTFS_POLL_WAIT_MAX];
+};
+
+// table changes and readiness collection are serialized by the mutex, the
+// wakeup callbacks only touch the pending list under the spinlock
+static DEFINE_MUTEX(qtfs_poll_mutex);
+static DEFINE_HASHTABLE(qtfs_poll_table, QTFS_POLL_HASH_BITS);
+static DEFINE_SPINLOCK(qtfs_poll_lock);
+static LIST_HEAD(qtfs_poll_pending_list);
+static atomic_t qtfs_poll_nwatch = ATOMIC_INIT(0);
+
+static int qtfs_poll_wake(wait_queue_entry_t *wait, unsigned int mode, int sync, void *key)
+{
+	struct qtfs_poll_wait *pw = container_of(wait, struct qtfs_poll_wait, wait);
+	struct qtfs_poll_watch *watch = pw->watch;
+	unsigned long flags;
+	bool kick = false;
+
+	// the wait queue is going away under us, same as epoll handles it
+	if (key_to_poll(key) & POLLFREE) {
+		list_del_init(&wait->entry);
+		smp_store_release(&pw->whead, NULL);
+	}
+	spin_lock_irqsave(&qtfs_poll_lock, flags);
+	if (list_empty(&watch->pending)) {
+		kick = list_empty(&qtfs_poll_pending_list);
+		list_add_tail(&watch->pending, &qtfs_poll_pending_list);
+	}
+	spin_unlock_irqrestore(&qtfs_poll_lock, flags);
+	if (kick)
+		qtfs_server_epoll_wake();
+	return 0;
+}
+
+static void qtfs_poll_queue_proc(struct file *file, wait_queue_head_t *whead, poll_table *pt)
+{
+	struct qtfs_poll_watch *watch = container_of(pt, struct qtfs_poll_watch, pt);
+	struct qtfs_poll_wait *pw;
+
+	if (watch->nwait >= QTFS_POLL_WAIT_MAX) {
+		watch->overflow = true;
+		return;
+	}
+	pw = &watch->waits[watch->nwait++];
+	pw->watch = watch;
+	pw->whead = whead;
+	init_waitqueue_func_entry(&pw->wait, qtfs_poll_wake);
+	add_wait_queue(whead, &pw->wait);
+}
+
+static struct qtfs_poll_watch *qtfs_poll_find(struct file *file)
+{
+	struct qtfs_poll_watch *watch;
+
+	hash_for_each_possible(qtfs_poll_table, watch, hnode, (unsigned long)file) {
+		if (watch->file == file)
+			return watch;
+	}
+	return NULL;
+}
+
+static void qtfs_poll_free(struct qtfs_poll_watch *watch)
+{
+	wait_queue_head_t *whead;
+	int i;
+
+	for (i = 0; i < watch->nwait; i++) {
+		rcu_read_lock();
+		whead = smp_load_acquire(&watch->waits[i].whead);
+		if (whead)
+			remove_wait_queue(whead, &watch->waits[i].wait);
+		rcu_read_unlock();
+	}
+	spin_lock_irq(&qtfs_poll_lock);
+	list_del_init(&watch->pending);
+	spin_unlock_irq(&qtfs_poll_lock);
+	fput(watch->file);
+	kfree(watch);
+}
+
+// return true if file is watched, mask is its current readiness either way
+bool qtfs_poll_watch(struct file *file, unsigned long data, __poll_t *mask)
+{
+	struct qtfs_poll_watch *watch;
+
+	mutex_lock(&qtfs_poll_mutex);
+	if (qtfs_poll_find(file) != NULL) {
+		mutex_unlock(&qtfs_poll_mutex);
+		*mask = vfs_poll(file, NULL);
+		return true;
+	}
+	if (atomic_read(&qtfs_poll_nwatch) >= qtfs_poll_max_watches)
+		goto fallback;
+	watch = kzalloc(sizeof(struct qtfs_poll_watch), GFP_KERNEL);
+	if (watch == NULL)
+		goto fallback;
+	INIT_LIST_HEAD(&watch->pending);
+	watch->file = get_file(file);
+	watch->data = data;
+	init_poll_funcptr(&watch->pt, qtfs_poll_queue_proc);
+	*mask = vfs_poll(file, &watch->pt);
+	// no wait queue means no wakeups to push, too many means some are missed
+	if (watch->nwait == 0 || watch->overflow) {
+		qtfs_poll_free(watch);
+		mutex_unlock(&qtfs_poll_mutex);
+		return false;
+	}
+	hash_add(qtfs_poll_table, &watch->hnode, (unsigned long)file);
+	atomic_inc(&qtfs_poll_nwatch);
+	mutex_unlock(&qtfs_poll_mutex);
+	return true;
+
+fallback:
+	mutex_unlock(&qtfs_poll_mutex);
+	*mask = vfs_poll(file, NULL);
+	return false;
+}
+
+// drop the watch before its fd is closed, the watch holds a file reference
+void qtfs_poll_unwatch(struct file *file)
+{
+	struct qtfs_poll_watch *watch;
+
+	if (atomic_read(&qtfs_poll_nwatch) == 0)
+		return;
+	mutex_lock(&qtfs_poll_mutex);
+	watch = qtfs_poll_find(file);
+	if (watch != NULL) {
+		hash_del(&watch->hnode);
+		atomic_dec(&qtfs_poll_nwatch);
+		qtfs_poll_free(watch);
+	}
+	mutex_unlock(&qtfs_poll_mutex);
+}
+
+bool qtfs_poll_pending(void)
+{
+	return !list_empty_careful(&qtfs_poll_pending_list);
+}
+
+// add the readiness of woken files to req until it's full
+void qtfs_poll_fill(struct qtreq_epollevt *req)
+{
+	struct qtfs_poll_watch *watch;
+	__poll_t mask;
+
+	mutex_lock(&qtfs_poll_mutex);
+	spin_lock_irq(&qtfs_poll_lock);
+	while (!list_empty(&qtfs_poll_pending_list) && req->event_nums < QTFS_EPOLL_MAX_EVENTS) {
+		watch = list_first_entry(&qtfs_poll_pending_list, struct qtfs_poll_watch, pending);
+		list_del_init(&watch->pending);
+		spin_unlock_irq(&qtfs_poll_lock);
+		mask = vfs_poll(watch->file, NULL);
+		qtfs_server_epoll_add(req, watch->data, (unsigned int)mask);
+		spin_lock_irq(&qtfs_poll_lock);
+	}
+	spin_unlock_irq(&qtfs_poll_lock);
+	mutex_unlock(&qtfs_poll_mutex);
+}
+
+void qtfs_poll_fini(void)
+{
+	struct qtfs_poll_watch *watch;
+	struct hlist_node *tmp;
+	int bkt;
+
+	mutex_lock(&qtfs_poll_mutex);
+	hash_for_each_safe(qtfs_poll_table, bkt, tmp, watch, hnode) {
+		hash_del(&watch->hnode);
+		atomic_dec(&qtfs_poll_nwatch);
+		qtfs_poll_free(watch);
+	}
+	mutex_unlock(&qtfs_poll_mutex);
+}
@@ -1,10 +1,13 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+#include <linux/eventfd.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/socket.h>
+#include <linux/version.h>
 
 #include "conn.h"
 #include "qtfs-server.h"
@@ -14,8 +17,12 @@
 #include "symbol_wrapper.h"
 
 #define QTFS_EPOLL_TIMEO 1000 // unit ms
+#define QTFS_EPOLL_NOWAKE_TIMEO 10 // unit ms, used when no wake eventfd is set
 
 int qtfs_server_thread_run = 1;
+// engine threads keep serving in kernel instead of returning per request
+bool qtfs_server_inkernel = false;
+struct qtfs_server_worker_s *qtfs_server_workers = NULL;
 
 long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
@@ -28,19 +35,107 @@ struct qtfs_server_epoll_s qtfs_epoll = {
 	.epfd = -1,
 	.event_nums = 0,
 	.events = NULL,
+	.wakefd = -1,
 };
 
-struct whitelist* whitelist[QTFS_WHITELIST_MAX];
+static struct eventfd_ctx *qtfs_epoll_wake_ctx = NULL;
+// set by a mount from a client that takes pushes without acking them
+bool qtfs_epoll_stream = false;
+
+// kick the epoll thread out of epoll_wait
+void qtfs_server_epoll_wake(void)
+{
+	struct eventfd_ctx *ctx = READ_ONCE(qtfs_epoll_wake_ctx);
+
+	if (ctx == NULL)
+		return;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0))
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+// send one message on epoll connection, and wait for client's ack unless
+// the message is streamed
+static int qtfs_server_epoll_push(struct qtfs_sock_var_s *pvar, unsigned int type, int sendlen, bool wait_ack)
+{
+	struct qtreq *head = pvar->vec_send.iov_base;
+	int ret;
+
+	pvar->vec_send.iov_len = QTFS_MSG_LEN - (QTFS_REQ_MAX_LEN - sendlen);
+	head->len = sendlen;
+	head->type = type;
+	ret = qtfs_conn_send(qtfs_conn_mode, pvar);
+	qtfs_dp_debug("qtfs send msg conn: %s:%u sendlen:%lu ret:%d.",
+					pvar->addr,pvar->port, (unsigned long)pvar->vec_send.iov_len, ret);
+	if (ret == -EPIPE) {
+		qtfs_err("epoll wait send events failed get EPIPE, just wait new connection.");
+		qtfs_sm_reconnect(pvar);
+		return ret;
+	}
+	if (ret < 0) {
+		qtfs_err("epoll wait send events failed, ret:%d.", ret);
+		WARN_ON(1);
+	}
+	if (!wait_ack)
+		return ret;
+retry:
+	ret = qtfs_conn_recv_block(qtfs_conn_mode, pvar);
+	if (ret == -EAGAIN) {
+		if (qtfs_server_thread_run == 0) {
+			qtfs_warn("qtfs module exiting, goodbye!");
+			return QTEXIT;
+		}
+		goto retry;
+	}
+	if (ret == -EPIPE) {
+		qtfs_err("epoll recv events failed get EPIPE, just wait new connection.");
+		qtfs_sm_reconnect(pvar);
+	}
+	return ret;
+}
+
+// fold events of data into req, a fd that is still ready shows up again on
+// the next drain and is merged into its first entry
+void qtfs_server_epoll_add(struct qtreq_epollevt *req, unsigned long data, unsigned int events)
+{
+	int i;
+
+	for (i = 0; i < req->event_nums; i++) {
+		if (req->events[i].data == data) {
+			req->events[i].events |= events;
+			return;
+		}
+	}
+	if (req->event_nums >= QTFS_EPOLL_MAX_EVENTS)
+		return;
+	req->events[i].data = data;
+	req->events[i].events = events;
+	req->event_nums++;
+}
+
+static void qtfs_server_epoll_merge(struct qtreq_epollevt *req, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		// the wake eventfd only breaks epoll_wait
+		if (qtfs_epoll.kevents[i].data == 0)
+			continue;
+		qtfs_server_epoll_add(req, qtfs_epoll.kevents[i].data, qtfs_epoll.kevents[i].events);
+	}
+}
 
 long qtfs_server_epoll_thread(struct qtfs_sock_var_s *pvar)
 {
 	int n;
 	struct qtreq_epollevt *req;
-	struct qtrsp_epollevt *rsp;
-	struct qtreq *head;
 	int sendlen;
 	int ret = 0;
-	int i = 0;
+	int timeout;
+	int maxevents = min(qtfs_epoll.event_nums, QTFS_EPOLL_MAX_EVENTS);
+	bool stream;
 
 	if (qtfs_epoll.epfd == -1) {
 		qtfs_err("qtfs epoll wait error, epfd is invalid.");
@@ -59,63 +154,62 @@ long qtfs_server_epoll_thread(struct qtfs_sock_var_s *pvar)
 		return QTERROR;
 	}
 	req = qtfs_sock_msg_buf(pvar, QTFS_SEND);
-	rsp = qtfs_sock_msg_buf(pvar, QTFS_RECV);
-	head = pvar->vec_send.iov_base;
-	do {
-		n = qtfs_syscall_epoll_wait(qtfs_epoll.epfd, qtfs_epoll.events, qtfs_epoll.event_nums, 0);
-		if (n == 0) {
-			msleep(1);
-			break;
-		}
-		if (n < 0) {
-			msleep(100);
-			qtfs_err("epoll get new events number failed:%d ", n);
-			break;
-		}
-		qtfs_info(">>epoll get new events number:%d.", n);
+	// without the wake eventfd, queued invalidations and poll wakeups are only
+	// noticed on timeout
+	if (qtfs_inval_pending() || qtfs_poll_pending())
+		timeout = 0;
+	else if (qtfs_epoll_wake_ctx == NULL)
+		timeout = QTFS_EPOLL_NOWAKE_TIMEO;
+	else
+		timeout = QTFS_EPOLL_TIMEO;
+	n = qtfs_syscall_epoll_wait(qtfs_epoll.epfd, qtfs_epoll.events, maxevents, timeout);
+	if (qtfs_server_thread_run == 0) {
+		qtfs_warn("qtfs module exiting, goodbye!");
+		return QTEXIT;
+	}
+	if (n < 0 && n != -EINTR) {
+		msleep(100);
+		qtfs_err("epoll get new events number failed:%d ", n);
+		return QTERROR;
+	}
+	// sampled once, so every message of this round agrees with itself
+	stream = READ_ONCE(qtfs_epoll_stream);
+	while (qtfs_inval_pending()) {
+		struct qtreq_invalidate *inval = (struct qtreq_invalidate *)req;
+
+		sendlen = qtfs_inval_fill(inval);
+		if (stream)
+			inval->flags |= QTFS_PUSH_NOACK;
+		ret = qtfs_server_epoll_push(pvar, QTFS_REQ_INVALIDATE, sendlen, !stream);
+		if (ret == QTEXIT)
+			return QTEXIT;
+		if (ret < 0)
+			return QTERROR;
+		qtinfo_cntinc(QTINF_INVALIDATE);
+	}
+	req->event_nums = 0;
+	req->flags = stream ? QTFS_PUSH_NOACK : 0;
+	while (n > 0) {
 		if (copy_from_user(qtfs_epoll.kevents, qtfs_epoll.events, sizeof(struct epoll_event) * n)) {
 			qtfs_err("qtfs copy epoll events failed, events lost.");
 			WARN_ON(1);
 			break;
 		}
-		for (i = 0; i < n; i++) {
-			req->events[i].data = qtfs_epoll.kevents[i].data;
-			req->events[i].events = qtfs_epoll.kevents[i].events;
-			qtfs_info("epoll thread head:%lx req:%lx data:%lx(offset:%lx).", (unsigned long)pvar->vec_send.iov_base,
-											(unsigned long)req, req->events[i].data, (unsigned long)&req->events[i].data);
-		}
-		req->event_nums = n;
-		sendlen = sizeof(struct qtreq_epollevt) - sizeof(req->events) + n * sizeof(struct qtreq_epoll_event);
-		pvar->vec_send.iov_len = QTFS_MSG_LEN - (QTFS_REQ_MAX_LEN - sendlen);
-		head->len = sendlen;
-		head->type = QTFS_REQ_EPOLL_EVENT;
-		ret = qtfs_conn_send(QTFS_CONN_SOCKET, pvar);
-		qtfs_info("qtfs send msg conn: %s:%u sendlen:%lu ret:%d.",
-						pvar->addr,pvar->port, (unsigned long)pvar->vec_send.iov_len, ret);
-		if (ret == -EPIPE) {
-			qtfs_err("epoll wait send events failed get EPIPE, just wait new connection.");
-			qtfs_sm_reconnect(pvar);
-			break;
-		}
-		if (ret < 0) {
-			qtfs_err("epoll wait send events failed, ret:%d.", ret);
-			WARN_ON(1);
-		}
-retry:
-		ret = qtfs_conn_recv_block(QTFS_CONN_SOCKET, pvar);
-		if (ret == -EAGAIN) {
-			if (qtfs_server_thread_run == 0) {
-				qtfs_warn("qtfs module exiting, goodbye!");
-				return QTEXIT;
-			}
-			goto retry;
-		}
-		if (ret == -EPIPE) {
-			qtfs_err("epoll recv events failed get EPIPE, just wait new connection.");
-			qtfs_sm_reconnect(pvar);
+		qtfs_dp_debug(">>epoll get new events number:%d.", n);
+		qtfs_server_epoll_merge(req, n);
+		// a full batch means more may be ready, drain them into the same
+		// message while another full batch still fits
+		if (n < maxevents || req->event_nums + maxevents > QTFS_EPOLL_MAX_EVENTS)
 			break;
-		}
-	}while (0);
+		n = qtfs_syscall_epoll_wait(qtfs_epoll.epfd, qtfs_epoll.events, maxevents, 0);
+	}
+	qtfs_poll_fill(req);
+	if (req->event_nums == 0)
+		return QTOK;
+	sendlen = sizeof(struct qtreq_epollevt) - sizeof(req->events) + req->event_nums * sizeof(struct qtreq_epoll_event);
+	ret = qtfs_server_epoll_push(pvar, QTFS_REQ_EPOLL_EVENT, sendlen, !stream);
+	if (ret == QTEXIT)
+		return QTEXIT;
 
 	return (ret < 0) ? QTERROR : QTOK;
 }
@@ -142,11 +236,36 @@ long qtfs_server_epoll_init(void)
 	return QTOK;
 }
 
+// serve one request from whichever connection is ready
+static long qtfs_server_thread_once(struct qtfs_server_worker_s *worker)
+{
+	struct qtfs_sock_var_s *pvar;
+	long ret;
+
+	pvar = qtfs_sched_take(worker);
+	if (pvar == NULL)
+		return qtfs_server_thread_run ? QTOK : QTEXIT;
+	ret = qtfs_sock_server_recv(pvar, worker);
+	if (ret == QTEXIT) {
+		qtfs_warn("qtfs thread idx:%d exit.", pvar->cur_threadidx);
+		mutex_lock(&pvar->sendlock);
+		qtfs_sm_exit(pvar);
+		mutex_unlock(&pvar->sendlock);
+		qtinfo_cntdec(QTINF_ACTIV_CONN);
+	}
+	// give the connection back before handling, the next request on it
+	// can be received by another thread while this one is running
+	qtfs_sched_put(pvar);
+	if (ret == QTOK)
+		ret = qtfs_sock_server_handle(pvar, worker);
+	return ret;
+}
+
 long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	int i, len;
 	long ret = 0;
-	struct qtfs_sock_var_s *pvar;
+	struct qtfs_server_worker_s *worker;
 	struct whitelist *tmp;
 	struct qtfs_thread_init_s init_userp;
 	switch (cmd) {
@@ -170,16 +289,28 @@ long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long a
 								(unsigned long)qtfs_userps[i].userp, (unsigned long)qtfs_userps[i].userp2);
 			break;
 		case QTFS_IOCTL_THREAD_RUN:
-			pvar = qtfs_conn_get_param();
-			if (pvar == NULL)
+			if (qtfs_server_workers == NULL || arg >= QTFS_MAX_THREADS) {
+				qtfs_err("qtfs thread run invalid thread idx:%lu.", arg);
+				ret = QTERROR;
 				break;
-			ret = qtfs_sock_server_run(pvar);
-			if (ret == QTEXIT) {
-				qtfs_warn("qtfs thread idx:%d exit.", pvar->cur_threadidx);
-				qtfs_sm_exit(pvar);
-				qtinfo_cntdec(QTINF_ACTIV_CONN);
 			}
-			qtfs_conn_put_param(pvar);
+			worker = &qtfs_server_workers[arg];
+			// req, rsp and bulk_len are the caller's alone while it runs
+			if (test_and_set_bit_lock(QTFS_WORKER_BUSY, &worker->flags)) {
+				qtfs_err("qtfs thread run idx:%lu is taken by another thread.", arg);
+				ret = -EBUSY;
+				break;
+			}
+			do {
+				ret = qtfs_server_thread_once(worker);
+				if (!qtfs_server_inkernel || ret == QTEXIT)
+					break;
+				// let the engine see its signals, it comes right back
+				if (signal_pending(current))
+					break;
+				cond_resched();
+			} while (1);
+			clear_bit_unlock(QTFS_WORKER_BUSY, &worker->flags);
 			break;
 		case QTFS_IOCTL_EPFDSET:
 			if (copy_from_user(&qtfs_epoll, (void __user *)arg, sizeof(struct qtfs_server_epoll_s))) {
@@ -195,6 +326,20 @@ long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long a
 				ret = QTERROR;
 				break;
 			}
+			do {
+				struct eventfd_ctx *ctx = NULL;
+
+				if (qtfs_epoll.wakefd >= 0) {
+					ctx = eventfd_ctx_fdget(qtfs_epoll.wakefd);
+					if (IS_ERR(ctx)) {
+						qtfs_err("epoll wake eventfd:%d invalid, fall back to timeout.", qtfs_epoll.wakefd);
+						ctx = NULL;
+					}
+				}
+				ctx = xchg(&qtfs_epoll_wake_ctx, ctx);
+				if (ctx != NULL)
+					eventfd_ctx_put(ctx);
+			} while (0);
 			break;
 		case QTFS_IOCTL_EPOLL_THREAD_INIT:
 			ret = qtfs_server_epoll_init();
@@ -214,6 +359,10 @@ long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long a
 		case QTFS_IOCTL_EXIT:
 			qtfs_info("qtfs server threads run set to:%lu.", arg);
 			qtfs_server_thread_run = arg;
+			if (arg == 0) {
+				qtfs_server_epoll_wake();
+				qtfs_sched_wake_all();
+			}
 			break;
 
 		case QTFS_IOCTL_WHITELIST:
@@ -221,20 +370,24 @@ long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long a
 				qtfs_err("qtfs ioctl white init copy from user failed.");
 				return QTERROR;
 			}
+			if (len < 0 || len > QTFS_WL_MAX_ITEMS) {
+				qtfs_err("qtfs ioctl white init invalid len:%d.", len);
+				return QTERROR;
+			}
 			tmp = (struct whitelist *)kmalloc(sizeof(struct whitelist) + sizeof(struct wl_item) * len, GFP_KERNEL);
-			
+			if (tmp == NULL)
+				return QTERROR;
 			if (copy_from_user(tmp, (void __user *)arg, sizeof(struct whitelist) + sizeof(struct wl_item) * len)) {
 				qtfs_err("qtfs ioctl white init copy from user failed.");
+				kfree(tmp);
 				return QTERROR;
 			}
-			
-			if (whitelist[tmp->type] != NULL) {
-				kfree(whitelist[tmp->type]);
-			}
-			whitelist[tmp->type] = tmp;
-			for (i = 0; i < whitelist[tmp->type]->len; i++) {
-				qtfs_err("init %d list:%d %s", tmp->type, i, whitelist[tmp->type]->wl[i].path);
+			tmp->len = len;
+			for (i = 0; i < len; i++) {
+				qtfs_err("init %d list:%d %s", tmp->type, i, tmp->wl[i].path);
 			}
+			if (qtfs_whitelist_set(tmp) != 0)
+				return QTERROR;
 			break;
 		case QTFS_IOCTL_ALLINFO:
 		case QTFS_IOCTL_CLEARALL:
@@ -242,6 +395,7 @@ long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long a
 		case QTFS_IOCTL_QTSOCK_WL_ADD:
 		case QTFS_IOCTL_QTSOCK_WL_DEL:
 		case QTFS_IOCTL_QTSOCK_WL_GET:
+		case QTFS_IOCTL_PASS_ADD:
 			ret = qtfs_misc_ioctl(file, cmd, arg);
 			break;
 		default:
@@ -252,18 +406,53 @@ long qtfs_server_misc_ioctl(struct file *file, unsigned int cmd, unsigned long a
 	return ret;
 }
 
-static int __init qtfs_server_init(void)
+static void qtfs_server_workers_free(void)
 {
 	int i;
-	qtfs_log_init(qtfs_log_level);
-	for (i = 0; i < QTFS_WHITELIST_MAX; i++) {
-		whitelist[i] = NULL;
+
+	if (qtfs_server_workers == NULL)
+		return;
+	for (i = 0; i < QTFS_MAX_THREADS; i++) {
+		kvfree(qtfs_server_workers[i].req);
+		kvfree(qtfs_server_workers[i].rsp);
+	}
+	kfree(qtfs_server_workers);
+	qtfs_server_workers = NULL;
+}
+
+static int qtfs_server_workers_alloc(void)
+{
+	int i;
+
+	qtfs_server_workers = (struct qtfs_server_worker_s *)kcalloc(QTFS_MAX_THREADS,
+											sizeof(struct qtfs_server_worker_s), GFP_KERNEL);
+	if (qtfs_server_workers == NULL)
+		return -ENOMEM;
+	for (i = 0; i < QTFS_MAX_THREADS; i++) {
+		qtfs_server_workers[i].idx = i;
+		qtfs_server_workers[i].req = kvzalloc(QTFS_MSG_LEN, GFP_KERNEL);
+		qtfs_server_workers[i].req_size = QTFS_MSG_LEN;
+		// response may carry a data message up to the negotiable size
+		qtfs_server_workers[i].rsp = kvzalloc(QTFS_MSG_HEAD_LEN + qtfs_data_msg_len, GFP_KERNEL);
+		qtfs_server_workers[i].rsp_max = qtfs_data_msg_len;
+		if (qtfs_server_workers[i].req == NULL || qtfs_server_workers[i].rsp == NULL) {
+			qtfs_server_workers_free();
+			return -ENOMEM;
+		}
 	}
+	return 0;
+}
+
+static int __init qtfs_server_init(void)
+{
+	qtfs_log_init(qtfs_log_level);
 	qtfs_diag_info = (struct qtinfo *)kmalloc(sizeof(struct qtinfo), GFP_KERNEL);
-	if (qtfs_diag_info == NULL) 
+	if (qtfs_diag_info == NULL) {
+		// connections count into it, there is no running without it
 		qtfs_err("kmalloc qtfs diag info failed.");
-	else
-		memset(qtfs_diag_info, 0, sizeof(struct qtinfo));
+		return -ENOMEM;
+	}
+	memset(qtfs_diag_info, 0, sizeof(struct qtinfo));
 	qtfs_userps = (struct qtfs_server_userp_s *)kmalloc(
 											QTFS_MAX_THREADS * sizeof(struct qtfs_server_userp_s), GFP_KERNEL);
 	if (qtfs_userps == NULL)
@@ -271,6 +460,10 @@ static int __init qtfs_server_init(void)
 	else
 		memset(qtfs_userps, 0, QTFS_MAX_THREADS * sizeof(struct qtfs_server_userp_s));
 	qtfs_conn_param_init();
+	if (qtfs_server_workers_alloc() != 0)
+		qtfs_err("kmalloc qtfs server workers failed, nums:%d", QTFS_MAX_THREADS);
+	if (qtfs_inval_init() != 0)
+		qtfs_err("qtfs invalidate init failed, clients will rely on cache timeouts.");
 	qtfs_kallsyms_hack_init();
 	qtfs_syscall_replace_start();
 	qtfs_misc_register();
@@ -280,22 +473,29 @@ static int __init qtfs_server_init(void)
 
 static void __exit qtfs_server_exit(void)
 {
-	int i;
 	qtfs_mod_exiting = true;
 	qtfs_server_thread_run = 0;
 
+	qtfs_sched_fini();
 	qtfs_conn_param_fini();
+	qtfs_inval_fini();
+	qtfs_poll_fini();
+	qtfs_handle_fini();
+	if (qtfs_epoll_wake_ctx != NULL) {
+		eventfd_ctx_put(qtfs_epoll_wake_ctx);
+		qtfs_epoll_wake_ctx = NULL;
+	}
 
 	if (qtfs_epoll_var != NULL) {
 		qtfs_epoll_cut_conn(qtfs_epoll_var);
-		if (qtfs_epoll_var->sock != NULL) {
-			sock_release(qtfs_epoll_var->sock);
-			qtfs_epoll_var->sock = NULL;
-		}
+		qtfs_conn_fini(qtfs_conn_mode, qtfs_epoll_var);
 		qtfs_sock_var_fini(qtfs_epoll_var);
 		kfree(qtfs_epoll_var);
 		qtfs_epoll_var = NULL;
 	}
+	qtfs_shm_exit();
+	// no more readers of diag info once the device and debugfs are gone
+	qtfs_misc_destroy();
 	if (qtfs_diag_info != NULL) {
 		kfree(qtfs_diag_info);
 		qtfs_diag_info = NULL;
@@ -304,12 +504,8 @@ static void __exit qtfs_server_exit(void)
 		kfree(qtfs_userps);
 		qtfs_userps = NULL;
 	}
-	for (i = 0; i < QTFS_WHITELIST_MAX; i++) {
-		if (whitelist[i] != NULL) {
-			kfree(whitelist[i]);
-		}
-	}
-	qtfs_misc_destroy();
+	qtfs_server_workers_free();
+	qtfs_whitelist_fini();
 	qtfs_uds_remote_exit();
 	qtfs_syscall_replace_stop();
 	qtfs_info("qtfs server exit done.\n");
@@ -320,6 +516,34 @@ module_param_string(qtfs_server_ip, qtfs_server_ip, sizeof(qtfs_server_ip), 0600
 MODULE_PARM_DESC(qtfs_server_ip, "qtfs server ip");
 module_param(qtfs_server_port, int, 0644);
 module_param(qtfs_sock_max_conn, int, 0644);
+module_param(qtfs_conn_mode, int, 0444);
+MODULE_PARM_DESC(qtfs_conn_mode, "transport of connections, 0 tcp socket, 1 shared memory rings (the server module's loopback backend)");
+module_param(qtfs_data_msg_len, uint, 0444);
+MODULE_PARM_DESC(qtfs_data_msg_len, "max payload size of data messages, 8KB~1MB");
+module_param(qtfs_inval_max_marks, int, 0644);
+MODULE_PARM_DESC(qtfs_inval_max_marks, "max host inodes watched to push invalidations, 0 disables pushing");
+module_param(qtfs_poll_max_watches, int, 0644);
+MODULE_PARM_DESC(qtfs_poll_max_watches, "max polled files whose readiness changes are pushed to client");
+module_param(qtfs_handle_max, int, 0644);
+MODULE_PARM_DESC(qtfs_handle_max, "max file handles kept for client lookups by handle, 0 disables them");
+module_param(qtfs_server_inkernel, bool, 0644);
+MODULE_PARM_DESC(qtfs_server_inkernel, "engine threads stay in kernel between requests");
+module_param(qtfs_server_min_workers, int, 0644);
+MODULE_PARM_DESC(qtfs_server_min_workers, "engine threads kept running when idle, the rest park");
+module_param(qtfs_server_idle_ms, int, 0644);
+MODULE_PARM_DESC(qtfs_server_idle_ms, "idle time in ms before a surplus engine thread parks");
+module_param(qtfs_tcp_nodelay, bool, 0644);
+MODULE_PARM_DESC(qtfs_tcp_nodelay, "set TCP_NODELAY on new connections, small requests don't wait for Nagle");
+module_param(qtfs_tcp_quickack, bool, 0644);
+MODULE_PARM_DESC(qtfs_tcp_quickack, "ack every received message right away instead of delaying acks");
+module_param(qtfs_tcp_msg_more, bool, 0644);
+MODULE_PARM_DESC(qtfs_tcp_msg_more, "send a frame head with MSG_MORE when its payload follows");
+module_param(qtfs_sock_sndbuf, int, 0644);
+MODULE_PARM_DESC(qtfs_sock_sndbuf, "SO_SNDBUF of new connections in bytes, 0 keeps autotuning");
+module_param(qtfs_sock_rcvbuf, int, 0644);
+MODULE_PARM_DESC(qtfs_sock_rcvbuf, "SO_RCVBUF of new connections in bytes, 0 keeps autotuning");
+module_param(qtfs_sock_busy_poll, int, 0644);
+MODULE_PARM_DESC(qtfs_sock_busy_poll, "busy poll time in us of new request connections, 0 disables it");
 module_param_string(qtfs_log_level, qtfs_log_level, sizeof(qtfs_log_level), 0600);
 
 module_init(qtfs_server_init);
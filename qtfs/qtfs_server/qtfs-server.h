@@ -6,14 +6,36 @@
 extern int qtfs_server_thread_run;
 extern struct qtfs_server_epoll_s qtfs_epoll;
 extern int qtfs_mod_exiting;
-extern struct whitelist* whitelist[QTFS_WHITELIST_MAX];
 
 struct qtserver_arg {
 	char *data;
 	char *out;
+	size_t outlen; // capacity of out, larger than QTFS_REQ_MAX_LEN for data messages
 	struct qtfs_server_userp_s *userp;
+	size_t bulk_len; // bulk payload already received to userp->userp, 0 if inline
+	size_t inlen; // bytes of data the client sent
 };
 
+// per engine thread state, a request is moved here from the connection
+// after it's received, so the connection can carry other requests while
+// this one is being handled
+#define QTFS_WORKER_BUSY 0 // bit of flags, an engine thread runs in it
+
+struct qtfs_server_worker_s {
+	int idx;
+	unsigned long flags;
+	unsigned long conn_gen;
+	struct qtreq *req;
+	struct qtreq *rsp;
+	size_t req_size; // buffer size of req, swapped together with req
+	size_t rsp_max; // payload capacity of rsp
+	size_t bulk_len; // bulk payload of req received to this thread's userp
+	bool sched_seen; // counted in the scheduler's workers
+	bool parked; // surplus thread idling on the spare queue
+};
+
+extern struct qtfs_server_worker_s *qtfs_server_workers;
+
 struct qtserver_ops {
 	int type;
 	// return int is output len.
@@ -21,10 +43,51 @@ struct qtserver_ops {
 	char str[32];
 };
 
-int qtfs_sock_server_run(struct qtfs_sock_var_s *pvar);
+struct qtreq_invalidate;
+extern int qtfs_inval_max_marks;
+extern bool qtfs_inval_enabled;
+extern bool qtfs_epoll_stream;
+void qtfs_server_epoll_wake(void);
+struct qtreq_epollevt;
+void qtfs_server_epoll_add(struct qtreq_epollevt *req, unsigned long data, unsigned int events);
+
+extern int qtfs_poll_max_watches;
+bool qtfs_poll_watch(struct file *file, unsigned long data, __poll_t *mask);
+void qtfs_poll_unwatch(struct file *file);
+bool qtfs_poll_pending(void);
+void qtfs_poll_fill(struct qtreq_epollevt *req);
+void qtfs_poll_fini(void);
+int qtfs_inval_init(void);
+void qtfs_inval_fini(void);
+void qtfs_inval_watch(struct inode *inode);
+bool qtfs_inval_pending(void);
+int qtfs_inval_fill(struct qtreq_invalidate *req);
+
+bool in_white_list(char *path, int type);
+int qtfs_whitelist_set(struct whitelist *wl);
+bool qtfs_wl_file_allowed(int fd, struct file *file, int type);
+void qtfs_wl_fd_drop(int fd);
+void qtfs_whitelist_fini(void);
+
+struct path;
+extern int qtfs_handle_max;
+u64 qtfs_handle_get(const struct path *path);
+int qtfs_handle_path(u64 id, struct path *path);
+void qtfs_handle_fini(void);
+
+extern int qtfs_server_min_workers;
+extern int qtfs_server_idle_ms;
+struct qtfs_sock_var_s *qtfs_sched_take(struct qtfs_server_worker_s *worker);
+void qtfs_sched_put(struct qtfs_sock_var_s *pvar);
+void qtfs_sched_wake_all(void);
+void qtfs_sched_fini(void);
+
+int qtfs_sock_server_recv(struct qtfs_sock_var_s *pvar, struct qtfs_server_worker_s *worker);
+int qtfs_sock_server_handle(struct qtfs_sock_var_s *pvar, struct qtfs_server_worker_s *worker);
 long qtfs_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 int qtfs_misc_register(void);
 void qtfs_misc_destroy(void);
+bool qtfs_ioctl_pass_find(unsigned int cmd, struct qtfs_ioctl_pass *pass);
 long qtfs_misc_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 #endif
@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "conn.h"
+#include "qtfs-server.h"
+#include "req.h"
+#include "log.h"
+#include "comm.h"
+
+// Connections are not tied to engine threads. An accepted connection is
+// watched by its transport (sk_data_ready of a socket, the doorbell of a
+// shared memory channel) to put itself on the ready list, any idle worker takes it,
+// receives one request, gives it back (queued again if more is buffered)
+// and then handles the request. The listening socket wakes a worker to
+// accept the same way. Workers beyond qtfs_server_min_workers park after
+// idling for qtfs_server_idle_ms, and are woken when a connection becomes
+// ready while no worker is idle.
+
+int qtfs_server_min_workers = 4;
+int qtfs_server_idle_ms = 1000;
+
+static LIST_HEAD(qtfs_sched_list);
+static DEFINE_SPINLOCK(qtfs_sched_lock);
+static DECLARE_WAIT_QUEUE_HEAD(qtfs_sched_waitq);
+static DECLARE_WAIT_QUEUE_HEAD(qtfs_sched_spareq);
+static atomic_t qtfs_sched_nconn = ATOMIC_INIT(0);
+static atomic_t qtfs_sched_nworkers = ATOMIC_INIT(0);
+static atomic_t qtfs_sched_idle = ATOMIC_INIT(0);
+static atomic_t qtfs_sched_parked = ATOMIC_INIT(0);
+static atomic_t qtfs_sched_accepting = ATOMIC_INIT(0);
+static bool qtfs_sched_listening = false;
+
+// pvar has data or was hung up, from the transport's callbacks
+void qtfs_sched_ready(struct qtfs_sock_var_s *pvar)
+{
+	unsigned long flags;
+	bool queued = false;
+
+	spin_lock_irqsave(&qtfs_sched_lock, flags);
+	if (pvar->sched_attached && !pvar->sched_queued && !pvar->sched_busy) {
+		list_add_tail(&pvar->sched_node, &qtfs_sched_list);
+		pvar->sched_queued = true;
+		queued = true;
+	}
+	spin_unlock_irqrestore(&qtfs_sched_lock, flags);
+	if (!queued)
+		return;
+	wake_up(&qtfs_sched_waitq);
+	if (atomic_read(&qtfs_sched_idle) == 0 && atomic_read(&qtfs_sched_parked) > 0)
+		wake_up(&qtfs_sched_spareq);
+}
+
+static struct qtfs_sock_var_s *qtfs_sched_pop(void)
+{
+	struct qtfs_sock_var_s *pvar = NULL;
+
+	spin_lock_irq(&qtfs_sched_lock);
+	if (!list_empty(&qtfs_sched_list)) {
+		pvar = list_first_entry(&qtfs_sched_list, struct qtfs_sock_var_s, sched_node);
+		list_del_init(&pvar->sched_node);
+		pvar->sched_queued = false;
+		pvar->sched_busy = true;
+	}
+	spin_unlock_irq(&qtfs_sched_lock);
+	return pvar;
+}
+
+static void qtfs_sched_attach(struct qtfs_sock_var_s *pvar)
+{
+	qtfs_conn_tp->watch(pvar, true);
+
+	spin_lock_irq(&qtfs_sched_lock);
+	pvar->sched_attached = true;
+	pvar->sched_busy = false;
+	spin_unlock_irq(&qtfs_sched_lock);
+	atomic_inc(&qtfs_sched_nconn);
+	// requests may have come before the hook
+	if (qtfs_conn_tp->readable(pvar))
+		qtfs_sched_ready(pvar);
+	qtfs_info("qtfs sched attach conn:%d, conns:%d.", pvar->cur_threadidx, atomic_read(&qtfs_sched_nconn));
+}
+
+// called before the connection is released
+void qtfs_sched_detach(struct qtfs_sock_var_s *pvar)
+{
+	if (!pvar->sched_attached)
+		return;
+	qtfs_conn_tp->watch(pvar, false);
+
+	spin_lock_irq(&qtfs_sched_lock);
+	if (pvar->sched_queued) {
+		list_del_init(&pvar->sched_node);
+		pvar->sched_queued = false;
+	}
+	pvar->sched_attached = false;
+	spin_unlock_irq(&qtfs_sched_lock);
+	atomic_dec(&qtfs_sched_nconn);
+}
+
+// a client came to be accepted
+void qtfs_sched_kick(void)
+{
+	wake_up(&qtfs_sched_waitq);
+}
+
+static void qtfs_sched_listen_hook(void)
+{
+	if (qtfs_sched_listening)
+		return;
+	if (qtfs_conn_tp->watch_listen(true) == 0)
+		qtfs_sched_listening = true;
+}
+
+// a client is waiting to be accepted and there is a free slot for it, until
+// the transport listens the first worker sets it up by accepting
+static bool qtfs_sched_accept_ready(void)
+{
+	if (atomic_read(&qtfs_sched_nconn) >= qtfs_sock_max_conn)
+		return false;
+	if (!qtfs_sched_listening)
+		return true;
+	return qtfs_conn_tp->accept_ready();
+}
+
+static void qtfs_sched_accept(void)
+{
+	struct qtfs_sock_var_s *pvar;
+
+	pvar = qtfs_conn_get_param();
+	if (pvar != NULL)
+		qtfs_sched_attach(pvar);
+	qtfs_sched_listen_hook();
+	atomic_set(&qtfs_sched_accepting, 0);
+}
+
+// wait for a ready connection, NULL if there was none this round
+struct qtfs_sock_var_s *qtfs_sched_take(struct qtfs_server_worker_s *worker)
+{
+	struct qtfs_sock_var_s *pvar = NULL;
+	bool accept = false;
+	long timeo;
+	DEFINE_WAIT(wait);
+
+	if (!worker->sched_seen) {
+		worker->sched_seen = true;
+		atomic_inc(&qtfs_sched_nworkers);
+	}
+	if (worker->parked) {
+		timeo = wait_event_interruptible_timeout(qtfs_sched_spareq,
+				(!list_empty_careful(&qtfs_sched_list) && atomic_read(&qtfs_sched_idle) == 0) ||
+				READ_ONCE(qtfs_server_thread_run) == 0, HZ);
+		if (timeo <= 0)
+			return NULL;
+		worker->parked = false;
+		atomic_dec(&qtfs_sched_parked);
+	}
+
+	atomic_inc(&qtfs_sched_idle);
+	timeo = msecs_to_jiffies(qtfs_server_idle_ms);
+	for (;;) {
+		prepare_to_wait_exclusive(&qtfs_sched_waitq, &wait, TASK_INTERRUPTIBLE);
+		pvar = qtfs_sched_pop();
+		if (pvar != NULL)
+			break;
+		// one worker at a time accepts
+		if (qtfs_sched_accept_ready() && atomic_cmpxchg(&qtfs_sched_accepting, 0, 1) == 0) {
+			accept = true;
+			break;
+		}
+		if (READ_ONCE(qtfs_server_thread_run) == 0 || signal_pending(current) || timeo == 0)
+			break;
+		timeo = schedule_timeout(timeo);
+	}
+	finish_wait(&qtfs_sched_waitq, &wait);
+	atomic_dec(&qtfs_sched_idle);
+
+	if (accept) {
+		qtfs_sched_accept();
+		return NULL;
+	}
+	if (pvar == NULL && timeo == 0 && atomic_read(&qtfs_sched_nworkers) -
+			atomic_read(&qtfs_sched_parked) > max(qtfs_server_min_workers, 1)) {
+		worker->parked = true;
+		atomic_inc(&qtfs_sched_parked);
+	}
+	return pvar;
+}
+
+// give the connection back after receiving from it
+void qtfs_sched_put(struct qtfs_sock_var_s *pvar)
+{
+	// it lost its socket while receiving: hook the new one, or let the
+	// accepting worker wait for the client to come back
+	if (!pvar->sched_attached) {
+		if (pvar->state == QTCONN_ACTIVE && qtfs_sock_connected(pvar))
+			qtfs_sched_attach(pvar);
+		else
+			qtfs_conn_put_param(pvar);
+		return;
+	}
+	spin_lock_irq(&qtfs_sched_lock);
+	pvar->sched_busy = false;
+	spin_unlock_irq(&qtfs_sched_lock);
+	// data that came while we held it didn't queue it, nor did the
+	// requests received ahead into its staging buffer
+	if (qtfs_conn_tp->readable(pvar) || qtfs_rx_pending(pvar) || !qtfs_sock_connected(pvar))
+		qtfs_sched_ready(pvar);
+}
+
+void qtfs_sched_wake_all(void)
+{
+	wake_up_all(&qtfs_sched_waitq);
+	wake_up_all(&qtfs_sched_spareq);
+}
+
+// before the listening socket is released
+void qtfs_sched_fini(void)
+{
+	qtfs_sched_wake_all();
+	if (!qtfs_sched_listening)
+		return;
+	qtfs_conn_tp->watch_listen(false);
+	qtfs_sched_listening = false;
+}
@@ -0,0 +1,328 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/dcache.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "conn.h"
+#include "qtfs-server.h"
+#include "req.h"
+#include "log.h"
+#include "comm.h"
+
+// A path is allowed when some item of the list is a prefix of it. Items
+// are hashed by content, and the path is hashed incrementally, probing the
+// table once at each distinct item length, so a check costs one pass over
+// the path however long the list is.
+#define QTFS_WL_HASH_INIT 2166136261U
+#define QTFS_WL_HASH_PRIME 16777619U
+#define QTFS_WL_FD_HASH_BITS 8
+
+struct qtfs_wl_set {
+	struct rcu_head rcu;
+	struct whitelist *wl;
+	int nlens;
+	int *lens; // distinct item lengths, ascending
+	u32 *hash; // of each item
+	int *next; // next item in the same bucket, -1 ends
+	unsigned int mask;
+	int buckets[]; // first item of the bucket, -1 if empty
+};
+
+static struct qtfs_wl_set __rcu *qtfs_wl_sets[QTFS_WHITELIST_MAX];
+static DEFINE_MUTEX(qtfs_wl_mutex);
+// bumped on every list change, verdicts cached per fd are checked against it
+static atomic_t qtfs_wl_gen = ATOMIC_INIT(0);
+
+// verdicts of an open fd, so data requests don't render its path
+struct qtfs_wl_fd {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	int fd;
+	struct file *file;
+	struct dentry *dentry;
+	int gen;
+	// rename_lock sequence the path was rendered under, a rename keeps
+	// the dentry but may move it out of the listed prefix
+	unsigned int rename_seq;
+	unsigned long checked; // bit per QTFS_WHITELIST_xxx
+	unsigned long allowed;
+};
+
+static DEFINE_HASHTABLE(qtfs_wl_fds, QTFS_WL_FD_HASH_BITS);
+static DEFINE_SPINLOCK(qtfs_wl_fd_lock);
+
+static inline u32 qtfs_wl_hash_step(u32 h, char c)
+{
+	return (h ^ (unsigned char)c) * QTFS_WL_HASH_PRIME;
+}
+
+static void qtfs_wl_set_free(struct qtfs_wl_set *set)
+{
+	if (set == NULL)
+		return;
+	kfree(set->lens);
+	kfree(set->hash);
+	kfree(set->next);
+	kfree(set->wl);
+	kfree(set);
+}
+
+static void qtfs_wl_set_free_rcu(struct rcu_head *rcu)
+{
+	qtfs_wl_set_free(container_of(rcu, struct qtfs_wl_set, rcu));
+}
+
+static int qtfs_wl_len_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static struct qtfs_wl_set *qtfs_wl_compile(struct whitelist *wl)
+{
+	struct qtfs_wl_set *set;
+	unsigned int nbuckets = 1;
+	int i, j;
+
+	while (nbuckets < wl->len * 2)
+		nbuckets <<= 1;
+	set = kzalloc(sizeof(struct qtfs_wl_set) + nbuckets * sizeof(int), GFP_KERNEL);
+	if (set == NULL)
+		return NULL;
+	set->lens = kcalloc(wl->len + 1, sizeof(int), GFP_KERNEL);
+	set->hash = kcalloc(wl->len + 1, sizeof(u32), GFP_KERNEL);
+	set->next = kcalloc(wl->len + 1, sizeof(int), GFP_KERNEL);
+	if (set->lens == NULL || set->hash == NULL || set->next == NULL) {
+		qtfs_wl_set_free(set);
+		return NULL;
+	}
+	set->mask = nbuckets - 1;
+	for (i = 0; i < nbuckets; i++)
+		set->buckets[i] = -1;
+	for (i = 0; i < wl->len; i++) {
+		struct wl_item *item = &wl->wl[i];
+		u32 h = QTFS_WL_HASH_INIT;
+
+		// same as strncmp(path, item->path, item->len) used to match
+		item->len = strnlen(item->path, clamp_t(int, item->len, 0, sizeof(item->path) - 1));
+		for (j = 0; j < item->len; j++)
+			h = qtfs_wl_hash_step(h, item->path[j]);
+		set->hash[i] = h;
+		set->next[i] = set->buckets[h & set->mask];
+		set->buckets[h & set->mask] = i;
+		set->lens[i] = item->len;
+	}
+	sort(set->lens, wl->len, sizeof(int), qtfs_wl_len_cmp, NULL);
+	for (i = 0; i < wl->len; i++) {
+		if (set->nlens == 0 || set->lens[set->nlens - 1] != set->lens[i])
+			set->lens[set->nlens++] = set->lens[i];
+	}
+	set->wl = wl;
+	return set;
+}
+
+// takes wl, it's freed on failure
+int qtfs_whitelist_set(struct whitelist *wl)
+{
+	struct qtfs_wl_set *set, *old;
+
+	if (wl->type < 0 || wl->type >= QTFS_WHITELIST_MAX || wl->len < 0) {
+		qtfs_err("qtfs whitelist invalid type:%d len:%d.", wl->type, wl->len);
+		kfree(wl);
+		return -EINVAL;
+	}
+	set = qtfs_wl_compile(wl);
+	if (set == NULL) {
+		qtfs_err("qtfs whitelist type:%d compile failed.", wl->type);
+		kfree(wl);
+		return -ENOMEM;
+	}
+	mutex_lock(&qtfs_wl_mutex);
+	old = rcu_dereference_protected(qtfs_wl_sets[wl->type], lockdep_is_held(&qtfs_wl_mutex));
+	rcu_assign_pointer(qtfs_wl_sets[wl->type], set);
+	atomic_inc(&qtfs_wl_gen);
+	mutex_unlock(&qtfs_wl_mutex);
+	if (old != NULL)
+		call_rcu(&old->rcu, qtfs_wl_set_free_rcu);
+	return 0;
+}
+
+static bool qtfs_wl_probe(struct qtfs_wl_set *set, const char *path, int len, u32 h)
+{
+	int i;
+
+	for (i = set->buckets[h & set->mask]; i >= 0; i = set->next[i]) {
+		if (set->hash[i] == h && set->wl->wl[i].len == len &&
+				memcmp(set->wl->wl[i].path, path, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool in_white_list(char *path, int type)
+{
+	struct qtfs_wl_set *set;
+	bool allowed = false;
+	u32 h = QTFS_WL_HASH_INIT;
+	int i, n = 0;
+
+	rcu_read_lock();
+	set = rcu_dereference(qtfs_wl_sets[type]);
+	// no list set for this type allows everything
+	if (set == NULL) {
+		rcu_read_unlock();
+		return true;
+	}
+	for (i = 0; i < set->nlens; i++) {
+		while (n < set->lens[i]) {
+			if (path[n] == '\0')
+				goto out;
+			h = qtfs_wl_hash_step(h, path[n++]);
+		}
+		if (qtfs_wl_probe(set, path, n, h)) {
+			allowed = true;
+			break;
+		}
+	}
+out:
+	rcu_read_unlock();
+	return allowed;
+}
+
+static struct qtfs_wl_fd *qtfs_wl_fd_find_rcu(int fd)
+{
+	struct qtfs_wl_fd *entry;
+
+	hash_for_each_possible_rcu(qtfs_wl_fds, entry, node, fd) {
+		if (entry->fd == fd)
+			return entry;
+	}
+	return NULL;
+}
+
+// under qtfs_wl_fd_lock
+static struct qtfs_wl_fd *qtfs_wl_fd_find(int fd)
+{
+	struct qtfs_wl_fd *entry;
+
+	hash_for_each_possible(qtfs_wl_fds, entry, node, fd) {
+		if (entry->fd == fd)
+			return entry;
+	}
+	return NULL;
+}
+
+static void qtfs_wl_fd_save(int fd, struct file *file, int gen, unsigned int rename_seq,
+		int type, bool allowed)
+{
+	struct qtfs_wl_fd *entry, *new;
+
+	new = kzalloc(sizeof(struct qtfs_wl_fd), GFP_KERNEL);
+	spin_lock(&qtfs_wl_fd_lock);
+	entry = qtfs_wl_fd_find(fd);
+	if (entry != NULL && entry->file == file && entry->dentry == file->f_path.dentry &&
+			entry->gen == gen && entry->rename_seq == rename_seq) {
+		if (allowed)
+			set_bit(type, &entry->allowed);
+		smp_mb__before_atomic();
+		set_bit(type, &entry->checked);
+		spin_unlock(&qtfs_wl_fd_lock);
+		kfree(new);
+		return;
+	}
+	if (entry != NULL) {
+		hash_del_rcu(&entry->node);
+		kfree_rcu(entry, rcu);
+	}
+	if (new != NULL) {
+		new->fd = fd;
+		new->file = file;
+		new->dentry = file->f_path.dentry;
+		new->gen = gen;
+		new->rename_seq = rename_seq;
+		new->checked = BIT(type);
+		new->allowed = allowed ? BIT(type) : 0;
+		hash_add_rcu(qtfs_wl_fds, &new->node, fd);
+	}
+	spin_unlock(&qtfs_wl_fd_lock);
+}
+
+// is the file open at fd allowed for type, its path is rendered and
+// matched once per fd
+bool qtfs_wl_file_allowed(int fd, struct file *file, int type)
+{
+	struct qtfs_wl_fd *entry;
+	char *pathbuf, *fullname;
+	int gen = atomic_read(&qtfs_wl_gen);
+	unsigned int rename_seq;
+	bool allowed = false;
+	bool hit = false;
+
+	if (file == NULL || IS_ERR(file))
+		return false;
+	if (rcu_access_pointer(qtfs_wl_sets[type]) == NULL)
+		return true;
+	rcu_read_lock();
+	entry = qtfs_wl_fd_find_rcu(fd);
+	// the fd may have been reused, the file and its name must be the same,
+	// and nothing may have been renamed since, the file or a parent of it
+	if (entry != NULL && entry->file == file && entry->dentry == file->f_path.dentry &&
+			entry->gen == gen && !read_seqretry(&rename_lock, entry->rename_seq) &&
+			test_bit(type, &entry->checked)) {
+		allowed = test_bit(type, &entry->allowed);
+		hit = true;
+	}
+	rcu_read_unlock();
+	if (hit)
+		return allowed;
+
+	pathbuf = __getname();
+	if (pathbuf == NULL)
+		return false;
+	rename_seq = read_seqbegin(&rename_lock);
+	fullname = file_path(file, pathbuf, PATH_MAX);
+	if (!IS_ERR(fullname))
+		allowed = in_white_list(fullname, type);
+	if (!allowed)
+		qtfs_err("%s not in whitelist:%d.\n", IS_ERR(fullname) ? "?" : fullname, type);
+	__putname(pathbuf);
+	qtfs_wl_fd_save(fd, file, gen, rename_seq, type, allowed);
+	return allowed;
+}
+
+void qtfs_wl_fd_drop(int fd)
+{
+	struct qtfs_wl_fd *entry;
+
+	spin_lock(&qtfs_wl_fd_lock);
+	entry = qtfs_wl_fd_find(fd);
+	if (entry != NULL) {
+		hash_del_rcu(&entry->node);
+		kfree_rcu(entry, rcu);
+	}
+	spin_unlock(&qtfs_wl_fd_lock);
+}
+
+void qtfs_whitelist_fini(void)
+{
+	struct qtfs_wl_fd *entry;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < QTFS_WHITELIST_MAX; i++) {
+		qtfs_wl_set_free(rcu_dereference_protected(qtfs_wl_sets[i], 1));
+		RCU_INIT_POINTER(qtfs_wl_sets[i], NULL);
+	}
+	spin_lock(&qtfs_wl_fd_lock);
+	hash_for_each_safe(qtfs_wl_fds, i, tmp, entry, node) {
+		hash_del_rcu(&entry->node);
+		kfree_rcu(entry, rcu);
+	}
+	spin_unlock(&qtfs_wl_fd_lock);
+	rcu_barrier();
+}
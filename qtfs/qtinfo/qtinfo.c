@@ -84,6 +84,17 @@ struct qtinfo_type_str qtinfo_all_events[] = {
 	{QTFS_REQ_EPOLL_CTL,		"epollctl"},
 
 	{QTFS_REQ_EPOLL_EVENT,		"epollevent"},
+
+	{QTFS_REQ_LLSEEK,			"llseek"},
+
+	// counters are printed by position, every type is listed in its order
+	{QTFS_SC_KILL,				"sc_kill"},
+	{QTFS_SC_SCHED_GETAFFINITY,	"sc_getaffinity"},
+	{QTFS_SC_SCHED_SETAFFINITY,	"sc_setaffinity"},
+	{QTFS_REQ_EXIT,				"exit"},
+
+	{QTFS_REQ_INVALIDATE,		"invalidate"},
+	{QTFS_REQ_READDIRPLUS,		"readdirplus"},
 };
 
 static void qtinfo_events_count(struct qtinfo *evts)
@@ -197,14 +208,63 @@ static void qtinfo_misc_count(struct qtinfo *info)
 					info->c.cnts[QTINF_ACTIV_CONN], info->c.cnts[QTINF_SEQ_ERR], info->c.cnts[QTINF_RESTART_SYS]);
 	qtinfo_out("Type mismatch  : %-8lu Epoll add fds   : %-8lu Epoll del fds: %-8lu",
 					info->c.cnts[QTINF_TYPE_MISMATCH], info->c.cnts[QTINF_EPOLL_ADDFDS], info->c.cnts[QTINF_EPOLL_DELFDS]);
-	qtinfo_out("Epoll err fds  : %-8lu",
-					info->c.cnts[QTINF_EPOLL_FDERR]);
+	qtinfo_out("Epoll err fds  : %-8lu Attr cache hit  : %-8lu Attr miss    : %-8lu",
+					info->c.cnts[QTINF_EPOLL_FDERR], info->c.cnts[QTINF_ATTR_HIT], info->c.cnts[QTINF_ATTR_MISS]);
+	qtinfo_out("Invalidations  : %-8lu Poll cache hit  : %-8lu Poll miss    : %-8lu",
+					info->c.cnts[QTINF_INVALIDATE], info->c.cnts[QTINF_POLL_HIT], info->c.cnts[QTINF_POLL_MISS]);
+	qtinfo_out("Reconnects     : %-8lu Replayed reqs   : %-8lu",
+					info->c.cnts[QTINF_RECONNECT], info->c.cnts[QTINF_REPLAY]);
 #else
 	qtinfo_out("Active connects: %-8lu Epoll add fds: %-8lu Epoll del fds: %-8lu",
 					info->s.cnts[QTINF_ACTIV_CONN], info->s.cnts[QTINF_EPOLL_ADDFDS], info->s.cnts[QTINF_EPOLL_DELFDS]);
+	qtinfo_out("Invalidations  : %-8lu",
+					info->s.cnts[QTINF_INVALIDATE]);
 #endif
 }
 
+// upper bound in us of the bucket holding the given share of samples
+static unsigned long qtinfo_lat_pct(unsigned long *lat, unsigned long total, int pct)
+{
+	unsigned long sum = 0;
+	int b;
+
+	for (b = 0; b < QTINFO_LAT_BUCKETS; b++) {
+		sum += lat[b];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+	return 1UL << (b < QTINFO_LAT_BUCKETS ? b : QTINFO_LAT_BUCKETS - 1);
+}
+
+static void qtinfo_lat_hist(struct qtinfo *info)
+{
+	unsigned long (*lat)[QTINFO_LAT_BUCKETS];
+	unsigned long total;
+	int i, b;
+
+#ifdef client
+	lat = info->c.lat;
+	qtinfo_out("+++++++++++++++++++++Round trip latency(us, log2)++++++++++++++++++++");
+#else
+	lat = info->s.lat;
+	qtinfo_out("+++++++++++++++++++++Service latency(us, log2)+++++++++++++++++++++++");
+#endif
+	for (i = 0; i < sizeof(qtinfo_all_events)/sizeof(struct qtinfo_type_str); i++) {
+		total = 0;
+		for (b = 0; b < QTINFO_LAT_BUCKETS; b++)
+			total += lat[i][b];
+		if (total == 0)
+			continue;
+		qtinfo_out2("%-11s: n:%-9lu p50:<%-7lu p99:<%-7lu |", qtinfo_all_events[i].str, total,
+						qtinfo_lat_pct(lat[i], total, 50), qtinfo_lat_pct(lat[i], total, 99));
+		for (b = 0; b < QTINFO_LAT_BUCKETS; b++) {
+			if (lat[i][b] != 0)
+				qtinfo_out2(" <%lu:%lu", 1UL << b, lat[i][b]);
+		}
+		qtinfo_out2("\n");
+	}
+}
+
 static void qtinfo_thread_state(struct qtinfo *info)
 {
 	int i = 0;
@@ -223,15 +283,64 @@ static void qtinfo_thread_state(struct qtinfo *info)
 	return;
 }
 
+static void qtinfo_pool_lat(const char *name, unsigned long *lat)
+{
+	unsigned long total = 0;
+	int b;
+
+	for (b = 0; b < QTINFO_LAT_BUCKETS; b++)
+		total += lat[b];
+	if (total == 0)
+		return;
+	qtinfo_out2("%-11s: n:%-9lu p50:<%-7lu p99:<%-7lu |", name, total,
+					qtinfo_lat_pct(lat, total, 50), qtinfo_lat_pct(lat, total, 99));
+	for (b = 0; b < QTINFO_LAT_BUCKETS; b++) {
+		if (lat[b] != 0)
+			qtinfo_out2(" <%lu:%lu", 1UL << b, lat[b]);
+	}
+	qtinfo_out2("\n");
+}
+
 static void qtinfo_pvar_count(struct qtinfo *info)
 {
+	struct qtinfo_pool *pool = &info->pool;
 	int i = 0;
 	qtinfo_out("+++++++++++++++++++++++++++++Param count+++++++++++++++++++++++++++++");
 	qtinfo_out("Parameter valid count: %-2d Parameter busy count: %-2d",
 							info->pvar_vld, info->pvar_busy);
-	for (i = 0; i < QTFS_MAX_THREADS; i++) {
-		qtinfo_out("Conn%-2d holder: [%-20s]", i+1, (info->who_using[i][0] == '\0') ? "No one" : info->who_using[i]);
-	}
+	qtinfo_out("Busy high-water: %-2d Takes: %-10lu Saturated: %-10lu",
+							pool->busy_max, pool->takes, pool->saturated);
+	qtinfo_pool_lat("Wait(us)", pool->wait_lat);
+	qtinfo_pool_lat("Hold(us)", pool->hold_lat);
+	for (i = 0; i < QTINFO_MAX_HOLDERS; i++) {
+		if (pool->holders[i].func[0] == '\0' || pool->holders[i].count == 0)
+			continue;
+		qtinfo_out("Caller %-30s count:%-9lu avg:%-7luus max:%-9luus", pool->holders[i].func,
+				pool->holders[i].count, pool->holders[i].total_us / pool->holders[i].count,
+				pool->holders[i].max_us);
+	}
+	// longest holders first, by param index
+	for (i = 0; i < QTFS_MAX_THREADS && pool->hold_idx[i] >= 0; i++)
+		qtinfo_out("Conn%-4d holder: [%-20s] for %luus", pool->hold_idx[i] + 1,
+				info->who_using[i], pool->hold_us[i]);
+	if (i == 0)
+		qtinfo_out("Conn holder: [%-20s]", "No one");
+	if (pool->hold_more > 0)
+		qtinfo_out("%d more holders not shown, held for less", pool->hold_more);
+}
+
+static void qtinfo_tcp(struct qtinfo *info)
+{
+	struct qtinfo_tcp *tcp = &info->tcp;
+
+	qtinfo_out("+++++++++++++++++++++++++++++Transport+++++++++++++++++++++++++++++++");
+	qtinfo_out("nodelay:%d quickack:%d msg_more:%d sndbuf:%d rcvbuf:%d busy_poll:%dus",
+				tcp->nodelay, tcp->quickack, tcp->msg_more, tcp->sndbuf, tcp->rcvbuf, tcp->busy_poll);
+	qtinfo_out("Tuned socks: %-8lu Option errors: %-8lu MSG_MORE sends: %-10lu",
+				tcp->tuned, tcp->tune_err, tcp->more_sends);
+	qtinfo_out("Quick acks: %-10lu Retransmits: %-10lu", tcp->quickacks, tcp->retrans);
+	qtinfo_out("Recv calls: %-10lu Messages: %-10lu", tcp->rx_calls, tcp->rx_msgs);
+	qtinfo_pool_lat("Srtt(us)", tcp->srtt);
 }
 
 static void qtinfo_log_level(struct qtinfo *info)
@@ -254,9 +363,11 @@ static void qtinfo_opt_a(int fd)
 	}
 	qtinfo_events_count(diag);
 	qtinfo_misc_count(diag);
+	qtinfo_lat_hist(diag);
 	qtinfo_log_level(diag);
 	qtinfo_thread_state(diag);
 	qtinfo_pvar_count(diag);
+	qtinfo_tcp(diag);
 end:
 	free(diag);
 	return;
@@ -458,6 +569,39 @@ void qtinfo_opt_z(int fd)
 	return;
 }
 
+// cmd[:dir:size], dir is n, r, w or rw, without them an _IOC encoded
+// command describes itself
+void qtinfo_opt_i(int fd, char *arg)
+{
+	struct qtfs_ioctl_pass pass;
+	char *end = NULL;
+	char dir[4] = {0};
+	int ret;
+
+	memset(&pass, 0, sizeof(pass));
+	pass.cmd = strtoul(arg, &end, 0);
+	if (end == arg) {
+		qtinfo_err("invalid ioctl cmd:%s", arg);
+		return;
+	}
+	if (*end == '\0') {
+		pass.dir = _IOC_DIR(pass.cmd);
+		pass.size = _IOC_SIZE(pass.cmd);
+	} else if (sscanf(end, ":%3[nrw]:%u", dir, &pass.size) == 2) {
+		pass.dir = (strchr(dir, 'r') ? _IOC_READ : 0) | (strchr(dir, 'w') ? _IOC_WRITE : 0);
+	} else {
+		qtinfo_err("invalid ioctl description:%s, expect cmd[:dir:size]", arg);
+		return;
+	}
+	ret = ioctl(fd, QTFS_IOCTL_PASS_ADD, &pass);
+	if (ret != QTOK) {
+		qtinfo_err("failed to pass ioctl cmd:0x%x dir:%u size:%u", pass.cmd, pass.dir, pass.size);
+	} else {
+		qtinfo_out("successed to pass ioctl cmd:0x%x dir:%u size:%u", pass.cmd, pass.dir, pass.size);
+	}
+	return;
+}
+
 static void qtinfo_help(char *exec)
 {
 	qtinfo_out("Usage: %s [OPTION].", exec);
@@ -469,6 +613,7 @@ static void qtinfo_help(char *exec)
 	qtinfo_out("  -t, For test informations.");
 	qtinfo_out("  -p, Epoll support file mode(1: any files; 0: only fifo).");
 	qtinfo_out("  -u, Display unix socket proxy diagnostic info");
+	qtinfo_out("  -i, Forward an ioctl to the remote file, on client and server(example: -i 0x5413 or -i 0x541b:r:4)");
 #endif
 	qtinfo_out("  -s, Set unix socket proxy log level(Increase by 1 each time)");
 	qtinfo_out("  -x, Add a uds white list path(example: -x /home/)");
@@ -488,7 +633,7 @@ int main(int argc, char *argv[])
 		qtinfo_err("open file %s failed.", QTFS_DEV_NAME);
 	}
 #ifndef QTINFO_RELEASE
-	while ((ch = getopt(argc, argv, "acl:tp:usx:y:z")) != -1) {
+	while ((ch = getopt(argc, argv, "acl:tp:ui:sx:y:z")) != -1) {
 #else
 	while ((ch = getopt(argc, argv, "sx:y:z")) != -1) {
 #endif
@@ -512,6 +657,9 @@ int main(int argc, char *argv[])
 			case 'u':
 				qtinfo_opt_u();
 				break;
+			case 'i':
+				qtinfo_opt_i(fd, optarg);
+				break;
 #endif
 			case 's':
 				qtinfo_opt_s();
@@ -56,7 +56,17 @@ enum qtfs_req_type
 	
 	QTFS_REQ_EPOLL_EVENT,
 
+	QTFS_REQ_LLSEEK,
+
+	QTFS_SC_KILL,
+	QTFS_SC_SCHED_GETAFFINITY,
+	QTFS_SC_SCHED_SETAFFINITY,
+
 	QTFS_REQ_EXIT,
+
+	QTFS_REQ_INVALIDATE,
+	QTFS_REQ_READDIRPLUS,
+
 	QTFS_REQ_INV,
 };
 
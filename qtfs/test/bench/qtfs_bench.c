@@ -0,0 +1,704 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * qtfs_bench: per operation latency and throughput of a qtfs mount.
+ *
+ * Every case runs the same number of operations on each thread, the
+ * latency of each operation is recorded and the results are printed as
+ * one JSON document, so runs of different releases can be compared.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/utsname.h>
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_MAX_BS 8
+#define BENCH_PATH_LEN 4096
+#define BENCH_ROOT_LEN 1024
+
+#define bench_err(fmt, ...) fprintf(stderr, "qtfs_bench: " fmt "\n", ##__VA_ARGS__)
+
+struct bench_opts {
+	char *dir;
+	char *out;
+	char *cases;
+	int threads;
+	long ops;
+	int entries;
+	long file_size;
+	int nbs;
+	long bs[BENCH_MAX_BS];
+};
+
+struct bench_case;
+
+struct bench_thread {
+	struct bench_case *bc;
+	pthread_t tid;
+	int idx;
+	long bs;
+	char path[BENCH_PATH_LEN];
+	char path2[BENCH_PATH_LEN];
+	char *buf;
+	uint64_t *lat;
+	uint64_t start;
+	uint64_t end;
+	long done;
+	long bytes;
+	int err;
+	unsigned int seed;
+	// files of the case, -1 if unused
+	int fd;
+	int fd2;
+	// fifo and epoll cases: the peer thread and the pipe pacing it
+	pthread_t peer;
+	int pace[2];
+};
+
+struct bench_case {
+	const char *name;
+	// data cases run once per block size
+	int data;
+	int (*setup)(struct bench_thread *t);
+	int (*op)(struct bench_thread *t, long i, uint64_t *lat);
+	void (*teardown)(struct bench_thread *t);
+};
+
+static struct bench_opts opts = {
+	.threads = 1,
+	.ops = 10000,
+	.entries = 1000,
+	.file_size = 64 << 20,
+	.nbs = 3,
+	.bs = {4096, 65536, 1 << 20},
+};
+static char bench_root[BENCH_ROOT_LEN];
+static pthread_barrier_t bench_barrier;
+static FILE *bench_out;
+static int bench_nresults;
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_fill_file(const char *path, long size)
+{
+	char *buf;
+	long off = 0;
+	int fd;
+	int ret = 0;
+
+	fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	buf = malloc(1 << 20);
+	if (buf == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	memset(buf, 0x5a, 1 << 20);
+	while (off < size) {
+		long len = (size - off < (1 << 20)) ? size - off : (1 << 20);
+		ssize_t w = pwrite(fd, buf, len, off);
+		if (w <= 0) {
+			ret = (w < 0) ? -errno : -EIO;
+			break;
+		}
+		off += w;
+	}
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/* open/close of an existing file */
+static int open_setup(struct bench_thread *t)
+{
+	snprintf(t->path, sizeof(t->path), "%s/open.%d", bench_root, t->idx);
+	return bench_fill_file(t->path, 0);
+}
+
+static int open_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	uint64_t start = bench_now();
+	int fd = open(t->path, O_RDONLY);
+
+	if (fd < 0)
+		return -errno;
+	close(fd);
+	*lat = bench_now() - start;
+	return 0;
+}
+
+/* stat of an existing file */
+static int stat_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	struct stat st;
+	uint64_t start = bench_now();
+
+	if (stat(t->path, &st) < 0)
+		return -errno;
+	*lat = bench_now() - start;
+	return 0;
+}
+
+/* lookup of names that don't exist, each one is new */
+static int miss_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	struct stat st;
+	uint64_t start;
+
+	snprintf(t->path, sizeof(t->path), "%s/miss.%d.%ld", bench_root, t->idx, i);
+	start = bench_now();
+	if (stat(t->path, &st) == 0 || errno != ENOENT)
+		return -EEXIST;
+	*lat = bench_now() - start;
+	return 0;
+}
+
+/* full listing of a dir with opts.entries entries, shared by all threads */
+static int readdir_setup(struct bench_thread *t)
+{
+	int i;
+
+	snprintf(t->path, sizeof(t->path), "%s/dir", bench_root);
+	if (t->idx != 0)
+		return 0;
+	if (mkdir(t->path, 0755) < 0 && errno != EEXIST)
+		return -errno;
+	for (i = 0; i < opts.entries; i++) {
+		char name[BENCH_PATH_LEN];
+		int fd;
+
+		snprintf(name, sizeof(name), "%s/dir/entry.%d", bench_root, i);
+		fd = open(name, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0)
+			return -errno;
+		close(fd);
+	}
+	return 0;
+}
+
+static int readdir_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	uint64_t start = bench_now();
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir(t->path);
+	if (dir == NULL)
+		return -errno;
+	while ((de = readdir(dir)) != NULL)
+		n++;
+	closedir(dir);
+	*lat = bench_now() - start;
+	// . and .. come with the entries
+	return (n >= opts.entries) ? 0 : -ENOENT;
+}
+
+/* sequential and random read/write of opts.file_size per thread */
+static int data_setup(struct bench_thread *t)
+{
+	int ret;
+
+	snprintf(t->path, sizeof(t->path), "%s/data.%d", bench_root, t->idx);
+	t->buf = aligned_alloc(4096, t->bs);
+	if (t->buf == NULL)
+		return -ENOMEM;
+	memset(t->buf, 0xa5, t->bs);
+	ret = bench_fill_file(t->path, opts.file_size);
+	if (ret < 0)
+		return ret;
+	t->fd = open(t->path, O_RDWR);
+	return (t->fd < 0) ? -errno : 0;
+}
+
+static void data_teardown(struct bench_thread *t)
+{
+	free(t->buf);
+	t->buf = NULL;
+	unlink(t->path);
+}
+
+static off_t data_off(struct bench_thread *t, long i, int random)
+{
+	long blocks = opts.file_size / t->bs;
+
+	if (blocks <= 0)
+		blocks = 1;
+	if (random)
+		return (off_t)(rand_r(&t->seed) % blocks) * t->bs;
+	return (off_t)(i % blocks) * t->bs;
+}
+
+static int data_rw(struct bench_thread *t, long i, uint64_t *lat, int write, int random)
+{
+	off_t off = data_off(t, i, random);
+	uint64_t start = bench_now();
+	ssize_t ret;
+
+	if (write)
+		ret = pwrite(t->fd, t->buf, t->bs, off);
+	else
+		ret = pread(t->fd, t->buf, t->bs, off);
+	if (ret < 0)
+		return -errno;
+	*lat = bench_now() - start;
+	t->bytes += ret;
+	return 0;
+}
+
+static int seqread_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	return data_rw(t, i, lat, 0, 0);
+}
+
+static int seqwrite_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	return data_rw(t, i, lat, 1, 0);
+}
+
+static int randread_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	return data_rw(t, i, lat, 0, 1);
+}
+
+static int randwrite_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	return data_rw(t, i, lat, 1, 1);
+}
+
+/*
+ * fifo ping-pong: one byte to the echo thread over fifo a and back over
+ * fifo b, the latency is the round trip
+ */
+static void *fifo_echo(void *arg)
+{
+	struct bench_thread *t = arg;
+	int rfd = open(t->path, O_RDONLY);
+	int wfd = open(t->path2, O_WRONLY);
+	char c;
+
+	if (rfd < 0 || wfd < 0)
+		goto out;
+	while (read(rfd, &c, 1) == 1) {
+		if (write(wfd, &c, 1) != 1)
+			break;
+	}
+out:
+	if (rfd >= 0)
+		close(rfd);
+	if (wfd >= 0)
+		close(wfd);
+	return NULL;
+}
+
+static int fifo_mk(struct bench_thread *t, const char *name)
+{
+	snprintf(t->path, sizeof(t->path), "%s/%s.%d.a", bench_root, name, t->idx);
+	snprintf(t->path2, sizeof(t->path2), "%s/%s.%d.b", bench_root, name, t->idx);
+	unlink(t->path);
+	unlink(t->path2);
+	if (mkfifo(t->path, 0644) < 0 || mkfifo(t->path2, 0644) < 0)
+		return -errno;
+	return 0;
+}
+
+static int fifo_setup(struct bench_thread *t)
+{
+	int ret = fifo_mk(t, "fifo");
+
+	if (ret < 0)
+		return ret;
+	if (pthread_create(&t->peer, NULL, fifo_echo, t) != 0)
+		return -EAGAIN;
+	// same open order as the echo thread, or both block
+	t->fd = open(t->path, O_WRONLY);
+	t->fd2 = open(t->path2, O_RDONLY);
+	if (t->fd < 0 || t->fd2 < 0)
+		return -errno;
+	return 0;
+}
+
+static int fifo_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	uint64_t start = bench_now();
+	char c = (char)i;
+
+	if (write(t->fd, &c, 1) != 1 || read(t->fd2, &c, 1) != 1)
+		return -EIO;
+	*lat = bench_now() - start;
+	return 0;
+}
+
+static void fifo_teardown(struct bench_thread *t)
+{
+	// closing our ends makes the echo thread see EOF
+	if (t->fd >= 0)
+		close(t->fd);
+	if (t->fd2 >= 0)
+		close(t->fd2);
+	t->fd = t->fd2 = -1;
+	if (t->peer)
+		pthread_join(t->peer, NULL);
+}
+
+/*
+ * epoll wakeup: the writer thread sends its clock over the fifo, the
+ * latency is from there to epoll_wait returning in the bench thread. A
+ * local pipe paces the writer so one message is in flight.
+ */
+static void *epoll_writer(void *arg)
+{
+	struct bench_thread *t = arg;
+	int wfd = open(t->path, O_WRONLY);
+	uint64_t now;
+	char c;
+
+	if (wfd < 0)
+		return NULL;
+	while (read(t->pace[0], &c, 1) == 1 && c != 'q') {
+		now = bench_now();
+		if (write(wfd, &now, sizeof(now)) != sizeof(now))
+			break;
+	}
+	close(wfd);
+	return NULL;
+}
+
+static int epoll_setup(struct bench_thread *t)
+{
+	struct epoll_event ev = {.events = EPOLLIN};
+	int ret = fifo_mk(t, "epoll");
+
+	if (ret < 0)
+		return ret;
+	if (pipe(t->pace) < 0)
+		return -errno;
+	// fd: fifo read end, fd2: epoll
+	t->fd = open(t->path, O_RDONLY | O_NONBLOCK);
+	if (t->fd < 0)
+		return -errno;
+	t->fd2 = epoll_create1(0);
+	if (t->fd2 < 0)
+		return -errno;
+	ev.data.fd = t->fd;
+	if (epoll_ctl(t->fd2, EPOLL_CTL_ADD, t->fd, &ev) < 0)
+		return -errno;
+	if (pthread_create(&t->peer, NULL, epoll_writer, t) != 0)
+		return -EAGAIN;
+	return 0;
+}
+
+static int epoll_op(struct bench_thread *t, long i, uint64_t *lat)
+{
+	struct epoll_event ev;
+	uint64_t sent;
+	int n;
+
+	if (write(t->pace[1], "g", 1) != 1)
+		return -EIO;
+	do {
+		n = epoll_wait(t->fd2, &ev, 1, 5000);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return -ETIMEDOUT;
+	*lat = bench_now();
+	if (read(t->fd, &sent, sizeof(sent)) != sizeof(sent))
+		return -EIO;
+	*lat -= sent;
+	return 0;
+}
+
+static void epoll_teardown(struct bench_thread *t)
+{
+	if (t->peer) {
+		if (write(t->pace[1], "q", 1) != 1)
+			bench_err("epoll writer %d stop failed", t->idx);
+		pthread_join(t->peer, NULL);
+	}
+}
+
+static struct bench_case bench_cases[] = {
+	{"open",	0, open_setup,		open_op,	NULL},
+	{"stat",	0, open_setup,		stat_op,	NULL},
+	{"lookup_miss",	0, NULL,		miss_op,	NULL},
+	{"readdir",	0, readdir_setup,	readdir_op,	NULL},
+	{"seqread",	1, data_setup,		seqread_op,	data_teardown},
+	{"seqwrite",	1, data_setup,		seqwrite_op,	data_teardown},
+	{"randread",	1, data_setup,		randread_op,	data_teardown},
+	{"randwrite",	1, data_setup,		randwrite_op,	data_teardown},
+	{"fifo",	0, fifo_setup,		fifo_op,	fifo_teardown},
+	{"epoll",	0, epoll_setup,		epoll_op,	epoll_teardown},
+};
+
+static void bench_close(struct bench_thread *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	if (t->fd2 >= 0)
+		close(t->fd2);
+	if (t->pace[0] >= 0)
+		close(t->pace[0]);
+	if (t->pace[1] >= 0)
+		close(t->pace[1]);
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	long i;
+
+	pthread_barrier_wait(&bench_barrier);
+	t->start = bench_now();
+	for (i = 0; i < opts.ops; i++) {
+		int ret = t->bc->op(t, i, &t->lat[i]);
+		if (ret < 0) {
+			t->err = ret;
+			break;
+		}
+	}
+	t->done = i;
+	t->end = bench_now();
+	return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_report(struct bench_case *bc, long bs, struct bench_thread *ts)
+{
+	uint64_t start = ts[0].start;
+	uint64_t end = ts[0].end;
+	uint64_t *all;
+	uint64_t sum = 0;
+	long bytes = 0;
+	long n = 0;
+	int err = 0;
+	double secs;
+	int i;
+	long j;
+
+	// from the first thread starting to the last one finishing
+	for (i = 1; i < opts.threads; i++) {
+		start = (ts[i].start < start) ? ts[i].start : start;
+		end = (ts[i].end > end) ? ts[i].end : end;
+	}
+	secs = (double)(end - start) / 1e9;
+
+	all = malloc(sizeof(uint64_t) * opts.ops * opts.threads);
+	if (all == NULL) {
+		bench_err("no memory for %s results", bc->name);
+		return;
+	}
+	for (i = 0; i < opts.threads; i++) {
+		for (j = 0; j < ts[i].done; j++) {
+			all[n++] = ts[i].lat[j];
+			sum += ts[i].lat[j];
+		}
+		bytes += bc->data ? ts[i].bytes : 0;
+		if (ts[i].err)
+			err = ts[i].err;
+	}
+	qsort(all, n, sizeof(uint64_t), u64_cmp);
+	fprintf(bench_out, "%s\n    {\"case\": \"%s\", \"bs\": %ld, \"threads\": %d, \"ops\": %ld, "
+			"\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+			"\"avg_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, \"error\": %d}",
+			(bench_nresults++ == 0) ? "" : ",", bc->name, bs, opts.threads, n,
+			secs, (secs > 0) ? n / secs : 0, (secs > 0) ? bytes / secs : 0,
+			(n > 0) ? sum / 1e3 / n : 0,
+			(n > 0) ? all[n / 2] / 1e3 : 0,
+			(n > 0) ? all[(n * 99) / 100] / 1e3 : 0,
+			(n > 0) ? all[n - 1] / 1e3 : 0, err);
+	fflush(bench_out);
+	free(all);
+}
+
+static int bench_run(struct bench_case *bc, long bs)
+{
+	struct bench_thread *ts;
+	int ret = 0;
+	int i;
+
+	ts = calloc(opts.threads, sizeof(struct bench_thread));
+	if (ts == NULL)
+		return -ENOMEM;
+	for (i = 0; i < opts.threads; i++) {
+		ts[i].bc = bc;
+		ts[i].idx = i;
+		ts[i].bs = bs;
+		ts[i].seed = (unsigned int)(i + 1) * 2654435761U;
+		ts[i].fd = ts[i].fd2 = -1;
+		ts[i].pace[0] = ts[i].pace[1] = -1;
+		ts[i].lat = calloc(opts.ops, sizeof(uint64_t));
+		if (ts[i].lat == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (bc->setup && (ret = bc->setup(&ts[i])) < 0) {
+			bench_err("%s setup thread:%d failed:%s", bc->name, i, strerror(-ret));
+			goto out;
+		}
+	}
+
+	pthread_barrier_init(&bench_barrier, NULL, opts.threads + 1);
+	for (i = 0; i < opts.threads; i++)
+		pthread_create(&ts[i].tid, NULL, bench_worker, &ts[i]);
+	pthread_barrier_wait(&bench_barrier);
+	for (i = 0; i < opts.threads; i++)
+		pthread_join(ts[i].tid, NULL);
+	bench_report(bc, bs, ts);
+	pthread_barrier_destroy(&bench_barrier);
+
+out:
+	for (i = 0; i < opts.threads; i++) {
+		if (ts[i].lat && bc->teardown)
+			bc->teardown(&ts[i]);
+		bench_close(&ts[i]);
+		free(ts[i].lat);
+	}
+	free(ts);
+	return ret;
+}
+
+static int bench_selected(const char *name)
+{
+	char list[1024];
+	char *save = NULL;
+	char *tok;
+
+	if (opts.cases == NULL)
+		return 1;
+	snprintf(list, sizeof(list), "%s", opts.cases);
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (strcmp(tok, name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static long bench_size(const char *s)
+{
+	char *end;
+	long v = strtol(s, &end, 0);
+
+	switch (*end) {
+		case 'k': case 'K': return v << 10;
+		case 'm': case 'M': return v << 20;
+		case 'g': case 'G': return v << 30;
+		default: return v;
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s -d <dir on qtfs> [options]\n", prog);
+	printf("    -t <threads>     concurrency of every case, default 1\n");
+	printf("    -n <ops>         operations per thread, default 10000\n");
+	printf("    -b <bs,bs,...>   block sizes of data cases, default 4k,64k,1m\n");
+	printf("    -s <size>        file size per thread of data cases, default 64m\n");
+	printf("    -e <entries>     entries of the readdir case, default 1000\n");
+	printf("    -c <case,...>    cases to run, default all:\n                     ");
+	for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++)
+		printf("%s ", bench_cases[i].name);
+	printf("\n    -o <file>        write JSON there instead of stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct utsname uts;
+	char *save = NULL;
+	char *tok;
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "d:t:n:b:s:e:c:o:h")) != -1) {
+		switch (opt) {
+			case 'd': opts.dir = optarg; break;
+			case 't': opts.threads = atoi(optarg); break;
+			case 'n': opts.ops = atol(optarg); break;
+			case 's': opts.file_size = bench_size(optarg); break;
+			case 'e': opts.entries = atoi(optarg); break;
+			case 'c': opts.cases = optarg; break;
+			case 'o': opts.out = optarg; break;
+			case 'b':
+				opts.nbs = 0;
+				for (tok = strtok_r(optarg, ",", &save); tok && opts.nbs < BENCH_MAX_BS;
+						tok = strtok_r(NULL, ",", &save))
+					opts.bs[opts.nbs++] = bench_size(tok);
+				break;
+			default:
+				usage(argv[0]);
+				return (opt == 'h') ? 0 : 1;
+		}
+	}
+	if (opts.dir == NULL || opts.threads <= 0 || opts.threads > BENCH_MAX_THREADS ||
+			opts.ops <= 0 || opts.nbs <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	snprintf(bench_root, sizeof(bench_root), "%s/qtfs_bench.%d", opts.dir, getpid());
+	if (mkdir(bench_root, 0755) < 0) {
+		bench_err("mkdir %s failed:%s", bench_root, strerror(errno));
+		return 1;
+	}
+	bench_out = stdout;
+	if (opts.out && (bench_out = fopen(opts.out, "w")) == NULL) {
+		bench_err("open %s failed:%s", opts.out, strerror(errno));
+		return 1;
+	}
+
+	uname(&uts);
+	fprintf(bench_out, "{\n  \"tool\": \"qtfs_bench\",\n  \"version\": 1,\n  \"time\": %ld,\n"
+			"  \"kernel\": \"%s\",\n  \"dir\": \"%s\",\n  \"threads\": %d,\n  \"ops_per_thread\": %ld,\n"
+			"  \"file_size\": %ld,\n  \"entries\": %d,\n  \"results\": [",
+			(long)time(NULL), uts.release, opts.dir, opts.threads, opts.ops, opts.file_size, opts.entries);
+	for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+		struct bench_case *bc = &bench_cases[i];
+		int nbs = bc->data ? opts.nbs : 1;
+
+		if (!bench_selected(bc->name))
+			continue;
+		for (int j = 0; j < nbs; j++) {
+			int err = bench_run(bc, bc->data ? opts.bs[j] : 0);
+			if (err < 0) {
+				bench_err("case %s failed:%s", bc->name, strerror(-err));
+				ret = 1;
+			}
+		}
+	}
+	fprintf(bench_out, "\n  ]\n}\n");
+	if (bench_out != stdout)
+		fclose(bench_out);
+
+	// best effort, cases remove what they can't leave behind
+	{
+		char cmd[BENCH_PATH_LEN + 16];
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", bench_root);
+		if (system(cmd) != 0)
+			bench_err("clean up %s failed", bench_root);
+	}
+	return ret;
+}
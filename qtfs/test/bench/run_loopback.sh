@@ -0,0 +1,50 @@
+#!/bin/bash
+# Load qtfs_server and qtfs on this host, connect them over 127.0.0.1 and
+# run qtfs_bench on the mount, options are passed to qtfs_bench as they are.
+#   ./run_loopback.sh -t 8 -n 20000 -o result.json
+# Build qtfs/, qtfs_server/ and this dir first, run as root.
+
+QTFS_ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+SRV_DIR=${SRV_DIR:-/tmp/qtfs_bench_srv}
+MNT_DIR=${MNT_DIR:-/tmp/qtfs_bench_mnt}
+PORT=${PORT:-12345}
+ENGINE_THREADS=${ENGINE_THREADS:-16}
+WHITELIST=/etc/qtfs/whitelist
+ENGINE_PID=
+
+cleanup()
+{
+	umount "$MNT_DIR" 2>/dev/null
+	[ -n "$ENGINE_PID" ] && kill "$ENGINE_PID" 2>/dev/null && wait "$ENGINE_PID" 2>/dev/null
+	rmmod qtfs 2>/dev/null
+	rmmod qtfs_server 2>/dev/null
+	if [ -f "$WHITELIST.bench.bak" ]; then
+		mv -f "$WHITELIST.bench.bak" "$WHITELIST"
+	else
+		rm -f "$WHITELIST"
+	fi
+}
+
+for f in "$QTFS_ROOT/qtfs_server/qtfs_server.ko" "$QTFS_ROOT/qtfs_server/engine" \
+		"$QTFS_ROOT/qtfs/qtfs.ko" "$QTFS_ROOT/test/bench/qtfs_bench"; do
+	if [ ! -e "$f" ]; then
+		echo "$f not found, build it first." >&2
+		exit 1
+	fi
+done
+
+trap cleanup EXIT
+mkdir -p "$SRV_DIR" "$MNT_DIR" /etc/qtfs
+[ -f "$WHITELIST" ] && cp -f "$WHITELIST" "$WHITELIST.bench.bak"
+: > "$WHITELIST"
+for t in Open Write Read Readdir Mkdir Rmdir Create Unlink Rename Setattr Setxattr Mount; do
+	printf '[%s]\nPath=%s\n\n' "$t" "$SRV_DIR" >> "$WHITELIST"
+done
+
+insmod "$QTFS_ROOT/qtfs_server/qtfs_server.ko" qtfs_server_ip=127.0.0.1 qtfs_server_port=$PORT qtfs_log_level=ERROR || exit 1
+"$QTFS_ROOT/qtfs_server/engine" $ENGINE_THREADS 1 127.0.0.1 12121 127.0.0.1 12122 > /tmp/qtfs_bench_engine.log 2>&1 &
+ENGINE_PID=$!
+insmod "$QTFS_ROOT/qtfs/qtfs.ko" qtfs_server_ip=127.0.0.1 qtfs_server_port=$PORT qtfs_log_level=ERROR || exit 1
+mount -t qtfs "$SRV_DIR" "$MNT_DIR" || exit 1
+
+"$QTFS_ROOT/test/bench/qtfs_bench" -d "$MNT_DIR" "$@"